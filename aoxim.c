@@ -1,18 +1,35 @@
 //   aoxim - Lambda Calculus Language with FFI, Closures, Error Handling,
 //   Tuples, and Any Type Build:
-//   cc -std=c99 -Wall -Wextra -O2 aoxim.c -o aoxim -ldl -lm -DBUILD_DIR=$(pwd)
+//   cc -std=c99 -Wall -Wextra -O2 aoxim.c -o aoxim -ldl -lm -pthread
+//   -DBUILD_DIR=$(pwd)
 #include <stddef.h>
 #define _POSIX_C_SOURCE 200809L
 #include <ctype.h>
+#include <errno.h>
 #ifndef _WIN32
 #include <dlfcn.h>
-#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <ucontext.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__) && defined(__x86_64__)
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS 0x20
+#endif
+#endif
+#ifdef _WIN32
 #include <direct.h>
+#include <process.h>
 #include <windows.h>
 #endif
 #include <math.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -68,7 +85,12 @@ bool match_os(const char *os_name) {
 }
 
 typedef struct {
-  char **files;
+  char *key;
+  struct Module *module;
+} ImportEntry;
+
+typedef struct {
+  ImportEntry *entries;
   size_t count;
   size_t capacity;
 } ImportTracker;
@@ -76,27 +98,72 @@ typedef struct {
 ImportTracker import_tracker = {NULL, 0, 0};
 
 void init_import_tracker(void) {
-  import_tracker.capacity = 16;
+  import_tracker.capacity = 64;
   import_tracker.count = 0;
-  import_tracker.files = malloc(sizeof(char *) * import_tracker.capacity);
+  import_tracker.entries = calloc(import_tracker.capacity, sizeof(ImportEntry));
 }
 
-bool is_file_imported(const char *filename) {
-  for (size_t i = 0; i < import_tracker.count; i++) {
-    if (strcmp(import_tracker.files[i], filename) == 0) {
-      return true;
-    }
+char *canonical_file_key(const char *filename) {
+#ifndef _WIN32
+  struct stat st;
+  if (stat(filename, &st) == 0) {
+    char key[64];
+    snprintf(key, sizeof(key), "%llx:%llx", (unsigned long long)st.st_dev,
+             (unsigned long long)st.st_ino);
+    return strdup(key);
   }
-  return false;
+#endif
+  return strdup(filename);
+}
+
+size_t import_key_hash(const char *key) {
+  size_t h = 1469598103934665603ULL;
+  for (; *key; key++)
+    h = (h ^ (unsigned char)*key) * 1099511628211ULL;
+  return h;
+}
+
+ImportEntry *import_lookup(const char *key) {
+  size_t mask = import_tracker.capacity - 1;
+  size_t i = import_key_hash(key) & mask;
+  while (import_tracker.entries[i].key &&
+         strcmp(import_tracker.entries[i].key, key))
+    i = (i + 1) & mask;
+  return &import_tracker.entries[i];
+}
+
+bool is_file_imported(const char *filename, struct Module **module) {
+  char *key = canonical_file_key(filename);
+  ImportEntry *e = import_lookup(key);
+  free(key);
+  if (!e->key)
+    return false;
+  *module = e->module;
+  return true;
 }
 
-void mark_file_imported(const char *filename) {
-  if (import_tracker.count >= import_tracker.capacity) {
+void mark_file_imported(const char *filename, struct Module *module) {
+  if ((import_tracker.count + 1) * 10 >= import_tracker.capacity * 7) {
+    ImportEntry *old = import_tracker.entries;
+    size_t old_cap = import_tracker.capacity;
     import_tracker.capacity *= 2;
-    import_tracker.files =
-        realloc(import_tracker.files, sizeof(char *) * import_tracker.capacity);
+    import_tracker.entries =
+        calloc(import_tracker.capacity, sizeof(ImportEntry));
+    for (size_t i = 0; i < old_cap; i++) {
+      if (old[i].key)
+        *import_lookup(old[i].key) = old[i];
+    }
+    free(old);
+  }
+  char *key = canonical_file_key(filename);
+  ImportEntry *e = import_lookup(key);
+  if (e->key) {
+    free(key);
+  } else {
+    e->key = key;
+    import_tracker.count++;
   }
-  import_tracker.files[import_tracker.count++] = strdup(filename);
+  e->module = module;
 }
 
 typedef struct {
@@ -198,7 +265,9 @@ typedef enum {
   FFI_PTR_CHAR,
   FFI_PTR_VOID,
   FFI_PTR_PTR,
-  FFI_OPTION_PTR
+  FFI_OPTION_PTR,
+  FFI_STRUCT,
+  FFI_CALLBACK
 } FFIType;
 
 typedef struct {
@@ -214,6 +283,10 @@ typedef struct {
   size_t param_count;
   bool is_variadic;
   FFIType return_type;
+  struct CLayout **param_layouts;
+  struct CLayout *return_layout;
+  struct CallbackType **param_callbacks;
+  struct Function *fn;
 } ExternFunc;
 
 LoadedLib *loaded_libs = NULL;
@@ -245,7 +318,17 @@ typedef enum {
   VAL_ANY
 } ValueType;
 
-typedef enum { CF_NONE, CF_RETURN, CF_BREAK, CF_CONTINUE } ControlFlow;
+typedef enum { CF_NONE, CF_RETURN, CF_BREAK, CF_CONTINUE, CF_TAIL } ControlFlow;
+
+typedef enum {
+  TY_ANY,
+  TY_INT,
+  TY_DOUBLE,
+  TY_BOOL,
+  TY_STRING,
+  TY_CHAR,
+  TY_LIST
+} TypeAnn;
 
 typedef struct Function {
   char **params;
@@ -255,12 +338,21 @@ typedef struct Function {
   bool is_variadic;
   Value (*builtin)(Value *, size_t);
   Env *closure_env;
+  bool reuse_frame;
+  struct Function *target;
+  Value *bound;
+  size_t bound_count;
+  TypeAnn *param_types;
+  TypeAnn return_type;
+  Value (*native)(Value *, size_t);
+  AST *lambda;
 } Function;
 
 typedef struct {
   Value *items;
   size_t size;
   size_t capacity;
+  bool shared;
 } List;
 
 typedef struct {
@@ -275,6 +367,7 @@ typedef struct {
   char **method_names;
   Function **methods;
   size_t method_count;
+  struct CLayout *layout;
 } StructDef;
 
 typedef struct {
@@ -282,6 +375,47 @@ typedef struct {
   Value *values;
 } StructVal;
 
+typedef enum {
+  CT_I8,
+  CT_U8,
+  CT_I16,
+  CT_U16,
+  CT_I32,
+  CT_U32,
+  CT_I64,
+  CT_U64,
+  CT_F32,
+  CT_F64,
+  CT_BOOL,
+  CT_PTR,
+  CT_STRING,
+  CT_STRUCT
+} CType;
+
+/* Field layout of an `extern struct`, computed with the platform's natural
+   alignment rules so instances can be handed to C as-is. */
+typedef struct CLayout {
+  char *name;
+  size_t index;
+  char **fields;
+  char **type_names;
+  CType *types;
+  struct CLayout **nested;
+  size_t *offsets;
+  size_t count;
+  size_t size;
+  size_t align;
+  bool int_word[2];
+} CLayout;
+
+typedef struct CallbackType {
+  char *name;
+  FFIType *param_types;
+  size_t param_count;
+  FFIType return_type;
+  bool retained;
+} CallbackType;
+
 struct Value {
   ValueType type;
   ControlFlow cf;
@@ -297,6 +431,7 @@ struct Value {
     struct {
       void *ptr;
       FFIType ptr_type;
+      bool is_view;
       size_t ptr_size;
     } ptr_info;
     StructDef *struct_def;
@@ -407,10 +542,23 @@ Value v_list(void) {
   v.list = xmalloc(sizeof(List));
   v.list->capacity = 8;
   v.list->size = 0;
+  v.list->shared = false;
   v.list->items = xmalloc(sizeof(Value) * v.list->capacity);
   return v;
 }
 
+Value v_list_view(Value *items, size_t size) {
+  Value v;
+  memset(&v, 0, sizeof(v));
+  v.type = VAL_LIST;
+  v.list = xmalloc(sizeof(List));
+  v.list->items = items;
+  v.list->size = size;
+  v.list->capacity = 0;
+  v.list->shared = true;
+  return v;
+}
+
 Value v_tuple(Value *items, size_t size) {
   Value v;
   memset(&v, 0, sizeof(v));
@@ -423,12 +571,15 @@ Value v_tuple(Value *items, size_t size) {
 }
 
 void list_append(List *l, Value v) {
-  if (l->size >= l->capacity) {
-    size_t new_capacity = l->capacity * 2;
+  if (l->shared || l->size >= l->capacity) {
+    size_t new_capacity = l->capacity;
+    if (l->size >= l->capacity)
+      new_capacity = l->capacity ? l->capacity * 2 : l->size * 2 + 8;
     Value *new_items = xmalloc(sizeof(Value) * new_capacity);
     memcpy(new_items, l->items, sizeof(Value) * l->size);
     l->items = new_items;
     l->capacity = new_capacity;
+    l->shared = false;
   }
   l->items[l->size++] = v;
 }
@@ -513,6 +664,30 @@ double value_to_double(Value v) {
   return 0.0;
 }
 
+bool type_accepts(TypeAnn t, Value *v) {
+  Value inner = (v->type == VAL_ANY && v->any_val) ? *v->any_val : *v;
+  switch (t) {
+  case TY_INT:
+    return inner.type == VAL_INT;
+  case TY_DOUBLE:
+    if (inner.type == VAL_INT) {
+      *v = v_double((double)inner.i);
+      return true;
+    }
+    return inner.type == VAL_DOUBLE;
+  case TY_BOOL:
+    return inner.type == VAL_BOOL;
+  case TY_STRING:
+    return inner.type == VAL_STRING;
+  case TY_CHAR:
+    return inner.type == VAL_CHAR;
+  case TY_LIST:
+    return inner.type == VAL_LIST;
+  default:
+    return true;
+  }
+}
+
 const char *value_type_name(Value v) {
   switch (v.type) {
   case VAL_INT:
@@ -587,114 +762,337 @@ struct Env {
   char *name;
   Value value;
   bool is_const;
+  bool pooled;
   Value *value_ptr;
+  Env *ref;
   Env *next;
 };
 
 Env *global_env = NULL;
 
+void *frame_alloc(size_t size);
+
 Env *env_new(void) {
   Env *e = xmalloc(sizeof(Env));
   e->name = NULL;
   e->is_const = false;
+  e->pooled = false;
+  e->value_ptr = NULL;
+  e->ref = NULL;
   e->next = NULL;
   return e;
 }
 
-void env_set(Env *env, const char *name, Value v, bool is_const) {
+Env *env_find(Env *env, const char *name) {
   for (Env *e = env; e; e = e->next) {
-    if (e->name && !strcmp(e->name, name)) {
-      if (e->is_const) {
-        fprintf(stderr, "Error: Cannot reassign const '%s'\n", name);
-        return;
-      }
-      e->value = v;
-      if (e->value_ptr) {
-        *e->value_ptr = v;
-      }
-      e->is_const = is_const;
+    if (e->name && !strcmp(e->name, name))
+      return e->ref ? e->ref : e;
+  }
+  return NULL;
+}
+
+void env_set(Env *env, const char *name, Value v, bool is_const) {
+  Env *e = env_find(env, name);
+  if (e) {
+    if (e->is_const) {
+      fprintf(stderr, "Error: Cannot reassign const '%s'\n", name);
       return;
     }
+    e->value = v;
+    if (e->value_ptr) {
+      *e->value_ptr = v;
+    }
+    e->is_const = is_const;
+    return;
+  }
+  Env *n;
+  if (env->pooled) {
+    size_t len = strlen(name) + 1;
+    n = frame_alloc(sizeof(Env) + len);
+    n->name = memcpy((char *)(n + 1), name, len);
+  } else {
+    n = xmalloc(sizeof(Env));
+    n->name = xstrdup(name);
   }
-  Env *n = xmalloc(sizeof(Env));
-  n->name = xstrdup(name);
   n->value = v;
   n->is_const = is_const;
-
-  n->value_ptr = malloc(sizeof(Value));
-  if (n->value_ptr) {
-    *n->value_ptr = v;
-  }
+  n->pooled = false;
+  n->value_ptr = NULL;
+  n->ref = NULL;
 
   n->next = env->next;
   env->next = n;
 }
 
+size_t lazy_pending = 0;
+bool lazy_import_resolve(const char *name, const char *file);
+void lazy_import_add(AST *decl);
+
 Value env_get(Env *env, const char *name) {
-  for (Env *e = env; e; e = e->next) {
-    if (e->name && !strcmp(e->name, name))
-      return e->value;
-  }
-  return v_null();
+  Env *e = env_find(env, name);
+  return e ? e->value : v_null();
+}
+
+/* Lookup of a name written in source file `file`; a miss may load one of
+   the lazy imports made by that file. */
+Value env_get_at(Env *env, const char *name, const char *file) {
+  Env *e = env_find(env, name);
+  if (!e && lazy_pending && lazy_import_resolve(name, file))
+    e = env_find(env, name);
+  return e ? e->value : v_null();
 }
 
 Value *env_get_address(Env *env, const char *name) {
-  for (Env *e = env; e; e = e->next) {
-    if (e->name && !strcmp(e->name, name)) {
-      return e->value_ptr;
-    }
+  Env *e = env_find(env, name);
+  if (!e)
+    return NULL;
+  if (!e->value_ptr) {
+    e->value_ptr = malloc(sizeof(Value));
+    if (e->value_ptr)
+      *e->value_ptr = e->value;
   }
-  return NULL;
+  return e->value_ptr;
 }
 
-typedef struct {
+#define MEMORY_SKIP_LEVELS 24
+
+typedef struct MemoryBlock {
   void *address;
   size_t size;
   FFIType type;
   Value value;
   bool allocated;
+  int level;
+  struct MemoryBlock *next[];
 } MemoryBlock;
 
-MemoryBlock *memory_blocks = NULL;
+/* Live alloc() blocks form a skip list ordered by address, so finding the
+   block that holds an address (possibly one inside it), inserting and
+   removing are all O(log n) expected, whatever order blocks are freed in. */
+MemoryBlock *memory_skip_head[MEMORY_SKIP_LEVELS];
+int memory_skip_level = 1;
+uint32_t memory_skip_seed = 2463534242u;
 size_t memory_blocks_count = 0;
-size_t memory_blocks_capacity = 0;
 
-void *allocate_memory(size_t size, FFIType type) {
-  void *ptr = malloc(size);
-  if (!ptr)
-    return NULL;
+/* Returns the block starting at addr, or else the last one starting before
+   it. update, if given, receives per level the last block before addr (NULL
+   standing for the list head). */
+MemoryBlock *memory_block_floor(uintptr_t addr, MemoryBlock **update) {
+  MemoryBlock *prev = NULL;
+  for (int lv = memory_skip_level - 1; lv >= 0; lv--) {
+    MemoryBlock *n = prev ? prev->next[lv] : memory_skip_head[lv];
+    while (n && (uintptr_t)n->address < addr) {
+      prev = n;
+      n = n->next[lv];
+    }
+    if (update)
+      update[lv] = prev;
+  }
+  MemoryBlock *n = prev ? prev->next[0] : memory_skip_head[0];
+  return n && (uintptr_t)n->address == addr ? n : prev;
+}
+
+int memory_skip_random_level(void) {
+  int level = 1;
+  for (;;) {
+    memory_skip_seed ^= memory_skip_seed << 13;
+    memory_skip_seed ^= memory_skip_seed >> 17;
+    memory_skip_seed ^= memory_skip_seed << 5;
+    if (level >= MEMORY_SKIP_LEVELS || (memory_skip_seed & 3) != 0)
+      return level;
+    level++;
+  }
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define AOXIM_THREAD_LOCAL __thread
+#else
+#define AOXIM_THREAD_LOCAL
+#endif
+
+/* FFI buffers up to POOL_MAX_SIZE come from power-of-two size classes carved
+   out of slabs; freed chunks go on their class's free list for reuse. Like
+   the block table, the pool belongs to the interpreter thread. */
+#define POOL_CLASSES 9
+#define POOL_MIN_SIZE 16
+#define POOL_MAX_SIZE (POOL_MIN_SIZE << (POOL_CLASSES - 1))
+#define POOL_SLAB_SIZE 65536
+
+typedef struct PoolChunk {
+  struct PoolChunk *next;
+} PoolChunk;
+
+typedef struct {
+  PoolChunk *free_list[POOL_CLASSES];
+  char *slab;
+  size_t slab_left;
+} PoolCache;
+
+PoolCache pool_cache;
+
+typedef struct {
+  size_t allocs;
+  size_t frees;
+  size_t live_bytes;
+  size_t peak_bytes;
+  size_t slab_bytes;
+  size_t large_allocs;
+  size_t class_allocs[POOL_CLASSES];
+  size_t class_reused[POOL_CLASSES];
+} FFIMemStats;
+
+FFIMemStats ffi_mem_stats;
+
+int pool_class(size_t size) {
+  size_t chunk = POOL_MIN_SIZE;
+  for (int c = 0; c < POOL_CLASSES; c++, chunk <<= 1) {
+    if (size <= chunk)
+      return c;
+  }
+  return -1;
+}
 
-  if (memory_blocks_count >= memory_blocks_capacity) {
-    size_t new_cap =
-        memory_blocks_capacity == 0 ? 16 : memory_blocks_capacity * 2;
-    MemoryBlock *new_blocks =
-        realloc(memory_blocks, sizeof(MemoryBlock) * new_cap);
-    if (!new_blocks) {
-      free(ptr);
+void *pool_alloc(size_t size) {
+  int c = pool_class(size);
+  if (c < 0) {
+    ffi_mem_stats.large_allocs++;
+    return malloc(size);
+  }
+  size_t chunk = (size_t)POOL_MIN_SIZE << c;
+  ffi_mem_stats.class_allocs[c]++;
+  PoolChunk *p = pool_cache.free_list[c];
+  if (p) {
+    pool_cache.free_list[c] = p->next;
+    ffi_mem_stats.class_reused[c]++;
+    return p;
+  }
+  if (pool_cache.slab_left < chunk) {
+    /* The tail of the old slab is a multiple of POOL_MIN_SIZE smaller than
+       chunk, so it splits into at most one chunk of each smaller class. */
+    for (int t = c - 1; t >= 0; t--) {
+      size_t tail = (size_t)POOL_MIN_SIZE << t;
+      if (pool_cache.slab_left >= tail) {
+        PoolChunk *spare = (PoolChunk *)pool_cache.slab;
+        spare->next = pool_cache.free_list[t];
+        pool_cache.free_list[t] = spare;
+        pool_cache.slab += tail;
+        pool_cache.slab_left -= tail;
+      }
+    }
+    pool_cache.slab = malloc(POOL_SLAB_SIZE);
+    if (!pool_cache.slab) {
+      pool_cache.slab_left = 0;
       return NULL;
     }
-    memory_blocks = new_blocks;
-    memory_blocks_capacity = new_cap;
+    pool_cache.slab_left = POOL_SLAB_SIZE;
+    ffi_mem_stats.slab_bytes += POOL_SLAB_SIZE;
+  }
+  void *ptr = pool_cache.slab;
+  pool_cache.slab += chunk;
+  pool_cache.slab_left -= chunk;
+  return ptr;
+}
+
+void pool_free(void *ptr, size_t size) {
+  int c = pool_class(size);
+  if (c < 0) {
+    free(ptr);
+    return;
+  }
+  PoolChunk *p = ptr;
+  p->next = pool_cache.free_list[c];
+  pool_cache.free_list[c] = p;
+}
+
+void print_ffi_mem_stats(void) {
+  const FFIMemStats *st = &ffi_mem_stats;
+  fprintf(stderr, "\n=== FFI memory ===\n");
+  fprintf(stderr, "allocs: %zu, frees: %zu, live blocks: %zu\n", st->allocs,
+          st->frees, memory_blocks_count);
+  fprintf(stderr, "live bytes: %zu, peak bytes: %zu, slab bytes: %zu, "
+                  "large allocs: %zu\n",
+          st->live_bytes, st->peak_bytes, st->slab_bytes, st->large_allocs);
+  for (int c = 0; c < POOL_CLASSES; c++) {
+    if (st->class_allocs[c])
+      fprintf(stderr, "  class %5zu: allocs %zu  reused %zu\n",
+              (size_t)POOL_MIN_SIZE << c, st->class_allocs[c],
+              st->class_reused[c]);
   }
+}
+
+void *allocate_memory(size_t size, FFIType type) {
+  void *ptr = pool_alloc(size);
+  if (!ptr)
+    return NULL;
+  memset(ptr, 0, size);
 
-  memory_blocks[memory_blocks_count].address = ptr;
-  memory_blocks[memory_blocks_count].size = size;
-  memory_blocks[memory_blocks_count].type = type;
-  memory_blocks[memory_blocks_count].allocated = true;
+  int level = memory_skip_random_level();
+  MemoryBlock *block =
+      malloc(sizeof(MemoryBlock) + sizeof(MemoryBlock *) * (size_t)level);
+  if (!block) {
+    pool_free(ptr, size);
+    return NULL;
+  }
+  memset(block, 0, sizeof(MemoryBlock));
+  block->address = ptr;
+  block->size = size;
+  block->type = type;
+  block->allocated = true;
+  block->level = level;
+
+  MemoryBlock *update[MEMORY_SKIP_LEVELS];
+  memory_block_floor((uintptr_t)ptr, update);
+  for (; memory_skip_level < level; memory_skip_level++)
+    update[memory_skip_level] = NULL;
+  for (int lv = 0; lv < level; lv++) {
+    MemoryBlock **link =
+        update[lv] ? &update[lv]->next[lv] : &memory_skip_head[lv];
+    block->next[lv] = *link;
+    *link = block;
+  }
   memory_blocks_count++;
 
+  ffi_mem_stats.allocs++;
+  ffi_mem_stats.live_bytes += size;
+  if (ffi_mem_stats.live_bytes > ffi_mem_stats.peak_bytes)
+    ffi_mem_stats.peak_bytes = ffi_mem_stats.live_bytes;
   return ptr;
 }
 
+bool release_memory(void *ptr) {
+  MemoryBlock *update[MEMORY_SKIP_LEVELS];
+  MemoryBlock *block = memory_block_floor((uintptr_t)ptr, update);
+  if (!block || block->address != ptr)
+    return false;
+  for (int lv = 0; lv < block->level; lv++) {
+    MemoryBlock **link =
+        update[lv] ? &update[lv]->next[lv] : &memory_skip_head[lv];
+    *link = block->next[lv];
+  }
+  pool_free(ptr, block->size);
+  ffi_mem_stats.frees++;
+  ffi_mem_stats.live_bytes -= block->size;
+  free(block);
+  memory_blocks_count--;
+  return true;
+}
+
 MemoryBlock *find_memory_block(void *ptr) {
-  for (size_t i = 0; i < memory_blocks_count; i++) {
-    if (memory_blocks[i].address == ptr && memory_blocks[i].allocated) {
-      return &memory_blocks[i];
-    }
-  }
-  return NULL;
+  uintptr_t addr = (uintptr_t)ptr;
+  MemoryBlock *block = memory_block_floor(addr, NULL);
+  if (!block)
+    return NULL;
+  uintptr_t start = (uintptr_t)block->address;
+  if (!block->allocated || addr - start >= (block->size ? block->size : 1))
+    return NULL;
+  return block;
 }
 
+Value v_view(void *p, FFIType type, size_t count);
+Value view_get(Value v, size_t i);
+bool view_set(Value v, size_t i, Value x);
+size_t view_elem_size(FFIType type);
+
 void store_value_at_address(void *address, Value v, FFIType type) {
   MemoryBlock *block = find_memory_block(address);
 
@@ -702,22 +1100,10 @@ void store_value_at_address(void *address, Value v, FFIType type) {
   case FFI_INT:
   case FFI_LONG:
   case FFI_BOOL:
-    if (v.type == VAL_INT) {
-      *(long long *)address = v.i;
-    } else if (v.type == VAL_DOUBLE) {
-      *(long long *)address = (long long)v.d;
-    } else if (v.type == VAL_BOOL) {
-      *(long long *)address = v.b ? 1 : 0;
-    }
-    break;
-
   case FFI_DOUBLE:
   case FFI_FLOAT:
-    if (v.type == VAL_DOUBLE) {
-      *(double *)address = v.d;
-    } else if (v.type == VAL_INT) {
-      *(double *)address = (double)v.i;
-    }
+    if (v.type == VAL_INT || v.type == VAL_DOUBLE || v.type == VAL_BOOL)
+      view_set(v_view(address, type, 1), 0, v);
     break;
 
   case FFI_CHAR:
@@ -744,13 +1130,14 @@ void store_value_at_address(void *address, Value v, FFIType type) {
     break;
 
   default:
-    if (block && block->size >= sizeof(Value)) {
+    if (block && block->size - ((char *)address - (char *)block->address) >=
+                     sizeof(Value)) {
       memcpy(address, &v, sizeof(Value));
     }
     break;
   }
 
-  if (block) {
+  if (block && block->address == address) {
     block->value = v;
   }
 }
@@ -1466,6 +1853,9 @@ typedef enum {
   A_VAR,
   A_BOOL,
   A_BINOP,
+  A_BINOP_INT,
+  A_BINOP_DOUBLE,
+  A_BINOP_STRING,
   A_CALL,
   A_LAMBDA,
   A_ASSIGN,
@@ -1495,12 +1885,20 @@ typedef enum {
   A_SLICE,
   A_COMPOUND_ASSIGN,
   A_ADDROF,
-  A_UNWRAP
+  A_UNWRAP,
+  A_IMPORT,
+  A_LINK,
+  A_EXTERN
 } ASTType;
 
+typedef struct Module Module;
+typedef struct MatchTable MatchTable;
+
 struct AST {
   ASTType type;
   SourceLoc loc;
+  TypeAnn static_type;
+  size_t slot; /* A_VAR, A_ASSIGN: 1 + frame slot of a typed name, or 0 */
   union {
     long long i;
     double d;
@@ -1510,22 +1908,49 @@ struct AST {
     struct {
       char op;
       AST *l, *r;
+      TypeAnn typed;
+      ASTType seen;
+      unsigned warm;
+      unsigned deopts;
+      size_t hits;
+      bool registered;
     } bin;
     struct {
       AST *fn;
       AST **args;
       size_t argc;
       bool ptr_return;
+      bool tail;
     } call;
     struct {
       char **params;
       size_t arity;
       AST *body;
+      bool tail_marked;
+      bool frame_escapes;
+      bool analyzed;
+      char **upvalues;
+      size_t upvalue_count;
+      char **assigned;
+      size_t assigned_count;
+      AST *enclosing;
+      TypeAnn *param_types;
+      TypeAnn return_type;
+      char **slot_names; /* typed lambdas: params, then annotated locals */
+      size_t slot_count;
+      Value (*native)(Value *, size_t);
+      struct JitCode *jit;
+      size_t jit_hot;
+      unsigned jit_bails;
+      bool jit_failed;
+      bool jit_blocked;
     } lambda;
     struct {
       char *name;
       AST *value;
       bool is_const;
+      TypeAnn ann;
+      TypeAnn check;
     } assign;
     struct {
       AST *cond;
@@ -1577,6 +2002,7 @@ struct AST {
       size_t count;
       AST **methods;
       size_t method_count;
+      char **c_types;
     } struct_def;
     struct {
       char *name;
@@ -1589,6 +2015,7 @@ struct AST {
       AST **patterns;
       AST **bodies;
       size_t case_count;
+      MatchTable *table;
     } match;
     struct {
       AST *obj;
@@ -1603,6 +2030,7 @@ struct AST {
       char **names;
       size_t count;
       AST *value;
+      bool is_const;
     } assign_unpack;
     struct {
       char *name;
@@ -1634,6 +2062,25 @@ struct AST {
     struct {
       AST *expr;
     } unwrap;
+    struct {
+      char *path;
+      Module *module;
+      bool lazy;
+    } import;
+    struct {
+      char *path;
+    } link;
+    struct {
+      char *name;
+      char *c_name;
+      FFIType *param_types;
+      size_t param_count;
+      FFIType return_type;
+      char **param_structs;
+      char *return_struct;
+      bool is_callback;
+      bool retained;
+    } extern_decl;
   };
 };
 
@@ -1660,7 +2107,56 @@ bool expect(TokType expected) {
   }
   return true;
 }
-ExternFunc *find_extern(const char *name);
+
+const char *type_ann_name(TypeAnn t) {
+  switch (t) {
+  case TY_INT:
+    return "int";
+  case TY_DOUBLE:
+    return "double";
+  case TY_BOOL:
+    return "bool";
+  case TY_STRING:
+    return "string";
+  case TY_CHAR:
+    return "char";
+  case TY_LIST:
+    return "list";
+  default:
+    return "any";
+  }
+}
+
+TypeAnn parse_type_ann(void) {
+  if (!expect(T_IDENT))
+    return TY_ANY;
+  TypeAnn t = TY_ANY;
+  if (!strcmp(tok.text, "int"))
+    t = TY_INT;
+  else if (!strcmp(tok.text, "double"))
+    t = TY_DOUBLE;
+  else if (!strcmp(tok.text, "bool"))
+    t = TY_BOOL;
+  else if (!strcmp(tok.text, "string") || !strcmp(tok.text, "str"))
+    t = TY_STRING;
+  else if (!strcmp(tok.text, "char"))
+    t = TY_CHAR;
+  else if (!strcmp(tok.text, "list"))
+    t = TY_LIST;
+  else if (strcmp(tok.text, "any"))
+    error_at(tok.loc, "unknown type '%s'", tok.text);
+  next_token();
+  return t;
+}
+
+AST *parse_call_arg(void) {
+  AST *arg = parse_expr();
+  if (tok.type == T_COLON && arg->type == A_VAR) {
+    next_token();
+    arg->static_type = parse_type_ann();
+  }
+  return arg;
+}
 
 AST *parse_postfix(void) {
   AST *obj = parse_primary();
@@ -1672,27 +2168,14 @@ AST *parse_postfix(void) {
       call->call.args = xmalloc(sizeof(AST *) * 64);
       call->call.argc = 0;
       if (tok.type != T_RP) {
-        call->call.args[call->call.argc++] = parse_expr();
+        call->call.args[call->call.argc++] = parse_call_arg();
         while (tok.type == T_COMMA) {
           next_token();
-          call->call.args[call->call.argc++] = parse_expr();
+          call->call.args[call->call.argc++] = parse_call_arg();
         }
       }
       expect(T_RP);
       next_token();
-      if (call->call.fn->type == A_VAR) {
-        ExternFunc *ext = find_extern(call->call.fn->name);
-        if (ext && ext->return_type == FFI_OPTION_PTR) {
-          call->call.ptr_return = true;
-          if (tok.type != T_QUESTION) {
-            error_at(call->loc,
-                     "call to '%s' returns Option<ptr> and requires '?' unwrap "
-                     "operator",
-                     call->call.fn->name);
-          }
-        }
-      }
-
       obj = call;
     } else if (tok.type == T_LB) {
       next_token();
@@ -2861,6 +3344,22 @@ AST *parse_stmt(void) {
     expr = tuple;
   }
 
+  if (tok.type == T_COLON && expr->type == A_VAR) {
+    next_token();
+    TypeAnn ann = parse_type_ann();
+    if (!expect(T_ASSIGN))
+      return expr;
+    next_token();
+    AST *assign = ast_new(A_ASSIGN);
+    assign->loc = expr->loc;
+    assign->assign.name = expr->name;
+    assign->assign.value = parse_expr();
+    assign->assign.is_const = is_const;
+    assign->assign.ann = ann;
+    assign->assign.check = ann;
+    return assign;
+  }
+
   if (tok.type == T_ASSIGN) {
     if (expr->type == A_TUPLE) {
       next_token();
@@ -2971,7 +3470,123 @@ AST *parse_stmt(void) {
   return expr;
 }
 
+typedef void (*ASTVisitor)(AST **slot, void *ctx);
+
+void ast_visit_children(AST *a, ASTVisitor fn, void *ctx) {
+#define VISIT(slot)                                                            \
+  do {                                                                         \
+    if (slot)                                                                  \
+      fn(&(slot), ctx);                                                        \
+  } while (0)
+  switch (a->type) {
+  case A_BINOP:
+  case A_BINOP_INT:
+  case A_BINOP_DOUBLE:
+  case A_BINOP_STRING:
+    VISIT(a->bin.l);
+    VISIT(a->bin.r);
+    break;
+  case A_CALL:
+    VISIT(a->call.fn);
+    for (size_t i = 0; i < a->call.argc; i++)
+      VISIT(a->call.args[i]);
+    break;
+  case A_LAMBDA:
+    VISIT(a->lambda.body);
+    break;
+  case A_ASSIGN:
+    VISIT(a->assign.value);
+    break;
+  case A_IF:
+    VISIT(a->ifelse.cond);
+    VISIT(a->ifelse.then_block);
+    VISIT(a->ifelse.else_block);
+    break;
+  case A_WHILE:
+    VISIT(a->whileloop.cond);
+    VISIT(a->whileloop.body);
+    break;
+  case A_FOR:
+    VISIT(a->forloop.iter);
+    VISIT(a->forloop.body);
+    break;
+  case A_LIST:
+  case A_TUPLE:
+  case A_PTR_LITERAL:
+    for (size_t i = 0; i < a->list.count; i++)
+      VISIT(a->list.items[i]);
+    break;
+  case A_RANGE:
+    VISIT(a->range.start);
+    VISIT(a->range.end);
+    break;
+  case A_INDEX:
+    VISIT(a->index.obj);
+    VISIT(a->index.idx);
+    break;
+  case A_METHOD:
+    VISIT(a->method.obj);
+    for (size_t i = 0; i < a->method.argc; i++)
+      VISIT(a->method.args[i]);
+    break;
+  case A_BLOCK:
+    for (size_t i = 0; i < a->block.count; i++)
+      VISIT(a->block.stmts[i]);
+    break;
+  case A_RETURN:
+    VISIT(a->ret.value);
+    break;
+  case A_STRING_INTERP:
+    for (size_t i = 0; i < a->str_interp.count; i++)
+      VISIT(a->str_interp.exprs[i]);
+    break;
+  case A_STRUCT_DEF:
+    for (size_t i = 0; i < a->struct_def.method_count; i++)
+      VISIT(a->struct_def.methods[i]);
+    break;
+  case A_STRUCT_INIT:
+    for (size_t i = 0; i < a->struct_init.count; i++)
+      VISIT(a->struct_init.values[i]);
+    break;
+  case A_MATCH:
+    VISIT(a->match.value);
+    for (size_t i = 0; i < a->match.case_count; i++) {
+      VISIT(a->match.patterns[i]);
+      VISIT(a->match.bodies[i]);
+    }
+    break;
+  case A_MEMBER:
+    VISIT(a->member.obj);
+    break;
+  case A_MEMBER_ASSIGN:
+    VISIT(a->member_assign.obj);
+    VISIT(a->member_assign.value);
+    break;
+  case A_ASSIGN_UNPACK:
+    VISIT(a->assign_unpack.value);
+    break;
+  case A_DEREF:
+    VISIT(a->deref.ptr_expr);
+    break;
+  case A_SLICE:
+    VISIT(a->slice.obj);
+    VISIT(a->slice.begin);
+    VISIT(a->slice.end);
+    break;
+  case A_UNWRAP:
+    VISIT(a->unwrap.expr);
+    break;
+  default:
+    break;
+  }
+#undef VISIT
+}
+
 void print_value(Value v);
+const char *ffi_type_name(FFIType type);
+CLayout *c_struct_layout(Value v);
+Value c_field_get(void *base, CLayout *l, size_t i);
+char *value_to_str(Value v);
 
 void print_value(Value v) {
   const char *color = value_type_color(v);
@@ -3014,7 +3629,20 @@ void print_value(Value v) {
     printf("%s<function>%s", color, reset);
     break;
   case VAL_PTR:
-    if (v.ptr == NULL) {
+    if (c_struct_layout(v)) {
+      CLayout *l = c_struct_layout(v);
+      printf("%s%s {", color, l->name);
+      for (size_t i = 0; i < l->count; i++) {
+        if (i > 0)
+          printf(", ");
+        printf(" %s: ", l->fields[i]);
+        print_value(c_field_get(v.ptr, l, i));
+      }
+      printf(" }%s", reset);
+    } else if (v.ptr_info.is_view) {
+      printf("%s<view:%s[%zu]>%s", color, ffi_type_name(v.ptr_info.ptr_type),
+             v.ptr_info.ptr_size, reset);
+    } else if (v.ptr == NULL) {
       printf("%snil%s", color, reset);
     } else {
       printf("%s<ptr:%p>%s", color, v.ptr, reset);
@@ -3106,12 +3734,12 @@ Value read_from_memory(void *address, FFIType type) {
   switch (type) {
   case FFI_INT:
   case FFI_LONG:
-  case FFI_BOOL:
-    return v_int(*(long long *)address);
-
   case FFI_DOUBLE:
   case FFI_FLOAT:
-    return v_double(*(double *)address);
+    return view_get(v_view(address, type, 1), 0);
+
+  case FFI_BOOL:
+    return v_int(*(bool *)address);
 
   case FFI_CHAR:
     return v_char(*(char *)address);
@@ -3142,7 +3770,7 @@ Value read_from_memory(void *address, FFIType type) {
 
   default: {
     MemoryBlock *block = find_memory_block(address);
-    if (block) {
+    if (block && block->type != type) {
       return read_from_memory(address, block->type);
     }
     return v_int(*(long long *)address);
@@ -3174,29 +3802,485 @@ Value builtin_store_ptr(Value *args, size_t argc) {
   return value_to_store;
 }
 
-Value builtin_print(Value *args, size_t argc) {
-  if (argc == 0) {
-    printf("\n");
-    fflush(stdout);
-    return v_null();
+FFIType parse_ffi_type(const char *type_name);
+
+/* Element size for alloc(); scalars take their C width from
+   view_elem_size so a block can be viewed as the type it was allocated
+   with. */
+size_t ffi_elem_size(FFIType type) {
+  if (type == FFI_VOID)
+    return 1;
+  if (type == FFI_ANY)
+    return sizeof(Value);
+  size_t size = view_elem_size(type);
+  return size ? size : sizeof(void *);
+}
+
+Value builtin_alloc(Value *args, size_t argc) {
+  if (argc != 2 || args[0].type != VAL_STRING || args[1].type != VAL_INT) {
+    return v_error("alloc() takes a type name and an element count");
+  }
+  FFIType type = parse_ffi_type(args[0].s);
+  if ((type == FFI_VOID && strcmp(args[0].s, "void")) ||
+      type == FFI_VARIADIC) {
+    char err[256];
+    snprintf(err, sizeof(err), "alloc(): unknown element type '%s'",
+             args[0].s);
+    return v_error(err);
+  }
+  size_t elem = ffi_elem_size(type);
+  if (args[1].i <= 0 || (unsigned long long)args[1].i > SIZE_MAX / elem) {
+    return v_error("alloc() count must be positive");
+  }
+  void *ptr = allocate_memory(elem * (size_t)args[1].i, type);
+  if (!ptr) {
+    return v_error("alloc(): out of memory");
   }
+  return v_ptr_with_type(ptr, type);
+}
 
-  if (args[0].type == VAL_STRING && argc > 1) {
-    const char *fmt = args[0].s;
-    size_t arg_idx = 1;
+Value builtin_free(Value *args, size_t argc) {
+  if (argc != 1) {
+    return v_error("free() takes exactly 1 argument");
+  }
+  Value arg = args[0];
+  if (arg.type == VAL_ANY && arg.any_val) {
+    arg = *arg.any_val;
+  }
+  if (arg.type != VAL_PTR) {
+    return v_error("free() expects a pointer");
+  }
+  if (arg.ptr && !release_memory(arg.ptr) && !c_struct_layout(arg)) {
+    return v_error("free() of a pointer not returned by alloc()");
+  }
+  return v_null();
+}
 
-    size_t placeholder_count = 0;
-    for (const char *p = fmt; *p; p++) {
-      if (*p == '%' && *(p + 1) != '%') {
-        placeholder_count++;
-      } else if (*p == '%' && *(p + 1) == '%') {
-        p++;
-      }
-    }
+/* A view is a VAL_PTR carrying an element type and count. Elements use the
+   C layout of the named type, so "int" and "float" are 4 bytes wide. */
+size_t view_elem_size(FFIType type) {
+  switch (type) {
+  case FFI_CHAR:
+    return sizeof(char);
+  case FFI_INT:
+    return sizeof(int);
+  case FFI_LONG:
+    return sizeof(long long);
+  case FFI_FLOAT:
+    return sizeof(float);
+  case FFI_DOUBLE:
+    return sizeof(double);
+  case FFI_BOOL:
+    return sizeof(bool);
+  case FFI_PTR:
+    return sizeof(void *);
+  default:
+    return 0;
+  }
+}
 
-    if (placeholder_count > 0 && placeholder_count <= argc - 1) {
-      const char *p = fmt;
-      while (*p) {
+Value v_view(void *p, FFIType type, size_t count) {
+  Value v = v_ptr_with_type(p, type);
+  v.ptr_info.ptr_type = type;
+  v.ptr_info.is_view = true;
+  v.ptr_info.ptr_size = count;
+  return v;
+}
+
+bool is_view(Value v) { return v.type == VAL_PTR && v.ptr_info.is_view; }
+
+Value view_get(Value v, size_t i) {
+  char *at = (char *)v.ptr + i * view_elem_size(v.ptr_info.ptr_type);
+  switch (v.ptr_info.ptr_type) {
+  case FFI_CHAR:
+    return v_char(*at);
+  case FFI_INT:
+    return v_int(*(int *)at);
+  case FFI_LONG:
+    return v_int(*(long long *)at);
+  case FFI_FLOAT:
+    return v_double(*(float *)at);
+  case FFI_DOUBLE:
+    return v_double(*(double *)at);
+  case FFI_BOOL:
+    return v_bool(*(bool *)at);
+  default:
+    return v_ptr(*(void **)at);
+  }
+}
+
+bool value_number(Value x, long long *n, double *d) {
+  *d = x.type == VAL_DOUBLE ? x.d
+       : x.type == VAL_INT  ? (double)x.i
+       : x.type == VAL_BOOL ? (double)x.b
+       : x.type == VAL_CHAR ? (double)x.c
+                            : 0.0;
+  *n = x.type == VAL_DOUBLE ? (long long)x.d
+       : x.type == VAL_INT  ? x.i
+       : x.type == VAL_BOOL ? (long long)x.b
+       : x.type == VAL_CHAR ? (long long)x.c
+                            : 0;
+  return x.type == VAL_INT || x.type == VAL_DOUBLE || x.type == VAL_BOOL ||
+         x.type == VAL_CHAR;
+}
+
+bool view_set(Value v, size_t i, Value x) {
+  char *at = (char *)v.ptr + i * view_elem_size(v.ptr_info.ptr_type);
+  if (x.type == VAL_ANY && x.any_val)
+    x = *x.any_val;
+  long long n;
+  double d;
+  bool numeric = value_number(x, &n, &d);
+  switch (v.ptr_info.ptr_type) {
+  case FFI_CHAR:
+    *at = (char)n;
+    break;
+  case FFI_INT:
+    *(int *)at = (int)n;
+    break;
+  case FFI_LONG:
+    *(long long *)at = n;
+    break;
+  case FFI_FLOAT:
+    *(float *)at = (float)d;
+    break;
+  case FFI_DOUBLE:
+    *(double *)at = d;
+    break;
+  case FFI_BOOL:
+    *(bool *)at = n != 0;
+    break;
+  default:
+    if (x.type != VAL_PTR && x.type != VAL_NULL)
+      return false;
+    *(void **)at = x.type == VAL_PTR ? x.ptr : NULL;
+    return true;
+  }
+  return numeric;
+}
+
+Value builtin_view(Value *args, size_t argc) {
+  if (argc != 3 || args[0].type != VAL_PTR || args[1].type != VAL_STRING ||
+      args[2].type != VAL_INT) {
+    return v_error("view() takes a pointer, an element type and a count");
+  }
+  FFIType type = parse_ffi_type(args[1].s);
+  if (!view_elem_size(type) || (type == FFI_PTR && strcmp(args[1].s, "ptr"))) {
+    char err[256];
+    snprintf(err, sizeof(err), "view(): unsupported element type '%s'",
+             args[1].s);
+    return v_error(err);
+  }
+  if (args[2].i < 0) {
+    return v_error("view() count cannot be negative");
+  }
+  if (!args[0].ptr && args[2].i > 0) {
+    return v_error("view() of a null pointer");
+  }
+  return v_view(args[0].ptr, type, (size_t)args[2].i);
+}
+
+Value view_method(Value obj, const char *method, Value *args, size_t argc) {
+  size_t count = obj.ptr_info.ptr_size;
+  if (!strcmp(method, "to_list") && argc == 0) {
+    Value list = v_list();
+    list.list->items = xmalloc(sizeof(Value) * (count + 1));
+    list.list->capacity = count + 1;
+    for (size_t i = 0; i < count; i++)
+      list.list->items[i] = view_get(obj, i);
+    list.list->size = count;
+    return list;
+  }
+  if (!strcmp(method, "set") && argc == 2) {
+    if (args[0].type != VAL_INT || args[0].i < 0 ||
+        (size_t)args[0].i >= count)
+      return v_error("view index out of range");
+    if (!view_set(obj, (size_t)args[0].i, args[1]))
+      return v_error("cannot store value of this type in view");
+    return args[1];
+  }
+  if (!strcmp(method, "copy_from") && argc == 1) {
+    Value src = args[0];
+    if (is_view(src)) {
+      if (src.ptr_info.ptr_type != obj.ptr_info.ptr_type)
+        return v_error("copy_from() needs a view of the same element type");
+      size_t n = src.ptr_info.ptr_size < count ? src.ptr_info.ptr_size : count;
+      memmove(obj.ptr, src.ptr, n * view_elem_size(obj.ptr_info.ptr_type));
+      return v_int((long long)n);
+    }
+    if (src.type != VAL_LIST)
+      return v_error("copy_from() takes a list or a view");
+    size_t n = src.list->size < count ? src.list->size : count;
+    for (size_t i = 0; i < n; i++) {
+      if (!view_set(obj, i, src.list->items[i]))
+        return v_error("cannot store value of this type in view");
+    }
+    return v_int((long long)n);
+  }
+  return v_null();
+}
+
+const struct {
+  const char *name;
+  CType type;
+} c_type_names[] = {
+    {"i8", CT_I8},       {"u8", CT_U8},         {"i16", CT_I16},
+    {"u16", CT_U16},     {"i32", CT_I32},       {"u32", CT_U32},
+    {"i64", CT_I64},     {"u64", CT_U64},       {"f32", CT_F32},
+    {"f64", CT_F64},     {"char", CT_I8},       {"int", CT_I32},
+    {"long", CT_I64},    {"float", CT_F32},     {"double", CT_F64},
+    {"bool", CT_BOOL},   {"ptr", CT_PTR},       {"string", CT_STRING},
+};
+
+CLayout **c_layouts = NULL;
+size_t c_layout_count = 0;
+size_t c_layout_capacity = 0;
+
+size_t c_type_size(CType t) {
+  switch (t) {
+  case CT_I8:
+  case CT_U8:
+    return 1;
+  case CT_I16:
+  case CT_U16:
+    return 2;
+  case CT_I32:
+  case CT_U32:
+  case CT_F32:
+    return 4;
+  case CT_I64:
+  case CT_U64:
+  case CT_F64:
+    return 8;
+  case CT_BOOL:
+    return sizeof(bool);
+  default:
+    return sizeof(void *);
+  }
+}
+
+CLayout *c_layout_find(const char *name) {
+  for (size_t i = c_layout_count; i > 0; i--) {
+    if (!strcmp(c_layouts[i - 1]->name, name))
+      return c_layouts[i - 1];
+  }
+  return NULL;
+}
+
+void c_layout_classify(CLayout *l, CLayout *part, size_t base) {
+  for (size_t i = 0; i < part->count; i++) {
+    size_t off = base + part->offsets[i];
+    if (part->types[i] == CT_STRUCT)
+      c_layout_classify(l, part->nested[i], off);
+    else if (part->types[i] != CT_F32 && part->types[i] != CT_F64 &&
+             off < 16)
+      l->int_word[off / 8] = true;
+  }
+}
+
+CLayout *c_layout_define(const char *name, char **fields, char **type_names,
+                         size_t count, char *err, size_t errlen) {
+  if (count == 0) {
+    snprintf(err, errlen, "extern struct '%s' has no fields", name);
+    return NULL;
+  }
+  CLayout *l = xmalloc(sizeof(CLayout));
+  memset(l, 0, sizeof(CLayout));
+  l->name = xstrdup(name);
+  l->fields = fields;
+  l->type_names = type_names;
+  l->count = count;
+  l->types = xmalloc(sizeof(CType) * count);
+  l->nested = xmalloc(sizeof(CLayout *) * count);
+  l->offsets = xmalloc(sizeof(size_t) * count);
+  l->align = 1;
+
+  size_t off = 0;
+  for (size_t i = 0; i < count; i++) {
+    size_t size = 0, align = 0;
+    l->nested[i] = NULL;
+    for (size_t k = 0; k < sizeof(c_type_names) / sizeof(c_type_names[0]);
+         k++) {
+      if (!strcmp(type_names[i], c_type_names[k].name)) {
+        l->types[i] = c_type_names[k].type;
+        size = align = c_type_size(l->types[i]);
+        break;
+      }
+    }
+    if (!size) {
+      CLayout *inner = c_layout_find(type_names[i]);
+      if (!inner) {
+        snprintf(err, errlen, "unknown C type '%s' for field '%s' of '%s'",
+                 type_names[i], fields[i], name);
+        return NULL;
+      }
+      l->types[i] = CT_STRUCT;
+      l->nested[i] = inner;
+      size = inner->size;
+      align = inner->align;
+    }
+    off = (off + align - 1) & ~(align - 1);
+    l->offsets[i] = off;
+    off += size;
+    if (align > l->align)
+      l->align = align;
+  }
+  l->size = (off + l->align - 1) & ~(l->align - 1);
+  c_layout_classify(l, l, 0);
+
+  if (c_layout_count >= c_layout_capacity) {
+    c_layout_capacity = c_layout_capacity == 0 ? 8 : c_layout_capacity * 2;
+    c_layouts = realloc(c_layouts, sizeof(CLayout *) * c_layout_capacity);
+  }
+  l->index = c_layout_count;
+  c_layouts[c_layout_count++] = l;
+  return l;
+}
+
+/* Instances of extern structs are pointers tagged with their layout, so
+   passing one to a `ptr` parameter hands C the struct itself. */
+Value c_struct_value(void *p, CLayout *l) {
+  Value v = v_ptr_with_type(p, FFI_STRUCT);
+  v.ptr_info.ptr_type = FFI_STRUCT;
+  v.ptr_info.ptr_size = l->index;
+  return v;
+}
+
+CLayout *c_struct_layout(Value v) {
+  if (v.type != VAL_PTR || v.ptr_info.is_view ||
+      v.ptr_info.ptr_type != FFI_STRUCT || !v.ptr ||
+      v.ptr_info.ptr_size >= c_layout_count)
+    return NULL;
+  return c_layouts[v.ptr_info.ptr_size];
+}
+
+/* Struct instances, including by-value returns, are interpreter values like
+   lists and strings: they live in the arena for the rest of the run rather
+   than being tracked alloc() blocks, and free() leaves them alone. */
+Value c_struct_new(CLayout *l) {
+  uintptr_t p = (uintptr_t)xmalloc(l->size + 15);
+  p = (p + 15) & ~(uintptr_t)15;
+  memset((void *)p, 0, l->size);
+  return c_struct_value((void *)p, l);
+}
+
+long c_field_index(CLayout *l, const char *field) {
+  for (size_t i = 0; i < l->count; i++) {
+    if (!strcmp(l->fields[i], field))
+      return (long)i;
+  }
+  return -1;
+}
+
+Value c_field_get(void *base, CLayout *l, size_t i) {
+  char *at = (char *)base + l->offsets[i];
+  switch (l->types[i]) {
+  case CT_I8:
+    return v_int(*(int8_t *)at);
+  case CT_U8:
+    return v_int(*(uint8_t *)at);
+  case CT_I16:
+    return v_int(*(int16_t *)at);
+  case CT_U16:
+    return v_int(*(uint16_t *)at);
+  case CT_I32:
+    return v_int(*(int32_t *)at);
+  case CT_U32:
+    return v_int(*(uint32_t *)at);
+  case CT_I64:
+    return v_int(*(int64_t *)at);
+  case CT_U64:
+    return v_int((long long)*(uint64_t *)at);
+  case CT_F32:
+    return v_double(*(float *)at);
+  case CT_F64:
+    return v_double(*(double *)at);
+  case CT_BOOL:
+    return v_bool(*(bool *)at);
+  case CT_PTR:
+    return v_ptr(*(void **)at);
+  case CT_STRING:
+    return *(char **)at ? v_str(*(char **)at) : v_null();
+  case CT_STRUCT:
+    return c_struct_value(at, l->nested[i]);
+  }
+  return v_null();
+}
+
+bool c_field_set(void *base, CLayout *l, size_t i, Value x) {
+  char *at = (char *)base + l->offsets[i];
+  if (x.type == VAL_ANY && x.any_val)
+    x = *x.any_val;
+  long long n;
+  double d;
+  bool numeric = value_number(x, &n, &d);
+  switch (l->types[i]) {
+  case CT_I8:
+  case CT_U8:
+    *(uint8_t *)at = (uint8_t)n;
+    break;
+  case CT_I16:
+  case CT_U16:
+    *(uint16_t *)at = (uint16_t)n;
+    break;
+  case CT_I32:
+  case CT_U32:
+    *(uint32_t *)at = (uint32_t)n;
+    break;
+  case CT_I64:
+  case CT_U64:
+    *(int64_t *)at = n;
+    break;
+  case CT_F32:
+    *(float *)at = (float)d;
+    break;
+  case CT_F64:
+    *(double *)at = d;
+    break;
+  case CT_BOOL:
+    *(bool *)at = n != 0;
+    break;
+  case CT_PTR:
+  case CT_STRING:
+    if (x.type == VAL_PTR || x.type == VAL_STRING)
+      *(void **)at = x.type == VAL_PTR ? x.ptr : (void *)x.s;
+    else if (x.type == VAL_NULL)
+      *(void **)at = NULL;
+    else
+      return false;
+    return true;
+  case CT_STRUCT:
+    if (c_struct_layout(x) != l->nested[i])
+      return false;
+    memmove(at, x.ptr, l->nested[i]->size);
+    return true;
+  }
+  return numeric;
+}
+
+Value builtin_print(Value *args, size_t argc) {
+  if (argc == 0) {
+    printf("\n");
+    fflush(stdout);
+    return v_null();
+  }
+
+  if (args[0].type == VAL_STRING && argc > 1) {
+    const char *fmt = args[0].s;
+    size_t arg_idx = 1;
+
+    size_t placeholder_count = 0;
+    for (const char *p = fmt; *p; p++) {
+      if (*p == '%' && *(p + 1) != '%') {
+        placeholder_count++;
+      } else if (*p == '%' && *(p + 1) == '%') {
+        p++;
+      }
+    }
+
+    if (placeholder_count > 0 && placeholder_count <= argc - 1) {
+      const char *p = fmt;
+      while (*p) {
         if (*p == '%' && *(p + 1) == '%') {
           printf("%%");
           p += 2;
@@ -3311,6 +4395,8 @@ Value builtin_len(Value *args, size_t argc) {
     return v_int(args[0].tuple->size);
   if (args[0].type == VAL_STRING)
     return v_int(strlen(args[0].s));
+  if (is_view(args[0]))
+    return v_int((long long)args[0].ptr_info.ptr_size);
   return v_null();
 }
 
@@ -3443,6 +4529,8 @@ Value builtin_str(Value *args, size_t argc) {
   case VAL_NULL:
     return v_str("None");
   case VAL_PTR:
+    if (arg.ptr_info.is_view)
+      return v_str(value_to_str(arg));
     snprintf(buf, sizeof(buf), "<ptr:%p>", arg.ptr);
     return v_str(buf);
   case VAL_ERROR:
@@ -3579,6 +4667,8 @@ Value builtin_apply(Value *args, size_t argc) {
     return v_error("apply() second argument must be a list");
   }
 
+  if (fn_val.fn->is_variadic)
+    list_val.list->shared = true;
   return call_values(fn_val.fn, list_val.list->items, list_val.list->size);
 }
 
@@ -3607,6 +4697,10 @@ Value builtin_help(Value *args, size_t argc) {
   printf("\n=== Pointer Operations ===\n");
   printf("ptr_to_int(p)  - Convert pointer to integer\n");
   printf("int_to_ptr(i)  - Convert integer to pointer\n");
+  printf("alloc(t, n)    - Allocate n zeroed elements of FFI type t\n");
+  printf("free(p)        - Release memory returned by alloc\n");
+  printf("_store_ptr(p, v) - Store v at pointer p\n");
+  printf("view(p, t, n)  - Index n C elements of type t at p in place\n");
   printf("\n=== FFI (Foreign Function Interface) ===\n");
   printf("link \"lib.so\"   - Load C shared library\n");
   printf("extern f = c_func(int, string): int - Declare C function\n");
@@ -3640,6 +4734,7 @@ Value builtin_help(Value *args, size_t argc) {
 }
 
 Value eval(AST *a, Env *env);
+void module_exec(Module *m);
 
 void load_library(const char *path) {
   for (size_t i = 0; i < loaded_libs_count; i++) {
@@ -3725,9 +4820,37 @@ FFIType parse_ffi_type(const char *type_name) {
   return FFI_VOID;
 }
 
+const char *ffi_type_name(FFIType type) {
+  switch (type) {
+  case FFI_INT:
+    return "int";
+  case FFI_DOUBLE:
+    return "double";
+  case FFI_STRING:
+    return "string";
+  case FFI_PTR:
+    return "ptr";
+  case FFI_LONG:
+    return "long";
+  case FFI_FLOAT:
+    return "float";
+  case FFI_CHAR:
+    return "char";
+  case FFI_BOOL:
+    return "bool";
+  case FFI_ANY:
+    return "any";
+  default:
+    return "void";
+  }
+}
+
+CallbackType *callback_type_find(const char *name);
+
 void register_extern(const char *aoxim_name, const char *c_name,
                      FFIType *param_types, size_t param_count,
-                     FFIType return_type) {
+                     FFIType return_type, char **param_structs,
+                     const char *return_struct) {
   void *func_ptr = find_symbol(c_name);
   if (!func_ptr) {
     fprintf(stderr, "Error: Symbol '%s' not found in loaded libraries\n",
@@ -3735,6 +4858,40 @@ void register_extern(const char *aoxim_name, const char *c_name,
     return;
   }
 
+  FFIType *types = malloc(sizeof(FFIType) * (param_count + 1));
+  memcpy(types, param_types, sizeof(FFIType) * param_count);
+  CLayout **param_layouts = malloc(sizeof(CLayout *) * (param_count + 1));
+  CallbackType **param_callbacks =
+      malloc(sizeof(CallbackType *) * (param_count + 1));
+  CLayout *return_layout = NULL;
+  for (size_t i = 0; i <= param_count; i++) {
+    FFIType t = i < param_count ? types[i] : return_type;
+    const char *sname = i < param_count
+                            ? (param_structs ? param_structs[i] : NULL)
+                            : return_struct;
+    CLayout *l = NULL;
+    CallbackType *cb = NULL;
+    if (i < param_count && (t == FFI_STRUCT || t == FFI_CALLBACK) && sname &&
+        !c_layout_find(sname) && (cb = callback_type_find(sname)))
+      types[i] = FFI_CALLBACK;
+    else if ((t == FFI_STRUCT || t == FFI_CALLBACK) &&
+             (!sname || !(l = c_layout_find(sname)))) {
+      fprintf(stderr, "Error: unknown extern type '%s' in declaration of "
+                      "'%s'\n",
+              sname ? sname : "?", aoxim_name);
+      free(types);
+      free(param_layouts);
+      free(param_callbacks);
+      return;
+    }
+    if (i < param_count) {
+      param_layouts[i] = l;
+      param_callbacks[i] = cb;
+    } else {
+      return_layout = l;
+    }
+  }
+
   if (extern_funcs_count >= extern_funcs_capacity) {
     size_t new_cap = extern_funcs_capacity == 0 ? 8 : extern_funcs_capacity * 2;
     ExternFunc *new_funcs = realloc(extern_funcs, sizeof(ExternFunc) * new_cap);
@@ -3744,23 +4901,24 @@ void register_extern(const char *aoxim_name, const char *c_name,
     extern_funcs_capacity = new_cap;
   }
   bool is_variadic = false;
-  if (param_count > 0 && param_types[param_count - 1] == FFI_VARIADIC) {
+  if (param_count > 0 && types[param_count - 1] == FFI_VARIADIC) {
     is_variadic = true;
   }
 
   extern_funcs[extern_funcs_count].name = strdup(aoxim_name);
   extern_funcs[extern_funcs_count].c_name = strdup(c_name);
   extern_funcs[extern_funcs_count].func_ptr = func_ptr;
-  extern_funcs[extern_funcs_count].param_types =
-      malloc(sizeof(FFIType) * param_count);
-  memcpy(extern_funcs[extern_funcs_count].param_types, param_types,
-         sizeof(FFIType) * param_count);
+  extern_funcs[extern_funcs_count].param_types = types;
   extern_funcs[extern_funcs_count].param_count = param_count;
   extern_funcs[extern_funcs_count].return_type = return_type;
   extern_funcs[extern_funcs_count].is_variadic = is_variadic;
+  extern_funcs[extern_funcs_count].param_layouts = param_layouts;
+  extern_funcs[extern_funcs_count].return_layout = return_layout;
+  extern_funcs[extern_funcs_count].param_callbacks = param_callbacks;
   extern_funcs_count++;
 
   Function *ffi_func = xmalloc(sizeof(Function));
+  memset(ffi_func, 0, sizeof(Function));
   ffi_func->is_builtin = false;
   ffi_func->is_variadic = true;
   ffi_func->arity = param_count;
@@ -3768,6 +4926,7 @@ void register_extern(const char *aoxim_name, const char *c_name,
   ffi_func->body = NULL;
   ffi_func->closure_env = NULL;
 
+  extern_funcs[extern_funcs_count - 1].fn = ffi_func;
   env_set(global_env, aoxim_name, v_func(ffi_func), false);
 }
 
@@ -3780,45 +4939,483 @@ ExternFunc *find_extern(const char *name) {
   return NULL;
 }
 
-Value call_extern(ExternFunc *ext, Value *args, size_t argc) {
-  if (!ext || !ext->func_ptr) {
-    return v_error("extern function not found or not loaded");
+ExternFunc *find_extern_fn(Function *fn) {
+  for (size_t i = 0; i < extern_funcs_count; i++) {
+    if (extern_funcs[i].fn == fn)
+      return &extern_funcs[i];
   }
+  return NULL;
+}
 
-  void *func = ext->func_ptr;
+#if defined(__x86_64__) && !defined(_WIN32)
+#define AOXIM_FFI_SYSV 1
+#endif
 
-  long long *params = xmalloc(sizeof(long long) * (argc > 32 ? argc : 32));
+Value ffi_value(FFIType type, long long result) {
+  switch (type) {
+  case FFI_INT:
+    return v_int((int)result);
+  case FFI_CHAR:
+    return v_int((char)result);
+  case FFI_LONG:
+  case FFI_BOOL:
+  case FFI_ANY:
+    return v_int(result);
+  case FFI_DOUBLE:
+  case FFI_FLOAT: {
+    if (type == FFI_FLOAT) {
+      float fval;
+      memcpy(&fval, &result, sizeof(float));
+      return v_double((double)fval);
+    } else {
+      double dval;
+      memcpy(&dval, &result, sizeof(double));
+      return v_double(dval);
+    }
+  }
+  case FFI_STRING:
+    if (result == 0)
+      return v_null();
+    return v_str((const char *)result);
+  case FFI_PTR:
+  case FFI_PTR_INT:
+  case FFI_PTR_DOUBLE:
+  case FFI_PTR_CHAR:
+  case FFI_PTR_VOID:
+  case FFI_PTR_PTR:
+  case FFI_OPTION_PTR:
+  case FFI_CALLBACK:
+    return v_ptr((void *)result);
+  case FFI_STRUCT:
+  case FFI_VOID:
+  case FFI_VARIADIC:
+    return v_null();
+  }
 
-  size_t fixed_count =
-      ext->is_variadic ? ext->param_count - 1 : ext->param_count;
+  return v_null();
+}
 
-  for (size_t i = 0; i < argc; i++) {
-    Value arg = args[i];
-    if (arg.type == VAL_ANY && arg.any_val) {
-      arg = *arg.any_val;
+#ifdef AOXIM_FFI_SYSV
+/* x86-64 System V: every argument is sorted into integer registers, SSE
+   registers or stack eightbytes, then the target is called through a
+   variadic prototype wide enough to fill all of them. */
+#define FFI_INT_REGS 6
+#define FFI_SSE_REGS 8
+#define FFI_STACK_WORDS 16
+
+typedef struct {
+  long long ints[FFI_INT_REGS];
+  double sse[FFI_SSE_REGS];
+  long long stack[FFI_STACK_WORDS];
+  size_t n_int, n_sse, n_stack;
+} FFIFrame;
+
+typedef struct {
+  long long a, b;
+} FFIRetII;
+typedef struct {
+  double a, b;
+} FFIRetDD;
+typedef struct {
+  long long a;
+  double b;
+} FFIRetID;
+typedef struct {
+  double a;
+  long long b;
+} FFIRetDI;
+
+#define FFI_FRAME_ARGS(f)                                                     \
+  (f).ints[1], (f).ints[2], (f).ints[3], (f).ints[4], (f).ints[5],            \
+      (f).sse[0], (f).sse[1], (f).sse[2], (f).sse[3], (f).sse[4], (f).sse[5], \
+      (f).sse[6], (f).sse[7], (f).stack[0], (f).stack[1], (f).stack[2],       \
+      (f).stack[3], (f).stack[4], (f).stack[5], (f).stack[6], (f).stack[7],   \
+      (f).stack[8], (f).stack[9], (f).stack[10], (f).stack[11],               \
+      (f).stack[12], (f).stack[13], (f).stack[14], (f).stack[15]
+
+#define FFI_FRAME_CALL(T, func, f)                                            \
+  ((T(*)(long long, ...))(func))((f).ints[0], FFI_FRAME_ARGS(f))
+
+bool ffi_frame_word(FFIFrame *f, long long w, bool sse) {
+  if (sse && f->n_sse < FFI_SSE_REGS) {
+    memcpy(&f->sse[f->n_sse++], &w, sizeof(w));
+  } else if (!sse && f->n_int < FFI_INT_REGS) {
+    f->ints[f->n_int++] = w;
+  } else if (f->n_stack < FFI_STACK_WORDS) {
+    f->stack[f->n_stack++] = w;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool ffi_frame_struct(FFIFrame *f, const void *data, CLayout *l) {
+  size_t words = (l->size + 7) / 8;
+  long long w[FFI_STACK_WORDS];
+  if (words > FFI_STACK_WORDS)
+    return false;
+  memset(w, 0, sizeof(w));
+  memcpy(w, data, l->size);
+
+  if (l->size <= 16) {
+    size_t need_int = 0, need_sse = 0;
+    for (size_t i = 0; i < words; i++)
+      l->int_word[i] ? need_int++ : need_sse++;
+    if (f->n_int + need_int <= FFI_INT_REGS &&
+        f->n_sse + need_sse <= FFI_SSE_REGS) {
+      for (size_t i = 0; i < words; i++)
+        ffi_frame_word(f, w[i], !l->int_word[i]);
+      return true;
     }
+  }
+  if (f->n_stack + words > FFI_STACK_WORDS)
+    return false;
+  memcpy(&f->stack[f->n_stack], w, words * 8);
+  f->n_stack += words;
+  return true;
+}
 
-    FFIType param_type;
-    if (i < fixed_count) {
-      param_type = ext->param_types[i];
+bool ffi_frame_build(FFIFrame *frame, CLayout *rl, void *ret_ptr,
+                     long long *params, FFIType *kinds, CLayout **layouts,
+                     size_t argc) {
+  memset(frame, 0, sizeof(*frame));
+  if (rl && rl->size > 16)
+    ffi_frame_word(frame, (long long)ret_ptr, false);
+
+  for (size_t i = 0; i < argc; i++) {
+    bool ok;
+    if (kinds[i] == FFI_STRUCT)
+      ok = ffi_frame_struct(frame, (void *)params[i], layouts[i]);
+    else
+      ok = ffi_frame_word(frame, params[i],
+                          kinds[i] == FFI_DOUBLE || kinds[i] == FFI_FLOAT);
+    if (!ok)
+      return false;
+  }
+  return true;
+}
+
+long long ffi_frame_call(ExternFunc *ext, FFIFrame *frame, void *ret_ptr) {
+  void *func = ext->func_ptr;
+  CLayout *rl = ext->return_type == FFI_STRUCT ? ext->return_layout : NULL;
+  if (rl && rl->size <= 16) {
+    long long w[2];
+    if (rl->int_word[0] && (rl->size <= 8 || rl->int_word[1])) {
+      FFIRetII r = FFI_FRAME_CALL(FFIRetII, func, *frame);
+      memcpy(&w[0], &r.a, 8);
+      memcpy(&w[1], &r.b, 8);
+    } else if (!rl->int_word[0] && (rl->size <= 8 || !rl->int_word[1])) {
+      FFIRetDD r = FFI_FRAME_CALL(FFIRetDD, func, *frame);
+      memcpy(&w[0], &r.a, 8);
+      memcpy(&w[1], &r.b, 8);
+    } else if (rl->int_word[0]) {
+      FFIRetID r = FFI_FRAME_CALL(FFIRetID, func, *frame);
+      memcpy(&w[0], &r.a, 8);
+      memcpy(&w[1], &r.b, 8);
     } else {
-      if (arg.type == VAL_INT || arg.type == VAL_BOOL)
-        param_type = FFI_INT;
-      else if (arg.type == VAL_DOUBLE)
-        param_type = FFI_DOUBLE;
-      else if (arg.type == VAL_STRING)
-        param_type = FFI_STRING;
-      else if (arg.type == VAL_PTR)
-        param_type = FFI_PTR;
-      else
-        param_type = FFI_ANY;
+      FFIRetDI r = FFI_FRAME_CALL(FFIRetDI, func, *frame);
+      memcpy(&w[0], &r.a, 8);
+      memcpy(&w[1], &r.b, 8);
     }
+    memcpy(ret_ptr, w, rl->size);
+    return 0;
+  }
+  if (rl) {
+    FFI_FRAME_CALL(FFIRetII, func, *frame);
+    return 0;
+  }
 
-    switch (param_type) {
-    case FFI_VARIADIC:
-      break;
+  long long result;
+  if (ext->return_type == FFI_DOUBLE || ext->return_type == FFI_FLOAT) {
+    FFIRetDD r = FFI_FRAME_CALL(FFIRetDD, func, *frame);
+    memcpy(&result, &r.a, sizeof(result));
+  } else {
+    FFIRetII r = FFI_FRAME_CALL(FFIRetII, func, *frame);
+    result = r.a;
+  }
+  return result;
+}
+#endif
 
-    case FFI_ANY:
+/* C-to-aoxim callbacks go through a fixed pool of trampolines compiled into
+   the interpreter; nothing is generated at runtime. A trampoline receives
+   every argument register, so one C signature serves all callback types,
+   and forwards them to callback_dispatch with its slot number. A call costs
+   one argument array allocation plus call_values. A slot is taken for the
+   duration of one extern call and freed when it returns, unless the
+   callback type is declared `retained` because C keeps the pointer; those
+   slots stay bound to their (function, callback type) pair for good. */
+#define CALLBACK_SLOTS 32
+
+typedef struct {
+  Function *fn;
+  CallbackType *type;
+  bool used;
+} CallbackSlot;
+
+CallbackType **callback_types = NULL;
+size_t callback_type_count = 0;
+size_t callback_type_capacity = 0;
+
+CallbackSlot callback_slots[CALLBACK_SLOTS];
+
+CallbackType *callback_type_find(const char *name) {
+  for (size_t i = callback_type_count; i > 0; i--) {
+    if (!strcmp(callback_types[i - 1]->name, name))
+      return callback_types[i - 1];
+  }
+  return NULL;
+}
+
+bool callback_type_ok(FFIType t, bool ret) {
+  switch (t) {
+  case FFI_INT:
+  case FFI_LONG:
+  case FFI_CHAR:
+  case FFI_BOOL:
+  case FFI_PTR:
+  case FFI_STRING:
+    return true;
+  case FFI_DOUBLE:
+  case FFI_FLOAT:
+#ifdef AOXIM_FFI_SYSV
+    return true;
+#else
+    return false;
+#endif
+  case FFI_VOID:
+    return ret;
+  default:
+    return false;
+  }
+}
+
+CallbackType *register_callback_type(const char *name, FFIType *param_types,
+                                     size_t param_count, FFIType return_type,
+                                     char *err, size_t errlen) {
+  size_t n_int = 0, n_sse = 0;
+  for (size_t i = 0; i <= param_count; i++) {
+    FFIType t = i < param_count ? param_types[i] : return_type;
+    if (!callback_type_ok(t, i == param_count)) {
+      snprintf(err, errlen,
+               "callback '%s': type '%s' is not supported in callbacks", name,
+               ffi_type_name(t));
+      return NULL;
+    }
+    if (i < param_count)
+      (t == FFI_DOUBLE || t == FFI_FLOAT) ? n_sse++ : n_int++;
+  }
+  if (n_int > 6 || n_sse > 8) {
+    snprintf(err, errlen, "callback '%s' has too many parameters", name);
+    return NULL;
+  }
+
+  CallbackType *cb = xmalloc(sizeof(CallbackType));
+  cb->name = xstrdup(name);
+  cb->param_types = xmalloc(sizeof(FFIType) * (param_count + 1));
+  memcpy(cb->param_types, param_types, sizeof(FFIType) * param_count);
+  cb->param_count = param_count;
+  cb->return_type = return_type;
+  cb->retained = false;
+  if (callback_type_count >= callback_type_capacity) {
+    callback_type_capacity =
+        callback_type_capacity == 0 ? 8 : callback_type_capacity * 2;
+    callback_types = realloc(callback_types,
+                             sizeof(CallbackType *) * callback_type_capacity);
+  }
+  callback_types[callback_type_count++] = cb;
+  return cb;
+}
+
+#ifdef AOXIM_FFI_SYSV
+typedef FFIRetID CallbackRet;
+#define CALLBACK_PARAMS                                                       \
+  long long i0, long long i1, long long i2, long long i3, long long i4,       \
+      long long i5, double d0, double d1, double d2, double d3, double d4,    \
+      double d5, double d6, double d7
+#define CALLBACK_COLLECT                                                      \
+  long long ints[6] = {i0, i1, i2, i3, i4, i5};                               \
+  double sse[8] = {d0, d1, d2, d3, d4, d5, d6, d7}
+#else
+typedef struct {
+  long long a;
+} CallbackRet;
+#define CALLBACK_PARAMS                                                       \
+  long long i0, long long i1, long long i2, long long i3, long long i4,       \
+      long long i5
+#define CALLBACK_COLLECT                                                      \
+  long long ints[6] = {i0, i1, i2, i3, i4, i5};                               \
+  double *sse = NULL
+#endif
+
+CallbackRet callback_dispatch(size_t slot, long long *ints, double *sse) {
+  CallbackSlot *cb = &callback_slots[slot];
+  CallbackType *t = cb->type;
+  CallbackRet ret;
+  memset(&ret, 0, sizeof(ret));
+
+  Value *args = xmalloc(sizeof(Value) * (t->param_count + 1));
+  size_t ni = 0, ns = 0;
+  for (size_t i = 0; i < t->param_count; i++) {
+    FFIType pt = t->param_types[i];
+    long long bits = 0;
+    if (pt == FFI_DOUBLE || pt == FFI_FLOAT)
+      memcpy(&bits, &sse[ns++], sizeof(bits));
+    else
+      bits = ints[ni++];
+    args[i] = ffi_value(pt, bits);
+  }
+
+  Value r = call_values(cb->fn, args, t->param_count);
+  if (r.type == VAL_ANY && r.any_val)
+    r = *r.any_val;
+  if (r.type == VAL_ERROR) {
+    fprintf(stderr, "Error: %s (in callback '%s')\n", r.s, t->name);
+    return ret;
+  }
+
+  long long n;
+  double d;
+  value_number(r, &n, &d);
+  switch (t->return_type) {
+  case FFI_DOUBLE:
+#ifdef AOXIM_FFI_SYSV
+    ret.b = d;
+#endif
+    break;
+  case FFI_FLOAT: {
+#ifdef AOXIM_FFI_SYSV
+    float f = (float)d;
+    memcpy(&ret.b, &f, sizeof(f));
+#endif
+    break;
+  }
+  case FFI_PTR:
+  case FFI_STRING:
+    ret.a = r.type == VAL_PTR      ? (long long)r.ptr
+            : r.type == VAL_STRING ? (long long)r.s
+                                   : 0;
+    break;
+  default:
+    ret.a = n;
+    break;
+  }
+  return ret;
+}
+
+#define CALLBACK_TRAMPOLINE(n)                                                \
+  CallbackRet callback_trampoline_##n(CALLBACK_PARAMS) {                      \
+    CALLBACK_COLLECT;                                                         \
+    return callback_dispatch(n, ints, sse);                                   \
+  }
+
+CALLBACK_TRAMPOLINE(0) CALLBACK_TRAMPOLINE(1) CALLBACK_TRAMPOLINE(2)
+CALLBACK_TRAMPOLINE(3) CALLBACK_TRAMPOLINE(4) CALLBACK_TRAMPOLINE(5)
+CALLBACK_TRAMPOLINE(6) CALLBACK_TRAMPOLINE(7) CALLBACK_TRAMPOLINE(8)
+CALLBACK_TRAMPOLINE(9) CALLBACK_TRAMPOLINE(10) CALLBACK_TRAMPOLINE(11)
+CALLBACK_TRAMPOLINE(12) CALLBACK_TRAMPOLINE(13) CALLBACK_TRAMPOLINE(14)
+CALLBACK_TRAMPOLINE(15) CALLBACK_TRAMPOLINE(16) CALLBACK_TRAMPOLINE(17)
+CALLBACK_TRAMPOLINE(18) CALLBACK_TRAMPOLINE(19) CALLBACK_TRAMPOLINE(20)
+CALLBACK_TRAMPOLINE(21) CALLBACK_TRAMPOLINE(22) CALLBACK_TRAMPOLINE(23)
+CALLBACK_TRAMPOLINE(24) CALLBACK_TRAMPOLINE(25) CALLBACK_TRAMPOLINE(26)
+CALLBACK_TRAMPOLINE(27) CALLBACK_TRAMPOLINE(28) CALLBACK_TRAMPOLINE(29)
+CALLBACK_TRAMPOLINE(30) CALLBACK_TRAMPOLINE(31)
+
+CallbackRet (*const callback_trampolines[CALLBACK_SLOTS])(CALLBACK_PARAMS) = {
+    callback_trampoline_0,  callback_trampoline_1,  callback_trampoline_2,
+    callback_trampoline_3,  callback_trampoline_4,  callback_trampoline_5,
+    callback_trampoline_6,  callback_trampoline_7,  callback_trampoline_8,
+    callback_trampoline_9,  callback_trampoline_10, callback_trampoline_11,
+    callback_trampoline_12, callback_trampoline_13, callback_trampoline_14,
+    callback_trampoline_15, callback_trampoline_16, callback_trampoline_17,
+    callback_trampoline_18, callback_trampoline_19, callback_trampoline_20,
+    callback_trampoline_21, callback_trampoline_22, callback_trampoline_23,
+    callback_trampoline_24, callback_trampoline_25, callback_trampoline_26,
+    callback_trampoline_27, callback_trampoline_28, callback_trampoline_29,
+    callback_trampoline_30, callback_trampoline_31,
+};
+
+long callback_acquire(Function *fn, CallbackType *type) {
+  if (type->retained) {
+    for (size_t i = 0; i < CALLBACK_SLOTS; i++) {
+      if (callback_slots[i].used && callback_slots[i].fn == fn &&
+          callback_slots[i].type == type)
+        return (long)i;
+    }
+  }
+  for (size_t i = 0; i < CALLBACK_SLOTS; i++) {
+    if (!callback_slots[i].used) {
+      callback_slots[i].fn = fn;
+      callback_slots[i].type = type;
+      callback_slots[i].used = true;
+      return (long)i;
+    }
+  }
+  return -1;
+}
+
+/* An extern call is split into the parts that touch interpreter state
+   (ffi_prepare, ffi_finish) and the part that only runs C (ffi_invoke), so
+   the C call itself can be moved to a worker thread. */
+typedef struct {
+  ExternFunc ext;
+  Value ret;
+  long long result;
+#ifdef AOXIM_FFI_SYSV
+  FFIFrame frame;
+#else
+  long long *params;
+  size_t argc;
+#endif
+  int cb_slots[16];
+  size_t cb_count;
+} FFICall;
+
+Value ffi_prepare(FFICall *c, ExternFunc *ext, Value *args, size_t argc) {
+  memset(c, 0, sizeof(*c));
+  if (!ext || !ext->func_ptr) {
+    return v_error("extern function not found or not loaded");
+  }
+  c->ext = *ext;
+  c->ret = v_null();
+
+  long long *params = xmalloc(sizeof(long long) * (argc > 32 ? argc : 32));
+  FFIType *kinds = xmalloc(sizeof(FFIType) * (argc + 1));
+  CLayout **layouts = xmalloc(sizeof(CLayout *) * (argc + 1));
+
+  size_t fixed_count =
+      ext->is_variadic ? ext->param_count - 1 : ext->param_count;
+
+  for (size_t i = 0; i < argc; i++) {
+    Value arg = args[i];
+    if (arg.type == VAL_ANY && arg.any_val) {
+      arg = *arg.any_val;
+    }
+
+    FFIType param_type;
+    layouts[i] = NULL;
+    if (i < fixed_count) {
+      param_type = ext->param_types[i];
+      layouts[i] = ext->param_layouts ? ext->param_layouts[i] : NULL;
+    } else {
+      if (arg.type == VAL_INT || arg.type == VAL_BOOL)
+        param_type = FFI_INT;
+      else if (arg.type == VAL_DOUBLE)
+        param_type = FFI_DOUBLE;
+      else if (arg.type == VAL_STRING)
+        param_type = FFI_STRING;
+      else if (arg.type == VAL_PTR)
+        param_type = FFI_PTR;
+      else
+        param_type = FFI_ANY;
+    }
+    kinds[i] = param_type;
+
+    switch (param_type) {
+    case FFI_VARIADIC:
+      break;
+
+    case FFI_ANY:
       if (arg.type == VAL_INT)
         params[i] = arg.i;
       else if (arg.type == VAL_DOUBLE)
@@ -3872,6 +5469,12 @@ Value call_extern(ExternFunc *ext, Value *args, size_t argc) {
       break;
 
     case FFI_PTR:
+    case FFI_PTR_INT:
+    case FFI_PTR_DOUBLE:
+    case FFI_PTR_CHAR:
+    case FFI_PTR_VOID:
+    case FFI_PTR_PTR:
+    case FFI_OPTION_PTR:
       if (arg.type == VAL_PTR)
         params[i] = (long long)arg.ptr;
       else if (arg.type == VAL_STRING)
@@ -3882,12 +5485,70 @@ Value call_extern(ExternFunc *ext, Value *args, size_t argc) {
         params[i] = 0;
       break;
 
+    case FFI_CALLBACK:
+      if (arg.type == VAL_FUNC) {
+        if (c->cb_count == sizeof(c->cb_slots) / sizeof(c->cb_slots[0]))
+          return v_error("too many callbacks in one extern call");
+        long slot = callback_acquire(arg.fn, ext->param_callbacks[i]);
+        if (slot < 0)
+          return v_error("out of callback slots");
+        if (!ext->param_callbacks[i]->retained)
+          c->cb_slots[c->cb_count++] = (int)slot;
+        params[i] = (long long)(uintptr_t)callback_trampolines[slot];
+      } else if (arg.type == VAL_PTR) {
+        params[i] = (long long)arg.ptr;
+      } else if (arg.type == VAL_NULL) {
+        params[i] = 0;
+      } else {
+        return v_error("invalid argument type for FFI callback parameter");
+      }
+      break;
+
+    case FFI_STRUCT:
+      if (c_struct_layout(arg) != layouts[i]) {
+        char err[256];
+        snprintf(err, sizeof(err), "%s(): argument %zu must be a %s struct",
+                 ext->name, i + 1, layouts[i]->name);
+        return v_error(err);
+      }
+      params[i] = (long long)arg.ptr;
+      break;
+
     case FFI_VOID:
       break;
     }
   }
 
-  long long result;
+#ifdef AOXIM_FFI_SYSV
+  CLayout *rl = ext->return_type == FFI_STRUCT ? ext->return_layout : NULL;
+  if (rl) {
+    c->ret = c_struct_new(rl);
+    if (c->ret.type == VAL_ERROR)
+      return c->ret;
+  }
+  if (!ffi_frame_build(&c->frame, rl, c->ret.ptr, params, kinds, layouts,
+                       argc))
+    return v_error("too many arguments for FFI call");
+#else
+  for (size_t i = 0; i < argc; i++) {
+    if (kinds[i] == FFI_STRUCT)
+      return v_error("passing structs by value is not supported on this "
+                     "platform");
+  }
+  if (ext->return_type == FFI_STRUCT)
+    return v_error("returning structs by value is not supported on this "
+                   "platform");
+  if (argc > 10)
+    return v_error("Result unreasonable value it reaches");
+  c->params = params;
+  c->argc = argc;
+#endif
+  return v_null();
+}
+
+#ifndef AOXIM_FFI_SYSV
+long long ffi_legacy_call(void *func, long long *params, size_t argc) {
+  long long result = 0;
   switch (argc) {
   case 0:
     result = ((long long (*)(void))func)();
@@ -3943,2002 +5604,7598 @@ Value call_extern(ExternFunc *ext, Value *args, size_t argc) {
         params[6], params[7], params[8], params[9]);
     break;
   default:
-    return v_error("Result unreasonable value it reaches");
-  }
-  switch (ext->return_type) {
-  case FFI_INT:
-  case FFI_LONG:
-  case FFI_CHAR:
-  case FFI_BOOL:
-  case FFI_ANY:
-    return v_int(result);
-  case FFI_DOUBLE:
-  case FFI_FLOAT: {
-    if (ext->return_type == FFI_FLOAT) {
-      float fval;
-      memcpy(&fval, &result, sizeof(float));
-      return v_double((double)fval);
-    } else {
-      double dval;
-      memcpy(&dval, &result, sizeof(double));
-      return v_double(dval);
-    }
-  }
-  case FFI_STRING:
-    if (result == 0)
-      return v_null();
-    return v_str((const char *)result);
-  case FFI_OPTION_PTR:
-    return v_ptr((void *)result);
-  case FFI_VOID:
-  case FFI_VARIADIC:
-    return v_null();
+    break;
   }
+  return result;
+}
+#endif
 
-  return v_null();
+void ffi_invoke(FFICall *c) {
+#ifdef AOXIM_FFI_SYSV
+  c->result = ffi_frame_call(&c->ext, &c->frame, c->ret.ptr);
+#else
+  c->result = ffi_legacy_call(c->ext.func_ptr, c->params, c->argc);
+#endif
 }
 
-Value call_values(Function *fn, Value *vals, size_t argc) {
-  if (fn->is_builtin) {
-    return fn->builtin(vals, argc);
+Value ffi_finish(FFICall *c) {
+  if (c->ext.return_type == FFI_STRUCT)
+    return c->ret;
+  return ffi_value(c->ext.return_type, c->result);
+}
+
+void ffi_release(FFICall *c) {
+  for (size_t i = 0; i < c->cb_count; i++)
+    callback_slots[c->cb_slots[i]].used = false;
+  c->cb_count = 0;
+}
+
+Value call_extern(ExternFunc *ext, Value *args, size_t argc) {
+  FFICall c;
+  Value err = ffi_prepare(&c, ext, args, argc);
+  if (err.type == VAL_ERROR) {
+    ffi_release(&c);
+    return err;
+  }
+  ffi_invoke(&c);
+  ffi_release(&c);
+  return ffi_finish(&c);
+}
+
+/* async_extern runs extern calls on a fixed pool of worker threads.
+   Arguments are marshalled and results converted on the interpreter thread;
+   workers only execute ffi_invoke, which touches no interpreter state. */
+#define ASYNC_WORKERS 4
+
+typedef struct AsyncJob {
+  FFICall call;
+  bool done;
+  struct AsyncJob *next;
+} AsyncJob;
+
+/* Job ids index async_jobs. An id is freed once its result is taken and
+   handed out again by the next submit, so the table only grows to the
+   largest number of jobs in flight at once. */
+AsyncJob **async_jobs = NULL;
+size_t async_job_count = 0;
+size_t async_job_capacity = 0;
+size_t *async_free_ids = NULL;
+size_t async_free_count = 0;
+size_t async_running = 0;
+size_t async_ready = 0;
+
+#ifndef _WIN32
+pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t async_work = PTHREAD_COND_INITIALIZER;
+pthread_cond_t async_done = PTHREAD_COND_INITIALIZER;
+AsyncJob *async_queue_head = NULL;
+AsyncJob *async_queue_tail = NULL;
+size_t async_workers = 0;
+
+void stack_limit_init(void);
+
+void *async_worker(void *arg) {
+  (void)arg;
+  stack_limit_init();
+  pthread_mutex_lock(&async_lock);
+  for (;;) {
+    while (!async_queue_head)
+      pthread_cond_wait(&async_work, &async_lock);
+    AsyncJob *job = async_queue_head;
+    async_queue_head = job->next;
+    if (!async_queue_head)
+      async_queue_tail = NULL;
+    pthread_mutex_unlock(&async_lock);
+
+    ffi_invoke(&job->call);
+
+    pthread_mutex_lock(&async_lock);
+    job->done = true;
+    async_running--;
+    async_ready++;
+    pthread_cond_broadcast(&async_done);
   }
+  return NULL;
+}
 
-  if (!fn->is_variadic && argc < fn->arity) {
-    Function *nf = xmalloc(sizeof(Function));
-    *nf = *fn;
-    nf->params += argc;
-    nf->arity -= argc;
-    return v_func(nf);
+void async_start_workers(void) {
+  while (async_workers < ASYNC_WORKERS) {
+    pthread_t t;
+    if (pthread_create(&t, NULL, async_worker, NULL) != 0)
+      break;
+    pthread_detach(t);
+    async_workers++;
   }
+}
+#endif
 
-  Env *local = env_new();
-  local->next = fn->closure_env ? fn->closure_env : global_env;
+AsyncJob *async_job_get(Value *args, size_t argc) {
+  if (argc != 1 || args[0].type != VAL_INT || args[0].i < 0 ||
+      (size_t)args[0].i >= async_job_count)
+    return NULL;
+  return async_jobs[args[0].i];
+}
 
-  if (fn->is_variadic) {
-    for (size_t i = 0; i < fn->arity - 1; i++) {
-      env_set(local, fn->params[i], i < argc ? vals[i] : v_null(), false);
-    }
-    Value list = v_list();
-    for (size_t i = fn->arity - 1; i < argc; i++) {
-      list_append(list.list, vals[i]);
-    }
-    env_set(local, fn->params[fn->arity - 1], list, false);
-  } else {
-    for (size_t i = 0; i < fn->arity; i++)
-      env_set(local, fn->params[i], i < argc ? vals[i] : v_null(), false);
+Value builtin_extern_submit(Value *args, size_t argc) {
+  if (argc < 1 || args[0].type != VAL_FUNC) {
+    return v_error("async_extern() takes an extern function and its "
+                   "arguments");
+  }
+  ExternFunc *ext = find_extern_fn(args[0].fn);
+  if (!ext) {
+    return v_error("async_extern() needs a function declared with extern");
+  }
+  size_t n = argc - 1;
+  if ((!ext->is_variadic && n != ext->param_count) ||
+      (ext->is_variadic && n < ext->param_count - 1)) {
+    return v_error("extern function argument count mismatch");
+  }
+  for (size_t i = 1; i < argc; i++) {
+    if (args[i].type == VAL_FUNC)
+      return v_error("callbacks cannot be passed to async extern calls");
   }
 
-  Value result = eval(fn->body, local);
-  if (result.cf == CF_RETURN) {
-    result.cf = CF_NONE;
+  AsyncJob *job = malloc(sizeof(AsyncJob));
+  memset(job, 0, sizeof(AsyncJob));
+  Value err = ffi_prepare(&job->call, ext, args + 1, n);
+  if (err.type == VAL_ERROR) {
+    free(job);
+    return err;
+  }
+  size_t id;
+  if (async_free_count > 0) {
+    id = async_free_ids[--async_free_count];
+  } else {
+    if (async_job_count >= async_job_capacity) {
+      async_job_capacity =
+          async_job_capacity == 0 ? 16 : async_job_capacity * 2;
+      async_jobs =
+          realloc(async_jobs, sizeof(AsyncJob *) * async_job_capacity);
+      async_free_ids =
+          realloc(async_free_ids, sizeof(size_t) * async_job_capacity);
+    }
+    id = async_job_count++;
   }
+  async_jobs[id] = job;
+
+#ifndef _WIN32
+  pthread_mutex_lock(&async_lock);
+  async_start_workers();
+  if (async_workers > 0) {
+    if (async_queue_tail)
+      async_queue_tail->next = job;
+    else
+      async_queue_head = job;
+    async_queue_tail = job;
+    async_running++;
+    pthread_cond_signal(&async_work);
+    pthread_mutex_unlock(&async_lock);
+    return v_int((long long)id);
+  }
+  pthread_mutex_unlock(&async_lock);
+#endif
+  ffi_invoke(&job->call);
+  job->done = true;
+  async_ready++;
+  return v_int((long long)id);
+}
+
+Value builtin_extern_poll(Value *args, size_t argc) {
+  AsyncJob *job = async_job_get(args, argc);
+  if (!job)
+    return v_error("_extern_poll() takes a pending job id");
+#ifndef _WIN32
+  pthread_mutex_lock(&async_lock);
+  bool done = job->done;
+  pthread_mutex_unlock(&async_lock);
+  return v_bool(done);
+#else
+  return v_bool(job->done);
+#endif
+}
+
+Value builtin_extern_result(Value *args, size_t argc) {
+  AsyncJob *job = async_job_get(args, argc);
+  if (!job)
+    return v_error("_extern_result() takes a pending job id");
+#ifndef _WIN32
+  pthread_mutex_lock(&async_lock);
+  while (!job->done)
+    pthread_cond_wait(&async_done, &async_lock);
+  async_ready--;
+  pthread_mutex_unlock(&async_lock);
+#else
+  async_ready--;
+#endif
+  async_jobs[args[0].i] = NULL;
+  async_free_ids[async_free_count++] = (size_t)args[0].i;
+  Value result = ffi_finish(&job->call);
+  free(job);
   return result;
 }
 
-Value call(Function *fn, AST **args, size_t argc, Env *caller) {
-  if (fn->is_builtin) {
-    Value *vals = xmalloc(sizeof(Value) * argc);
-    for (size_t i = 0; i < argc; i++)
-      vals[i] = eval(args[i], caller);
-    Value result = fn->builtin(vals, argc);
-    return result;
-  }
+/* Blocks until some submitted call has finished; returns at once if none
+   are running. */
+Value builtin_extern_wait(Value *args, size_t argc) {
+  (void)args;
+  (void)argc;
+#ifndef _WIN32
+  pthread_mutex_lock(&async_lock);
+  while (async_running > 0 && async_ready == 0)
+    pthread_cond_wait(&async_done, &async_lock);
+  pthread_mutex_unlock(&async_lock);
+#endif
+  return v_null();
+}
 
-  if (!fn->is_variadic && argc < fn->arity) {
-    Function *nf = xmalloc(sizeof(Function));
-    *nf = *fn;
-    nf->params += argc;
-    nf->arity -= argc;
-    return v_func(nf);
-  }
+Function *tail_fn = NULL;
+Value *tail_stack = NULL;
+size_t tail_top = 0;
+size_t tail_capacity = 0;
+size_t tail_base = 0;
+size_t tail_argc = 0;
 
-  size_t effective_argc = argc > fn->arity ? argc : fn->arity;
-  Value *vals = xmalloc(sizeof(Value) * effective_argc);
-  for (size_t i = 0; i < argc; i++)
-    vals[i] = eval(args[i], caller);
-  for (size_t i = argc; i < effective_argc; i++)
-    vals[i] = v_null();
+void tail_reserve(size_t n) {
+  if (tail_top + n <= tail_capacity)
+    return;
+  while (tail_top + n > tail_capacity)
+    tail_capacity = tail_capacity == 0 ? 64 : tail_capacity * 2;
+  tail_stack = realloc(tail_stack, sizeof(Value) * tail_capacity);
+}
 
-  return call_values(fn, vals, effective_argc);
+void mark_tail_calls(AST *a) {
+  if (!a)
+    return;
+  switch (a->type) {
+  case A_CALL:
+    a->call.tail = true;
+    break;
+  case A_BLOCK:
+    if (a->block.count > 0)
+      mark_tail_calls(a->block.stmts[a->block.count - 1]);
+    break;
+  case A_IF:
+    mark_tail_calls(a->ifelse.then_block);
+    mark_tail_calls(a->ifelse.else_block);
+    break;
+  case A_MATCH:
+    for (size_t i = 0; i < a->match.case_count; i++)
+      mark_tail_calls(a->match.bodies[i]);
+    break;
+  case A_RETURN:
+    mark_tail_calls(a->ret.value);
+    break;
+  default:
+    break;
+  }
 }
 
-Value call_method(Value obj, const char *method, Value *args, size_t argc) {
-  if (obj.type == VAL_ANY && obj.any_val) {
-    return call_method(*obj.any_val, method, args, argc);
+void mark_returns_visit(AST **slot, void *ctx) {
+  AST *a = *slot;
+  bool *escapes = ctx;
+  if (a->type == A_LAMBDA) {
+    *escapes = true;
+    return;
   }
+  if (a->type == A_ADDROF || a->type == A_STRUCT_DEF)
+    *escapes = true;
+  if (a->type == A_RETURN)
+    mark_tail_calls(a->ret.value);
+  ast_visit_children(a, mark_returns_visit, ctx);
+}
 
-  if (obj.type == VAL_STRUCT) {
-    for (size_t i = 0; i < obj.struct_val->def->field_count; i++) {
-      if (strcmp(method, obj.struct_val->def->fields[i]) == 0) {
-        Value val = obj.struct_val->values[i];
-        if (val.type == VAL_FUNC) {
-          Value *new_args = xmalloc(sizeof(Value) * (argc + 1));
-          new_args[0] = obj;
-          for (size_t k = 0; k < argc; k++)
-            new_args[k + 1] = args[k];
-          Value result = call_values(val.fn, new_args, argc + 1);
-          return result;
-        }
-        return val;
-      }
-    }
-
-    for (size_t i = 0; i < obj.struct_val->def->method_count; i++) {
-      if (strcmp(method, obj.struct_val->def->method_names[i]) == 0) {
-        Value val_fn = v_func(obj.struct_val->def->methods[i]);
-        Value *new_args = xmalloc(sizeof(Value) * (argc + 1));
-        new_args[0] = obj;
-        for (size_t k = 0; k < argc; k++)
-          new_args[k + 1] = args[k];
-        Value result = call_values(val_fn.fn, new_args, argc + 1);
-        return result;
-      }
-    }
+typedef struct {
+  char **names;
+  size_t count;
+  size_t capacity;
+} NameList;
 
-    return v_error("method/member not found");
+bool name_list_has(NameList *l, const char *name) {
+  for (size_t i = 0; i < l->count; i++) {
+    if (!strcmp(l->names[i], name))
+      return true;
   }
+  return false;
+}
 
-  if (obj.type == VAL_INT) {
-    if (!strcmp(method, "bin")) {
-      char buf[128];
-      long long n = obj.i;
-      if (n == 0)
-        return v_str("0b0");
-      char bits[128];
-      int i = 0;
-      bool neg = n < 0;
-      if (neg)
-        n = -n;
-      while (n > 0) {
-        bits[i++] = (n & 1) ? '1' : '0';
-        n >>= 1;
-      }
-      char *p = buf;
-      if (neg)
-        *p++ = '-';
-      *p++ = '0';
-      *p++ = 'b';
-      for (int j = i - 1; j >= 0; j--)
-        *p++ = bits[j];
-      *p = 0;
-      return v_str(buf);
-    } else if (!strcmp(method, "hex")) {
-      char buf[64];
-      sprintf(buf, "0x%llx", obj.i);
-      return v_str(buf);
-    }
-  }
-  if (obj.type == VAL_STRING) {
-    if (!strcmp(method, "upper")) {
-      char *s = xstrdup(obj.s);
-      for (char *p = s; *p; p++)
-        *p = toupper(*p);
-      return v_str(s);
-    } else if (!strcmp(method, "lower")) {
-      char *s = xstrdup(obj.s);
-      for (char *p = s; *p; p++)
-        *p = tolower(*p);
-      return v_str(s);
-    }
-  }
-  if (obj.type == VAL_LIST) {
-    if (!strcmp(method, "append") && argc == 1) {
-      list_append(obj.list, args[0]);
-      return v_null();
-    } else if (!strcmp(method, "pop") && obj.list->size > 0) {
-      return obj.list->items[--obj.list->size];
-    }
+void name_list_add(NameList *l, char *name) {
+  if (name_list_has(l, name))
+    return;
+  if (l->count >= l->capacity) {
+    l->capacity = l->capacity == 0 ? 8 : l->capacity * 2;
+    l->names = realloc(l->names, sizeof(char *) * l->capacity);
   }
-  return v_null();
+  l->names[l->count++] = name;
 }
 
-char *value_to_str(Value v) {
-  if (v.type == VAL_ANY && v.any_val) {
-    return value_to_str(*v.any_val);
-  }
+typedef struct {
+  AST *owner;
+  NameList refs;
+  NameList assigned;
+} FreeNameCtx;
 
-  char buf[256];
-  switch (v.type) {
-  case VAL_INT:
-    snprintf(buf, sizeof(buf), "%lld", v.i);
-    return xstrdup(buf);
-  case VAL_DOUBLE:
-    snprintf(buf, sizeof(buf), "%g", v.d);
-    return xstrdup(buf);
-  case VAL_STRING:
-    return xstrdup(v.s);
-  case VAL_BOOL:
-    return xstrdup(v.b ? "True" : "False");
-  case VAL_NULL:
-    return xstrdup("None");
-  case VAL_PTR:
-    if (v.ptr == NULL) {
-      return xstrdup("nil");
-    }
-    snprintf(buf, sizeof(buf), "<ptr:%p>", v.ptr);
-    return xstrdup(buf);
-  case VAL_CHAR:
-    if (v.c >= 32 && v.c < 127) {
-      snprintf(buf, sizeof(buf), "%c", v.c);
-    } else {
-      snprintf(buf, sizeof(buf), "\\x%02x", (unsigned char)v.c);
+void lambda_analyze(AST *lambda);
+
+void free_name_bind(FreeNameCtx *fc, char *name) {
+  name_list_add(&fc->refs, name);
+  name_list_add(&fc->assigned, name);
+}
+
+void free_names_visit(AST **slot, void *ctx) {
+  FreeNameCtx *fc = ctx;
+  AST *a = *slot;
+  switch (a->type) {
+  case A_VAR:
+    name_list_add(&fc->refs, a->name);
+    break;
+  case A_ASSIGN:
+    free_name_bind(fc, a->assign.name);
+    break;
+  case A_ASSIGN_UNPACK:
+    for (size_t i = 0; i < a->assign_unpack.count; i++)
+      free_name_bind(fc, a->assign_unpack.names[i]);
+    break;
+  case A_INCREMENT:
+    free_name_bind(fc, a->increment.name);
+    break;
+  case A_DECREMENT:
+    free_name_bind(fc, a->decrement.name);
+    break;
+  case A_ADDROF:
+    name_list_add(&fc->refs, a->addrof.var_name);
+    break;
+  case A_FOR: {
+    char *var1 = xstrdup(a->forloop.var);
+    char *var2 = strchr(var1, ',');
+    if (var2) {
+      *var2++ = '\0';
+      while (*var2 && isspace(*var2))
+        var2++;
+      char *end = var1 + strlen(var1) - 1;
+      while (end > var1 && isspace(*end))
+        *end-- = '\0';
+      free_name_bind(fc, var2);
     }
-    return xstrdup(buf);
-  case VAL_ERROR:
-    snprintf(buf, sizeof(buf), "Error: %s", v.s);
-    return xstrdup(buf);
+    free_name_bind(fc, var1);
+    break;
+  }
+  case A_LAMBDA:
+    a->lambda.enclosing = fc->owner;
+    lambda_analyze(a);
+    for (size_t i = 0; i < a->lambda.upvalue_count; i++)
+      name_list_add(&fc->refs, a->lambda.upvalues[i]);
+    return;
   default:
-    return xstrdup("<object>");
+    break;
   }
+  ast_visit_children(a, free_names_visit, ctx);
 }
 
-Value eval(AST *a, Env *env) {
-  switch (a->type) {
-  case A_INT:
-    return v_int(a->i);
-  case A_DOUBLE:
-    return v_double(a->d);
-  case A_STRING:
-    return v_str(a->s);
-  case A_BOOL:
-    return v_bool(a->b);
-  case A_VAR:
-    return env_get(env, a->name);
-  case A_CHAR:
-    return v_char(a->c);
+void lambda_analyze(AST *lambda) {
+  if (lambda->lambda.analyzed)
+    return;
+  lambda->lambda.analyzed = true;
 
-  case A_DEREF: {
-    Value ptr_val = eval(a->deref.ptr_expr, env);
+  FreeNameCtx fc;
+  memset(&fc, 0, sizeof(fc));
+  fc.owner = lambda;
+  ast_visit_children(lambda, free_names_visit, &fc);
 
-    if (ptr_val.type == VAL_ERROR)
-      return ptr_val;
+  size_t count = 0;
+  char **upvalues = xmalloc(sizeof(char *) * (fc.refs.count + 1));
+  for (size_t i = 0; i < fc.refs.count; i++) {
+    bool is_param = false;
+    for (size_t j = 0; j < lambda->lambda.arity; j++) {
+      if (!strcmp(lambda->lambda.params[j], fc.refs.names[i]))
+        is_param = true;
+    }
+    if (!is_param)
+      upvalues[count++] = fc.refs.names[i];
+  }
+  lambda->lambda.upvalues = upvalues;
+  lambda->lambda.upvalue_count = count;
+  lambda->lambda.assigned = fc.assigned.names;
+  lambda->lambda.assigned_count = fc.assigned.count;
+  free(fc.refs.names);
+}
 
-    if (ptr_val.type == VAL_PTR) {
-      if (ptr_val.ptr == NULL) {
-        return v_error("dereferencing null pointer");
-      }
+void lambda_prepare(AST *lambda) {
+  if (lambda->lambda.tail_marked)
+    return;
+  mark_tail_calls(lambda->lambda.body);
+  ast_visit_children(lambda, mark_returns_visit,
+                     &lambda->lambda.frame_escapes);
+  lambda->lambda.tail_marked = true;
+  lambda_analyze(lambda);
+}
 
-      Value *val_ptr = (Value *)ptr_val.ptr;
+Env *env_find_local(Env *env, const char *name) {
+  for (Env *e = env; e && e != global_env; e = e->next) {
+    if (e->name && !strcmp(e->name, name))
+      return e->ref ? e->ref : e;
+  }
+  return NULL;
+}
 
-      if (val_ptr->type <= VAL_ANY) {
-        return *val_ptr;
-      }
+bool lambda_assigns(AST *lambda, const char *name) {
+  for (size_t i = 0; i < lambda->lambda.assigned_count; i++) {
+    if (!strcmp(lambda->lambda.assigned[i], name))
+      return true;
+  }
+  return false;
+}
 
-      MemoryBlock *block = find_memory_block(ptr_val.ptr);
-      FFIType ptr_type = block ? block->type : FFI_INT;
+Env *capture_upvalues(AST *lambda, Env *env) {
+  lambda_analyze(lambda);
+  Env *captured = global_env;
+  for (size_t i = 0; i < lambda->lambda.upvalue_count; i++) {
+    char *name = lambda->lambda.upvalues[i];
+    Env *target = env_find_local(env, name);
+    if (!target && lambda->lambda.enclosing &&
+        lambda_assigns(lambda->lambda.enclosing, name) &&
+        !env_find(global_env, name)) {
+      env_set(env, name, v_null(), false);
+      target = env_find_local(env, name);
+    }
+    if (!target)
+      continue;
+    Env *up = xmalloc(sizeof(Env));
+    memset(up, 0, sizeof(Env));
+    up->name = name;
+    up->ref = target;
+    up->next = captured;
+    captured = up;
+  }
+  return captured;
+}
 
-      return read_from_memory(ptr_val.ptr, ptr_type);
+typedef struct FrameChunk {
+  struct FrameChunk *prev;
+  struct FrameChunk *next;
+  size_t used;
+  size_t size;
+  char *data;
+} FrameChunk;
+
+typedef struct {
+  FrameChunk *chunk;
+  size_t used;
+} FrameMark;
+
+#define FRAME_CHUNK_SIZE (64 * 1024)
+
+FrameChunk *frame_chunk = NULL;
+
+void *frame_alloc(size_t size) {
+  size = (size + 15) & ~(size_t)15;
+  if (!frame_chunk || frame_chunk->used + size > frame_chunk->size) {
+    FrameChunk *c = frame_chunk ? frame_chunk->next : NULL;
+    if (!c || c->size < size) {
+      c = malloc(sizeof(FrameChunk));
+      c->size = size > FRAME_CHUNK_SIZE ? size : FRAME_CHUNK_SIZE;
+      c->data = malloc(c->size);
+      if (!c->data) {
+        fprintf(stderr, "Fatal: out of memory for call frames\n");
+        exit(1);
+      }
+      c->prev = frame_chunk;
+      c->next = frame_chunk ? frame_chunk->next : NULL;
+      if (frame_chunk)
+        frame_chunk->next = c;
     }
+    c->used = 0;
+    frame_chunk = c;
   }
+  void *p = frame_chunk->data + frame_chunk->used;
+  frame_chunk->used += size;
+  return p;
+}
 
-  case A_ADDROF: {
-    Value *addr = env_get_address(env, a->addrof.var_name);
+FrameMark frame_mark(void) {
+  FrameMark m = {frame_chunk, frame_chunk ? frame_chunk->used : 0};
+  return m;
+}
 
-    if (!addr) {
-      char err[256];
-      snprintf(err, sizeof(err),
-               "cannot take address of undefined variable '%s'",
-               a->addrof.var_name);
-      return v_error(err);
-    }
+void frame_release(FrameMark m) {
+  if (m.chunk) {
+    frame_chunk = m.chunk;
+    frame_chunk->used = m.used;
+    return;
+  }
+  while (frame_chunk && frame_chunk->prev)
+    frame_chunk = frame_chunk->prev;
+  if (frame_chunk)
+    frame_chunk->used = 0;
+}
 
-    return v_ptr((void *)addr);
+#define frame_slot(head, i) (&(head)[(i) + 1])
+
+/* A typed lambda also gets a slot for each annotated local, after its
+   parameters, so the names the typechecker resolved are found by index. */
+Env *frame_env(Function *fn, bool pooled) {
+  size_t n = fn->arity;
+  char **names = fn->params;
+  if (fn->lambda && fn->lambda->lambda.slot_count > n) {
+    n = fn->lambda->lambda.slot_count;
+    names = fn->lambda->lambda.slot_names;
+  }
+  Env *head = pooled ? frame_alloc(sizeof(Env) * (n + 1))
+                     : xmalloc(sizeof(Env) * (n + 1));
+  Env *next = fn->closure_env ? fn->closure_env : global_env;
+  for (size_t i = 0; i < n; i++) {
+    Env *slot = frame_slot(head, i);
+    slot->name = names[i];
+    slot->value = v_null();
+    slot->is_const = false;
+    slot->pooled = false;
+    slot->value_ptr = NULL;
+    slot->ref = NULL;
+    slot->next = next;
+    next = slot;
+  }
+  head->name = NULL;
+  head->is_const = false;
+  head->pooled = pooled;
+  head->value_ptr = NULL;
+  head->ref = NULL;
+  head->next = next;
+  return head;
+}
+
+Env *bind_frame(Function *fn, Value *vals, size_t argc) {
+  Env *local = frame_env(fn, fn->reuse_frame && !fn->is_variadic);
+
+  if (fn->is_variadic) {
+    for (size_t i = 0; i < fn->arity - 1; i++)
+      frame_slot(local, i)->value = i < argc ? vals[i] : v_null();
+    size_t fixed = fn->arity - 1;
+    frame_slot(local, fixed)->value =
+        v_list_view(argc > fixed ? vals + fixed : vals,
+                    argc > fixed ? argc - fixed : 0);
+  } else {
+    for (size_t i = 0; i < fn->arity; i++)
+      frame_slot(local, i)->value = i < argc ? vals[i] : v_null();
   }
+  return local;
+}
 
-  case A_PTR_LITERAL: {
-    if (a->list.count > 0) {
-      Value v = eval(a->list.items[0], env);
+#define STACK_SEGMENT_SIZE (1024 * 1024)
+#define STACK_SEGMENT_RESERVE (64 * 1024)
+#define MAIN_STACK_BUDGET (256 * 1024)
+
+/* Recursion state belongs to the thread running the script code: a callback
+   from a C library may run on an async worker with its own stack. */
+AOXIM_THREAD_LOCAL size_t call_depth = 0;
+size_t max_call_depth = 100000;
+SourceLoc call_loc = {"<stdin>", 1, 1};
+AOXIM_THREAD_LOCAL uintptr_t stack_limit = 0;
+
+/* Called near the base of every thread that may run script code. */
+void stack_limit_init(void) {
+  char stack_base;
+  stack_limit = (uintptr_t)&stack_base - MAIN_STACK_BUDGET;
+}
 
-      if (v.type != VAL_INT && v.type != VAL_NULL && v.type != VAL_PTR) {
-        return v_error(
-            "pointer can only be created from int, null, or another pointer");
-      }
+bool jit_enabled = false;
+size_t jit_ticks = 0;
 
-      if (v.type == VAL_INT) {
-        return v_ptr((void *)v.i);
-      } else if (v.type == VAL_PTR) {
-        return v;
-      } else if (v.type == VAL_NULL) {
-        return v_ptr(NULL);
-      }
+#if defined(__linux__) && defined(__x86_64__)
+#define JIT_SUPPORTED 1
+#define JIT_THRESHOLD 64
+#define JIT_MAX_BAILS 16
 
-      return v_error("pointer cast requires integer, pointer, or null");
-    }
+typedef enum { JT_NONE, JT_INT, JT_BOOL } JitType;
 
-    return v_ptr(a->ptr_lit.addr);
-  }
-  case A_STRING_INTERP: {
-    size_t total_len = 0;
-    for (size_t i = 0; i <= a->str_interp.count; i++) {
-      total_len += strlen(a->str_interp.parts[i]);
-    }
+struct JitCode {
+  int64_t (*entry)(int64_t *args);
+  JitType result;
+  size_t frame_bytes;
+};
 
-    char **expr_strs = xmalloc(sizeof(char *) * a->str_interp.count);
-    for (size_t i = 0; i < a->str_interp.count; i++) {
-      Value expr_val = eval(a->str_interp.exprs[i], env);
-      expr_strs[i] = value_to_str(expr_val);
-      total_len += strlen(expr_strs[i]);
-    }
-    char *result = xmalloc(total_len + 1);
-    result[0] = '\0';
+typedef struct {
+  uint8_t *code;
+  size_t len;
+  size_t cap;
+  Function *fn;
+  char **locals;
+  JitType *local_types;
+  size_t local_count;
+  size_t local_cap;
+  size_t pushes;
+  size_t max_pushes;
+  size_t *bails;
+  size_t bail_count;
+  size_t bail_cap;
+  size_t *breaks;
+  size_t break_count;
+  size_t break_cap;
+  size_t loop_top;
+  bool in_loop;
+  size_t *returns;
+  size_t return_count;
+  size_t return_cap;
+  JitType result;
+  bool self_int;
+  bool failed;
+} JitBuf;
+
+volatile uint8_t jit_bailed = 0;
+int64_t jit_depth = 0;
+size_t jit_max_frame = 64;
+
+void jit_byte(JitBuf *j, uint8_t b) {
+  if (j->len >= j->cap) {
+    j->cap = j->cap ? j->cap * 2 : 1024;
+    j->code = realloc(j->code, j->cap);
+  }
+  j->code[j->len++] = b;
+}
 
-    for (size_t i = 0; i <= a->str_interp.count; i++) {
-      strcat(result, a->str_interp.parts[i]);
-      if (i < a->str_interp.count) {
-        strcat(result, expr_strs[i]);
-      }
-    }
+void jit_bytes(JitBuf *j, const char *bytes, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    jit_byte(j, (uint8_t)bytes[i]);
+}
 
-    return v_str(result);
-  }
+void jit_u32(JitBuf *j, uint32_t v) {
+  for (int i = 0; i < 4; i++)
+    jit_byte(j, (uint8_t)(v >> (8 * i)));
+}
 
-  case A_LIST: {
-    Value v = v_list();
-    for (size_t i = 0; i < a->list.count; i++)
-      list_append(v.list, eval(a->list.items[i], env));
-    return v;
+void jit_u64(JitBuf *j, uint64_t v) {
+  for (int i = 0; i < 8; i++)
+    jit_byte(j, (uint8_t)(v >> (8 * i)));
+}
+
+void jit_patch(JitBuf *j, size_t at, size_t target) {
+  uint32_t rel = (uint32_t)((int64_t)target - (int64_t)(at + 4));
+  for (int i = 0; i < 4; i++)
+    j->code[at + i] = (uint8_t)(rel >> (8 * i));
+}
+
+size_t jit_push_site(size_t **list, size_t *count, size_t *cap, size_t at) {
+  if (*count >= *cap) {
+    *cap = *cap ? *cap * 2 : 16;
+    *list = realloc(*list, sizeof(size_t) * *cap);
   }
-  case A_TUPLE: {
-    Value *items = xmalloc(sizeof(Value) * a->list.count);
-    for (size_t i = 0; i < a->list.count; i++)
-      items[i] = eval(a->list.items[i], env);
-    return v_tuple(items, a->list.count);
+  (*list)[(*count)++] = at;
+  return at;
+}
+
+void jit_mov_rax_imm(JitBuf *j, uint64_t v) {
+  jit_bytes(j, "\x48\xb8", 2);
+  jit_u64(j, v);
+}
+
+void jit_mov_rcx_imm(JitBuf *j, uint64_t v) {
+  jit_bytes(j, "\x48\xb9", 2);
+  jit_u64(j, v);
+}
+
+size_t jit_jump(JitBuf *j, const char *op, size_t n) {
+  jit_bytes(j, op, n);
+  size_t at = j->len;
+  jit_u32(j, 0);
+  return at;
+}
+
+void jit_jump_bail(JitBuf *j, const char *op, size_t n) {
+  jit_push_site(&j->bails, &j->bail_count, &j->bail_cap, jit_jump(j, op, n));
+}
+
+void jit_push(JitBuf *j) {
+  jit_byte(j, 0x50);
+  if (++j->pushes > j->max_pushes)
+    j->max_pushes = j->pushes;
+}
+
+void jit_pop_rcx(JitBuf *j) {
+  jit_byte(j, 0x59);
+  j->pushes--;
+}
+
+uint32_t jit_local_disp(size_t i) { return (uint32_t)(-8 * (int32_t)(i + 1)); }
+
+long jit_find_local(JitBuf *j, const char *name) {
+  for (size_t i = 0; i < j->local_count; i++) {
+    if (!strcmp(j->locals[i], name))
+      return (long)i;
   }
-  case A_INDEX: {
-    Value obj = eval(a->index.obj, env);
-    Value idx = eval(a->index.idx, env);
+  return -1;
+}
 
-    if (obj.type == VAL_ERROR)
-      return obj;
-    if (idx.type == VAL_ERROR)
-      return idx;
+size_t jit_add_local(JitBuf *j, char *name, JitType t) {
+  if (j->local_count >= j->local_cap) {
+    j->local_cap = j->local_cap ? j->local_cap * 2 : 16;
+    j->locals = realloc(j->locals, sizeof(char *) * j->local_cap);
+    j->local_types = realloc(j->local_types, sizeof(JitType) * j->local_cap);
+  }
+  j->locals[j->local_count] = name;
+  j->local_types[j->local_count] = t;
+  return j->local_count++;
+}
 
-    if (obj.type == VAL_ANY && obj.any_val) {
-      obj = *obj.any_val;
-    }
+void jit_load_local(JitBuf *j, size_t i) {
+  jit_bytes(j, "\x48\x8b\x85", 3);
+  jit_u32(j, jit_local_disp(i));
+}
 
-    if (obj.type == VAL_LIST && idx.type == VAL_INT) {
-      if (idx.i < 0) {
-        return v_error("list index cannot be negative");
-      }
-      if ((size_t)idx.i >= obj.list->size) {
-        return v_error("list index out of range");
-      }
-      return obj.list->items[idx.i];
-    }
-    if (obj.type == VAL_TUPLE && idx.type == VAL_INT) {
-      if (idx.i < 0) {
-        return v_error("tuple index cannot be negative");
-      }
-      if ((size_t)idx.i >= obj.tuple->size) {
-        return v_error("tuple index out of range");
-      }
-      return obj.tuple->items[idx.i];
+void jit_store_local(JitBuf *j, size_t i) {
+  jit_bytes(j, "\x48\x89\x85", 3);
+  jit_u32(j, jit_local_disp(i));
+}
+
+void jit_truthy(JitBuf *j) {
+  jit_bytes(j, "\x48\x85\xc0\x0f\x95\xc0\x48\x0f\xb6\xc0", 10);
+}
+
+JitType jit_expr(JitBuf *j, AST *a);
+void jit_stmt(JitBuf *j, AST *a);
+
+/* Annotations only admit compiled code when they agree with the integer
+   lowering; double-typed code stays in the interpreter. */
+bool jit_type_fits(TypeAnn ann, JitType t) {
+  return ann == TY_ANY || (ann == TY_INT && t == JT_INT) ||
+         (ann == TY_BOOL && t == JT_BOOL);
+}
+
+JitType jit_binop(JitBuf *j, AST *a) {
+  char op = a->bin.op;
+  JitType lt = jit_expr(j, a->bin.l);
+  jit_push(j);
+  JitType rt = jit_expr(j, a->bin.r);
+  jit_bytes(j, "\x48\x89\xc1", 3);
+  jit_byte(j, 0x58);
+  j->pushes--;
+  if (lt == JT_NONE || rt == JT_NONE)
+    return JT_NONE;
+
+  if (op == '&' || op == '|') {
+    jit_truthy(j);
+    jit_bytes(j, "\x48\x85\xc9\x0f\x95\xc1\x48\x0f\xb6\xc9", 10);
+    jit_bytes(j, op == '&' ? "\x48\x21\xc8" : "\x48\x09\xc8", 3);
+    return JT_BOOL;
+  }
+  const char *cmp = strchr("EN<>LG", op);
+  if (op && cmp) {
+    static const uint8_t setcc[] = {0x94, 0x95, 0x9c, 0x9f, 0x9e, 0x9d};
+    if (lt != rt || (lt == JT_BOOL && op != 'E' && op != 'N'))
+      return JT_NONE;
+    jit_bytes(j, "\x48\x39\xc8\x0f", 4);
+    jit_byte(j, setcc[cmp - "EN<>LG"]);
+    jit_bytes(j, "\xc0\x48\x0f\xb6\xc0", 5);
+    return JT_BOOL;
+  }
+  if (lt != JT_INT || rt != JT_INT)
+    return JT_NONE;
+  switch (op) {
+  case '+':
+    jit_bytes(j, "\x48\x01\xc8", 3);
+    return JT_INT;
+  case '-':
+    jit_bytes(j, "\x48\x29\xc8", 3);
+    return JT_INT;
+  case '*':
+    jit_bytes(j, "\x48\x0f\xaf\xc1", 4);
+    return JT_INT;
+  case '/':
+  case 'F':
+  case '%':
+    jit_bytes(j, "\x48\x85\xc9", 3);
+    jit_jump_bail(j, "\x0f\x84", 2);
+    jit_bytes(j, "\x48\x83\xf9\xff", 4);
+    jit_jump_bail(j, "\x0f\x84", 2);
+    jit_bytes(j, "\x48\x99\x48\xf7\xf9", 5);
+    if (op == '%')
+      jit_bytes(j, "\x48\x89\xd0", 3);
+    return JT_INT;
+  case 'l':
+    jit_bytes(j, "\x48\xd3\xe0", 3);
+    return JT_INT;
+  case 'r':
+    jit_bytes(j, "\x48\xd3\xe8", 3);
+    return JT_INT;
+  default:
+    return JT_NONE;
+  }
+}
+
+JitType jit_call(JitBuf *j, AST *a) {
+  if (a->call.fn->type != A_VAR || jit_find_local(j, a->call.fn->name) >= 0)
+    return JT_NONE;
+  Env *binding = env_find(global_env, a->call.fn->name);
+  if (!binding || binding->value.type != VAL_FUNC)
+    return JT_NONE;
+  Function *callee = binding->value.fn;
+  bool self = callee == j->fn;
+  struct JitCode *code = callee->lambda ? callee->lambda->lambda.jit : NULL;
+  if ((!self && !code) || callee->arity != a->call.argc || callee->is_variadic)
+    return JT_NONE;
+  /* Arguments are always ints here, so a typed callee is fine as long as
+     every annotation accepts one; its return type was checked when it was
+     compiled (or is checked by jit_compile for a self call). */
+  for (size_t i = 0; callee->param_types && i < callee->arity; i++) {
+    if (!jit_type_fits(callee->param_types[i], JT_INT))
+      return JT_NONE;
+  }
+
+  for (size_t i = a->call.argc; i-- > 0;) {
+    if (jit_expr(j, a->call.args[i]) != JT_INT)
+      return JT_NONE;
+    jit_push(j);
+  }
+  jit_mov_rax_imm(j, (uint64_t)(uintptr_t)&binding->value.fn);
+  jit_bytes(j, "\x48\x8b\x00", 3);
+  jit_mov_rcx_imm(j, (uint64_t)(uintptr_t)callee);
+  jit_bytes(j, "\x48\x39\xc8", 3);
+  jit_jump_bail(j, "\x0f\x85", 2);
+  jit_bytes(j, "\x48\x89\xe7", 3);
+  if (self) {
+    jit_patch(j, jit_jump(j, "\xe8", 1), 0);
+  } else {
+    jit_mov_rax_imm(j, (uint64_t)(uintptr_t)code->entry);
+    jit_bytes(j, "\xff\xd0", 2);
+  }
+  if (a->call.argc) {
+    jit_bytes(j, "\x48\x81\xc4", 3);
+    jit_u32(j, (uint32_t)(8 * a->call.argc));
+    j->pushes -= a->call.argc;
+  }
+  jit_mov_rcx_imm(j, (uint64_t)(uintptr_t)&jit_bailed);
+  jit_bytes(j, "\x80\x39\x00", 3);
+  jit_jump_bail(j, "\x0f\x85", 2);
+  if (self) {
+    if (j->result != JT_NONE)
+      return j->result;
+    j->self_int = true;
+    return JT_INT;
+  }
+  return code->result;
+}
+
+void jit_return(JitBuf *j, JitType t) {
+  if (t == JT_NONE || (j->result != JT_NONE && j->result != t)) {
+    j->failed = true;
+    return;
+  }
+  j->result = t;
+  jit_push_site(&j->returns, &j->return_count, &j->return_cap,
+                jit_jump(j, "\xe9", 1));
+}
+
+JitType jit_if(JitBuf *j, AST *a, bool value) {
+  if (jit_expr(j, a->ifelse.cond) == JT_NONE)
+    return JT_NONE;
+  jit_bytes(j, "\x48\x85\xc0", 3);
+  size_t to_else = jit_jump(j, "\x0f\x84", 2);
+  JitType tt = JT_NONE, et = JT_NONE;
+  if (value)
+    tt = jit_expr(j, a->ifelse.then_block);
+  else
+    jit_stmt(j, a->ifelse.then_block);
+  size_t to_end = jit_jump(j, "\xe9", 1);
+  jit_patch(j, to_else, j->len);
+  if (a->ifelse.else_block) {
+    if (value)
+      et = jit_expr(j, a->ifelse.else_block);
+    else
+      jit_stmt(j, a->ifelse.else_block);
+  } else if (value) {
+    jit_jump_bail(j, "\xe9", 1);
+    et = tt;
+  }
+  jit_patch(j, to_end, j->len);
+  return tt == et ? tt : JT_NONE;
+}
+
+JitType jit_match(JitBuf *j, AST *a, bool value) {
+  if (jit_expr(j, a->match.value) != JT_INT)
+    return JT_NONE;
+  size_t *ends = malloc(sizeof(size_t) * (a->match.case_count + 1));
+  JitType result = JT_NONE;
+  bool ok = true;
+  for (size_t i = 0; i < a->match.case_count && ok; i++) {
+    AST *p = a->match.patterns[i];
+    if (p->type != A_INT || p->i != (int32_t)p->i) {
+      ok = false;
+      break;
     }
-    if (obj.type == VAL_STRING && idx.type == VAL_INT) {
-      size_t len = strlen(obj.s);
-      if (idx.i < 0) {
-        return v_error("string index cannot be negative");
-      }
-      if ((size_t)idx.i >= len) {
-        return v_error("string index out of range");
-      }
-      char buf[2] = {obj.s[idx.i], '\0'};
-      return v_str(buf);
+    jit_bytes(j, "\x48\x3d", 2);
+    jit_u32(j, (uint32_t)(int32_t)p->i);
+    size_t next = jit_jump(j, "\x0f\x85", 2);
+    if (value) {
+      JitType t = jit_expr(j, a->match.bodies[i]);
+      ok = t != JT_NONE && (result == JT_NONE || result == t);
+      result = t;
+    } else {
+      jit_stmt(j, a->match.bodies[i]);
+    }
+    ends[i] = jit_jump(j, "\xe9", 1);
+    jit_patch(j, next, j->len);
+  }
+  if (value)
+    jit_jump_bail(j, "\xe9", 1);
+  for (size_t i = 0; ok && i < a->match.case_count; i++)
+    jit_patch(j, ends[i], j->len);
+  free(ends);
+  if (!ok)
+    return JT_NONE;
+  return value ? result : JT_INT;
+}
+
+JitType jit_block(JitBuf *j, AST *a) {
+  if (a->block.count == 0)
+    return JT_NONE;
+  for (size_t i = 0; i + 1 < a->block.count; i++)
+    jit_stmt(j, a->block.stmts[i]);
+  return jit_expr(j, a->block.stmts[a->block.count - 1]);
+}
+
+JitType jit_assign(JitBuf *j, AST *a) {
+  if (env_find(global_env, a->assign.name))
+    return JT_NONE;
+  JitType t = jit_expr(j, a->assign.value);
+  if (t == JT_NONE || !jit_type_fits(a->assign.check, t))
+    return JT_NONE;
+  long slot = jit_find_local(j, a->assign.name);
+  if (slot < 0)
+    slot = (long)jit_add_local(j, a->assign.name, t);
+  else if (j->local_types[slot] != t)
+    return JT_NONE;
+  jit_store_local(j, (size_t)slot);
+  return t;
+}
+
+JitType jit_step(JitBuf *j, const char *name, bool inc, bool is_post) {
+  long slot = jit_find_local(j, name);
+  if (slot < 0 || j->local_types[slot] != JT_INT)
+    return JT_NONE;
+  jit_load_local(j, (size_t)slot);
+  jit_bytes(j, "\x48\x89\xc1\x48\x83", 5);
+  jit_bytes(j, inc ? "\xc1\x01" : "\xe9\x01", 2);
+  jit_bytes(j, "\x48\x89\x8d", 3);
+  jit_u32(j, jit_local_disp((size_t)slot));
+  if (!is_post)
+    jit_bytes(j, "\x48\x89\xc8", 3);
+  return JT_INT;
+}
+
+JitType jit_expr(JitBuf *j, AST *a) {
+  if (j->failed)
+    return JT_NONE;
+  JitType t = JT_NONE;
+  switch (a->type) {
+  case A_INT:
+    jit_mov_rax_imm(j, (uint64_t)a->i);
+    t = JT_INT;
+    break;
+  case A_BOOL:
+    jit_mov_rax_imm(j, a->b ? 1 : 0);
+    t = JT_BOOL;
+    break;
+  case A_VAR: {
+    long slot = jit_find_local(j, a->name);
+    if (slot >= 0) {
+      jit_load_local(j, (size_t)slot);
+      t = j->local_types[slot];
     }
-    return v_error("cannot index non-sequence or with non-integer");
+    break;
   }
-  case A_UNWRAP: {
-    Value v = eval(a->unwrap.expr, env);
-    if (v.type == VAL_ERROR) {
-      fprintf(stderr, "%s:%d:%d: error: unwrap failed: %s\n", a->loc.filename,
-              a->loc.line, a->loc.column, v.s);
-      exit(1);
-    }
-    if (v.type == VAL_PTR && v.ptr == NULL) {
-      fprintf(stderr, "%s:%d:%d: error: unwrap failed: null pointer\n",
-              a->loc.filename, a->loc.line, a->loc.column);
-      exit(1);
+  case A_BINOP:
+  case A_BINOP_INT:
+    t = jit_binop(j, a);
+    break;
+  case A_CALL:
+    t = jit_call(j, a);
+    break;
+  case A_IF:
+    t = jit_if(j, a, true);
+    break;
+  case A_MATCH:
+    t = jit_match(j, a, true);
+    break;
+  case A_BLOCK:
+    t = jit_block(j, a);
+    break;
+  case A_ASSIGN:
+    t = jit_assign(j, a);
+    break;
+  case A_INCREMENT:
+    t = jit_step(j, a->increment.name, true, a->increment.is_post);
+    break;
+  case A_DECREMENT:
+    t = jit_step(j, a->decrement.name, false, a->decrement.is_post);
+    break;
+  case A_RETURN:
+    if (a->ret.value)
+      jit_return(j, jit_expr(j, a->ret.value));
+    else
+      j->failed = true;
+    t = j->result;
+    break;
+  default:
+    break;
+  }
+  if (t == JT_NONE)
+    j->failed = true;
+  return t;
+}
+
+void jit_stmt(JitBuf *j, AST *a) {
+  if (j->failed)
+    return;
+  switch (a->type) {
+  case A_IF:
+    jit_if(j, a, false);
+    return;
+  case A_MATCH:
+    if (jit_match(j, a, false) == JT_NONE)
+      j->failed = true;
+    return;
+  case A_BLOCK:
+    for (size_t i = 0; i < a->block.count; i++)
+      jit_stmt(j, a->block.stmts[i]);
+    return;
+  case A_WHILE: {
+    size_t saved_top = j->loop_top, saved_breaks = j->break_count;
+    bool saved_in_loop = j->in_loop;
+    j->loop_top = j->len;
+    j->in_loop = true;
+    if (jit_expr(j, a->whileloop.cond) == JT_NONE)
+      return;
+    jit_bytes(j, "\x48\x85\xc0", 3);
+    size_t exit = jit_jump(j, "\x0f\x84", 2);
+    jit_stmt(j, a->whileloop.body);
+    jit_patch(j, jit_jump(j, "\xe9", 1), j->loop_top);
+    jit_patch(j, exit, j->len);
+    for (size_t i = saved_breaks; i < j->break_count; i++)
+      jit_patch(j, j->breaks[i], j->len);
+    j->break_count = saved_breaks;
+    j->loop_top = saved_top;
+    j->in_loop = saved_in_loop;
+    return;
+  }
+  case A_BREAK:
+    if (!j->in_loop) {
+      j->failed = true;
+      return;
     }
-    if (v.type == VAL_NULL) {
-      fprintf(stderr, "%s:%d:%d: error: unwrap failed: got null\n",
-              a->loc.filename, a->loc.line, a->loc.column);
-      exit(1);
+    jit_push_site(&j->breaks, &j->break_count, &j->break_cap,
+                  jit_jump(j, "\xe9", 1));
+    return;
+  case A_CONTINUE:
+    if (!j->in_loop) {
+      j->failed = true;
+      return;
     }
-    return v;
+    jit_patch(j, jit_jump(j, "\xe9", 1), j->loop_top);
+    return;
+  default:
+    jit_expr(j, a);
+    return;
   }
-  case A_METHOD: {
-    Value obj = eval(a->method.obj, env);
-    Value *args = NULL;
-    if (a->method.argc > 0) {
-      args = xmalloc(sizeof(Value) * a->method.argc);
-      for (size_t i = 0; i < a->method.argc; i++)
-        args[i] = eval(a->method.args[i], env);
+}
+
+bool jit_compile(Function *fn) {
+  if (fn->is_builtin || fn->is_variadic || fn->target ||
+      fn->closure_env != global_env || !fn->lambda)
+    return false;
+  for (size_t i = 0; fn->param_types && i < fn->arity; i++) {
+    if (!jit_type_fits(fn->param_types[i], JT_INT))
+      return false;
+  }
+
+  JitBuf j;
+  memset(&j, 0, sizeof(j));
+  j.fn = fn;
+  for (size_t i = 0; i < fn->arity; i++) {
+    if (jit_find_local(&j, fn->params[i]) >= 0)
+      return false;
+    jit_add_local(&j, fn->params[i], JT_INT);
+  }
+
+  jit_bytes(&j, "\x55\x48\x89\xe5\x48\x81\xec", 7);
+  size_t frame_at = j.len;
+  jit_u32(&j, 0);
+  jit_mov_rax_imm(&j, (uint64_t)(uintptr_t)&jit_depth);
+  jit_bytes(&j, "\x48\xff\x08", 3);
+  jit_jump_bail(&j, "\x0f\x88", 2);
+  for (size_t i = 0; i < fn->arity; i++) {
+    jit_bytes(&j, "\x48\x8b\x87", 3);
+    jit_u32(&j, (uint32_t)(8 * i));
+    jit_store_local(&j, i);
+  }
+
+  JitType body = jit_expr(&j, fn->body);
+  if (!j.failed)
+    jit_return(&j, body);
+
+  size_t epilogue = j.len;
+  jit_mov_rcx_imm(&j, (uint64_t)(uintptr_t)&jit_depth);
+  jit_bytes(&j, "\x48\xff\x01\xc9\xc3", 5);
+  size_t bail = j.len;
+  jit_mov_rcx_imm(&j, (uint64_t)(uintptr_t)&jit_bailed);
+  jit_bytes(&j, "\xc6\x01\x01\xc9\xc3", 5);
+
+  bool ok = !j.failed && j.result != JT_NONE &&
+            (!j.self_int || j.result == JT_INT) &&
+            jit_type_fits(fn->return_type, j.result);
+  void *mem = MAP_FAILED;
+  if (ok) {
+    uint32_t frame = (uint32_t)((8 * j.local_count + 15) & ~(size_t)15);
+    for (int i = 0; i < 4; i++)
+      j.code[frame_at + i] = (uint8_t)(frame >> (8 * i));
+    for (size_t i = 0; i < j.return_count; i++)
+      jit_patch(&j, j.returns[i], epilogue);
+    for (size_t i = 0; i < j.bail_count; i++)
+      jit_patch(&j, j.bails[i], bail);
+    mem = mmap(NULL, j.len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+               -1, 0);
+  }
+  if (mem != MAP_FAILED) {
+    memcpy(mem, j.code, j.len);
+    if (mprotect(mem, j.len, PROT_READ | PROT_EXEC) == 0) {
+      struct JitCode *code = malloc(sizeof(struct JitCode));
+      code->entry = (int64_t(*)(int64_t *))mem;
+      code->result = j.result;
+      code->frame_bytes = 8 * j.local_count + 8 * j.max_pushes + 48;
+      if (code->frame_bytes > jit_max_frame)
+        jit_max_frame = code->frame_bytes;
+      fn->lambda->lambda.jit = code;
+    } else {
+      munmap(mem, j.len);
+      ok = false;
     }
-    Value result = call_method(obj, a->method.method, args, a->method.argc);
-    return result;
   }
-  case A_BINOP: {
-    Value l = eval(a->bin.l, env);
-    Value r = eval(a->bin.r, env);
+  free(j.code);
+  free(j.locals);
+  free(j.local_types);
+  free(j.bails);
+  free(j.breaks);
+  free(j.returns);
+  return ok && mem != MAP_FAILED;
+}
 
-    if (l.type == VAL_ERROR)
-      return l;
-    if (r.type == VAL_ERROR)
-      return r;
+/* Hotness is calls plus while-loop iterations run by the call, checked
+   when the call returns. There is no on-stack replacement: compiled code
+   is entered on the next call, so a function that runs a long loop once
+   stays interpreted. Frames of a recursion that was already running when
+   the function got compiled return here too and must not compile it
+   again. */
+void jit_observe(Function *fn, size_t ticks) {
+  AST *l = fn->lambda;
+  l->lambda.jit_hot += 1 + ticks;
+  if (l->lambda.jit || l->lambda.jit_hot < JIT_THRESHOLD)
+    return;
+  l->lambda.jit_hot = 0;
+  if (!jit_compile(fn) && ++l->lambda.jit_bails >= 4)
+    l->lambda.jit_failed = true;
+}
 
-    if (a->bin.op == '|') {
-      return v_bool(value_is_truthy(l) || value_is_truthy(r));
+bool jit_enter(Function *fn, Env *local, Value *result) {
+  AST *l = fn->lambda;
+  struct JitCode *code = l->lambda.jit;
+  int64_t args[16];
+  if (fn->arity > 16)
+    return false;
+  for (size_t i = 0; i < fn->arity; i++) {
+    Value v = frame_slot(local, i)->value;
+    if (v.type != VAL_INT)
+      return false;
+    args[i] = v.i;
+  }
+
+  char probe;
+  uintptr_t room = (uintptr_t)&probe > stack_limit
+                       ? (uintptr_t)&probe - stack_limit
+                       : 0;
+  size_t budget = room / jit_max_frame;
+  if (max_call_depth > call_depth && budget > max_call_depth - call_depth)
+    budget = max_call_depth - call_depth;
+  jit_depth = (int64_t)budget;
+  jit_bailed = 0;
+  int64_t r = code->entry(args);
+  if (jit_bailed) {
+    if (++l->lambda.jit_bails >= JIT_MAX_BAILS) {
+      l->lambda.jit = NULL;
+      l->lambda.jit_failed = true;
     }
+    return false;
+  }
+  *result = code->result == JT_BOOL ? v_bool(r != 0) : v_int(r);
+  return true;
+}
+
+bool jit_run(Function *fn, Env *local, Value *result) {
+  AST *l = fn->lambda;
+  if (!l || l->lambda.jit_failed || l->lambda.jit_blocked)
+    return false;
+  if (!l->lambda.jit) {
+    size_t start = jit_ticks;
+    *result = eval(fn->body, local);
+    jit_observe(fn, jit_ticks - start);
+    return true;
+  }
+  if (jit_enter(fn, local, result))
+    return true;
+  if (!jit_bailed)
+    return false;
+  l->lambda.jit_blocked = true;
+  *result = eval(fn->body, local);
+  l->lambda.jit_blocked = false;
+  return true;
+}
+#else
+bool jit_run(Function *fn, Env *local, Value *result) {
+  (void)fn;
+  (void)local;
+  (void)result;
+  return false;
+}
+#endif
 
-    if (a->bin.op == '&') {
-      return v_bool(value_is_truthy(l) && value_is_truthy(r));
+bool check_param_types(Function *fn, Env *local, Value *error) {
+  for (size_t i = 0; i < fn->arity; i++) {
+    Env *slot = frame_slot(local, i);
+    if (!type_accepts(fn->param_types[i], &slot->value)) {
+      char msg[256];
+      snprintf(msg, sizeof(msg), "argument '%s' expects %s, got %s",
+               fn->params[i], type_ann_name(fn->param_types[i]),
+               value_type_name(slot->value));
+      *error = v_error(msg);
+      return false;
     }
+  }
+  return true;
+}
+
+void check_return_type(TypeAnn t, Value *result) {
+  if (t == TY_ANY || result->type == VAL_ERROR || type_accepts(t, result))
+    return;
+  char msg[256];
+  snprintf(msg, sizeof(msg), "function declared to return %s returned %s",
+           type_ann_name(t), value_type_name(*result));
+  *result = v_error(msg);
+}
+
+Value run_frame(Function *fn, Env *local, FrameMark mark) {
+  Env *params = local->next;
+  FrameMark body_mark = frame_mark();
+  TypeAnn outer_return = fn->return_type;
 
-    if (l.type == VAL_ANY && l.any_val) {
-      l = *l.any_val;
+  for (;;) {
+    Value result;
+    if (fn->param_types && !check_param_types(fn, local, &result)) {
+      frame_release(mark);
+      return result;
+    }
+    if (fn->native) {
+      Value args[16];
+      size_t n = fn->arity < 16 ? fn->arity : 16;
+      for (size_t i = 0; i < n; i++)
+        args[i] = frame_slot(local, i)->value;
+      result = fn->native(args, fn->arity);
+    } else if (!jit_enabled || !jit_run(fn, local, &result)) {
+      result = eval(fn->body, local);
     }
-    if (r.type == VAL_ANY && r.any_val) {
-      r = *r.any_val;
+    if (result.cf != CF_TAIL) {
+      if (result.cf == CF_RETURN) {
+        result.cf = CF_NONE;
+      }
+      frame_release(mark);
+      check_return_type(fn->return_type, &result);
+      check_return_type(outer_return, &result);
+      return result;
     }
 
-    if (a->bin.op == 'E') {
-      if (l.type != r.type)
-        return v_bool(false);
+    Function *next = tail_fn;
+    size_t n = tail_argc;
+    tail_top = tail_base;
 
-      switch (l.type) {
-      case VAL_INT:
-        return v_bool(l.i == r.i);
-      case VAL_DOUBLE:
-        return v_bool(l.d == r.d);
-      case VAL_BOOL:
-        return v_bool(l.b == r.b);
-      case VAL_CHAR:
-        return v_bool(l.c == r.c);
-      case VAL_STRING:
-        return v_bool(strcmp(l.s, r.s) == 0);
-      case VAL_PTR:
-        return v_bool(l.ptr == r.ptr);
-      case VAL_NULL:
-        return v_bool(true);
-      case VAL_FUNC:
-        return v_bool(l.fn == r.fn);
-      case VAL_LIST:
-        if (l.list->size != r.list->size)
-          return v_bool(false);
-        for (size_t i = 0; i < l.list->size; i++) {
-          Value li = l.list->items[i];
-          Value ri = r.list->items[i];
-          if (li.type != ri.type)
-            return v_bool(false);
-          switch (li.type) {
-          case VAL_INT:
-            if (li.i != ri.i)
-              return v_bool(false);
-            break;
-          case VAL_DOUBLE:
-            if (li.d != ri.d)
-              return v_bool(false);
-            break;
-          case VAL_BOOL:
-            if (li.b != ri.b)
-              return v_bool(false);
-            break;
-          case VAL_CHAR:
-            if (li.c != ri.c)
-              return v_bool(false);
-            break;
-          case VAL_STRING:
-            if (strcmp(li.s, ri.s) != 0)
-              return v_bool(false);
-            break;
-          case VAL_PTR:
-            if (li.ptr != ri.ptr)
-              return v_bool(false);
-            break;
-          case VAL_NULL:
-            break;
-          default:
-            return v_bool(false);
-          }
-        }
-        return v_bool(true);
+    if (next == fn && local->pooled) {
+      frame_release(body_mark);
+      local->next = params;
+      for (size_t i = 0; i < fn->arity; i++) {
+        Env *slot = frame_slot(local, i);
+        slot->value = i < n ? tail_stack[tail_base + i] : v_null();
+        if (slot->value_ptr)
+          *slot->value_ptr = slot->value;
+      }
+      size_t slots = fn->lambda ? fn->lambda->lambda.slot_count : 0;
+      for (size_t i = fn->arity; i < slots; i++) {
+        Env *slot = frame_slot(local, i);
+        slot->value = v_null();
+        slot->is_const = false;
+        slot->value_ptr = NULL;
+      }
+      continue;
+    }
 
-      case VAL_TUPLE:
-        if (l.tuple->size != r.tuple->size)
-          return v_bool(false);
-        for (size_t i = 0; i < l.tuple->size; i++) {
-          if (!values_equal(l.tuple->items[i], r.tuple->items[i])) {
-            return v_bool(false);
-          }
-        }
-        return v_bool(true);
+    frame_release(mark);
+    fn = next;
+    if (fn->is_variadic) {
+      size_t effective_argc = n > fn->arity - 1 ? n : fn->arity - 1;
+      Value *vals = xmalloc(sizeof(Value) * (effective_argc + 1));
+      for (size_t i = 0; i < effective_argc; i++)
+        vals[i] = i < n ? tail_stack[tail_base + i] : v_null();
+      local = bind_frame(fn, vals, effective_argc);
+    } else {
+      local = bind_frame(fn, tail_stack + tail_base, n);
+    }
+    params = local->next;
+    body_mark = frame_mark();
+  }
+}
 
-      case VAL_STRUCT:
-        if (l.struct_val->def != r.struct_val->def)
-          return v_bool(false);
-        for (size_t i = 0; i < l.struct_val->def->field_count; i++) {
-          if (!values_equal(l.struct_val->values[i], r.struct_val->values[i])) {
-            return v_bool(false);
-          }
-        }
-        return v_bool(true);
+#ifndef _WIN32
+typedef struct StackSegment {
+  char *memory;
+  ucontext_t ctx;
+  ucontext_t caller;
+  Function *fn;
+  Env *local;
+  FrameMark mark;
+  Value result;
+  struct StackSegment *next_free;
+} StackSegment;
+
+AOXIM_THREAD_LOCAL StackSegment *free_segments = NULL;
+AOXIM_THREAD_LOCAL StackSegment *entering_segment = NULL;
+AOXIM_THREAD_LOCAL size_t stack_segments_used = 0;
+
+/* Deep recursion runs on malloc'd segments (about 3KB per script call), so
+   a large --max-depth could otherwise exhaust memory before the depth check
+   fires. The segments of a thread may use up to a quarter of physical
+   memory; past that a call fails like an exceeded depth. */
+size_t stack_segment_budget(void) {
+#ifdef _SC_PHYS_PAGES
+  long pages = sysconf(_SC_PHYS_PAGES);
+  long page = sysconf(_SC_PAGESIZE);
+  if (pages > 0 && page > 0) {
+    size_t n = (size_t)pages / 4 / (STACK_SEGMENT_SIZE / (size_t)page);
+    return n > 16 ? n : 16;
+  }
+#endif
+  return 1024;
+}
 
-      case VAL_STRUCT_DEF:
-        return v_bool(l.struct_def == r.struct_def);
+size_t stack_segment_limit = 0;
 
-      case VAL_ERROR:
-        return v_bool(strcmp(l.s, r.s) == 0);
+Value call_frame(Function *fn, Env *local, FrameMark mark);
 
-      default:
-        return v_bool(false);
-      }
-    }
-    if (a->bin.op == 'N') {
-      if (l.type != r.type)
-        return v_bool(true);
+void segment_entry(void) {
+  StackSegment *seg = entering_segment;
+  seg->result = call_frame(seg->fn, seg->local, seg->mark);
+}
 
-      switch (l.type) {
-      case VAL_INT:
-        return v_bool(l.i != r.i);
-      case VAL_DOUBLE:
-        return v_bool(l.d != r.d);
-      case VAL_BOOL:
-        return v_bool(l.b != r.b);
-      case VAL_CHAR:
-        return v_bool(l.c != r.c);
-      case VAL_STRING:
-        return v_bool(strcmp(l.s, r.s) != 0);
-      case VAL_PTR:
-        return v_bool(l.ptr != r.ptr);
-      case VAL_NULL:
-        return v_bool(false);
-      case VAL_FUNC:
-        return v_bool(l.fn != r.fn);
-      case VAL_LIST:
-        if (l.list->size != r.list->size)
-          return v_bool(true);
-        for (size_t i = 0; i < l.list->size; i++) {
-          Value li = l.list->items[i];
-          Value ri = r.list->items[i];
-          if (li.type != ri.type)
-            return v_bool(true);
-          switch (li.type) {
-          case VAL_INT:
-            if (li.i != ri.i)
-              return v_bool(true);
-            break;
-          case VAL_DOUBLE:
-            if (li.d != ri.d)
-              return v_bool(true);
-            break;
-          case VAL_BOOL:
-            if (li.b != ri.b)
-              return v_bool(true);
-            break;
-          case VAL_CHAR:
-            if (li.c != ri.c)
-              return v_bool(true);
-            break;
-          case VAL_STRING:
-            if (strcmp(li.s, ri.s) != 0)
-              return v_bool(true);
-            break;
-          case VAL_PTR:
-            if (li.ptr != ri.ptr)
-              return v_bool(true);
-            break;
-          case VAL_NULL:
-            break;
-          default:
-            return v_bool(true);
-          }
-        }
-        return v_bool(false);
+Value call_on_new_segment(Function *fn, Env *local, FrameMark mark) {
+  if (!stack_segment_limit)
+    stack_segment_limit = stack_segment_budget();
+  if (stack_segments_used >= stack_segment_limit) {
+    frame_release(mark);
+    char msg[512];
+    snprintf(msg, sizeof(msg),
+             "maximum recursion depth exceeded at %s:%d:%d: call stack "
+             "reached its %zu MB budget at depth %zu",
+             call_loc.filename, call_loc.line, call_loc.column,
+             stack_segment_limit * (STACK_SEGMENT_SIZE / (1024 * 1024)),
+             call_depth);
+    return v_error(msg);
+  }
+  StackSegment *seg = free_segments;
+  if (seg) {
+    free_segments = seg->next_free;
+  } else {
+    seg = malloc(sizeof(StackSegment));
+    if (seg)
+      seg->memory = malloc(STACK_SEGMENT_SIZE);
+    if (!seg || !seg->memory) {
+      free(seg);
+      frame_release(mark);
+      return v_error("out of memory for call stack");
+    }
+  }
+
+  seg->fn = fn;
+  seg->local = local;
+  seg->mark = mark;
+  getcontext(&seg->ctx);
+  seg->ctx.uc_stack.ss_sp = seg->memory;
+  seg->ctx.uc_stack.ss_size = STACK_SEGMENT_SIZE;
+  seg->ctx.uc_link = &seg->caller;
+  makecontext(&seg->ctx, segment_entry, 0);
+
+  uintptr_t saved_limit = stack_limit;
+  stack_limit = (uintptr_t)seg->memory + STACK_SEGMENT_RESERVE;
+  entering_segment = seg;
+  stack_segments_used++;
+  swapcontext(&seg->caller, &seg->ctx);
+  stack_segments_used--;
+  stack_limit = saved_limit;
+
+  Value result = seg->result;
+  seg->next_free = free_segments;
+  free_segments = seg;
+  return result;
+}
+#endif
 
-      case VAL_TUPLE:
-        if (l.tuple->size != r.tuple->size)
-          return v_bool(true);
-        for (size_t i = 0; i < l.tuple->size; i++) {
-          if (!values_equal(l.tuple->items[i], r.tuple->items[i])) {
-            return v_bool(true);
-          }
-        }
-        return v_bool(false);
+Value call_frame(Function *fn, Env *local, FrameMark mark) {
+  if (call_depth >= max_call_depth) {
+    frame_release(mark);
+    char msg[512];
+    snprintf(msg, sizeof(msg), "maximum recursion depth %zu exceeded at %s:%d:%d",
+             max_call_depth, call_loc.filename, call_loc.line, call_loc.column);
+    return v_error(msg);
+  }
 
-      case VAL_STRUCT:
-        if (l.struct_val->def != r.struct_val->def)
-          return v_bool(true);
-        for (size_t i = 0; i < l.struct_val->def->field_count; i++) {
-          if (!values_equal(l.struct_val->values[i], r.struct_val->values[i])) {
-            return v_bool(true);
-          }
-        }
-        return v_bool(false);
+#ifndef _WIN32
+  char probe;
+  if ((uintptr_t)&probe < stack_limit)
+    return call_on_new_segment(fn, local, mark);
+#endif
 
-      case VAL_STRUCT_DEF:
-        return v_bool(l.struct_def != r.struct_def);
+  call_depth++;
+  Value result = run_frame(fn, local, mark);
+  call_depth--;
+  return result;
+}
 
-      case VAL_ERROR:
-        return v_bool(strcmp(l.s, r.s) != 0);
+Function *bind_args(Function *fn, Value *vals, size_t argc) {
+  size_t prior = fn->target ? fn->bound_count : 0;
+  Function *nf = xmalloc(sizeof(Function));
+  memset(nf, 0, sizeof(Function));
+  nf->params = fn->params + argc;
+  nf->arity = fn->arity - argc;
+  nf->target = fn->target ? fn->target : fn;
+  nf->bound_count = prior + argc;
+  nf->bound = xmalloc(sizeof(Value) * nf->bound_count);
+  for (size_t i = 0; i < prior; i++)
+    nf->bound[i] = fn->bound[i];
+  for (size_t i = 0; i < argc; i++)
+    nf->bound[prior + i] = vals[i];
+  return nf;
+}
 
-      default:
-        return v_bool(true);
-      }
-    }
-    if (a->bin.op == '<') {
-      if (l.type == VAL_INT && r.type == VAL_INT)
-        return v_bool(l.i < r.i);
-      if (l.type == VAL_BOOL && r.type == VAL_BOOL)
-        return v_bool(l.b < r.b);
-      if (l.type == VAL_CHAR && r.type == VAL_CHAR)
-        return v_bool(l.c < r.c);
-      if (l.type == VAL_DOUBLE || r.type == VAL_DOUBLE)
-        return v_bool(value_to_double(l) < value_to_double(r));
-      return v_bool(false);
-    }
-    if (a->bin.op == '>') {
-      if (l.type == VAL_INT && r.type == VAL_INT)
-        return v_bool(l.i > r.i);
-      if (l.type == VAL_CHAR && r.type == VAL_CHAR)
-        return v_bool(l.c > r.c);
-      if (l.type == VAL_DOUBLE || r.type == VAL_DOUBLE)
-        return v_bool(value_to_double(l) > value_to_double(r));
-      return v_bool(false);
-    }
-    if (a->bin.op == 'L') {
-      if (l.type == VAL_INT && r.type == VAL_INT)
-        return v_bool(l.i <= r.i);
-      if (l.type == VAL_CHAR && r.type == VAL_CHAR)
-        return v_bool(l.c <= r.c);
-      if (l.type == VAL_DOUBLE || r.type == VAL_DOUBLE)
-        return v_bool(value_to_double(l) <= value_to_double(r));
-      return v_bool(false);
-    }
-    if (a->bin.op == 'G') {
-      if (l.type == VAL_INT && r.type == VAL_INT)
-        return v_bool(l.i >= r.i);
-      if (l.type == VAL_BOOL && r.type == VAL_BOOL)
-        return v_bool(l.b >= r.b);
-      if (l.type == VAL_CHAR && r.type == VAL_CHAR)
-        return v_bool(l.c >= r.c);
-      if (l.type == VAL_DOUBLE || r.type == VAL_DOUBLE)
-        return v_bool(value_to_double(l) >= value_to_double(r));
-      return v_bool(false);
-    }
-    if (l.type == VAL_DOUBLE || r.type == VAL_DOUBLE) {
-      double ld = value_to_double(l);
-      double rd = value_to_double(r);
-      if (a->bin.op == '+')
-        return v_double(ld + rd);
-      if (a->bin.op == '-')
-        return v_double(ld - rd);
-      if (a->bin.op == '*')
-        return v_double(ld * rd);
-      if (a->bin.op == '/') {
-        if (rd == 0.0)
-          return v_error("division by zero");
-        return v_double(ld / rd);
-      }
-      if (a->bin.op == '^')
-        return v_double(pow(ld, rd));
-    }
-    if (a->bin.op == 'l') {
-      if (l.type == VAL_INT && r.type == VAL_INT)
-        return v_int(
-            (long long)((unsigned long long)l.i << (unsigned int)(r.i & 63)));
-      return v_error("'<<' requires integer operands");
-    }
-    if (a->bin.op == 'r') {
-      if (l.type == VAL_INT && r.type == VAL_INT)
-        return v_int(
-            (long long)((unsigned long long)l.i >> (unsigned int)(r.i & 63)));
-      return v_error("'>>' requires integer operands");
-    }
-    if (l.type == VAL_INT && r.type == VAL_INT) {
-      if (a->bin.op == '+')
-        return v_int(l.i + r.i);
-      if (a->bin.op == '-')
-        return v_int(l.i - r.i);
-      if (a->bin.op == '*')
-        return v_int(l.i * r.i);
-      if (a->bin.op == '/') {
-        if (r.i == 0)
-          return v_error("division by zero");
-        return v_int(l.i / r.i);
-      }
-      if (a->bin.op == '%') {
-        if (r.i == 0)
-          return v_error("modulo by zero");
-        return v_int(l.i % r.i);
-      }
-      if (a->bin.op == '^') {
-        if (r.i < 0)
-          return v_int(0);
-        long long result = 1;
-        long long base = l.i;
-        long long exp = r.i;
-        while (exp > 0) {
-          if (exp & 1)
-            result *= base;
-          base *= base;
-          exp >>= 1;
-        }
-        return v_int(result);
-      }
-    }
-    if (a->bin.op == '+' && l.type == VAL_STRING && r.type == VAL_STRING) {
-      char *s = xmalloc(strlen(l.s) + strlen(r.s) + 1);
-      strcpy(s, l.s);
-      strcat(s, r.s);
-      Value v;
-      memset(&v, 0, sizeof(v));
-      v.type = VAL_STRING;
-      v.s = s;
-      return v;
-    }
-    if (a->bin.op == 'F') {
-      if (l.type == VAL_INT && r.type == VAL_INT) {
-        if (r.i == 0)
-          return v_error("division by zero");
-        return v_int(l.i / r.i);
-      }
-      if (l.type == VAL_DOUBLE || r.type == VAL_DOUBLE) {
-        double ld = value_to_double(l);
-        double rd = value_to_double(r);
-        if (rd == 0.0)
-          return v_error("division by zero");
-        return v_double(floor(ld / rd));
-      }
-    }
-    return v_error("invalid operand types for operation");
+Value call_values(Function *fn, Value *vals, size_t argc) {
+  if (fn->is_builtin) {
+    return fn->builtin(vals, argc);
   }
-  case A_CALL: {
-    Value f = eval(a->call.fn, env);
-
-    if (a->call.fn->type == A_VAR) {
-      ExternFunc *ext = find_extern(a->call.fn->name);
-      if (ext) {
-        if (!ext->is_variadic && a->call.argc != ext->param_count) {
-          return v_error("extern function argument count mismatch");
-        }
-        if (ext->is_variadic && a->call.argc < ext->param_count - 1) {
-          return v_error("extern function requires at least %zu arguments");
-        }
-        Value *vals = xmalloc(sizeof(Value) * a->call.argc);
-        for (size_t i = 0; i < a->call.argc; i++)
-          vals[i] = eval(a->call.args[i], env);
-        return call_extern(ext, vals, a->call.argc);
-      }
-    }
-    if (f.type != VAL_FUNC)
-      return v_null();
-    Value result = call(f.fn, a->call.args, a->call.argc, env);
 
-    return result;
-  }
-  case A_LAMBDA: {
-    Function *f = xmalloc(sizeof(Function));
-    f->params = a->lambda.params;
-    f->arity = a->lambda.arity;
-    f->body = a->lambda.body;
-    f->is_builtin = false;
-    bool is_variadic = false;
-    for (size_t i = 0; i < a->lambda.arity; i++) {
-      if (a->lambda.params[i][0] == '$') {
-        is_variadic = true;
-        break;
-      }
-    }
-    f->is_variadic = is_variadic;
-    f->closure_env = env;
-    return v_func(f);
-  }
-  case A_ASSIGN: {
-    Value v = eval(a->assign.value, env);
-    env_set(env, a->assign.name, v, a->assign.is_const);
-    return v;
-  }
-  case A_IF: {
-    Value cond = eval(a->ifelse.cond, env);
-    if (value_is_truthy(cond)) {
-      return eval(a->ifelse.then_block, env);
-    } else if (a->ifelse.else_block) {
-      return eval(a->ifelse.else_block, env);
-    }
-    return v_null();
+  if (!fn->is_variadic && argc < fn->arity) {
+    return v_func(bind_args(fn, vals, argc));
   }
 
-  case A_RANGE: {
-    Value start = eval(a->range.start, env);
-    Value end = eval(a->range.end, env);
-
-    if (start.type != VAL_INT || end.type != VAL_INT) {
-      return v_error("range requires integer bounds");
-    }
+  FrameMark mark = frame_mark();
+  if (fn->target) {
+    Function *target = fn->target;
+    Env *local = frame_env(target, target->reuse_frame);
+    for (size_t i = 0; i < fn->bound_count; i++)
+      frame_slot(local, i)->value = fn->bound[i];
+    for (size_t i = 0; i < argc && fn->bound_count + i < target->arity; i++)
+      frame_slot(local, fn->bound_count + i)->value = vals[i];
+    return call_frame(target, local, mark);
+  }
+  return call_frame(fn, bind_frame(fn, vals, argc), mark);
+}
 
-    Value result = v_list();
-    if (start.i <= end.i) {
-      for (long long i = start.i; i < end.i; i++) {
-        list_append(result.list, v_int(i));
-      }
-    } else {
-      for (long long i = start.i; i > end.i; i--) {
-        list_append(result.list, v_int(i));
-      }
-    }
+Value call(Function *fn, AST **args, size_t argc, Env *caller) {
+  if (fn->is_builtin) {
+    Value *vals = xmalloc(sizeof(Value) * argc);
+    for (size_t i = 0; i < argc; i++)
+      vals[i] = eval(args[i], caller);
+    Value result = fn->builtin(vals, argc);
     return result;
   }
 
-  case A_FOR: {
-    Value result = v_null();
-    Value iter_val = eval(a->forloop.iter, env);
+  if (!fn->is_variadic && argc < fn->arity) {
+    Value *vals = xmalloc(sizeof(Value) * (argc + 1));
+    for (size_t i = 0; i < argc; i++)
+      vals[i] = eval(args[i], caller);
+    return v_func(bind_args(fn, vals, argc));
+  }
 
-    if (iter_val.type == VAL_ERROR) {
-      return iter_val;
+  if (!fn->is_variadic) {
+    Function *target = fn->target ? fn->target : fn;
+    size_t bound = fn->target ? fn->bound_count : 0;
+    FrameMark mark = frame_mark();
+    Env *local = frame_env(target, target->reuse_frame);
+    for (size_t i = 0; i < bound; i++)
+      frame_slot(local, i)->value = fn->bound[i];
+    for (size_t i = 0; i < argc; i++) {
+      Value v = eval(args[i], caller);
+      if (bound + i < target->arity)
+        frame_slot(local, bound + i)->value = v;
     }
+    return call_frame(target, local, mark);
+  }
 
-    bool two_vars = false;
-    char *var1 = NULL;
-    char *var2 = NULL;
-
-    char var_buffer[256];
-    strcpy(var_buffer, a->forloop.var);
+  size_t effective_argc = argc > fn->arity - 1 ? argc : fn->arity - 1;
+  Value *vals = xmalloc(sizeof(Value) * (effective_argc + 1));
+  for (size_t i = 0; i < argc; i++)
+    vals[i] = eval(args[i], caller);
+  for (size_t i = argc; i < effective_argc; i++)
+    vals[i] = v_null();
 
-    char *comma = strchr(var_buffer, ',');
-    if (comma) {
-      two_vars = true;
-      *comma = '\0';
-      var1 = var_buffer;
-      var2 = comma + 1;
-      while (*var2 && isspace(*var2))
-        var2++;
-      char *end = var1 + strlen(var1) - 1;
-      while (end > var1 && isspace(*end))
-        *end-- = '\0';
-    } else {
-      var1 = var_buffer;
-    }
+  return call_values(fn, vals, effective_argc);
+}
 
-    if (iter_val.type == VAL_LIST) {
-      for (size_t i = 0; i < iter_val.list->size; i++) {
-        if (two_vars) {
-          env_set(env, var1, v_int(i), false);
-          env_set(env, var2, iter_val.list->items[i], false);
-        } else {
-          env_set(env, var1, iter_val.list->items[i], false);
-        }
-        result = eval(a->forloop.body, env);
+Value call_method(Value obj, const char *method, Value *args, size_t argc) {
+  if (obj.type == VAL_ANY && obj.any_val) {
+    return call_method(*obj.any_val, method, args, argc);
+  }
 
-        if (result.cf == CF_BREAK) {
-          result.cf = CF_NONE;
-          break;
-        }
-        if (result.cf == CF_CONTINUE) {
-          result.cf = CF_NONE;
-          continue;
-        }
-        if (result.cf == CF_RETURN) {
+  if (obj.type == VAL_STRUCT) {
+    for (size_t i = 0; i < obj.struct_val->def->field_count; i++) {
+      if (strcmp(method, obj.struct_val->def->fields[i]) == 0) {
+        Value val = obj.struct_val->values[i];
+        if (val.type == VAL_FUNC) {
+          Value *new_args = xmalloc(sizeof(Value) * (argc + 1));
+          new_args[0] = obj;
+          for (size_t k = 0; k < argc; k++)
+            new_args[k + 1] = args[k];
+          Value result = call_values(val.fn, new_args, argc + 1);
           return result;
         }
+        return val;
       }
-    } else if (iter_val.type == VAL_TUPLE) {
-      for (size_t i = 0; i < iter_val.tuple->size; i++) {
-        if (two_vars) {
-          env_set(env, var1, v_int(i), false);
-          env_set(env, var2, iter_val.tuple->items[i], false);
-        } else {
-          env_set(env, var1, iter_val.tuple->items[i], false);
-        }
-        result = eval(a->forloop.body, env);
+    }
 
-        if (result.cf == CF_BREAK) {
-          result.cf = CF_NONE;
-          break;
-        }
-        if (result.cf == CF_CONTINUE) {
-          result.cf = CF_NONE;
-          continue;
-        }
-        if (result.cf == CF_RETURN) {
-          return result;
-        }
+    for (size_t i = 0; i < obj.struct_val->def->method_count; i++) {
+      if (strcmp(method, obj.struct_val->def->method_names[i]) == 0) {
+        Value val_fn = v_func(obj.struct_val->def->methods[i]);
+        Value *new_args = xmalloc(sizeof(Value) * (argc + 1));
+        new_args[0] = obj;
+        for (size_t k = 0; k < argc; k++)
+          new_args[k + 1] = args[k];
+        Value result = call_values(val_fn.fn, new_args, argc + 1);
+        return result;
       }
-    } else if (iter_val.type == VAL_STRING) {
-      for (size_t i = 0; i < strlen(iter_val.s); i++) {
-        char buf[2] = {iter_val.s[i], '\0'};
-        if (two_vars) {
-          env_set(env, var1, v_int(i), false);
-          env_set(env, var2, v_str(buf), false);
-        } else {
-          env_set(env, var1, v_str(buf), false);
-        }
-        result = eval(a->forloop.body, env);
+    }
 
-        if (result.cf == CF_BREAK) {
-          result.cf = CF_NONE;
-          break;
-        }
-        if (result.cf == CF_CONTINUE) {
-          result.cf = CF_NONE;
-          continue;
-        }
-        if (result.cf == CF_RETURN) {
-          return result;
-        }
-      }
-    } else if (iter_val.type == VAL_STRUCT) {
-      StructDef *def = iter_val.struct_val->def;
-      for (size_t i = 0; i < def->field_count; i++) {
-        if (two_vars) {
-          env_set(env, var1, v_str(def->fields[i]), false);
-          env_set(env, var2, iter_val.struct_val->values[i], false);
-        } else {
-          env_set(env, var1, iter_val.struct_val->values[i], false);
-        }
-        result = eval(a->forloop.body, env);
+    return v_error("method/member not found");
+  }
 
-        if (result.cf == CF_BREAK) {
-          result.cf = CF_NONE;
-          break;
-        }
-        if (result.cf == CF_CONTINUE) {
-          result.cf = CF_NONE;
-          continue;
-        }
-        if (result.cf == CF_RETURN) {
-          return result;
-        }
+  if (obj.type == VAL_INT) {
+    if (!strcmp(method, "bin")) {
+      char buf[128];
+      long long n = obj.i;
+      if (n == 0)
+        return v_str("0b0");
+      char bits[128];
+      int i = 0;
+      bool neg = n < 0;
+      if (neg)
+        n = -n;
+      while (n > 0) {
+        bits[i++] = (n & 1) ? '1' : '0';
+        n >>= 1;
       }
-    } else {
-      return v_error(
-          "for loop requires iterable (list, tuple, string, struct, or "
-          "range)");
+      char *p = buf;
+      if (neg)
+        *p++ = '-';
+      *p++ = '0';
+      *p++ = 'b';
+      for (int j = i - 1; j >= 0; j--)
+        *p++ = bits[j];
+      *p = 0;
+      return v_str(buf);
+    } else if (!strcmp(method, "hex")) {
+      char buf[64];
+      sprintf(buf, "0x%llx", obj.i);
+      return v_str(buf);
     }
-    return result;
   }
-  case A_WHILE: {
-    Value result = v_null();
-    while (value_is_truthy(eval(a->whileloop.cond, env))) {
-      result = eval(a->whileloop.body, env);
-      if (result.cf == CF_BREAK) {
-        result.cf = CF_NONE;
-        break;
-      }
-      if (result.cf == CF_CONTINUE) {
-        result.cf = CF_NONE;
-        continue;
-      }
-      if (result.cf == CF_RETURN) {
-        return result;
-      }
+  if (obj.type == VAL_STRING) {
+    if (!strcmp(method, "upper")) {
+      char *s = xstrdup(obj.s);
+      for (char *p = s; *p; p++)
+        *p = toupper(*p);
+      return v_str(s);
+    } else if (!strcmp(method, "lower")) {
+      char *s = xstrdup(obj.s);
+      for (char *p = s; *p; p++)
+        *p = tolower(*p);
+      return v_str(s);
     }
-    return result;
   }
-  case A_BLOCK: {
-    Value result = v_null();
-    for (size_t i = 0; i < a->block.count; i++) {
-      result = eval(a->block.stmts[i], env);
-      if (result.cf != CF_NONE) {
-        return result;
-      }
+  if (is_view(obj))
+    return view_method(obj, method, args, argc);
+  if (obj.type == VAL_LIST) {
+    if (!strcmp(method, "append") && argc == 1) {
+      list_append(obj.list, args[0]);
+      return v_null();
+    } else if (!strcmp(method, "pop") && obj.list->size > 0) {
+      return obj.list->items[--obj.list->size];
     }
-    return result;
-  }
-  case A_RETURN: {
-    Value v = a->ret.value ? eval(a->ret.value, env) : v_null();
-    return v_return(v);
   }
-  case A_BREAK: {
-    return v_break();
+  return v_null();
+}
+
+char *value_to_str(Value v) {
+  if (v.type == VAL_ANY && v.any_val) {
+    return value_to_str(*v.any_val);
   }
-  case A_CONTINUE: {
-    return v_continue();
+
+  char buf[256];
+  switch (v.type) {
+  case VAL_INT:
+    snprintf(buf, sizeof(buf), "%lld", v.i);
+    return xstrdup(buf);
+  case VAL_DOUBLE:
+    snprintf(buf, sizeof(buf), "%g", v.d);
+    return xstrdup(buf);
+  case VAL_STRING:
+    return xstrdup(v.s);
+  case VAL_BOOL:
+    return xstrdup(v.b ? "True" : "False");
+  case VAL_NULL:
+    return xstrdup("None");
+  case VAL_PTR:
+    if (v.ptr_info.is_view) {
+      snprintf(buf, sizeof(buf), "<view:%s[%zu]>",
+               ffi_type_name(v.ptr_info.ptr_type), v.ptr_info.ptr_size);
+      return xstrdup(buf);
+    }
+    if (v.ptr == NULL) {
+      return xstrdup("nil");
+    }
+    snprintf(buf, sizeof(buf), "<ptr:%p>", v.ptr);
+    return xstrdup(buf);
+  case VAL_CHAR:
+    if (v.c >= 32 && v.c < 127) {
+      snprintf(buf, sizeof(buf), "%c", v.c);
+    } else {
+      snprintf(buf, sizeof(buf), "\\x%02x", (unsigned char)v.c);
+    }
+    return xstrdup(buf);
+  case VAL_ERROR:
+    snprintf(buf, sizeof(buf), "Error: %s", v.s);
+    return xstrdup(buf);
+  default:
+    return xstrdup("<object>");
   }
-  case A_STRUCT_DEF: {
-    Value v;
-    v.type = VAL_STRUCT_DEF;
-    v.struct_def = xmalloc(sizeof(StructDef));
-    v.struct_def->name = a->struct_def.name;
-    v.struct_def->fields = a->struct_def.fields;
-    v.struct_def->field_count = a->struct_def.count;
+}
 
-    size_t mcount = a->struct_def.method_count;
-    v.struct_def->method_count = mcount;
-    v.struct_def->methods = xmalloc(sizeof(Function *) * mcount);
-    v.struct_def->method_names = xmalloc(sizeof(char *) * mcount);
+typedef enum { MATCH_LINEAR, MATCH_DENSE, MATCH_SORTED, MATCH_HASHED } MatchKind;
 
-    for (size_t i = 0; i < mcount; i++) {
-      AST *assign = a->struct_def.methods[i];
-      if (assign->type == A_ASSIGN) {
-        Value val = eval(assign->assign.value, env);
-        if (val.type == VAL_FUNC) {
-          v.struct_def->methods[i] = val.fn;
-          v.struct_def->method_names[i] = assign->assign.name;
-        } else {
-          v.struct_def->methods[i] = NULL;
-        }
-      }
-    }
+typedef struct {
+  long long key;
+  size_t index;
+} MatchKey;
 
-    env_set(env, a->struct_def.name, v, false);
-    return v;
+typedef struct {
+  const char *key;
+  uint64_t hash;
+  size_t index;
+} MatchSlot;
+
+struct MatchTable {
+  MatchKind kind;
+  ValueType key_type;
+  long long min;
+  size_t size;
+  long *dense;
+  MatchKey *sorted;
+  MatchSlot *slots;
+};
+
+uint64_t hash_string(const char *s) {
+  uint64_t h = 1469598103934665603ULL;
+  while (*s) {
+    h ^= (unsigned char)*s++;
+    h *= 1099511628211ULL;
   }
-  case A_STRUCT_INIT: {
-    Value def_val = env_get(env, a->struct_init.name);
-    if (def_val.type != VAL_STRUCT_DEF) {
-      return v_error("struct not defined");
-    }
-    StructDef *def = def_val.struct_def;
-    Value *values = xmalloc(sizeof(Value) * def->field_count);
-    for (size_t i = 0; i < def->field_count; i++)
-      values[i] = v_null();
+  return h;
+}
 
-    for (size_t i = 0; i < a->struct_init.count; i++) {
-      char *fname = a->struct_init.fields[i];
-      bool found = false;
-      for (size_t j = 0; j < def->field_count; j++) {
-        if (strcmp(fname, def->fields[j]) == 0) {
-          values[j] = eval(a->struct_init.values[i], env);
-          found = true;
-          break;
-        }
-      }
-      if (!found) {
-        return v_error("field not found in struct");
+int compare_match_keys(const void *a, const void *b) {
+  const MatchKey *x = a, *y = b;
+  if (x->key != y->key)
+    return x->key < y->key ? -1 : 1;
+  return x->index < y->index ? -1 : x->index > y->index;
+}
+
+MatchTable *match_table_build(AST *a) {
+  MatchTable *t = xmalloc(sizeof(MatchTable));
+  memset(t, 0, sizeof(MatchTable));
+  size_t n = a->match.case_count;
+  if (n == 0)
+    return t;
+
+  ASTType lit = a->match.patterns[0]->type;
+  if (lit != A_INT && lit != A_CHAR && lit != A_STRING)
+    return t;
+  for (size_t i = 1; i < n; i++) {
+    if (a->match.patterns[i]->type != lit)
+      return t;
+  }
+
+  if (lit == A_STRING) {
+    t->kind = MATCH_HASHED;
+    t->key_type = VAL_STRING;
+    t->size = 8;
+    while (t->size < n * 2)
+      t->size *= 2;
+    t->slots = xmalloc(sizeof(MatchSlot) * t->size);
+    memset(t->slots, 0, sizeof(MatchSlot) * t->size);
+    for (size_t i = 0; i < n; i++) {
+      const char *key = a->match.patterns[i]->s;
+      uint64_t h = hash_string(key);
+      size_t slot = h & (t->size - 1);
+      while (t->slots[slot].key &&
+             !(t->slots[slot].hash == h && !strcmp(t->slots[slot].key, key)))
+        slot = (slot + 1) & (t->size - 1);
+      if (!t->slots[slot].key) {
+        t->slots[slot].key = key;
+        t->slots[slot].hash = h;
+        t->slots[slot].index = i;
       }
     }
+    return t;
+  }
 
-    Value v;
-    v.type = VAL_STRUCT;
-    v.struct_val = xmalloc(sizeof(StructVal));
-    v.struct_val->def = def;
-    v.struct_val->values = values;
-    return v;
+  t->key_type = lit == A_INT ? VAL_INT : VAL_CHAR;
+  MatchKey *keys = xmalloc(sizeof(MatchKey) * n);
+  for (size_t i = 0; i < n; i++) {
+    AST *p = a->match.patterns[i];
+    keys[i].key = lit == A_INT ? p->i : (long long)p->c;
+    keys[i].index = i;
   }
-  case A_MEMBER: {
-    Value obj = eval(a->member.obj, env);
-    if (obj.type == VAL_STRUCT) {
-      for (size_t i = 0; i < obj.struct_val->def->field_count; i++) {
-        if (strcmp(a->member.member, obj.struct_val->def->fields[i]) == 0) {
-          return obj.struct_val->values[i];
-        }
-      }
-    }
-    return call_method(obj, a->member.member, NULL, 0);
+  qsort(keys, n, sizeof(MatchKey), compare_match_keys);
+
+  size_t unique = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (unique == 0 || keys[unique - 1].key != keys[i].key)
+      keys[unique++] = keys[i];
   }
-  case A_MEMBER_ASSIGN: {
-    Value val = eval(a->member_assign.value, env);
-    if (val.type == VAL_ERROR)
-      return val;
-    Value obj = eval(a->member_assign.obj, env);
-    if (obj.type == VAL_STRUCT) {
-      StructDef *def = obj.struct_val->def;
-      for (size_t i = 0; i < def->field_count; i++) {
-        if (strcmp(a->member_assign.member, def->fields[i]) == 0) {
-          obj.struct_val->values[i] = val;
-          return val;
-        }
-      }
-      return v_error("field not found in struct for assignment");
-    }
 
-    return v_error("cannot assign to member of non-struct");
+  unsigned long long span =
+      (unsigned long long)keys[unique - 1].key - (unsigned long long)keys[0].key;
+  if (span < unique * 4 + 16) {
+    t->kind = MATCH_DENSE;
+    t->min = keys[0].key;
+    t->size = (size_t)span + 1;
+    t->dense = xmalloc(sizeof(long) * t->size);
+    for (size_t i = 0; i < t->size; i++)
+      t->dense[i] = -1;
+    for (size_t i = 0; i < unique; i++)
+      t->dense[keys[i].key - t->min] = (long)keys[i].index;
+  } else {
+    t->kind = MATCH_SORTED;
+    t->sorted = keys;
+    t->size = unique;
   }
-  case A_INCREMENT: {
-    Value v = env_get(env, a->increment.name);
-    if (v.type == VAL_INT) {
-      Value new_val = v_int(v.i + 1);
-      env_set(env, a->increment.name, new_val, false);
-      return a->increment.is_post ? v : new_val;
+  return t;
+}
+
+long match_table_lookup(MatchTable *t, Value target) {
+  if (target.type != t->key_type)
+    return -1;
+
+  if (t->kind == MATCH_HASHED) {
+    uint64_t h = hash_string(target.s);
+    size_t slot = h & (t->size - 1);
+    while (t->slots[slot].key) {
+      if (t->slots[slot].hash == h && !strcmp(t->slots[slot].key, target.s))
+        return (long)t->slots[slot].index;
+      slot = (slot + 1) & (t->size - 1);
     }
-    return v_error("increment requires integer variable");
+    return -1;
   }
 
-  case A_DECREMENT: {
-    Value v = env_get(env, a->decrement.name);
-    if (v.type == VAL_INT) {
-      Value new_val = v_int(v.i - 1);
-      env_set(env, a->decrement.name, new_val, false);
-      return a->decrement.is_post ? v : new_val;
-    }
-    return v_error("decrement requires integer variable");
+  long long key = target.type == VAL_INT ? target.i : (long long)target.c;
+  if (t->kind == MATCH_DENSE) {
+    if (key < t->min || (unsigned long long)key - (unsigned long long)t->min >=
+                            t->size)
+      return -1;
+    return t->dense[key - t->min];
   }
 
-  case A_ASSIGN_UNPACK: {
-    Value rhs = eval(a->assign_unpack.value, env);
-    if (rhs.type != VAL_TUPLE && rhs.type != VAL_LIST) {
-      return v_error("cannot unpack non-sequence");
-    }
-    size_t count = (rhs.type == VAL_TUPLE) ? rhs.tuple->size : rhs.list->size;
-    Value *items = (rhs.type == VAL_TUPLE) ? rhs.tuple->items : rhs.list->items;
-
-    if (count != a->assign_unpack.count) {
-      return v_error("unpacking count mismatch");
-    }
-
-    for (size_t i = 0; i < count; i++) {
-      env_set(env, a->assign_unpack.names[i], items[i], false);
-    }
-    return rhs;
-  }
-  case A_MATCH: {
-    Value target = eval(a->match.value, env);
-    for (size_t i = 0; i < a->match.case_count; i++) {
-      Value pattern_val = eval(a->match.patterns[i], env);
-      if (values_equal(target, pattern_val)) {
-        return eval(a->match.bodies[i], env);
-      }
-    }
-    return v_null();
+  size_t lo = 0, hi = t->size;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (t->sorted[mid].key == key)
+      return (long)t->sorted[mid].index;
+    if (t->sorted[mid].key < key)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
-  case A_SLICE: {
-    Value obj = eval(a->slice.obj, env);
-    if (obj.type == VAL_ERROR)
-      return obj;
-    if (obj.type == VAL_ANY && obj.any_val)
-      obj = *obj.any_val;
+  return -1;
+}
 
-    size_t obj_len = 0;
-    if (obj.type == VAL_LIST)
-      obj_len = obj.list->size;
-    else if (obj.type == VAL_STRING)
-      obj_len = strlen(obj.s);
-    else
-      return v_error("slice requires a list or string");
+Value eval_binop(AST *a, Value l, Value r) {
 
-    long long s = 0;
-    long long e = (long long)obj_len;
+  if (l.type == VAL_ERROR)
+    return l;
+  if (r.type == VAL_ERROR)
+    return r;
 
-    if (a->slice.begin) {
-      Value sv = eval(a->slice.begin, env);
-      if (sv.type != VAL_INT)
-        return v_error("slice index must be an integer");
-      s = sv.i;
-    }
-    if (a->slice.end) {
-      Value ev = eval(a->slice.end, env);
-      if (ev.type != VAL_INT)
-        return v_error("slice index must be an integer");
-      e = ev.i;
-    }
+  if (a->bin.op == '|') {
+    return v_bool(value_is_truthy(l) || value_is_truthy(r));
+  }
 
-    if (s < 0)
-      s = 0;
-    if (e > (long long)obj_len)
-      e = (long long)obj_len;
+  if (a->bin.op == '&') {
+    return v_bool(value_is_truthy(l) && value_is_truthy(r));
+  }
 
-    if (obj.type == VAL_LIST) {
-      Value result = v_list();
-      for (long long i = s; i < e; i++)
-        list_append(result.list, obj.list->items[i]);
-      return result;
-    } else {
-      if (s >= e)
-        return v_str("");
-      size_t len = (size_t)(e - s);
-      char *buf = xmalloc(len + 1);
-      memcpy(buf, obj.s + s, len);
-      buf[len] = '\0';
-      Value r;
-      memset(&r, 0, sizeof(r));
-      r.type = VAL_STRING;
-      r.s = buf;
-      return r;
-    }
+  if (l.type == VAL_ANY && l.any_val) {
+    l = *l.any_val;
   }
-  case A_COMPOUND_ASSIGN:
-    return v_error("compound assign not implemented in eval");
+  if (r.type == VAL_ANY && r.any_val) {
+    r = *r.any_val;
   }
-  return v_null();
-}
-
-Function *make_builtin(Value (*fn)(Value *, size_t)) {
-  Function *f = xmalloc(sizeof(Function));
-  f->is_builtin = true;
-  f->builtin = fn;
-  f->arity = 0;
-  f->is_variadic = false;
-  f->closure_env = NULL;
-  return f;
-}
-
-void run_file(const char *filename);
-char *resolve_import_path(const char *import_name, const char *current_file);
-
-void run_repl(void) {
-  char line[2048];
-  while (1) {
-    printf(">>> ");
-    fflush(stdout);
-    if (!fgets(line, sizeof(line), stdin))
-      break;
-    size_t len = strlen(line);
-    if (len > 0 && line[len - 1] == '\n')
-      line[len - 1] = 0;
-    char *trimmed = line;
-    while (*trimmed && isspace(*trimmed))
-      trimmed++;
-    if (strlen(trimmed) == 0 || trimmed[0] == '#')
-      continue;
-    if (!strcmp(trimmed, "quit") || !strcmp(trimmed, "exit")) {
-      printf("\n");
-      break;
-    }
-
-    src = line;
-    src_start = line;
-    current_loc.filename = "<stdin>";
-    current_loc.line = 1;
-    current_loc.column = 1;
-    errors_occurred = false;
 
-    next_token();
+  if (a->bin.op == 'E') {
+    if (l.type != r.type)
+      return v_bool(false);
 
-    if (tok.type == T_IMPORT) {
-      next_token();
-      if (tok.type != T_STRING) {
-        error_at(tok.loc, "import requires a filename string");
-        continue;
+    switch (l.type) {
+    case VAL_INT:
+      return v_bool(l.i == r.i);
+    case VAL_DOUBLE:
+      return v_bool(l.d == r.d);
+    case VAL_BOOL:
+      return v_bool(l.b == r.b);
+    case VAL_CHAR:
+      return v_bool(l.c == r.c);
+    case VAL_STRING:
+      return v_bool(strcmp(l.s, r.s) == 0);
+    case VAL_PTR:
+      return v_bool(l.ptr == r.ptr);
+    case VAL_NULL:
+      return v_bool(true);
+    case VAL_FUNC:
+      return v_bool(l.fn == r.fn);
+    case VAL_LIST:
+      if (l.list->size != r.list->size)
+        return v_bool(false);
+      for (size_t i = 0; i < l.list->size; i++) {
+        Value li = l.list->items[i];
+        Value ri = r.list->items[i];
+        if (li.type != ri.type)
+          return v_bool(false);
+        switch (li.type) {
+        case VAL_INT:
+          if (li.i != ri.i)
+            return v_bool(false);
+          break;
+        case VAL_DOUBLE:
+          if (li.d != ri.d)
+            return v_bool(false);
+          break;
+        case VAL_BOOL:
+          if (li.b != ri.b)
+            return v_bool(false);
+          break;
+        case VAL_CHAR:
+          if (li.c != ri.c)
+            return v_bool(false);
+          break;
+        case VAL_STRING:
+          if (strcmp(li.s, ri.s) != 0)
+            return v_bool(false);
+          break;
+        case VAL_PTR:
+          if (li.ptr != ri.ptr)
+            return v_bool(false);
+          break;
+        case VAL_NULL:
+          break;
+        default:
+          return v_bool(false);
+        }
       }
-      char filename[256];
-      strcpy(filename, tok.text);
-      next_token();
-      bool saved_import_mode = import_mode;
-      import_mode = true;
-      run_file(filename);
-      import_mode = saved_import_mode;
-      continue;
-    }
+      return v_bool(true);
 
-    if (tok.type == T_LINK) {
-      next_token();
-      if (tok.type != T_STRING) {
-        error_at(tok.loc, "link requires a library path string");
-        continue;
+    case VAL_TUPLE:
+      if (l.tuple->size != r.tuple->size)
+        return v_bool(false);
+      for (size_t i = 0; i < l.tuple->size; i++) {
+        if (!values_equal(l.tuple->items[i], r.tuple->items[i])) {
+          return v_bool(false);
+        }
       }
-      char libpath[256];
-      strcpy(libpath, tok.text);
-      next_token();
-      load_library(libpath);
-      continue;
-    }
+      return v_bool(true);
 
-    if (tok.type == T_EXTERN) {
-      next_token();
-      if (tok.type != T_IDENT) {
-        error_at(tok.loc, "extern requires function name");
-        next_token();
-        continue;
+    case VAL_STRUCT:
+      if (l.struct_val->def != r.struct_val->def)
+        return v_bool(false);
+      for (size_t i = 0; i < l.struct_val->def->field_count; i++) {
+        if (!values_equal(l.struct_val->values[i], r.struct_val->values[i])) {
+          return v_bool(false);
+        }
       }
-      char aoxim_name[256];
-      strcpy(aoxim_name, tok.text);
-      next_token();
+      return v_bool(true);
 
-      if (tok.type != T_ASSIGN) {
-        error_at(tok.loc, "expected '=' after extern function name");
-        next_token();
-        continue;
-      }
+    case VAL_STRUCT_DEF:
+      return v_bool(l.struct_def == r.struct_def);
 
-      next_token();
+    case VAL_ERROR:
+      return v_bool(strcmp(l.s, r.s) == 0);
 
-      if (tok.type != T_IDENT) {
-        error_at(tok.loc, "expected C function name");
-        next_token();
-        continue;
+    default:
+      return v_bool(false);
+    }
+  }
+  if (a->bin.op == 'N') {
+    if (l.type != r.type)
+      return v_bool(true);
+
+    switch (l.type) {
+    case VAL_INT:
+      return v_bool(l.i != r.i);
+    case VAL_DOUBLE:
+      return v_bool(l.d != r.d);
+    case VAL_BOOL:
+      return v_bool(l.b != r.b);
+    case VAL_CHAR:
+      return v_bool(l.c != r.c);
+    case VAL_STRING:
+      return v_bool(strcmp(l.s, r.s) != 0);
+    case VAL_PTR:
+      return v_bool(l.ptr != r.ptr);
+    case VAL_NULL:
+      return v_bool(false);
+    case VAL_FUNC:
+      return v_bool(l.fn != r.fn);
+    case VAL_LIST:
+      if (l.list->size != r.list->size)
+        return v_bool(true);
+      for (size_t i = 0; i < l.list->size; i++) {
+        Value li = l.list->items[i];
+        Value ri = r.list->items[i];
+        if (li.type != ri.type)
+          return v_bool(true);
+        switch (li.type) {
+        case VAL_INT:
+          if (li.i != ri.i)
+            return v_bool(true);
+          break;
+        case VAL_DOUBLE:
+          if (li.d != ri.d)
+            return v_bool(true);
+          break;
+        case VAL_BOOL:
+          if (li.b != ri.b)
+            return v_bool(true);
+          break;
+        case VAL_CHAR:
+          if (li.c != ri.c)
+            return v_bool(true);
+          break;
+        case VAL_STRING:
+          if (strcmp(li.s, ri.s) != 0)
+            return v_bool(true);
+          break;
+        case VAL_PTR:
+          if (li.ptr != ri.ptr)
+            return v_bool(true);
+          break;
+        case VAL_NULL:
+          break;
+        default:
+          return v_bool(true);
+        }
       }
-      char c_name[256];
-      strcpy(c_name, tok.text);
-      next_token();
+      return v_bool(false);
 
-      if (tok.type != T_LP) {
-        error_at(tok.loc, "expected '(' for parameter types");
-        next_token();
-        continue;
+    case VAL_TUPLE:
+      if (l.tuple->size != r.tuple->size)
+        return v_bool(true);
+      for (size_t i = 0; i < l.tuple->size; i++) {
+        if (!values_equal(l.tuple->items[i], r.tuple->items[i])) {
+          return v_bool(true);
+        }
       }
-      next_token();
-
-      FFIType param_types[16];
-      size_t param_count = 0;
+      return v_bool(false);
 
-      while ((tok.type == T_IDENT || tok.type == T_PTR) && param_count < 16) {
-        param_types[param_count++] = parse_ffi_type(tok.text);
-        next_token();
-        if (tok.type == T_COMMA)
-          next_token();
-        else
-          break;
+    case VAL_STRUCT:
+      if (l.struct_val->def != r.struct_val->def)
+        return v_bool(true);
+      for (size_t i = 0; i < l.struct_val->def->field_count; i++) {
+        if (!values_equal(l.struct_val->values[i], r.struct_val->values[i])) {
+          return v_bool(true);
+        }
       }
+      return v_bool(false);
 
-      if (tok.type != T_RP) {
-        error_at(tok.loc, "expected ')' after parameters");
-        continue;
-      }
-      next_token();
+    case VAL_STRUCT_DEF:
+      return v_bool(l.struct_def != r.struct_def);
 
-      if (tok.type != T_COLON) {
-        error_at(tok.loc, "expected ':' before return type");
-        continue;
-      }
-      next_token();
+    case VAL_ERROR:
+      return v_bool(strcmp(l.s, r.s) != 0);
 
-      FFIType return_type;
-      if (tok.type == T_OPTION_PTR) {
-        return_type = FFI_OPTION_PTR;
-        next_token();
-      } else if (tok.type == T_IDENT || tok.type == T_PTR) {
-        return_type = parse_ffi_type(tok.text);
-        next_token();
+    default:
+      return v_bool(true);
+    }
+  }
+  if (a->bin.op == '<') {
+    if (l.type == VAL_INT && r.type == VAL_INT)
+      return v_bool(l.i < r.i);
+    if (l.type == VAL_BOOL && r.type == VAL_BOOL)
+      return v_bool(l.b < r.b);
+    if (l.type == VAL_CHAR && r.type == VAL_CHAR)
+      return v_bool(l.c < r.c);
+    if (l.type == VAL_DOUBLE || r.type == VAL_DOUBLE)
+      return v_bool(value_to_double(l) < value_to_double(r));
+    return v_bool(false);
+  }
+  if (a->bin.op == '>') {
+    if (l.type == VAL_INT && r.type == VAL_INT)
+      return v_bool(l.i > r.i);
+    if (l.type == VAL_CHAR && r.type == VAL_CHAR)
+      return v_bool(l.c > r.c);
+    if (l.type == VAL_DOUBLE || r.type == VAL_DOUBLE)
+      return v_bool(value_to_double(l) > value_to_double(r));
+    return v_bool(false);
+  }
+  if (a->bin.op == 'L') {
+    if (l.type == VAL_INT && r.type == VAL_INT)
+      return v_bool(l.i <= r.i);
+    if (l.type == VAL_CHAR && r.type == VAL_CHAR)
+      return v_bool(l.c <= r.c);
+    if (l.type == VAL_DOUBLE || r.type == VAL_DOUBLE)
+      return v_bool(value_to_double(l) <= value_to_double(r));
+    return v_bool(false);
+  }
+  if (a->bin.op == 'G') {
+    if (l.type == VAL_INT && r.type == VAL_INT)
+      return v_bool(l.i >= r.i);
+    if (l.type == VAL_BOOL && r.type == VAL_BOOL)
+      return v_bool(l.b >= r.b);
+    if (l.type == VAL_CHAR && r.type == VAL_CHAR)
+      return v_bool(l.c >= r.c);
+    if (l.type == VAL_DOUBLE || r.type == VAL_DOUBLE)
+      return v_bool(value_to_double(l) >= value_to_double(r));
+    return v_bool(false);
+  }
+  if (l.type == VAL_DOUBLE || r.type == VAL_DOUBLE) {
+    double ld = value_to_double(l);
+    double rd = value_to_double(r);
+    if (a->bin.op == '+')
+      return v_double(ld + rd);
+    if (a->bin.op == '-')
+      return v_double(ld - rd);
+    if (a->bin.op == '*')
+      return v_double(ld * rd);
+    if (a->bin.op == '/') {
+      if (rd == 0.0)
+        return v_error("division by zero");
+      return v_double(ld / rd);
+    }
+    if (a->bin.op == '^')
+      return v_double(pow(ld, rd));
+  }
+  if (a->bin.op == 'l') {
+    if (l.type == VAL_INT && r.type == VAL_INT)
+      return v_int(
+          (long long)((unsigned long long)l.i << (unsigned int)(r.i & 63)));
+    return v_error("'<<' requires integer operands");
+  }
+  if (a->bin.op == 'r') {
+    if (l.type == VAL_INT && r.type == VAL_INT)
+      return v_int(
+          (long long)((unsigned long long)l.i >> (unsigned int)(r.i & 63)));
+    return v_error("'>>' requires integer operands");
+  }
+  if (l.type == VAL_INT && r.type == VAL_INT) {
+    if (a->bin.op == '+')
+      return v_int(l.i + r.i);
+    if (a->bin.op == '-')
+      return v_int(l.i - r.i);
+    if (a->bin.op == '*')
+      return v_int(l.i * r.i);
+    if (a->bin.op == '/') {
+      if (r.i == 0)
+        return v_error("division by zero");
+      return v_int(l.i / r.i);
+    }
+    if (a->bin.op == '%') {
+      if (r.i == 0)
+        return v_error("modulo by zero");
+      return v_int(l.i % r.i);
+    }
+    if (a->bin.op == '^') {
+      if (r.i < 0)
+        return v_int(0);
+      long long result = 1;
+      long long base = l.i;
+      long long exp = r.i;
+      while (exp > 0) {
+        if (exp & 1)
+          result *= base;
+        base *= base;
+        exp >>= 1;
+      }
+      return v_int(result);
+    }
+  }
+  if (a->bin.op == '+' && l.type == VAL_STRING && r.type == VAL_STRING) {
+    char *s = xmalloc(strlen(l.s) + strlen(r.s) + 1);
+    strcpy(s, l.s);
+    strcat(s, r.s);
+    Value v;
+    memset(&v, 0, sizeof(v));
+    v.type = VAL_STRING;
+    v.s = s;
+    return v;
+  }
+  if (a->bin.op == 'F') {
+    if (l.type == VAL_INT && r.type == VAL_INT) {
+      if (r.i == 0)
+        return v_error("division by zero");
+      return v_int(l.i / r.i);
+    }
+    if (l.type == VAL_DOUBLE || r.type == VAL_DOUBLE) {
+      double ld = value_to_double(l);
+      double rd = value_to_double(r);
+      if (rd == 0.0)
+        return v_error("division by zero");
+      return v_double(floor(ld / rd));
+    }
+  }
+  return v_error("invalid operand types for operation");
+}
+
+#define QUICKEN_THRESHOLD 2
+#define QUICKEN_MAX_DEOPTS 4
+
+bool quicken_stats = false;
+size_t quicken_hits = 0;
+size_t quicken_deopts = 0;
+size_t quicken_generic = 0;
+AST **quickened_sites = NULL;
+size_t quickened_count = 0;
+size_t quickened_capacity = 0;
+
+bool quicken_supports(ASTType kind, char op) {
+  switch (kind) {
+  case A_BINOP_INT:
+    return strchr("+-*/%^FlrENLG<>", op) != NULL;
+  case A_BINOP_DOUBLE:
+    return strchr("+-*/^FENLG<>", op) != NULL;
+  case A_BINOP_STRING:
+    return op == '+' || op == 'E' || op == 'N';
+  default:
+    return false;
+  }
+}
+
+void quicken_observe(AST *a, Value l, Value r) {
+  quicken_generic++;
+  if (a->bin.deopts >= QUICKEN_MAX_DEOPTS)
+    return;
+
+  ASTType kind = A_BINOP;
+  if (l.type == r.type) {
+    if (l.type == VAL_INT)
+      kind = A_BINOP_INT;
+    else if (l.type == VAL_DOUBLE)
+      kind = A_BINOP_DOUBLE;
+    else if (l.type == VAL_STRING)
+      kind = A_BINOP_STRING;
+  }
+  if (!quicken_supports(kind, a->bin.op)) {
+    a->bin.warm = 0;
+    return;
+  }
+  if (a->bin.seen != kind) {
+    a->bin.seen = kind;
+    a->bin.warm = 0;
+  }
+  if (++a->bin.warm < QUICKEN_THRESHOLD)
+    return;
+
+  a->type = kind;
+  if (quicken_stats && !a->bin.registered) {
+    if (quickened_count >= quickened_capacity) {
+      quickened_capacity = quickened_capacity == 0 ? 64 : quickened_capacity * 2;
+      quickened_sites =
+          realloc(quickened_sites, sizeof(AST *) * quickened_capacity);
+    }
+    quickened_sites[quickened_count++] = a;
+    a->bin.registered = true;
+  }
+}
+
+Value quicken_deopt(AST *a, Value l, Value r) {
+  a->type = A_BINOP;
+  a->bin.warm = 0;
+  a->bin.deopts++;
+  quicken_deopts++;
+  return eval_binop(a, l, r);
+}
+
+Value eval_binop_int(char op, long long l, long long r) {
+  switch (op) {
+  case '+':
+    return v_int(l + r);
+  case '-':
+    return v_int(l - r);
+  case '*':
+    return v_int(l * r);
+  case '/':
+  case 'F':
+    if (r == 0)
+      return v_error("division by zero");
+    return v_int(l / r);
+  case '%':
+    if (r == 0)
+      return v_error("modulo by zero");
+    return v_int(l % r);
+  case '^': {
+    if (r < 0)
+      return v_int(0);
+    long long result = 1;
+    while (r > 0) {
+      if (r & 1)
+        result *= l;
+      l *= l;
+      r >>= 1;
+    }
+    return v_int(result);
+  }
+  case 'l':
+    return v_int((long long)((unsigned long long)l << (unsigned int)(r & 63)));
+  case 'r':
+    return v_int((long long)((unsigned long long)l >> (unsigned int)(r & 63)));
+  case 'E':
+    return v_bool(l == r);
+  case 'N':
+    return v_bool(l != r);
+  case '<':
+    return v_bool(l < r);
+  case '>':
+    return v_bool(l > r);
+  case 'L':
+    return v_bool(l <= r);
+  case 'G':
+    return v_bool(l >= r);
+  default:
+    return v_error("invalid operand types for operation");
+  }
+}
+
+Value eval_binop_double(char op, double l, double r) {
+  switch (op) {
+  case '+':
+    return v_double(l + r);
+  case '-':
+    return v_double(l - r);
+  case '*':
+    return v_double(l * r);
+  case '/':
+    if (r == 0.0)
+      return v_error("division by zero");
+    return v_double(l / r);
+  case 'F':
+    if (r == 0.0)
+      return v_error("division by zero");
+    return v_double(floor(l / r));
+  case '^':
+    return v_double(pow(l, r));
+  case 'E':
+    return v_bool(l == r);
+  case 'N':
+    return v_bool(l != r);
+  case '<':
+    return v_bool(l < r);
+  case '>':
+    return v_bool(l > r);
+  case 'L':
+    return v_bool(l <= r);
+  case 'G':
+    return v_bool(l >= r);
+  default:
+    return v_error("invalid operand types for operation");
+  }
+}
+
+Value eval_binop_string(char op, const char *l, const char *r) {
+  if (op == 'E')
+    return v_bool(strcmp(l, r) == 0);
+  if (op == 'N')
+    return v_bool(strcmp(l, r) != 0);
+  size_t ll = strlen(l), rl = strlen(r);
+  char *s = xmalloc(ll + rl + 1);
+  memcpy(s, l, ll);
+  memcpy(s + ll, r, rl + 1);
+  Value v;
+  memset(&v, 0, sizeof(v));
+  v.type = VAL_STRING;
+  v.s = s;
+  return v;
+}
+
+/* Operands of a binop the typechecker proved int or double are evaluated
+   without going through eval(): literals and typed parameters (read from
+   their frame slot) are produced directly. A value of another runtime type
+   is handed back boxed so the caller can fall back to eval_binop. */
+Value eval_binop_typed(AST *a, Env *env);
+
+bool eval_int(AST *a, Env *env, long long *out, Value *boxed) {
+  Value v;
+  if (a->type == A_INT) {
+    *out = a->i;
+    return true;
+  }
+  if (a->type == A_VAR && a->slot)
+    v = frame_slot(env, a->slot - 1)->value;
+  else if (a->type == A_BINOP && a->bin.typed != TY_ANY)
+    v = eval_binop_typed(a, env);
+  else
+    v = eval(a, env);
+  if (v.type == VAL_INT) {
+    *out = v.i;
+    return true;
+  }
+  *boxed = v;
+  return false;
+}
+
+bool eval_double(AST *a, Env *env, double *out, Value *boxed) {
+  Value v;
+  if (a->type == A_DOUBLE) {
+    *out = a->d;
+    return true;
+  }
+  if (a->type == A_VAR && a->slot)
+    v = frame_slot(env, a->slot - 1)->value;
+  else if (a->type == A_BINOP && a->bin.typed != TY_ANY)
+    v = eval_binop_typed(a, env);
+  else
+    v = eval(a, env);
+  if (v.type == VAL_DOUBLE) {
+    *out = v.d;
+    return true;
+  }
+  *boxed = v;
+  return false;
+}
+
+Value eval_binop_typed(AST *a, Env *env) {
+  Value lv, rv;
+  if (a->bin.typed == TY_INT) {
+    long long l, r;
+    bool lok = eval_int(a->bin.l, env, &l, &lv);
+    bool rok = eval_int(a->bin.r, env, &r, &rv);
+    if (lok && rok)
+      return eval_binop_int(a->bin.op, l, r);
+    return eval_binop(a, lok ? v_int(l) : lv, rok ? v_int(r) : rv);
+  }
+  double l, r;
+  bool lok = eval_double(a->bin.l, env, &l, &lv);
+  bool rok = eval_double(a->bin.r, env, &r, &rv);
+  if (lok && rok)
+    return eval_binop_double(a->bin.op, l, r);
+  return eval_binop(a, lok ? v_double(l) : lv, rok ? v_double(r) : rv);
+}
+
+const char *binop_name(char op) {
+  switch (op) {
+  case 'E':
+    return "==";
+  case 'N':
+    return "!=";
+  case 'L':
+    return "<=";
+  case 'G':
+    return ">=";
+  case 'F':
+    return "//";
+  case 'l':
+    return "<<";
+  case 'r':
+    return ">>";
+  case '^':
+    return "**";
+  default: {
+    static char buf[2];
+    buf[0] = op;
+    buf[1] = '\0';
+    return buf;
+  }
+  }
+}
+
+void print_quicken_stats(void) {
+  size_t total = quicken_hits + quicken_generic;
+  fprintf(stderr, "\n=== Quickening ===\n");
+  fprintf(stderr, "specialized sites: %zu, deoptimizations: %zu\n",
+          quickened_count, quicken_deopts);
+  fprintf(stderr, "specialized evals: %zu, generic evals: %zu, hit rate: %.1f%%\n",
+          quicken_hits, quicken_generic,
+          total ? 100.0 * (double)quicken_hits / (double)total : 0.0);
+  for (size_t i = 0; i < quickened_count; i++) {
+    AST *a = quickened_sites[i];
+    const char *kind = a->type == A_BINOP_INT      ? "int"
+                       : a->type == A_BINOP_DOUBLE ? "double"
+                       : a->type == A_BINOP_STRING ? "string"
+                                                   : "generic";
+    fprintf(stderr, "  %s:%d:%d  '%s'  %-7s hits %zu  deopts %u\n",
+            a->loc.filename, a->loc.line, a->loc.column, binop_name(a->bin.op),
+            kind, a->bin.hits, a->bin.deopts);
+  }
+}
+
+Value eval(AST *a, Env *env) {
+  switch (a->type) {
+  case A_INT:
+    return v_int(a->i);
+  case A_DOUBLE:
+    return v_double(a->d);
+  case A_STRING:
+    return v_str(a->s);
+  case A_BOOL:
+    return v_bool(a->b);
+  case A_VAR:
+    if (a->slot)
+      return frame_slot(env, a->slot - 1)->value;
+    return env_get_at(env, a->name, a->loc.filename);
+  case A_CHAR:
+    return v_char(a->c);
+
+  case A_DEREF: {
+    Value ptr_val = eval(a->deref.ptr_expr, env);
+
+    if (ptr_val.type == VAL_ERROR)
+      return ptr_val;
+
+    if (ptr_val.type == VAL_PTR) {
+      if (ptr_val.ptr == NULL) {
+        return v_error("dereferencing null pointer");
+      }
+      if (c_struct_layout(ptr_val))
+        return ptr_val;
+
+      MemoryBlock *block = find_memory_block(ptr_val.ptr);
+      if (block && block->type != FFI_ANY)
+        return read_from_memory(ptr_val.ptr, block->type);
+
+      Value *val_ptr = (Value *)ptr_val.ptr;
+
+      if (val_ptr->type <= VAL_ANY) {
+        return *val_ptr;
+      }
+
+      FFIType ptr_type = block ? block->type : FFI_INT;
+
+      return read_from_memory(ptr_val.ptr, ptr_type);
+    }
+  }
+
+  case A_ADDROF: {
+    Value *addr = env_get_address(env, a->addrof.var_name);
+
+    if (!addr) {
+      char err[256];
+      snprintf(err, sizeof(err),
+               "cannot take address of undefined variable '%s'",
+               a->addrof.var_name);
+      return v_error(err);
+    }
+
+    return v_ptr((void *)addr);
+  }
+
+  case A_PTR_LITERAL: {
+    if (a->list.count > 0) {
+      Value v = eval(a->list.items[0], env);
+
+      if (v.type != VAL_INT && v.type != VAL_NULL && v.type != VAL_PTR) {
+        return v_error(
+            "pointer can only be created from int, null, or another pointer");
+      }
+
+      if (v.type == VAL_INT) {
+        return v_ptr((void *)v.i);
+      } else if (v.type == VAL_PTR) {
+        return v;
+      } else if (v.type == VAL_NULL) {
+        return v_ptr(NULL);
+      }
+
+      return v_error("pointer cast requires integer, pointer, or null");
+    }
+
+    return v_ptr(a->ptr_lit.addr);
+  }
+  case A_STRING_INTERP: {
+    size_t total_len = 0;
+    for (size_t i = 0; i <= a->str_interp.count; i++) {
+      total_len += strlen(a->str_interp.parts[i]);
+    }
+
+    char **expr_strs = xmalloc(sizeof(char *) * a->str_interp.count);
+    for (size_t i = 0; i < a->str_interp.count; i++) {
+      Value expr_val = eval(a->str_interp.exprs[i], env);
+      expr_strs[i] = value_to_str(expr_val);
+      total_len += strlen(expr_strs[i]);
+    }
+    char *result = xmalloc(total_len + 1);
+    result[0] = '\0';
+
+    for (size_t i = 0; i <= a->str_interp.count; i++) {
+      strcat(result, a->str_interp.parts[i]);
+      if (i < a->str_interp.count) {
+        strcat(result, expr_strs[i]);
+      }
+    }
+
+    return v_str(result);
+  }
+
+  case A_LIST: {
+    Value v = v_list();
+    for (size_t i = 0; i < a->list.count; i++)
+      list_append(v.list, eval(a->list.items[i], env));
+    return v;
+  }
+  case A_TUPLE: {
+    Value *items = xmalloc(sizeof(Value) * a->list.count);
+    for (size_t i = 0; i < a->list.count; i++)
+      items[i] = eval(a->list.items[i], env);
+    return v_tuple(items, a->list.count);
+  }
+  case A_INDEX: {
+    Value obj = eval(a->index.obj, env);
+    Value idx = eval(a->index.idx, env);
+
+    if (obj.type == VAL_ERROR)
+      return obj;
+    if (idx.type == VAL_ERROR)
+      return idx;
+
+    if (obj.type == VAL_ANY && obj.any_val) {
+      obj = *obj.any_val;
+    }
+
+    if (obj.type == VAL_LIST && idx.type == VAL_INT) {
+      if (idx.i < 0) {
+        return v_error("list index cannot be negative");
+      }
+      if ((size_t)idx.i >= obj.list->size) {
+        return v_error("list index out of range");
+      }
+      return obj.list->items[idx.i];
+    }
+    if (obj.type == VAL_TUPLE && idx.type == VAL_INT) {
+      if (idx.i < 0) {
+        return v_error("tuple index cannot be negative");
+      }
+      if ((size_t)idx.i >= obj.tuple->size) {
+        return v_error("tuple index out of range");
+      }
+      return obj.tuple->items[idx.i];
+    }
+    if (is_view(obj) && idx.type == VAL_INT) {
+      if (idx.i < 0 || (size_t)idx.i >= obj.ptr_info.ptr_size) {
+        return v_error("view index out of range");
+      }
+      return view_get(obj, (size_t)idx.i);
+    }
+    if (obj.type == VAL_STRING && idx.type == VAL_INT) {
+      size_t len = strlen(obj.s);
+      if (idx.i < 0) {
+        return v_error("string index cannot be negative");
+      }
+      if ((size_t)idx.i >= len) {
+        return v_error("string index out of range");
+      }
+      char buf[2] = {obj.s[idx.i], '\0'};
+      return v_str(buf);
+    }
+    return v_error("cannot index non-sequence or with non-integer");
+  }
+  case A_UNWRAP: {
+    Value v = eval(a->unwrap.expr, env);
+    if (v.type == VAL_ERROR) {
+      fprintf(stderr, "%s:%d:%d: error: unwrap failed: %s\n", a->loc.filename,
+              a->loc.line, a->loc.column, v.s);
+      exit(1);
+    }
+    if (v.type == VAL_PTR && v.ptr == NULL) {
+      fprintf(stderr, "%s:%d:%d: error: unwrap failed: null pointer\n",
+              a->loc.filename, a->loc.line, a->loc.column);
+      exit(1);
+    }
+    if (v.type == VAL_NULL) {
+      fprintf(stderr, "%s:%d:%d: error: unwrap failed: got null\n",
+              a->loc.filename, a->loc.line, a->loc.column);
+      exit(1);
+    }
+    return v;
+  }
+  case A_METHOD: {
+    Value obj = eval(a->method.obj, env);
+    Value *args = NULL;
+    if (a->method.argc > 0) {
+      args = xmalloc(sizeof(Value) * a->method.argc);
+      for (size_t i = 0; i < a->method.argc; i++)
+        args[i] = eval(a->method.args[i], env);
+    }
+    Value result = call_method(obj, a->method.method, args, a->method.argc);
+    return result;
+  }
+  case A_BINOP: {
+    if (a->bin.typed != TY_ANY)
+      return eval_binop_typed(a, env);
+    Value l = eval(a->bin.l, env);
+    Value r = eval(a->bin.r, env);
+    quicken_observe(a, l, r);
+    return eval_binop(a, l, r);
+  }
+  case A_BINOP_INT: {
+    Value l = eval(a->bin.l, env);
+    Value r = eval(a->bin.r, env);
+    if (l.type != VAL_INT || r.type != VAL_INT)
+      return quicken_deopt(a, l, r);
+    a->bin.hits++;
+    quicken_hits++;
+    return eval_binop_int(a->bin.op, l.i, r.i);
+  }
+  case A_BINOP_DOUBLE: {
+    Value l = eval(a->bin.l, env);
+    Value r = eval(a->bin.r, env);
+    if (l.type != VAL_DOUBLE || r.type != VAL_DOUBLE)
+      return quicken_deopt(a, l, r);
+    a->bin.hits++;
+    quicken_hits++;
+    return eval_binop_double(a->bin.op, l.d, r.d);
+  }
+  case A_BINOP_STRING: {
+    Value l = eval(a->bin.l, env);
+    Value r = eval(a->bin.r, env);
+    if (l.type != VAL_STRING || r.type != VAL_STRING)
+      return quicken_deopt(a, l, r);
+    a->bin.hits++;
+    quicken_hits++;
+    return eval_binop_string(a->bin.op, l.s, r.s);
+  }
+  case A_CALL: {
+    Value f = eval(a->call.fn, env);
+    call_loc = a->loc;
+
+    if (a->call.fn->type == A_VAR) {
+      ExternFunc *ext = find_extern(a->call.fn->name);
+      if (ext) {
+        if (!ext->is_variadic && a->call.argc != ext->param_count) {
+          return v_error("extern function argument count mismatch");
+        }
+        if (ext->is_variadic && a->call.argc < ext->param_count - 1) {
+          return v_error("extern function requires at least %zu arguments");
+        }
+        Value *vals = xmalloc(sizeof(Value) * a->call.argc);
+        for (size_t i = 0; i < a->call.argc; i++)
+          vals[i] = eval(a->call.args[i], env);
+        return call_extern(ext, vals, a->call.argc);
+      }
+    }
+    if (f.type != VAL_FUNC)
+      return v_null();
+    if (a->call.tail && !f.fn->is_builtin &&
+        (f.fn->is_variadic || a->call.argc >= f.fn->arity)) {
+      Function *target = f.fn->target ? f.fn->target : f.fn;
+      size_t bound = f.fn->target ? f.fn->bound_count : 0;
+      size_t base = tail_top;
+      tail_reserve(bound + a->call.argc);
+      tail_top += bound + a->call.argc;
+      for (size_t i = 0; i < bound; i++)
+        tail_stack[base + i] = f.fn->bound[i];
+      for (size_t i = 0; i < a->call.argc; i++) {
+        Value v = eval(a->call.args[i], env);
+        tail_stack[base + bound + i] = v;
+      }
+      tail_fn = target;
+      tail_base = base;
+      tail_argc = bound + a->call.argc;
+      Value pending = v_null();
+      pending.cf = CF_TAIL;
+      return pending;
+    }
+    Value result = call(f.fn, a->call.args, a->call.argc, env);
+
+    return result;
+  }
+  case A_LAMBDA: {
+    lambda_prepare(a);
+    Function *f = xmalloc(sizeof(Function));
+    memset(f, 0, sizeof(Function));
+    f->params = a->lambda.params;
+    f->arity = a->lambda.arity;
+    f->body = a->lambda.body;
+    f->is_builtin = false;
+    bool is_variadic = false;
+    for (size_t i = 0; i < a->lambda.arity; i++) {
+      if (a->lambda.params[i][0] == '$') {
+        is_variadic = true;
+        break;
+      }
+    }
+    f->is_variadic = is_variadic;
+    f->closure_env = env == global_env ? env : capture_upvalues(a, env);
+    f->param_types = a->lambda.param_types;
+    f->return_type = a->lambda.return_type;
+    f->native = a->lambda.native;
+    f->lambda = a;
+    f->reuse_frame = !a->lambda.frame_escapes;
+    return v_func(f);
+  }
+  case A_ASSIGN: {
+    Value v = eval(a->assign.value, env);
+    if (a->assign.check != TY_ANY && v.type != VAL_ERROR &&
+        !type_accepts(a->assign.check, &v)) {
+      char msg[256];
+      snprintf(msg, sizeof(msg), "cannot assign %s to '%s' of type %s",
+               value_type_name(v), a->assign.name,
+               type_ann_name(a->assign.check));
+      return v_error(msg);
+    }
+    if (a->slot && !a->assign.is_const) {
+      Env *e = frame_slot(env, a->slot - 1);
+      if (!e->is_const) {
+        e->value = v;
+        if (e->value_ptr)
+          *e->value_ptr = v;
+        return v;
+      }
+    }
+    env_set(env, a->assign.name, v, a->assign.is_const);
+    return v;
+  }
+  case A_IF: {
+    Value cond = eval(a->ifelse.cond, env);
+    if (value_is_truthy(cond)) {
+      return eval(a->ifelse.then_block, env);
+    } else if (a->ifelse.else_block) {
+      return eval(a->ifelse.else_block, env);
+    }
+    return v_null();
+  }
+
+  case A_RANGE: {
+    Value start = eval(a->range.start, env);
+    Value end = eval(a->range.end, env);
+
+    if (start.type != VAL_INT || end.type != VAL_INT) {
+      return v_error("range requires integer bounds");
+    }
+
+    Value result = v_list();
+    if (start.i <= end.i) {
+      for (long long i = start.i; i < end.i; i++) {
+        list_append(result.list, v_int(i));
+      }
+    } else {
+      for (long long i = start.i; i > end.i; i--) {
+        list_append(result.list, v_int(i));
+      }
+    }
+    return result;
+  }
+
+  case A_FOR: {
+    Value result = v_null();
+    Value iter_val = eval(a->forloop.iter, env);
+
+    if (iter_val.type == VAL_ERROR) {
+      return iter_val;
+    }
+
+    bool two_vars = false;
+    char *var1 = NULL;
+    char *var2 = NULL;
+
+    char var_buffer[256];
+    strcpy(var_buffer, a->forloop.var);
+
+    char *comma = strchr(var_buffer, ',');
+    if (comma) {
+      two_vars = true;
+      *comma = '\0';
+      var1 = var_buffer;
+      var2 = comma + 1;
+      while (*var2 && isspace(*var2))
+        var2++;
+      char *end = var1 + strlen(var1) - 1;
+      while (end > var1 && isspace(*end))
+        *end-- = '\0';
+    } else {
+      var1 = var_buffer;
+    }
+
+    if (iter_val.type == VAL_LIST) {
+      for (size_t i = 0; i < iter_val.list->size; i++) {
+        if (two_vars) {
+          env_set(env, var1, v_int(i), false);
+          env_set(env, var2, iter_val.list->items[i], false);
+        } else {
+          env_set(env, var1, iter_val.list->items[i], false);
+        }
+        result = eval(a->forloop.body, env);
+
+        if (result.cf == CF_BREAK) {
+          result.cf = CF_NONE;
+          break;
+        }
+        if (result.cf == CF_CONTINUE) {
+          result.cf = CF_NONE;
+          continue;
+        }
+        if (result.cf == CF_RETURN || result.cf == CF_TAIL) {
+          return result;
+        }
+      }
+    } else if (iter_val.type == VAL_TUPLE) {
+      for (size_t i = 0; i < iter_val.tuple->size; i++) {
+        if (two_vars) {
+          env_set(env, var1, v_int(i), false);
+          env_set(env, var2, iter_val.tuple->items[i], false);
+        } else {
+          env_set(env, var1, iter_val.tuple->items[i], false);
+        }
+        result = eval(a->forloop.body, env);
+
+        if (result.cf == CF_BREAK) {
+          result.cf = CF_NONE;
+          break;
+        }
+        if (result.cf == CF_CONTINUE) {
+          result.cf = CF_NONE;
+          continue;
+        }
+        if (result.cf == CF_RETURN || result.cf == CF_TAIL) {
+          return result;
+        }
+      }
+    } else if (is_view(iter_val)) {
+      for (size_t i = 0; i < iter_val.ptr_info.ptr_size; i++) {
+        Value item = view_get(iter_val, i);
+        if (two_vars) {
+          env_set(env, var1, v_int(i), false);
+          env_set(env, var2, item, false);
+        } else {
+          env_set(env, var1, item, false);
+        }
+        result = eval(a->forloop.body, env);
+
+        if (result.cf == CF_BREAK) {
+          result.cf = CF_NONE;
+          break;
+        }
+        if (result.cf == CF_CONTINUE) {
+          result.cf = CF_NONE;
+          continue;
+        }
+        if (result.cf == CF_RETURN || result.cf == CF_TAIL) {
+          return result;
+        }
+      }
+    } else if (iter_val.type == VAL_STRING) {
+      for (size_t i = 0; i < strlen(iter_val.s); i++) {
+        char buf[2] = {iter_val.s[i], '\0'};
+        if (two_vars) {
+          env_set(env, var1, v_int(i), false);
+          env_set(env, var2, v_str(buf), false);
+        } else {
+          env_set(env, var1, v_str(buf), false);
+        }
+        result = eval(a->forloop.body, env);
+
+        if (result.cf == CF_BREAK) {
+          result.cf = CF_NONE;
+          break;
+        }
+        if (result.cf == CF_CONTINUE) {
+          result.cf = CF_NONE;
+          continue;
+        }
+        if (result.cf == CF_RETURN || result.cf == CF_TAIL) {
+          return result;
+        }
+      }
+    } else if (iter_val.type == VAL_STRUCT) {
+      StructDef *def = iter_val.struct_val->def;
+      for (size_t i = 0; i < def->field_count; i++) {
+        if (two_vars) {
+          env_set(env, var1, v_str(def->fields[i]), false);
+          env_set(env, var2, iter_val.struct_val->values[i], false);
+        } else {
+          env_set(env, var1, iter_val.struct_val->values[i], false);
+        }
+        result = eval(a->forloop.body, env);
+
+        if (result.cf == CF_BREAK) {
+          result.cf = CF_NONE;
+          break;
+        }
+        if (result.cf == CF_CONTINUE) {
+          result.cf = CF_NONE;
+          continue;
+        }
+        if (result.cf == CF_RETURN || result.cf == CF_TAIL) {
+          return result;
+        }
+      }
+    } else {
+      return v_error(
+          "for loop requires iterable (list, tuple, string, struct, or "
+          "range)");
+    }
+    return result;
+  }
+  case A_WHILE: {
+    Value result = v_null();
+    while (value_is_truthy(eval(a->whileloop.cond, env))) {
+      jit_ticks++;
+      result = eval(a->whileloop.body, env);
+      if (result.cf == CF_BREAK) {
+        result.cf = CF_NONE;
+        break;
+      }
+      if (result.cf == CF_CONTINUE) {
+        result.cf = CF_NONE;
+        continue;
+      }
+      if (result.cf == CF_RETURN || result.cf == CF_TAIL) {
+        return result;
+      }
+    }
+    return result;
+  }
+  case A_BLOCK: {
+    Value result = v_null();
+    for (size_t i = 0; i < a->block.count; i++) {
+      result = eval(a->block.stmts[i], env);
+      if (result.cf != CF_NONE) {
+        return result;
+      }
+    }
+    return result;
+  }
+  case A_RETURN: {
+    Value v = a->ret.value ? eval(a->ret.value, env) : v_null();
+    if (v.cf == CF_TAIL)
+      return v;
+    return v_return(v);
+  }
+  case A_BREAK: {
+    return v_break();
+  }
+  case A_CONTINUE: {
+    return v_continue();
+  }
+  case A_STRUCT_DEF: {
+    Value v;
+    v.type = VAL_STRUCT_DEF;
+    v.struct_def = xmalloc(sizeof(StructDef));
+    v.struct_def->name = a->struct_def.name;
+    v.struct_def->fields = a->struct_def.fields;
+    v.struct_def->field_count = a->struct_def.count;
+    v.struct_def->layout = NULL;
+    if (a->struct_def.c_types) {
+      char err[256];
+      v.struct_def->layout =
+          c_layout_define(a->struct_def.name, a->struct_def.fields,
+                          a->struct_def.c_types, a->struct_def.count, err,
+                          sizeof(err));
+      if (!v.struct_def->layout)
+        return v_error(err);
+    }
+
+    size_t mcount = a->struct_def.method_count;
+    v.struct_def->method_count = mcount;
+    v.struct_def->methods = xmalloc(sizeof(Function *) * mcount);
+    v.struct_def->method_names = xmalloc(sizeof(char *) * mcount);
+
+    for (size_t i = 0; i < mcount; i++) {
+      AST *assign = a->struct_def.methods[i];
+      if (assign->type == A_ASSIGN) {
+        Value val = eval(assign->assign.value, env);
+        if (val.type == VAL_FUNC) {
+          v.struct_def->methods[i] = val.fn;
+          v.struct_def->method_names[i] = assign->assign.name;
+        } else {
+          v.struct_def->methods[i] = NULL;
+        }
+      }
+    }
+
+    env_set(env, a->struct_def.name, v, false);
+    return v;
+  }
+  case A_STRUCT_INIT: {
+    Value def_val = env_get_at(env, a->struct_init.name, a->loc.filename);
+    if (def_val.type != VAL_STRUCT_DEF) {
+      return v_error("struct not defined");
+    }
+    StructDef *def = def_val.struct_def;
+    if (def->layout) {
+      Value v = c_struct_new(def->layout);
+      if (v.type == VAL_ERROR)
+        return v;
+      for (size_t i = 0; i < a->struct_init.count; i++) {
+        long j = c_field_index(def->layout, a->struct_init.fields[i]);
+        if (j < 0)
+          return v_error("field not found in struct");
+        Value val = eval(a->struct_init.values[i], env);
+        if (val.type == VAL_ERROR)
+          return val;
+        if (!c_field_set(v.ptr, def->layout, (size_t)j, val))
+          return v_error("cannot store value of this type in extern struct");
+      }
+      return v;
+    }
+    Value *values = xmalloc(sizeof(Value) * def->field_count);
+    for (size_t i = 0; i < def->field_count; i++)
+      values[i] = v_null();
+
+    for (size_t i = 0; i < a->struct_init.count; i++) {
+      char *fname = a->struct_init.fields[i];
+      bool found = false;
+      for (size_t j = 0; j < def->field_count; j++) {
+        if (strcmp(fname, def->fields[j]) == 0) {
+          values[j] = eval(a->struct_init.values[i], env);
+          found = true;
+          break;
+        }
+      }
+      if (!found) {
+        return v_error("field not found in struct");
+      }
+    }
+
+    Value v;
+    v.type = VAL_STRUCT;
+    v.struct_val = xmalloc(sizeof(StructVal));
+    v.struct_val->def = def;
+    v.struct_val->values = values;
+    return v;
+  }
+  case A_MEMBER: {
+    Value obj = eval(a->member.obj, env);
+    if (obj.type == VAL_STRUCT) {
+      for (size_t i = 0; i < obj.struct_val->def->field_count; i++) {
+        if (strcmp(a->member.member, obj.struct_val->def->fields[i]) == 0) {
+          return obj.struct_val->values[i];
+        }
+      }
+    }
+    if (c_struct_layout(obj)) {
+      CLayout *l = c_struct_layout(obj);
+      long i = c_field_index(l, a->member.member);
+      if (i >= 0)
+        return c_field_get(obj.ptr, l, (size_t)i);
+    }
+    return call_method(obj, a->member.member, NULL, 0);
+  }
+  case A_MEMBER_ASSIGN: {
+    Value val = eval(a->member_assign.value, env);
+    if (val.type == VAL_ERROR)
+      return val;
+    Value obj = eval(a->member_assign.obj, env);
+    if (obj.type == VAL_STRUCT) {
+      StructDef *def = obj.struct_val->def;
+      for (size_t i = 0; i < def->field_count; i++) {
+        if (strcmp(a->member_assign.member, def->fields[i]) == 0) {
+          obj.struct_val->values[i] = val;
+          return val;
+        }
+      }
+      return v_error("field not found in struct for assignment");
+    }
+    if (c_struct_layout(obj)) {
+      CLayout *l = c_struct_layout(obj);
+      long i = c_field_index(l, a->member_assign.member);
+      if (i < 0)
+        return v_error("field not found in struct for assignment");
+      if (!c_field_set(obj.ptr, l, (size_t)i, val))
+        return v_error("cannot store value of this type in extern struct");
+      return val;
+    }
+
+    return v_error("cannot assign to member of non-struct");
+  }
+  case A_INCREMENT: {
+    Value v = env_get_at(env, a->increment.name, a->loc.filename);
+    if (v.type == VAL_INT) {
+      Value new_val = v_int(v.i + 1);
+      env_set(env, a->increment.name, new_val, false);
+      return a->increment.is_post ? v : new_val;
+    }
+    return v_error("increment requires integer variable");
+  }
+
+  case A_DECREMENT: {
+    Value v = env_get_at(env, a->decrement.name, a->loc.filename);
+    if (v.type == VAL_INT) {
+      Value new_val = v_int(v.i - 1);
+      env_set(env, a->decrement.name, new_val, false);
+      return a->decrement.is_post ? v : new_val;
+    }
+    return v_error("decrement requires integer variable");
+  }
+
+  case A_ASSIGN_UNPACK: {
+    Value rhs = eval(a->assign_unpack.value, env);
+    if (rhs.type != VAL_TUPLE && rhs.type != VAL_LIST) {
+      return v_error("cannot unpack non-sequence");
+    }
+    size_t count = (rhs.type == VAL_TUPLE) ? rhs.tuple->size : rhs.list->size;
+    Value *items = (rhs.type == VAL_TUPLE) ? rhs.tuple->items : rhs.list->items;
+
+    if (count != a->assign_unpack.count) {
+      return v_error("unpacking count mismatch");
+    }
+
+    for (size_t i = 0; i < count; i++) {
+      env_set(env, a->assign_unpack.names[i], items[i], false);
+    }
+    return rhs;
+  }
+  case A_MATCH: {
+    Value target = eval(a->match.value, env);
+    if (!a->match.table)
+      a->match.table = match_table_build(a);
+    if (a->match.table->kind != MATCH_LINEAR) {
+      long hit = match_table_lookup(a->match.table, target);
+      return hit < 0 ? v_null() : eval(a->match.bodies[hit], env);
+    }
+    for (size_t i = 0; i < a->match.case_count; i++) {
+      Value pattern_val = eval(a->match.patterns[i], env);
+      if (values_equal(target, pattern_val)) {
+        return eval(a->match.bodies[i], env);
+      }
+    }
+    return v_null();
+  }
+  case A_SLICE: {
+    Value obj = eval(a->slice.obj, env);
+    if (obj.type == VAL_ERROR)
+      return obj;
+    if (obj.type == VAL_ANY && obj.any_val)
+      obj = *obj.any_val;
+
+    size_t obj_len = 0;
+    if (obj.type == VAL_LIST)
+      obj_len = obj.list->size;
+    else if (obj.type == VAL_STRING)
+      obj_len = strlen(obj.s);
+    else if (is_view(obj))
+      obj_len = obj.ptr_info.ptr_size;
+    else
+      return v_error("slice requires a list, string or view");
+
+    long long s = 0;
+    long long e = (long long)obj_len;
+
+    if (a->slice.begin) {
+      Value sv = eval(a->slice.begin, env);
+      if (sv.type != VAL_INT)
+        return v_error("slice index must be an integer");
+      s = sv.i;
+    }
+    if (a->slice.end) {
+      Value ev = eval(a->slice.end, env);
+      if (ev.type != VAL_INT)
+        return v_error("slice index must be an integer");
+      e = ev.i;
+    }
+
+    if (s < 0)
+      s = 0;
+    if (e > (long long)obj_len)
+      e = (long long)obj_len;
+
+    if (obj.type == VAL_LIST) {
+      Value result = v_list();
+      for (long long i = s; i < e; i++)
+        list_append(result.list, obj.list->items[i]);
+      return result;
+    } else if (is_view(obj)) {
+      size_t elem = view_elem_size(obj.ptr_info.ptr_type);
+      if (s >= e)
+        return v_view(obj.ptr, obj.ptr_info.ptr_type, 0);
+      return v_view((char *)obj.ptr + (size_t)s * elem, obj.ptr_info.ptr_type,
+                    (size_t)(e - s));
+    } else {
+      if (s >= e)
+        return v_str("");
+      size_t len = (size_t)(e - s);
+      char *buf = xmalloc(len + 1);
+      memcpy(buf, obj.s + s, len);
+      buf[len] = '\0';
+      Value r;
+      memset(&r, 0, sizeof(r));
+      r.type = VAL_STRING;
+      r.s = buf;
+      return r;
+    }
+  }
+  case A_COMPOUND_ASSIGN:
+    return v_error("compound assign not implemented in eval");
+  case A_IMPORT: {
+    if (a->import.lazy) {
+      lazy_import_add(a);
+      return v_null();
+    }
+    bool saved_import_mode = import_mode;
+    import_mode = true;
+    module_exec(a->import.module);
+    import_mode = saved_import_mode;
+    return v_null();
+  }
+  case A_LINK:
+    load_library(a->link.path);
+    return v_null();
+  case A_EXTERN:
+    if (a->extern_decl.is_callback) {
+      char err[256];
+      CallbackType *cb = register_callback_type(
+          a->extern_decl.name, a->extern_decl.param_types,
+          a->extern_decl.param_count, a->extern_decl.return_type, err,
+          sizeof(err));
+      if (!cb)
+        return v_error(err);
+      cb->retained = a->extern_decl.retained;
+      return v_null();
+    }
+    register_extern(a->extern_decl.name, a->extern_decl.c_name,
+                    a->extern_decl.param_types, a->extern_decl.param_count,
+                    a->extern_decl.return_type, a->extern_decl.param_structs,
+                    a->extern_decl.return_struct);
+    return v_null();
+  }
+  return v_null();
+}
+
+Function *make_builtin(Value (*fn)(Value *, size_t)) {
+  Function *f = xmalloc(sizeof(Function));
+  memset(f, 0, sizeof(Function));
+  f->is_builtin = true;
+  f->builtin = fn;
+  f->arity = 0;
+  f->is_variadic = false;
+  f->closure_env = NULL;
+  return f;
+}
+
+void run_file(const char *filename);
+char *resolve_import_path(const char *import_name, const char *current_file);
+bool check_extern_unwraps(AST *stmt);
+bool typecheck_stmt(AST *stmt);
+
+void run_repl(void) {
+  char line[2048];
+  while (1) {
+    printf(">>> ");
+    fflush(stdout);
+    if (!fgets(line, sizeof(line), stdin))
+      break;
+    size_t len = strlen(line);
+    if (len > 0 && line[len - 1] == '\n')
+      line[len - 1] = 0;
+    char *trimmed = line;
+    while (*trimmed && isspace(*trimmed))
+      trimmed++;
+    if (strlen(trimmed) == 0 || trimmed[0] == '#')
+      continue;
+    if (!strcmp(trimmed, "quit") || !strcmp(trimmed, "exit")) {
+      printf("\n");
+      break;
+    }
+
+    src = line;
+    src_start = line;
+    current_loc.filename = "<stdin>";
+    current_loc.line = 1;
+    current_loc.column = 1;
+    errors_occurred = false;
+
+    next_token();
+
+    if (tok.type == T_IMPORT) {
+      next_token();
+      if (tok.type != T_STRING) {
+        error_at(tok.loc, "import requires a filename string");
+        continue;
+      }
+      char filename[256];
+      strcpy(filename, tok.text);
+      next_token();
+      char *resolved = resolve_import_path(filename, NULL);
+      bool saved_import_mode = import_mode;
+      import_mode = true;
+      run_file(resolved ? resolved : filename);
+      import_mode = saved_import_mode;
+      free(resolved);
+      continue;
+    }
+
+    if (tok.type == T_LINK) {
+      next_token();
+      if (tok.type != T_STRING) {
+        error_at(tok.loc, "link requires a library path string");
+        continue;
+      }
+      char libpath[256];
+      strcpy(libpath, tok.text);
+      next_token();
+      load_library(libpath);
+      continue;
+    }
+
+    if (tok.type == T_EXTERN) {
+      next_token();
+      if (tok.type != T_IDENT) {
+        error_at(tok.loc, "extern requires function name");
+        next_token();
+        continue;
+      }
+      char aoxim_name[256];
+      strcpy(aoxim_name, tok.text);
+      next_token();
+
+      if (tok.type != T_ASSIGN) {
+        error_at(tok.loc, "expected '=' after extern function name");
+        next_token();
+        continue;
+      }
+
+      next_token();
+
+      if (tok.type != T_IDENT) {
+        error_at(tok.loc, "expected C function name");
+        next_token();
+        continue;
+      }
+      char c_name[256];
+      strcpy(c_name, tok.text);
+      next_token();
+
+      if (tok.type != T_LP) {
+        error_at(tok.loc, "expected '(' for parameter types");
+        next_token();
+        continue;
+      }
+      next_token();
+
+      FFIType param_types[16];
+      size_t param_count = 0;
+
+      while ((tok.type == T_IDENT || tok.type == T_PTR) && param_count < 16) {
+        param_types[param_count++] = parse_ffi_type(tok.text);
+        next_token();
+        if (tok.type == T_COMMA)
+          next_token();
+        else
+          break;
+      }
+
+      if (tok.type != T_RP) {
+        error_at(tok.loc, "expected ')' after parameters");
+        continue;
+      }
+      next_token();
+
+      if (tok.type != T_COLON) {
+        error_at(tok.loc, "expected ':' before return type");
+        continue;
+      }
+      next_token();
+
+      FFIType return_type;
+      if (tok.type == T_OPTION_PTR) {
+        return_type = FFI_OPTION_PTR;
+        next_token();
+      } else if (tok.type == T_IDENT || tok.type == T_PTR) {
+        return_type = parse_ffi_type(tok.text);
+        next_token();
       } else {
         error_at(tok.loc, "expected return type");
         continue;
       }
     }
-
-    bool is_const = false;
-    if (tok.type == T_CONST) {
-      is_const = true;
-      next_token();
+
+    bool is_const = false;
+    if (tok.type == T_CONST) {
+      is_const = true;
+      next_token();
+    }
+
+    if (tok.type == T_IDENT) {
+      char name[256];
+      strcpy(name, tok.text);
+      next_token();
+      if (tok.type == T_LP) {
+        next_token();
+        char **params = xmalloc(sizeof(char *) * 16);
+        size_t n = 0;
+        while (tok.type == T_IDENT) {
+          params[n++] = xstrdup(tok.text);
+          next_token();
+          if (tok.type == T_LP) {
+            int depth = 1;
+            next_token();
+            while (depth > 0 && tok.type != T_EOF) {
+              if (tok.type == T_IDENT && depth == 1) {
+                params[n++] = xstrdup(tok.text);
+              }
+              next_token();
+              if (tok.type == T_LP)
+                depth++;
+              else if (tok.type == T_RP)
+                depth--;
+            }
+          }
+          if (tok.type == T_COMMA) {
+            next_token();
+          } else if (tok.type == T_RP) {
+            break;
+          }
+        }
+        if (tok.type == T_RP) {
+          next_token();
+          if (tok.type == T_ASSIGN) {
+            next_token();
+            AST *body = parse_expr();
+            if (!errors_occurred) {
+              AST *lambda = ast_new(A_LAMBDA);
+              lambda->lambda.params = params;
+              bool is_variadic = false;
+              for (size_t i = 0; i < n; i++) {
+                if (params[i][0] == '$') {
+                  is_variadic = true;
+                  break;
+                }
+              }
+              lambda->lambda.arity = n;
+              lambda->lambda.body = body;
+              Value fn_val = eval(lambda, global_env);
+              fn_val.fn->is_variadic = is_variadic;
+              env_set(global_env, name, fn_val, is_const);
+            }
+            continue;
+          }
+        }
+        src = line;
+        current_loc.column = 1;
+        next_token();
+      } else if (tok.type == T_ASSIGN) {
+        next_token();
+        AST *expr = parse_expr();
+        if (!errors_occurred) {
+          Value v = eval(expr, global_env);
+          env_set(global_env, name, v, is_const);
+        }
+        continue;
+      }
+    }
+
+    src = line;
+    current_loc.column = 1;
+    next_token();
+    AST *e = parse_stmt();
+    if (errors_occurred || !check_extern_unwraps(e) || !typecheck_stmt(e))
+      continue;
+
+    Value v = eval(e, global_env);
+
+    const char *color = value_type_color(v);
+    const char *reset = use_colors ? COLOR_RESET : "";
+
+    if (v.type == VAL_INT)
+      printf("%s%lld%s\n", color, v.i, reset);
+    else if (v.type == VAL_DOUBLE)
+      printf("%s%g%s\n", color, v.d, reset);
+    else if (v.type == VAL_STRING)
+      printf("%s\"%s\"%s\n", color, v.s, reset);
+    else if (v.type == VAL_BOOL)
+      printf("%s%s%s\n", color, v.b ? "True" : "False", reset);
+    else if (v.type == VAL_ERROR)
+      printf("%sError: %s%s\n", color, v.s, reset);
+    else if (v.type == VAL_PTR)
+      printf("%s<ptr:%p>%s\n", color, v.ptr, reset);
+    else if (v.type == VAL_ANY) {
+      printf("%s<any:", color);
+      if (v.any_val)
+        print_value(*v.any_val);
+      else
+        printf("null");
+      printf(">%s\n", reset);
+    } else if (v.type == VAL_TUPLE) {
+      printf("%s(%s", color, reset);
+      for (size_t i = 0; i < v.tuple->size; i++) {
+        if (i > 0)
+          printf(", ");
+        const char *item_color = value_type_color(v.tuple->items[i]);
+        if (v.tuple->items[i].type == VAL_INT)
+          printf("%s%lld%s", item_color, v.tuple->items[i].i, reset);
+        else if (v.tuple->items[i].type == VAL_DOUBLE)
+          printf("%s%g%s", item_color, v.tuple->items[i].d, reset);
+        else if (v.tuple->items[i].type == VAL_STRING)
+          printf("%s\"%s\"%s", item_color, v.tuple->items[i].s, reset);
+        else if (v.tuple->items[i].type == VAL_PTR)
+          printf("%s<ptr:%p>%s", item_color, v.tuple->items[i].ptr, reset);
+      }
+      printf("%s)%s\n", color, reset);
+    } else if (v.type == VAL_LIST) {
+      printf("%s[%s", color, reset);
+      for (size_t i = 0; i < v.list->size; i++) {
+        if (i > 0)
+          printf(", ");
+        const char *item_color = value_type_color(v.list->items[i]);
+        if (v.list->items[i].type == VAL_INT)
+          printf("%s%lld%s", item_color, v.list->items[i].i, reset);
+        else if (v.list->items[i].type == VAL_DOUBLE)
+          printf("%s%g%s", item_color, v.list->items[i].d, reset);
+        else if (v.list->items[i].type == VAL_STRING)
+          printf("%s\"%s\"%s", item_color, v.list->items[i].s, reset);
+        else if (v.list->items[i].type == VAL_PTR)
+          printf("%s<ptr:%p>%s", item_color, v.list->items[i].ptr, reset);
+      }
+      printf("%s]%s\n", color, reset);
+    }
+    fflush(stdout);
+  }
+}
+
+#ifndef STR1
+#define STR1(x) #x
+#define STR(x) STR1(x)
+#endif
+
+bool file_exists(const char *path) {
+#ifndef _WIN32
+  struct stat st;
+  return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+#else
+  FILE *f = fopen(path, "r");
+  if (f)
+    fclose(f);
+  return f != NULL;
+#endif
+}
+
+static char *build_and_test(const char *a, const char *b) {
+  size_t la = a ? strlen(a) : 0;
+  size_t lb = b ? strlen(b) : 0;
+  size_t need = la + (la && lb ? 1 : 0) + lb + 1;
+  char *buf = malloc(need);
+  if (!buf)
+    return NULL;
+  if (la && lb)
+    snprintf(buf, need, "%s/%s", a, b);
+  else if (la)
+    snprintf(buf, need, "%s", a);
+  else
+    snprintf(buf, need, "%s", b ? b : "");
+  if (file_exists(buf))
+    return buf;
+  free(buf);
+  return NULL;
+}
+
+char *force_ext(const char *name) {
+  char *ext = ".calc";
+  if (!name)
+    return NULL;
+  char *buf = malloc(sizeof(*buf) + strlen(name) + strlen(ext));
+  if (!buf)
+    return NULL;
+  strcpy(buf, name);
+  strcat(buf, ".calc");
+  return buf;
+}
+
+typedef struct {
+  const char *path;
+  const char *text;
+} EmbeddedSource;
+
+typedef struct {
+  const char *from;
+  const char *name;
+  const char *path;
+} EmbeddedImport;
+
+const EmbeddedSource *embedded_sources = NULL;
+size_t embedded_source_count = 0;
+const EmbeddedImport *embedded_imports = NULL;
+size_t embedded_import_count = 0;
+
+#ifdef AOXIM_EMBED_STDLIB
+static const EmbeddedSource stdlib_table[] = {
+#include "stdlib.inc"
+};
+const EmbeddedSource *stdlib_sources = stdlib_table;
+size_t stdlib_source_count = sizeof(stdlib_table) / sizeof(stdlib_table[0]);
+#else
+const EmbeddedSource *stdlib_sources = NULL;
+size_t stdlib_source_count = 0;
+#endif
+
+/* The interpreter's own source, pasted into programs built by --compile-c.
+   build.sh generates runtime.inc next to stdlib.inc. */
+#ifdef AOXIM_EMBED_RUNTIME
+const char *runtime_source =
+#include "runtime.inc"
+    ;
+#else
+const char *runtime_source = NULL;
+#endif
+
+const char *embedded_source(const char *path) {
+  for (size_t i = 0; i < embedded_source_count; i++) {
+    if (!strcmp(embedded_sources[i].path, path))
+      return embedded_sources[i].text;
+  }
+  for (size_t i = 0; i < stdlib_source_count; i++) {
+    if (!strcmp(stdlib_sources[i].path, path))
+      return stdlib_sources[i].text;
+  }
+  return NULL;
+}
+
+const char *embedded_stdlib_path(const char *import_name) {
+  for (size_t i = 0; i < stdlib_source_count; i++) {
+    const char *path = stdlib_sources[i].path;
+    if (!strcmp(path, import_name) || !strcmp(strchr(path, '/') + 1, import_name))
+      return path;
+  }
+  return NULL;
+}
+
+typedef struct ResolvedPath {
+  char *dir;
+  char *name;
+  char *path;
+  struct ResolvedPath *next;
+} ResolvedPath;
+
+#define RESOLVED_BUCKETS 256
+ResolvedPath *resolved_paths[RESOLVED_BUCKETS];
+
+size_t resolved_bucket(const char *dir, size_t dir_len, const char *name) {
+  uint64_t h = 1469598103934665603ULL;
+  for (size_t i = 0; i < dir_len; i++)
+    h = (h ^ (unsigned char)dir[i]) * 1099511628211ULL;
+  return (size_t)((h ^ hash_string(name)) % RESOLVED_BUCKETS);
+}
+
+char *probe_import_path(const char *import_name, const char *current_file);
+
+char *resolve_import_path(const char *import_name, const char *current_file) {
+  for (size_t i = 0; i < embedded_import_count; i++) {
+    const EmbeddedImport *e = &embedded_imports[i];
+    if (current_file && !strcmp(e->from, current_file) &&
+        !strcmp(e->name, import_name))
+      return strdup(e->path);
+  }
+
+  const char *slash = current_file ? strrchr(current_file, '/') : NULL;
+  size_t dir_len = slash ? (size_t)(slash - current_file) : 0;
+  size_t bucket = resolved_bucket(current_file, dir_len, import_name);
+  for (ResolvedPath *r = resolved_paths[bucket]; r; r = r->next) {
+    if (strlen(r->dir) == dir_len && !strncmp(r->dir, current_file, dir_len) &&
+        !strcmp(r->name, import_name))
+      return strdup(r->path);
+  }
+
+  char *path = probe_import_path(import_name, current_file);
+  if (path) {
+    ResolvedPath *r = malloc(sizeof(ResolvedPath));
+    r->dir = malloc(dir_len + 1);
+    memcpy(r->dir, current_file, dir_len);
+    r->dir[dir_len] = '\0';
+    r->name = strdup(import_name);
+    r->path = strdup(path);
+    r->next = resolved_paths[bucket];
+    resolved_paths[bucket] = r;
+  }
+  return path;
+}
+
+/* A file next to the importing one, or relative to the working directory,
+   wins over a standard library module of the same name; the stdlib
+   (embedded or installed) is the fallback. */
+char *probe_import_path(const char *import_name, const char *current_file) {
+  if (import_name[0] == '/') {
+    if (file_exists(import_name))
+      return strdup(import_name);
+  }
+
+  if (current_file && strchr(current_file, '/')) {
+    const char *last_slash = strrchr(current_file, '/');
+    size_t dir_len = (size_t)(last_slash - current_file) + 1;
+    char *dir = malloc(dir_len + 1);
+    if (dir) {
+      strncpy(dir, current_file, dir_len);
+      dir[dir_len] = '\0';
+      char *p = build_and_test(dir, import_name);
+      free(dir);
+      if (p)
+        return p;
+    }
+  }
+
+#if defined(PATH_MAX)
+  {
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd))) {
+      char *p = build_and_test(cwd, import_name);
+      if (p)
+        return p;
+    }
+  }
+#else
+  {
+    const char *pwd = getenv("PWD");
+    if (pwd) {
+      char *p = build_and_test(pwd, import_name);
+      if (p)
+        return p;
+    }
+  }
+#endif
+  if (file_exists(import_name))
+    return strdup(import_name);
+
+  const char *std_path = embedded_stdlib_path(import_name);
+  if (std_path)
+    return strdup(std_path);
+
+#ifdef BUILD_DIR
+  {
+    const char *build_dir = STR(BUILD_DIR);
+    if (build_dir && build_dir[0]) {
+      char *p = build_and_test(build_dir, import_name);
+      if (p)
+        return p;
+
+      size_t rel_len = strlen("stdlib/") + strlen(import_name) + 1;
+      char *rel = malloc(rel_len);
+      snprintf(rel, rel_len, "stdlib/%s", import_name);
+
+      char *p2 = build_and_test(build_dir, rel);
+      if (p2)
+        return p2;
+      char *exet = force_ext(rel);
+      if (exet) {
+        p2 = build_and_test(build_dir, exet);
+        free(exet);
+        if (p2)
+          return p2;
+      }
+      free(rel);
+    }
+  }
+#endif
+
+  {
+    size_t rel_len = strlen("stdlib/") + strlen(import_name) + 1;
+    char *rel = malloc(rel_len);
+    if (rel) {
+      snprintf(rel, rel_len, "stdlib/%s", import_name);
+      if (file_exists(rel))
+        return rel;
+      free(rel);
+    }
+  }
+
+  return NULL;
+}
+
+struct Module {
+  char *filename;
+  AST **stmts;
+  size_t count;
+  size_t capacity;
+  AST **imports;
+  size_t import_count;
+  AST **externs;
+  size_t extern_count;
+  char **exports;
+  size_t export_count;
+  bool imports_loaded;
+  bool analyzed;
+  bool well_typed;
+  bool optimized;
+  bool executed;
+};
+
+Module **modules = NULL;
+size_t modules_count = 0;
+size_t modules_capacity = 0;
+
+void module_add_stmt(Module *m, AST *stmt) {
+  if (m->count >= m->capacity) {
+    size_t new_cap = m->capacity == 0 ? 64 : m->capacity * 2;
+    AST **new_stmts = xmalloc(sizeof(AST *) * new_cap);
+    if (m->count)
+      memcpy(new_stmts, m->stmts, sizeof(AST *) * m->count);
+    m->stmts = new_stmts;
+    m->capacity = new_cap;
+  }
+  m->stmts[m->count++] = stmt;
+}
+
+AST *parse_extern_struct(void) {
+  next_token();
+  if (tok.type != T_IDENT) {
+    error_at(tok.loc, "expected struct name");
+    return NULL;
+  }
+  AST *a = ast_new(A_STRUCT_DEF);
+  a->struct_def.name = xstrdup(tok.text);
+  next_token();
+  if (!expect(T_LC))
+    return NULL;
+  next_token();
+
+  char **fields = xmalloc(sizeof(char *) * 64);
+  char **types = xmalloc(sizeof(char *) * 64);
+  size_t count = 0;
+  while (tok.type != T_RC && tok.type != T_EOF) {
+    if (tok.type != T_IDENT || count >= 64) {
+      error_at(tok.loc, "expected field name");
+      return NULL;
+    }
+    fields[count] = xstrdup(tok.text);
+    next_token();
+    if (tok.type != T_COLON) {
+      error_at(tok.loc, "expected ':' after field name");
+      return NULL;
+    }
+    next_token();
+    if (tok.type != T_IDENT && tok.type != T_PTR) {
+      error_at(tok.loc, "expected C field type");
+      return NULL;
+    }
+    types[count++] = xstrdup(tok.text);
+    next_token();
+    if (tok.type == T_COMMA)
+      next_token();
+  }
+  if (!expect(T_RC))
+    return NULL;
+  next_token();
+
+  a->struct_def.fields = fields;
+  a->struct_def.count = count;
+  a->struct_def.methods = xmalloc(sizeof(AST *));
+  a->struct_def.c_types = types;
+  return a;
+}
+
+FFIType parse_extern_type(char **struct_name) {
+  FFIType type = parse_ffi_type(tok.text);
+  *struct_name = NULL;
+  if (type == FFI_VOID && tok.type == T_IDENT && strcmp(tok.text, "void")) {
+    type = FFI_STRUCT;
+    *struct_name = xstrdup(tok.text);
+  }
+  return type;
+}
+
+AST *parse_extern_signature(AST *ext) {
+  if (tok.type != T_LP) {
+    error_at(tok.loc, "expected '(' for parameter types");
+    return NULL;
+  }
+  next_token();
+
+  FFIType *param_types = xmalloc(sizeof(FFIType) * 16);
+  char **param_structs = xmalloc(sizeof(char *) * 16);
+  size_t param_count = 0;
+  while ((tok.type == T_IDENT || tok.type == T_PTR) && param_count < 16) {
+    param_types[param_count] = parse_extern_type(&param_structs[param_count]);
+    param_count++;
+    next_token();
+    if (tok.type == T_COMMA)
+      next_token();
+    else
+      break;
+  }
+
+  if (tok.type != T_RP) {
+    error_at(tok.loc, "expected ')' after parameters");
+    next_token();
+    return NULL;
+  }
+  next_token();
+
+  if (tok.type != T_COLON) {
+    error_at(tok.loc, "expected ':' before return type");
+    next_token();
+    return NULL;
+  }
+  next_token();
+
+  if (tok.type == T_OPTION_PTR) {
+    ext->extern_decl.return_type = FFI_OPTION_PTR;
+    next_token();
+  } else if (tok.type == T_IDENT || tok.type == T_PTR) {
+    ext->extern_decl.return_type =
+        parse_extern_type(&ext->extern_decl.return_struct);
+    next_token();
+  } else {
+    error_at(tok.loc, "expected return type");
+    next_token();
+    return NULL;
+  }
+
+  ext->extern_decl.param_types = param_types;
+  ext->extern_decl.param_structs = param_structs;
+  ext->extern_decl.param_count = param_count;
+  return ext;
+}
+
+AST *parse_extern_decl(void) {
+  AST *ext = ast_new(A_EXTERN);
+  next_token();
+  if (tok.type == T_STRUCT)
+    return parse_extern_struct();
+  if (tok.type != T_IDENT) {
+    error_at(tok.loc, "extern requires function name");
+    return NULL;
+  }
+  ext->extern_decl.name = xstrdup(tok.text);
+  next_token();
+
+  if (!strcmp(ext->extern_decl.name, "callback") && tok.type == T_IDENT) {
+    ext->extern_decl.name = xstrdup(tok.text);
+    ext->extern_decl.is_callback = true;
+    next_token();
+    if (!strcmp(ext->extern_decl.name, "retained") && tok.type == T_IDENT) {
+      ext->extern_decl.name = xstrdup(tok.text);
+      ext->extern_decl.retained = true;
+      next_token();
+    }
+    return parse_extern_signature(ext);
+  }
+
+  if (tok.type != T_ASSIGN) {
+    error_at(tok.loc, "expected '=' after extern function name");
+    return NULL;
+  }
+  next_token();
+
+  if (tok.type != T_IDENT) {
+    error_at(tok.loc, "expected C function name");
+    return NULL;
+  }
+  ext->extern_decl.c_name = xstrdup(tok.text);
+  next_token();
+
+  return parse_extern_signature(ext);
+}
+
+void parse_os_block(Module *m) {
+  next_token();
+  if (tok.type != T_IDENT) {
+    error_at(tok.loc, "expected decorator name after '@'");
+    next_token();
+    return;
+  }
+
+  char decorator[256];
+  strcpy(decorator, tok.text);
+  next_token();
+
+  if (strcmp(decorator, "os")) {
+    error_at(tok.loc, "unknown decorator '@%s'", decorator);
+    next_token();
+    return;
+  }
+  if (tok.type != T_STRING) {
+    error_at(tok.loc, "@os requires a string argument");
+    next_token();
+    return;
+  }
+  bool os_matches = match_os(tok.text);
+  next_token();
+
+  if (!expect(T_LC))
+    return;
+  next_token();
+
+  while (tok.type != T_RC && tok.type != T_EOF) {
+    if (tok.type == T_LINK) {
+      next_token();
+      if (tok.type != T_STRING) {
+        error_at(tok.loc, "link requires a library path string");
+        next_token();
+        continue;
+      }
+      if (os_matches) {
+        AST *link = ast_new(A_LINK);
+        link->link.path = xstrdup(tok.text);
+        module_add_stmt(m, link);
+      }
+      next_token();
+    } else if (tok.type == T_SEMI) {
+      next_token();
+    } else {
+      error_at(tok.loc, "expected link statement or '}' in @os block");
+      next_token();
+    }
+  }
+
+  if (tok.type == T_RC)
+    next_token();
+}
+
+AST *parse_toplevel(Module *m) {
+  if (tok.type == T_AT) {
+    parse_os_block(m);
+    return NULL;
+  }
+
+  if (tok.type == T_IMPORT) {
+    AST *imp = ast_new(A_IMPORT);
+    next_token();
+    if (tok.type == T_IDENT && !strcmp(tok.text, "lazy")) {
+      imp->import.lazy = true;
+      next_token();
+    }
+    imp->loc = tok.loc;
+    if (tok.type != T_STRING) {
+      error_at(tok.loc, "import requires a filename string");
+      next_token();
+      return NULL;
+    }
+    imp->import.path = xstrdup(tok.text);
+    next_token();
+    return imp;
+  }
+
+  if (tok.type == T_LINK) {
+    next_token();
+    if (tok.type != T_STRING) {
+      error_at(tok.loc, "link requires a library path string");
+      next_token();
+      return NULL;
+    }
+    AST *link = ast_new(A_LINK);
+    link->link.path = xstrdup(tok.text);
+    next_token();
+    return link;
+  }
+
+  if (tok.type == T_EXTERN)
+    return parse_extern_decl();
+
+  bool is_const = false;
+  if (tok.type == T_CONST) {
+    is_const = true;
+    next_token();
+  }
+
+  AST *stmt = parse_stmt();
+  if (errors_occurred)
+    return NULL;
+
+  if (stmt->type == A_ASSIGN) {
+    stmt->assign.is_const = is_const;
+  } else if (stmt->type == A_ASSIGN_UNPACK) {
+    stmt->assign_unpack.is_const = is_const;
+  } else if (stmt->type == A_CALL && stmt->call.fn->type == A_VAR &&
+             (tok.type == T_ASSIGN || tok.type == T_COLON)) {
+    AST **args = stmt->call.args;
+    size_t argc = stmt->call.argc;
+
+    char **params = xmalloc(sizeof(char *) * argc);
+    TypeAnn *param_types = NULL;
+    for (size_t i = 0; i < argc; i++) {
+      if (args[i]->type != A_VAR) {
+        error_at(args[i]->loc, "function parameters must be identifiers");
+        return NULL;
+      }
+      params[i] = args[i]->name;
+      if (args[i]->static_type != TY_ANY && !param_types) {
+        param_types = xmalloc(sizeof(TypeAnn) * argc);
+        for (size_t j = 0; j < argc; j++)
+          param_types[j] = TY_ANY;
+      }
+      if (param_types)
+        param_types[i] = args[i]->static_type;
+    }
+
+    TypeAnn return_type = TY_ANY;
+    if (tok.type == T_COLON) {
+      next_token();
+      return_type = parse_type_ann();
+      if (!expect(T_ASSIGN))
+        return NULL;
+    }
+
+    next_token();
+    AST *lambda = ast_new(A_LAMBDA);
+    lambda->loc = stmt->loc;
+    lambda->lambda.params = params;
+    lambda->lambda.param_types = param_types;
+    lambda->lambda.return_type = return_type;
+    lambda->lambda.arity = argc;
+    lambda->lambda.body = parse_expr();
+    if (errors_occurred)
+      return NULL;
+
+    AST *assign = ast_new(A_ASSIGN);
+    assign->loc = stmt->loc;
+    assign->assign.name = stmt->call.fn->name;
+    assign->assign.value = lambda;
+    assign->assign.is_const = is_const;
+    stmt = assign;
+  }
+  return stmt;
+}
+
+char *read_file_text(const char *filename) {
+  FILE *f = fopen(filename, "r");
+  if (!f)
+    return NULL;
+  fseek(f, 0, SEEK_END);
+  long fsize = ftell(f);
+  fseek(f, 0, SEEK_SET);
+
+  char *content = xmalloc(fsize + 1);
+  size_t bytes_read = fread(content, 1, fsize, f);
+  content[bytes_read] = 0;
+  fclose(f);
+  return content;
+}
+
+/* Bump whenever the serialized AST changes; the key no longer depends on
+   when aoxim was built. */
+#define AOXC_VERSION 6
+
+bool module_cache_enabled = true;
+
+typedef struct {
+  FILE *f;
+  bool ok;
+} CacheWriter;
+
+typedef struct {
+  char *data;
+  size_t pos;
+  size_t size;
+  const char *filename;
+  bool ok;
+} CacheReader;
+
+uint64_t module_cache_key(const char *content) {
+  uint64_t h = hash_string(content) ^ (uint64_t)AOXC_VERSION;
+  h *= 1099511628211ULL;
+  return h ^ (uint64_t)sizeof(AST);
+}
+
+/* One cache file per source path, named after the absolute path, so a
+   changed source overwrites its old entry instead of leaving it behind. The
+   key of the content it was parsed from is stored inside. */
+char *module_cache_path(const char *source, bool create) {
+  const char *base = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  char dir[1024];
+  if (base && base[0])
+    snprintf(dir, sizeof(dir), "%s/aoxim", base);
+  else if (home && home[0])
+    snprintf(dir, sizeof(dir), "%s/.cache/aoxim", home);
+  else
+    return NULL;
+#ifndef _WIN32
+  if (create) {
+    char *slash = dir;
+    while ((slash = strchr(slash + 1, '/'))) {
+      *slash = '\0';
+      mkdir(dir, 0755);
+      *slash = '/';
+    }
+    mkdir(dir, 0755);
+  }
+#else
+  (void)create;
+#endif
+  char abs[2048];
+#ifndef _WIN32
+  if (source[0] == '/' || !getcwd(abs, sizeof(abs)) ||
+      strlen(abs) + strlen(source) + 2 > sizeof(abs))
+    snprintf(abs, sizeof(abs), "%s", source);
+  else
+    strcat(strcat(abs, "/"), source);
+#else
+  if (!_fullpath(abs, source, sizeof(abs)))
+    snprintf(abs, sizeof(abs), "%s", source);
+#endif
+  uint64_t name = hash_string(abs);
+  size_t len = strlen(dir) + 32;
+  char *path = malloc(len);
+  snprintf(path, len, "%s/%016llx.aoxc", dir, (unsigned long long)name);
+  return path;
+}
+
+void cache_put(CacheWriter *w, const void *p, size_t n) {
+  if (w->ok && fwrite(p, 1, n, w->f) != n)
+    w->ok = false;
+}
+
+void cache_put_u8(CacheWriter *w, unsigned v) {
+  uint8_t b = (uint8_t)v;
+  cache_put(w, &b, 1);
+}
+
+void cache_put_u32(CacheWriter *w, size_t v) {
+  uint32_t x = (uint32_t)v;
+  cache_put(w, &x, 4);
+}
+
+void cache_put_str(CacheWriter *w, const char *s) {
+  if (!s) {
+    cache_put_u32(w, 0xffffffffu);
+    return;
+  }
+  size_t n = strlen(s);
+  cache_put_u32(w, n);
+  cache_put(w, s, n + 1);
+}
+
+void cache_put_ast(CacheWriter *w, AST *a);
+
+void cache_put_asts(CacheWriter *w, AST **items, size_t count) {
+  cache_put_u32(w, count);
+  for (size_t i = 0; i < count; i++)
+    cache_put_ast(w, items[i]);
+}
+
+void cache_put_strs(CacheWriter *w, char **items, size_t count) {
+  cache_put_u32(w, count);
+  for (size_t i = 0; i < count; i++)
+    cache_put_str(w, items[i]);
+}
+
+void cache_put_ast(CacheWriter *w, AST *a) {
+  if (!a) {
+    cache_put_u8(w, 0xff);
+    return;
+  }
+  cache_put_u8(w, a->type);
+  cache_put_u32(w, (size_t)a->loc.line);
+  cache_put_u32(w, (size_t)a->loc.column);
+  cache_put_u8(w, a->static_type);
+  switch (a->type) {
+  case A_INT:
+    cache_put(w, &a->i, sizeof(a->i));
+    break;
+  case A_DOUBLE:
+    cache_put(w, &a->d, sizeof(a->d));
+    break;
+  case A_STRING:
+  case A_VAR:
+    cache_put_str(w, a->s);
+    break;
+  case A_BOOL:
+    cache_put_u8(w, a->b);
+    break;
+  case A_CHAR:
+    cache_put_u8(w, (unsigned char)a->c);
+    break;
+  case A_BINOP:
+  case A_BINOP_INT:
+  case A_BINOP_DOUBLE:
+  case A_BINOP_STRING:
+    cache_put_u8(w, (unsigned char)a->bin.op);
+    cache_put_ast(w, a->bin.l);
+    cache_put_ast(w, a->bin.r);
+    break;
+  case A_CALL:
+    cache_put_ast(w, a->call.fn);
+    cache_put_asts(w, a->call.args, a->call.argc);
+    cache_put_u8(w, a->call.ptr_return);
+    break;
+  case A_LAMBDA:
+    cache_put_strs(w, a->lambda.params, a->lambda.arity);
+    cache_put_ast(w, a->lambda.body);
+    cache_put_u8(w, a->lambda.param_types != NULL);
+    for (size_t i = 0; a->lambda.param_types && i < a->lambda.arity; i++)
+      cache_put_u8(w, a->lambda.param_types[i]);
+    cache_put_u8(w, a->lambda.return_type);
+    break;
+  case A_ASSIGN:
+    cache_put_str(w, a->assign.name);
+    cache_put_ast(w, a->assign.value);
+    cache_put_u8(w, a->assign.is_const);
+    cache_put_u8(w, a->assign.ann);
+    cache_put_u8(w, a->assign.check);
+    break;
+  case A_IF:
+    cache_put_ast(w, a->ifelse.cond);
+    cache_put_ast(w, a->ifelse.then_block);
+    cache_put_ast(w, a->ifelse.else_block);
+    break;
+  case A_WHILE:
+    cache_put_ast(w, a->whileloop.cond);
+    cache_put_ast(w, a->whileloop.body);
+    break;
+  case A_FOR:
+    cache_put_str(w, a->forloop.var);
+    cache_put_ast(w, a->forloop.iter);
+    cache_put_ast(w, a->forloop.body);
+    break;
+  case A_LIST:
+  case A_TUPLE:
+  case A_PTR_LITERAL:
+    cache_put_asts(w, a->list.items, a->list.count);
+    break;
+  case A_RANGE:
+    cache_put_ast(w, a->range.start);
+    cache_put_ast(w, a->range.end);
+    break;
+  case A_INDEX:
+    cache_put_ast(w, a->index.obj);
+    cache_put_ast(w, a->index.idx);
+    break;
+  case A_METHOD:
+    cache_put_ast(w, a->method.obj);
+    cache_put_str(w, a->method.method);
+    cache_put_asts(w, a->method.args, a->method.argc);
+    break;
+  case A_BLOCK:
+    cache_put_asts(w, a->block.stmts, a->block.count);
+    break;
+  case A_RETURN:
+    cache_put_ast(w, a->ret.value);
+    break;
+  case A_STRING_INTERP:
+    cache_put_strs(w, a->str_interp.parts, a->str_interp.count + 1);
+    cache_put_asts(w, a->str_interp.exprs, a->str_interp.count);
+    break;
+  case A_STRUCT_DEF:
+    cache_put_str(w, a->struct_def.name);
+    cache_put_strs(w, a->struct_def.fields, a->struct_def.count);
+    cache_put_asts(w, a->struct_def.methods, a->struct_def.method_count);
+    cache_put_u8(w, a->struct_def.c_types != NULL);
+    if (a->struct_def.c_types)
+      cache_put_strs(w, a->struct_def.c_types, a->struct_def.count);
+    break;
+  case A_STRUCT_INIT:
+    cache_put_str(w, a->struct_init.name);
+    cache_put_strs(w, a->struct_init.fields, a->struct_init.count);
+    cache_put_asts(w, a->struct_init.values, a->struct_init.count);
+    break;
+  case A_MATCH:
+    cache_put_ast(w, a->match.value);
+    cache_put_asts(w, a->match.patterns, a->match.case_count);
+    cache_put_asts(w, a->match.bodies, a->match.case_count);
+    break;
+  case A_MEMBER:
+    cache_put_ast(w, a->member.obj);
+    cache_put_str(w, a->member.member);
+    break;
+  case A_MEMBER_ASSIGN:
+    cache_put_ast(w, a->member_assign.obj);
+    cache_put_str(w, a->member_assign.member);
+    cache_put_ast(w, a->member_assign.value);
+    break;
+  case A_ASSIGN_UNPACK:
+    cache_put_strs(w, a->assign_unpack.names, a->assign_unpack.count);
+    cache_put_ast(w, a->assign_unpack.value);
+    cache_put_u8(w, a->assign_unpack.is_const);
+    break;
+  case A_INCREMENT:
+  case A_DECREMENT:
+    cache_put_str(w, a->increment.name);
+    cache_put_u8(w, a->increment.is_post);
+    break;
+  case A_DEREF:
+    cache_put_ast(w, a->deref.ptr_expr);
+    break;
+  case A_SLICE:
+    cache_put_ast(w, a->slice.obj);
+    cache_put_ast(w, a->slice.begin);
+    cache_put_ast(w, a->slice.end);
+    break;
+  case A_COMPOUND_ASSIGN:
+    cache_put_str(w, a->compound_assign.name);
+    cache_put_u8(w, (unsigned char)a->compound_assign.op);
+    break;
+  case A_ADDROF:
+    cache_put_str(w, a->addrof.var_name);
+    break;
+  case A_UNWRAP:
+    cache_put_ast(w, a->unwrap.expr);
+    break;
+  case A_IMPORT:
+    cache_put_str(w, a->import.path);
+    cache_put_u8(w, a->import.lazy);
+    break;
+  case A_LINK:
+    cache_put_str(w, a->link.path);
+    break;
+  case A_EXTERN:
+    cache_put_str(w, a->extern_decl.name);
+    cache_put_str(w, a->extern_decl.c_name);
+    cache_put_u32(w, a->extern_decl.param_count);
+    for (size_t i = 0; i < a->extern_decl.param_count; i++) {
+      cache_put_u8(w, a->extern_decl.param_types[i]);
+      cache_put_str(w, a->extern_decl.param_structs
+                           ? a->extern_decl.param_structs[i]
+                           : NULL);
+    }
+    cache_put_u8(w, a->extern_decl.return_type);
+    cache_put_str(w, a->extern_decl.return_struct);
+    cache_put_u8(w, a->extern_decl.is_callback);
+    cache_put_u8(w, a->extern_decl.retained);
+    break;
+  case A_BREAK:
+  case A_CONTINUE:
+    break;
+  }
+}
+
+void module_cache_store(Module *m, uint64_t key) {
+  char *path = module_cache_path(m->filename, true);
+  if (!path)
+    return;
+  size_t tmp_len = strlen(path) + 32;
+  char *tmp = malloc(tmp_len);
+#ifndef _WIN32
+  snprintf(tmp, tmp_len, "%s.%ld.tmp", path, (long)getpid());
+#else
+  snprintf(tmp, tmp_len, "%s.tmp", path);
+#endif
+
+  CacheWriter w = {fopen(tmp, "wb"), true};
+  if (w.f) {
+    uint64_t k = key;
+    cache_put(&w, "AOXC", 4);
+    cache_put_u32(&w, AOXC_VERSION);
+    cache_put(&w, &k, sizeof(k));
+    cache_put_asts(&w, m->stmts, m->count);
+    w.ok = fclose(w.f) == 0 && w.ok;
+    if (!w.ok || rename(tmp, path) != 0)
+      remove(tmp);
+  }
+  free(tmp);
+  free(path);
+}
+
+void cache_get(CacheReader *r, void *out, size_t n) {
+  if (!r->ok || r->size - r->pos < n) {
+    r->ok = false;
+    memset(out, 0, n);
+    return;
+  }
+  memcpy(out, r->data + r->pos, n);
+  r->pos += n;
+}
+
+unsigned cache_get_u8(CacheReader *r) {
+  uint8_t b;
+  cache_get(r, &b, 1);
+  return b;
+}
+
+size_t cache_get_u32(CacheReader *r) {
+  uint32_t x;
+  cache_get(r, &x, 4);
+  return x;
+}
+
+char *cache_get_str(CacheReader *r) {
+  size_t n = cache_get_u32(r);
+  if (n == 0xffffffffu || !r->ok)
+    return NULL;
+  if (r->size - r->pos < n + 1 || r->data[r->pos + n] != '\0') {
+    r->ok = false;
+    return NULL;
+  }
+  char *s = r->data + r->pos;
+  r->pos += n + 1;
+  return s;
+}
+
+AST *cache_get_ast(CacheReader *r);
+
+AST **cache_get_asts(CacheReader *r, size_t *count) {
+  *count = cache_get_u32(r);
+  if (!r->ok || *count > r->size - r->pos) {
+    r->ok = false;
+    *count = 0;
+    return NULL;
+  }
+  AST **items = xmalloc(sizeof(AST *) * (*count + 1));
+  for (size_t i = 0; i < *count; i++)
+    items[i] = cache_get_ast(r);
+  return items;
+}
+
+char **cache_get_strs(CacheReader *r, size_t *count) {
+  *count = cache_get_u32(r);
+  if (!r->ok || *count > r->size - r->pos) {
+    r->ok = false;
+    *count = 0;
+    return NULL;
+  }
+  char **items = xmalloc(sizeof(char *) * (*count + 1));
+  for (size_t i = 0; i < *count; i++)
+    items[i] = cache_get_str(r);
+  return items;
+}
+
+TypeAnn *cache_get_types(CacheReader *r, size_t count) {
+  TypeAnn *types = xmalloc(sizeof(TypeAnn) * (count + 1));
+  for (size_t i = 0; i < count; i++)
+    types[i] = (TypeAnn)cache_get_u8(r);
+  return types;
+}
+
+AST *cache_get_ast(CacheReader *r) {
+  unsigned type = cache_get_u8(r);
+  if (type == 0xff || !r->ok || type > A_EXTERN)
+    return NULL;
+  AST *a = xmalloc(sizeof(AST));
+  memset(a, 0, sizeof(AST));
+  a->type = (ASTType)type;
+  a->loc.filename = r->filename;
+  a->loc.line = (int)cache_get_u32(r);
+  a->loc.column = (int)cache_get_u32(r);
+  a->static_type = (TypeAnn)cache_get_u8(r);
+  size_t n;
+  switch (a->type) {
+  case A_INT:
+    cache_get(r, &a->i, sizeof(a->i));
+    break;
+  case A_DOUBLE:
+    cache_get(r, &a->d, sizeof(a->d));
+    break;
+  case A_STRING:
+  case A_VAR:
+    a->s = cache_get_str(r);
+    break;
+  case A_BOOL:
+    a->b = cache_get_u8(r) != 0;
+    break;
+  case A_CHAR:
+    a->c = (char)cache_get_u8(r);
+    break;
+  case A_BINOP:
+  case A_BINOP_INT:
+  case A_BINOP_DOUBLE:
+  case A_BINOP_STRING:
+    a->bin.op = (char)cache_get_u8(r);
+    a->bin.l = cache_get_ast(r);
+    a->bin.r = cache_get_ast(r);
+    break;
+  case A_CALL:
+    a->call.fn = cache_get_ast(r);
+    a->call.args = cache_get_asts(r, &a->call.argc);
+    a->call.ptr_return = cache_get_u8(r) != 0;
+    break;
+  case A_LAMBDA:
+    a->lambda.params = cache_get_strs(r, &a->lambda.arity);
+    a->lambda.body = cache_get_ast(r);
+    if (cache_get_u8(r))
+      a->lambda.param_types = cache_get_types(r, a->lambda.arity);
+    a->lambda.return_type = (TypeAnn)cache_get_u8(r);
+    break;
+  case A_ASSIGN:
+    a->assign.name = cache_get_str(r);
+    a->assign.value = cache_get_ast(r);
+    a->assign.is_const = cache_get_u8(r) != 0;
+    a->assign.ann = (TypeAnn)cache_get_u8(r);
+    a->assign.check = (TypeAnn)cache_get_u8(r);
+    break;
+  case A_IF:
+    a->ifelse.cond = cache_get_ast(r);
+    a->ifelse.then_block = cache_get_ast(r);
+    a->ifelse.else_block = cache_get_ast(r);
+    break;
+  case A_WHILE:
+    a->whileloop.cond = cache_get_ast(r);
+    a->whileloop.body = cache_get_ast(r);
+    break;
+  case A_FOR:
+    a->forloop.var = cache_get_str(r);
+    a->forloop.iter = cache_get_ast(r);
+    a->forloop.body = cache_get_ast(r);
+    break;
+  case A_LIST:
+  case A_TUPLE:
+  case A_PTR_LITERAL:
+    a->list.items = cache_get_asts(r, &a->list.count);
+    if (a->type == A_PTR_LITERAL && a->list.count == 0)
+      a->ptr_lit.addr = NULL;
+    break;
+  case A_RANGE:
+    a->range.start = cache_get_ast(r);
+    a->range.end = cache_get_ast(r);
+    break;
+  case A_INDEX:
+    a->index.obj = cache_get_ast(r);
+    a->index.idx = cache_get_ast(r);
+    break;
+  case A_METHOD:
+    a->method.obj = cache_get_ast(r);
+    a->method.method = cache_get_str(r);
+    a->method.args = cache_get_asts(r, &a->method.argc);
+    break;
+  case A_BLOCK:
+    a->block.stmts = cache_get_asts(r, &a->block.count);
+    break;
+  case A_RETURN:
+    a->ret.value = cache_get_ast(r);
+    break;
+  case A_STRING_INTERP:
+    a->str_interp.parts = cache_get_strs(r, &n);
+    a->str_interp.exprs = cache_get_asts(r, &a->str_interp.count);
+    if (n != a->str_interp.count + 1)
+      r->ok = false;
+    break;
+  case A_STRUCT_DEF:
+    a->struct_def.name = cache_get_str(r);
+    a->struct_def.fields = cache_get_strs(r, &a->struct_def.count);
+    a->struct_def.methods = cache_get_asts(r, &a->struct_def.method_count);
+    if (cache_get_u8(r)) {
+      a->struct_def.c_types = cache_get_strs(r, &n);
+      if (n != a->struct_def.count)
+        r->ok = false;
+    }
+    break;
+  case A_STRUCT_INIT:
+    a->struct_init.name = cache_get_str(r);
+    a->struct_init.fields = cache_get_strs(r, &a->struct_init.count);
+    a->struct_init.values = cache_get_asts(r, &n);
+    if (n != a->struct_init.count)
+      r->ok = false;
+    break;
+  case A_MATCH:
+    a->match.value = cache_get_ast(r);
+    a->match.patterns = cache_get_asts(r, &a->match.case_count);
+    a->match.bodies = cache_get_asts(r, &n);
+    if (n != a->match.case_count)
+      r->ok = false;
+    break;
+  case A_MEMBER:
+    a->member.obj = cache_get_ast(r);
+    a->member.member = cache_get_str(r);
+    break;
+  case A_MEMBER_ASSIGN:
+    a->member_assign.obj = cache_get_ast(r);
+    a->member_assign.member = cache_get_str(r);
+    a->member_assign.value = cache_get_ast(r);
+    break;
+  case A_ASSIGN_UNPACK:
+    a->assign_unpack.names = cache_get_strs(r, &a->assign_unpack.count);
+    a->assign_unpack.value = cache_get_ast(r);
+    a->assign_unpack.is_const = cache_get_u8(r) != 0;
+    break;
+  case A_INCREMENT:
+  case A_DECREMENT:
+    a->increment.name = cache_get_str(r);
+    a->increment.is_post = cache_get_u8(r) != 0;
+    break;
+  case A_DEREF:
+    a->deref.ptr_expr = cache_get_ast(r);
+    break;
+  case A_SLICE:
+    a->slice.obj = cache_get_ast(r);
+    a->slice.begin = cache_get_ast(r);
+    a->slice.end = cache_get_ast(r);
+    break;
+  case A_COMPOUND_ASSIGN:
+    a->compound_assign.name = cache_get_str(r);
+    a->compound_assign.op = (char)cache_get_u8(r);
+    break;
+  case A_ADDROF:
+    a->addrof.var_name = cache_get_str(r);
+    break;
+  case A_UNWRAP:
+    a->unwrap.expr = cache_get_ast(r);
+    break;
+  case A_IMPORT:
+    a->import.path = cache_get_str(r);
+    a->import.lazy = cache_get_u8(r) != 0;
+    break;
+  case A_LINK:
+    a->link.path = cache_get_str(r);
+    break;
+  case A_EXTERN:
+    a->extern_decl.name = cache_get_str(r);
+    a->extern_decl.c_name = cache_get_str(r);
+    a->extern_decl.param_count = cache_get_u32(r);
+    if (a->extern_decl.param_count > 16) {
+      r->ok = false;
+      break;
+    }
+    a->extern_decl.param_types =
+        xmalloc(sizeof(FFIType) * (a->extern_decl.param_count + 1));
+    a->extern_decl.param_structs =
+        xmalloc(sizeof(char *) * (a->extern_decl.param_count + 1));
+    for (size_t i = 0; i < a->extern_decl.param_count; i++) {
+      a->extern_decl.param_types[i] = (FFIType)cache_get_u8(r);
+      a->extern_decl.param_structs[i] = cache_get_str(r);
+    }
+    a->extern_decl.return_type = (FFIType)cache_get_u8(r);
+    a->extern_decl.return_struct = cache_get_str(r);
+    a->extern_decl.is_callback = cache_get_u8(r) != 0;
+    a->extern_decl.retained = cache_get_u8(r) != 0;
+    break;
+  case A_BREAK:
+  case A_CONTINUE:
+    break;
+  }
+  return r->ok ? a : NULL;
+}
+
+char *map_file(const char *path, size_t *size) {
+#ifndef _WIN32
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  char *data = NULL;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                fd, 0);
+    if (data == MAP_FAILED)
+      data = NULL;
+    else
+      *size = (size_t)st.st_size;
+  }
+  close(fd);
+  return data;
+#else
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return NULL;
+  fseek(f, 0, SEEK_END);
+  long n = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *data = n > 0 ? malloc((size_t)n) : NULL;
+  if (data && fread(data, 1, (size_t)n, f) != (size_t)n) {
+    free(data);
+    data = NULL;
+  }
+  fclose(f);
+  *size = (size_t)n;
+  return data;
+#endif
+}
+
+void unmap_file(char *data, size_t size) {
+#ifndef _WIN32
+  munmap(data, size);
+#else
+  (void)size;
+  free(data);
+#endif
+}
+
+bool module_cache_load(Module *m, uint64_t key) {
+  char *path = module_cache_path(m->filename, false);
+  if (!path)
+    return false;
+  CacheReader r = {NULL, 0, 0, m->filename, true};
+  r.data = map_file(path, &r.size);
+  free(path);
+  if (!r.data)
+    return false;
+
+  char magic[4];
+  uint64_t k = 0;
+  cache_get(&r, magic, 4);
+  size_t version = cache_get_u32(&r);
+  cache_get(&r, &k, sizeof(k));
+  if (r.ok && !memcmp(magic, "AOXC", 4) && version == AOXC_VERSION &&
+      k == key) {
+    m->stmts = cache_get_asts(&r, &m->count);
+    m->capacity = m->count + 1;
+    for (size_t i = 0; r.ok && i < m->count; i++) {
+      if (!m->stmts[i])
+        r.ok = false;
+    }
+  } else {
+    r.ok = false;
+  }
+  if (!r.ok || r.pos != r.size) {
+    unmap_file(r.data, r.size);
+    m->stmts = NULL;
+    m->count = m->capacity = 0;
+    return false;
+  }
+  return true;
+}
+
+typedef struct {
+  const char *path;
+  char *data;
+  size_t size;
+} BundledModule;
+
+BundledModule *bundled_modules = NULL;
+size_t bundled_module_count = 0;
+
+bool bundle_module_load(Module *m) {
+  for (size_t i = 0; i < bundled_module_count; i++) {
+    BundledModule *bm = &bundled_modules[i];
+    if (strcmp(bm->path, m->filename))
+      continue;
+    CacheReader r = {bm->data, 0, bm->size, m->filename, true};
+    m->stmts = cache_get_asts(&r, &m->count);
+    m->capacity = m->count + 1;
+    for (size_t j = 0; r.ok && j < m->count; j++) {
+      if (!m->stmts[j])
+        r.ok = false;
+    }
+    if (r.ok && r.pos == r.size)
+      return true;
+    fprintf(stderr, "%s:1:1: error: bundled module is corrupt\n", m->filename);
+    m->stmts = NULL;
+    m->count = m->capacity = 0;
+    return true;
+  }
+  return false;
+}
+
+/* The global names a module's own top-level statements bind, gathered
+   once at parse time so lazy imports can be matched without running or
+   analysing the module. */
+void module_add_export(Module *m, size_t *cap, char *name) {
+  if (m->export_count >= *cap) {
+    *cap = *cap ? *cap * 2 : 16;
+    char **grown = xmalloc(sizeof(char *) * *cap);
+    if (m->export_count)
+      memcpy(grown, m->exports, sizeof(char *) * m->export_count);
+    m->exports = grown;
+  }
+  m->exports[m->export_count++] = name;
+}
+
+void module_collect_exports(Module *m) {
+  size_t cap = 0;
+  for (size_t i = 0; i < m->count; i++) {
+    AST *s = m->stmts[i];
+    if (s->type == A_ASSIGN)
+      module_add_export(m, &cap, s->assign.name);
+    else if (s->type == A_STRUCT_DEF)
+      module_add_export(m, &cap, s->struct_def.name);
+    else if (s->type == A_EXTERN && !s->extern_decl.is_callback)
+      module_add_export(m, &cap, s->extern_decl.name);
+    else if (s->type == A_ASSIGN_UNPACK) {
+      for (size_t j = 0; j < s->assign_unpack.count; j++)
+        module_add_export(m, &cap, s->assign_unpack.names[j]);
+    }
+  }
+}
+
+Module *module_parse(const char *filename) {
+  Module *m = xmalloc(sizeof(Module));
+  memset(m, 0, sizeof(Module));
+  m->filename = xstrdup(filename);
+
+  char *content = NULL;
+  if (!bundle_module_load(m)) {
+    const char *embedded = embedded_source(filename);
+    content = embedded ? xstrdup(embedded) : read_file_text(filename);
+    if (!content) {
+      fprintf(stderr, "%s:1:1: error: could not open file\n", filename);
+      return NULL;
+    }
+  }
+
+  uint64_t key =
+      content && module_cache_enabled ? module_cache_key(content) : 0;
+  if (content && (!module_cache_enabled || !module_cache_load(m, key))) {
+    src = content;
+    src_start = content;
+    current_loc.filename = m->filename;
+    current_loc.line = 1;
+    current_loc.column = 1;
+    errors_occurred = false;
+
+    bool failed = false;
+    next_token();
+    while (tok.type != T_EOF) {
+      if (tok.type == T_ERROR) {
+        failed = true;
+        next_token();
+        continue;
+      }
+
+      AST *stmt = parse_toplevel(m);
+      if (errors_occurred) {
+        failed = true;
+        errors_occurred = false;
+        while (tok.type != T_SEMI && tok.type != T_EOF)
+          next_token();
+        if (tok.type == T_SEMI)
+          next_token();
+        continue;
+      }
+      if (stmt)
+        module_add_stmt(m, stmt);
+
+      if (tok.type == T_SEMI)
+        next_token();
+    }
+    if (module_cache_enabled && !failed)
+      module_cache_store(m, key);
+  }
+
+  size_t n_imports = 0, n_externs = 0;
+  for (size_t i = 0; i < m->count; i++) {
+    if (m->stmts[i]->type == A_IMPORT)
+      n_imports++;
+    else if (m->stmts[i]->type == A_EXTERN)
+      n_externs++;
+  }
+  m->imports = xmalloc(sizeof(AST *) * (n_imports + 1));
+  m->externs = xmalloc(sizeof(AST *) * (n_externs + 1));
+  for (size_t i = 0; i < m->count; i++) {
+    if (m->stmts[i]->type == A_IMPORT)
+      m->imports[m->import_count++] = m->stmts[i];
+    else if (m->stmts[i]->type == A_EXTERN)
+      m->externs[m->extern_count++] = m->stmts[i];
+  }
+  module_collect_exports(m);
+
+  if (modules_count >= modules_capacity) {
+    modules_capacity = modules_capacity == 0 ? 8 : modules_capacity * 2;
+    modules = realloc(modules, sizeof(Module *) * modules_capacity);
+  }
+  modules[modules_count++] = m;
+  return m;
+}
+
+Module *module_load(const char *filename);
+
+/* Parses a module without loading its imports. */
+Module *module_load_shallow(const char *filename) {
+  Module *m = NULL;
+  if (is_file_imported(filename, &m))
+    return m;
+  mark_file_imported(filename, NULL);
+  m = module_parse(filename);
+  if (m)
+    mark_file_imported(filename, m);
+  return m;
+}
+
+void module_load_imports(Module *m) {
+  if (m->imports_loaded)
+    return;
+  m->imports_loaded = true;
+  for (size_t i = 0; i < m->import_count; i++) {
+    AST *imp = m->imports[i];
+    if (imp->import.lazy)
+      continue;
+    char *resolved_path = resolve_import_path(imp->import.path, m->filename);
+    if (!resolved_path) {
+      error_at(imp->loc, "could not find import file: %s", imp->import.path);
+      continue;
+    }
+    imp->import.module = module_load(resolved_path);
+  }
+}
+
+Module *module_load(const char *filename) {
+  Module *m = module_load_shallow(filename);
+  if (m)
+    module_load_imports(m);
+  return m;
+}
+
+AST *find_extern_decl(const char *name) {
+  for (size_t i = modules_count; i-- > 0;) {
+    Module *m = modules[i];
+    for (size_t j = 0; j < m->extern_count; j++) {
+      if (!strcmp(m->externs[j]->extern_decl.name, name))
+        return m->externs[j];
+    }
+  }
+  return NULL;
+}
+
+typedef struct {
+  bool unwrapped;
+  bool failed;
+} UnwrapCheck;
+
+void check_unwrap_visit(AST **slot, void *ctx) {
+  UnwrapCheck *uc = ctx;
+  AST *a = *slot;
+  bool unwrapped = uc->unwrapped;
+
+  if (a->type == A_CALL && a->call.fn->type == A_VAR) {
+    AST *decl = find_extern_decl(a->call.fn->name);
+    ExternFunc *ext = decl ? NULL : find_extern(a->call.fn->name);
+    if ((decl && decl->extern_decl.return_type == FFI_OPTION_PTR) ||
+        (ext && ext->return_type == FFI_OPTION_PTR)) {
+      a->call.ptr_return = true;
+      if (!unwrapped) {
+        error_at(a->loc,
+                 "call to '%s' returns Option<ptr> and requires '?' unwrap "
+                 "operator",
+                 a->call.fn->name);
+        uc->failed = true;
+      }
+    }
+  }
+
+  uc->unwrapped = a->type == A_UNWRAP;
+  ast_visit_children(a, check_unwrap_visit, uc);
+  uc->unwrapped = unwrapped;
+}
+
+bool check_extern_unwraps(AST *stmt) {
+  UnwrapCheck uc = {false, false};
+  AST *root = stmt;
+  check_unwrap_visit(&root, &uc);
+  return !uc.failed;
+}
+
+typedef struct TypeScope {
+  char **names;
+  TypeAnn *types;
+  size_t count;
+  size_t capacity;
+  struct TypeScope *parent;
+} TypeScope;
+
+typedef struct {
+  TypeScope *scope;
+  AST *lambda;
+  bool typed;
+  bool failed;
+} TypeCtx;
+
+typedef struct {
+  char *name;
+  AST *lambda;
+} TypedFunc;
+
+TypedFunc *typed_funcs = NULL;
+size_t typed_funcs_count = 0;
+size_t typed_funcs_capacity = 0;
+
+void type_scope_add(TypeScope *sc, char *name, TypeAnn t) {
+  if (sc->count >= sc->capacity) {
+    sc->capacity = sc->capacity == 0 ? 8 : sc->capacity * 2;
+    sc->names = realloc(sc->names, sizeof(char *) * sc->capacity);
+    sc->types = realloc(sc->types, sizeof(TypeAnn) * sc->capacity);
+  }
+  sc->names[sc->count] = name;
+  sc->types[sc->count] = t;
+  sc->count++;
+}
+
+bool type_scope_find(TypeScope *sc, const char *name, TypeAnn *out) {
+  for (; sc; sc = sc->parent) {
+    for (size_t i = 0; i < sc->count; i++) {
+      if (!strcmp(sc->names[i], name)) {
+        *out = sc->types[i];
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+TypeAnn type_scope_lookup(TypeScope *sc, const char *name) {
+  TypeAnn t = TY_ANY;
+  type_scope_find(sc, name, &t);
+  return t;
+}
+
+TypedFunc *find_typed_func(const char *name) {
+  for (size_t i = typed_funcs_count; i-- > 0;) {
+    if (!strcmp(typed_funcs[i].name, name))
+      return &typed_funcs[i];
+  }
+  return NULL;
+}
+
+bool type_compatible(TypeAnn declared, TypeAnn actual) {
+  return declared == TY_ANY || actual == TY_ANY || declared == actual ||
+         (declared == TY_DOUBLE && actual == TY_INT);
+}
+
+bool type_is_numeric(TypeAnn t) { return t == TY_INT || t == TY_DOUBLE; }
+
+/* Names declared in a typed lambda's own scope live in its frame slots. */
+size_t type_scope_slot(TypeCtx *tc, const char *name) {
+  if (!tc->typed || !tc->lambda)
+    return 0;
+  for (size_t i = 0; i < tc->scope->count; i++) {
+    if (!strcmp(tc->scope->names[i], name))
+      return i + 1;
+  }
+  return 0;
+}
+
+TypeAnn typecheck(AST *a, TypeCtx *tc);
+
+void typecheck_visit(AST **slot, void *ctx) { typecheck(*slot, ctx); }
+
+TypeAnn typecheck_binop(AST *a, TypeCtx *tc) {
+  TypeAnn l = typecheck(a->bin.l, tc);
+  TypeAnn r = typecheck(a->bin.r, tc);
+  char op = a->bin.op;
+
+  if (l == r && type_is_numeric(l) &&
+      quicken_supports(l == TY_INT ? A_BINOP_INT : A_BINOP_DOUBLE, op))
+    a->bin.typed = l;
+
+  if (op == '&' || op == '|' || op == 'E' || op == 'N' || op == '<' ||
+      op == '>' || op == 'L' || op == 'G')
+    return TY_BOOL;
+  if (l == TY_ANY || r == TY_ANY)
+    return TY_ANY;
+
+  TypeAnn result = TY_ANY;
+  if (l == TY_INT && r == TY_INT)
+    result = TY_INT;
+  else if (type_is_numeric(l) && type_is_numeric(r) && op != '%' &&
+           op != 'l' && op != 'r')
+    result = TY_DOUBLE;
+  else if (op == '+' && l == TY_STRING && r == TY_STRING)
+    return TY_STRING;
+
+  if (result == TY_ANY) {
+    if (!tc->typed)
+      return TY_ANY;
+    error_at(a->loc, "operator '%s' cannot be applied to %s and %s",
+             binop_name(op), type_ann_name(l), type_ann_name(r));
+    tc->failed = true;
+    return TY_ANY;
+  }
+  return result;
+}
+
+void typecheck_lambda(AST *lambda, TypeCtx *outer);
+
+void collect_annotations_visit(AST **slot, void *ctx) {
+  TypeCtx *tc = ctx;
+  AST *a = *slot;
+  if (a->type == A_LAMBDA)
+    return;
+  if (a->type == A_ASSIGN && a->assign.ann != TY_ANY) {
+    TypeAnn prev;
+    bool local = false;
+    for (size_t i = 0; i < tc->scope->count; i++) {
+      if (!strcmp(tc->scope->names[i], a->assign.name)) {
+        local = true;
+        prev = tc->scope->types[i];
+      }
+    }
+    if (!local)
+      type_scope_add(tc->scope, a->assign.name, a->assign.ann);
+    else if (prev != a->assign.ann) {
+      error_at(a->loc, "'%s' already declared as %s", a->assign.name,
+               type_ann_name(prev));
+      tc->failed = true;
+    }
+  }
+  ast_visit_children(a, collect_annotations_visit, ctx);
+}
+
+void typecheck_return(TypeCtx *tc, AST *at, TypeAnn actual) {
+  TypeAnn declared = tc->lambda ? tc->lambda->lambda.return_type : TY_ANY;
+  if (!type_compatible(declared, actual)) {
+    error_at(at->loc, "function declared to return %s returns %s",
+             type_ann_name(declared), type_ann_name(actual));
+    tc->failed = true;
+  }
+}
+
+TypeAnn typecheck(AST *a, TypeCtx *tc) {
+  switch (a->type) {
+  case A_INT:
+    return TY_INT;
+  case A_DOUBLE:
+    return TY_DOUBLE;
+  case A_STRING:
+    return TY_STRING;
+  case A_BOOL:
+    return TY_BOOL;
+  case A_CHAR:
+    return TY_CHAR;
+  case A_STRING_INTERP:
+    ast_visit_children(a, typecheck_visit, tc);
+    return TY_STRING;
+  case A_LIST:
+    ast_visit_children(a, typecheck_visit, tc);
+    return TY_LIST;
+  case A_VAR:
+    a->slot = type_scope_slot(tc, a->name);
+    return type_scope_lookup(tc->scope, a->name);
+  case A_BINOP:
+    return typecheck_binop(a, tc);
+  case A_LAMBDA:
+    typecheck_lambda(a, tc);
+    return TY_ANY;
+  case A_ASSIGN: {
+    TypeAnn actual = typecheck(a->assign.value, tc);
+    TypeAnn declared = type_scope_lookup(tc->scope, a->assign.name);
+    if (a->assign.ann != TY_ANY)
+      declared = a->assign.ann;
+    if (!type_compatible(declared, actual)) {
+      error_at(a->loc, "cannot assign %s to '%s' of type %s",
+               type_ann_name(actual), a->assign.name, type_ann_name(declared));
+      tc->failed = true;
+    }
+    a->assign.check = declared == actual ? TY_ANY : declared;
+    a->slot = type_scope_slot(tc, a->assign.name);
+    return actual;
+  }
+  case A_RETURN:
+    if (a->ret.value)
+      typecheck_return(tc, a, typecheck(a->ret.value, tc));
+    return TY_ANY;
+  case A_BLOCK: {
+    TypeAnn last = TY_ANY;
+    for (size_t i = 0; i < a->block.count; i++)
+      last = typecheck(a->block.stmts[i], tc);
+    return last;
+  }
+  case A_IF: {
+    typecheck(a->ifelse.cond, tc);
+    TypeAnn t = typecheck(a->ifelse.then_block, tc);
+    TypeAnn e = a->ifelse.else_block ? typecheck(a->ifelse.else_block, tc)
+                                     : TY_ANY;
+    return t == e ? t : TY_ANY;
+  }
+  case A_CALL: {
+    typecheck(a->call.fn, tc);
+    TypeAnn *args = xmalloc(sizeof(TypeAnn) * (a->call.argc + 1));
+    for (size_t i = 0; i < a->call.argc; i++)
+      args[i] = typecheck(a->call.args[i], tc);
+    if (a->call.fn->type != A_VAR)
+      return TY_ANY;
+    TypeAnn shadow;
+    if (type_scope_find(tc->scope, a->call.fn->name, &shadow))
+      return TY_ANY;
+    TypedFunc *tf = find_typed_func(a->call.fn->name);
+    if (!tf)
+      return TY_ANY;
+    AST *target = tf->lambda;
+    if (target->lambda.param_types && a->call.argc >= target->lambda.arity) {
+      for (size_t i = 0; i < target->lambda.arity; i++) {
+        TypeAnn want = target->lambda.param_types[i];
+        if (!type_compatible(want, args[i])) {
+          error_at(a->call.args[i]->loc,
+                   "argument %zu of '%s' expects %s, got %s", i + 1,
+                   a->call.fn->name, type_ann_name(want),
+                   type_ann_name(args[i]));
+          tc->failed = true;
+        }
+      }
+    }
+    return a->call.argc >= target->lambda.arity ? target->lambda.return_type
+                                                : TY_ANY;
+  }
+  default:
+    ast_visit_children(a, typecheck_visit, tc);
+    return TY_ANY;
+  }
+}
+
+void typecheck_lambda(AST *lambda, TypeCtx *outer) {
+  TypeScope scope;
+  memset(&scope, 0, sizeof(scope));
+  scope.parent = outer ? outer->scope : NULL;
+  for (size_t i = 0; i < lambda->lambda.arity; i++) {
+    type_scope_add(&scope, lambda->lambda.params[i],
+                   lambda->lambda.param_types ? lambda->lambda.param_types[i]
+                                              : TY_ANY);
+  }
+
+  TypeCtx tc = {&scope, lambda, outer && outer->typed, false};
+  AST *body = lambda->lambda.body;
+  collect_annotations_visit(&body, &tc);
+  if (lambda->lambda.param_types || lambda->lambda.return_type != TY_ANY ||
+      scope.count > lambda->lambda.arity)
+    tc.typed = true;
+  if (tc.typed) {
+    lambda->lambda.slot_names = xmalloc(sizeof(char *) * (scope.count + 1));
+    memcpy(lambda->lambda.slot_names, scope.names,
+           sizeof(char *) * scope.count);
+    lambda->lambda.slot_count = scope.count;
+  }
+  TypeAnn result = typecheck(body, &tc);
+  typecheck_return(&tc, body, result);
+
+  if (outer && tc.failed)
+    outer->failed = true;
+  free(scope.names);
+  free(scope.types);
+}
+
+bool typecheck_stmt(AST *stmt) {
+  TypeScope scope;
+  memset(&scope, 0, sizeof(scope));
+  TypeCtx tc = {&scope, NULL,
+                stmt->type == A_ASSIGN && stmt->assign.ann != TY_ANY, false};
+  typecheck(stmt, &tc);
+  free(scope.names);
+  free(scope.types);
+
+  if (!tc.failed && stmt->type == A_ASSIGN &&
+      stmt->assign.value->type == A_LAMBDA &&
+      (stmt->assign.value->lambda.param_types ||
+       stmt->assign.value->lambda.return_type != TY_ANY)) {
+    if (typed_funcs_count >= typed_funcs_capacity) {
+      typed_funcs_capacity =
+          typed_funcs_capacity == 0 ? 16 : typed_funcs_capacity * 2;
+      typed_funcs =
+          realloc(typed_funcs, sizeof(TypedFunc) * typed_funcs_capacity);
+    }
+    typed_funcs[typed_funcs_count].name = stmt->assign.name;
+    typed_funcs[typed_funcs_count].lambda = stmt->assign.value;
+    typed_funcs_count++;
+  }
+  return !tc.failed;
+}
+
+bool ast_is_literal(AST *a) {
+  return a->type == A_INT || a->type == A_DOUBLE || a->type == A_STRING ||
+         a->type == A_BOOL || a->type == A_CHAR;
+}
+
+AST *literal_from_value(Value v, SourceLoc loc) {
+  AST *lit;
+  switch (v.type) {
+  case VAL_INT:
+    lit = ast_new(A_INT);
+    lit->i = v.i;
+    break;
+  case VAL_DOUBLE:
+    lit = ast_new(A_DOUBLE);
+    lit->d = v.d;
+    break;
+  case VAL_STRING:
+    lit = ast_new(A_STRING);
+    lit->s = v.s;
+    break;
+  case VAL_BOOL:
+    lit = ast_new(A_BOOL);
+    lit->b = v.b;
+    break;
+  case VAL_CHAR:
+    lit = ast_new(A_CHAR);
+    lit->c = v.c;
+    break;
+  default:
+    return NULL;
+  }
+  lit->loc = loc;
+  return lit;
+}
+
+typedef struct {
+  char *name;
+  AST *decl;
+  AST *value;
+  size_t binders;
+} ConstGlobal;
+
+typedef struct {
+  ConstGlobal *consts;
+  size_t count;
+  size_t active;
+} FoldCtx;
+
+ConstGlobal *find_const_global(FoldCtx *fc, const char *name, size_t limit) {
+  for (size_t i = 0; i < limit; i++) {
+    if (!strcmp(fc->consts[i].name, name))
+      return &fc->consts[i];
+  }
+  return NULL;
+}
+
+void count_binder(FoldCtx *fc, const char *name) {
+  ConstGlobal *cg = find_const_global(fc, name, fc->count);
+  if (cg)
+    cg->binders++;
+}
+
+void count_binders_visit(AST **slot, void *ctx) {
+  FoldCtx *fc = ctx;
+  AST *a = *slot;
+  switch (a->type) {
+  case A_ASSIGN:
+    count_binder(fc, a->assign.name);
+    break;
+  case A_ASSIGN_UNPACK:
+    for (size_t i = 0; i < a->assign_unpack.count; i++)
+      count_binder(fc, a->assign_unpack.names[i]);
+    break;
+  case A_LAMBDA:
+    for (size_t i = 0; i < a->lambda.arity; i++)
+      count_binder(fc, a->lambda.params[i]);
+    break;
+  case A_FOR: {
+    char var_buffer[256];
+    strcpy(var_buffer, a->forloop.var);
+    char *var2 = strchr(var_buffer, ',');
+    if (var2) {
+      *var2++ = '\0';
+      while (*var2 && isspace(*var2))
+        var2++;
+      count_binder(fc, var2);
+    }
+    count_binder(fc, var_buffer);
+    break;
+  }
+  case A_INCREMENT:
+    count_binder(fc, a->increment.name);
+    break;
+  case A_DECREMENT:
+    count_binder(fc, a->decrement.name);
+    break;
+  case A_STRUCT_DEF:
+    count_binder(fc, a->struct_def.name);
+    break;
+  case A_ADDROF:
+    count_binder(fc, a->addrof.var_name);
+    break;
+  case A_EXTERN:
+    count_binder(fc, a->extern_decl.name);
+    break;
+  default:
+    break;
+  }
+  ast_visit_children(a, count_binders_visit, ctx);
+}
+
+void fold_visit(AST **slot, void *ctx) {
+  FoldCtx *fc = ctx;
+  AST *a = *slot;
+
+  if (a->type == A_VAR) {
+    ConstGlobal *cg = find_const_global(fc, a->name, fc->active);
+    if (cg && cg->value) {
+      AST *lit = ast_new(cg->value->type);
+      *lit = *cg->value;
+      lit->loc = a->loc;
+      *slot = lit;
+    }
+    return;
+  }
+
+  ast_visit_children(a, fold_visit, ctx);
+
+  if (a->type == A_BINOP && ast_is_literal(a->bin.l) &&
+      ast_is_literal(a->bin.r)) {
+    AST *lit = literal_from_value(eval(a, global_env), a->loc);
+    if (lit)
+      *slot = lit;
+  } else if (a->type == A_STRING_INTERP) {
+    for (size_t i = 0; i < a->str_interp.count; i++) {
+      if (!ast_is_literal(a->str_interp.exprs[i]))
+        return;
+    }
+    AST *lit = literal_from_value(eval(a, global_env), a->loc);
+    if (lit)
+      *slot = lit;
+  } else if (a->type == A_IF && ast_is_literal(a->ifelse.cond)) {
+    if (value_is_truthy(eval(a->ifelse.cond, global_env)))
+      *slot = a->ifelse.then_block;
+    else if (a->ifelse.else_block)
+      *slot = a->ifelse.else_block;
+    else
+      *slot = ast_new(A_BLOCK);
+  }
+}
+
+/* Collects the owning slot of every top-level statement, so folding can
+   replace a statement in its module. */
+void collect_exec_order(Module *m, AST ****order, size_t *count,
+                        size_t *capacity) {
+  if (m->optimized)
+    return;
+  m->optimized = true;
+  for (size_t i = 0; i < m->count; i++) {
+    AST *stmt = m->stmts[i];
+    if (stmt->type == A_IMPORT && stmt->import.module)
+      collect_exec_order(stmt->import.module, order, count, capacity);
+    if (*count >= *capacity) {
+      *capacity = *capacity == 0 ? 64 : *capacity * 2;
+      *order = realloc(*order, sizeof(AST **) * *capacity);
+    }
+    (*order)[(*count)++] = &m->stmts[i];
+  }
+}
+
+void optimize_program(Module *root) {
+  AST ***order = NULL;
+  size_t count = 0, capacity = 0;
+  collect_exec_order(root, &order, &count, &capacity);
+
+  FoldCtx fc = {NULL, 0, 0};
+  for (size_t i = 0; i < count; i++) {
+    if ((*order[i])->type == A_ASSIGN && (*order[i])->assign.is_const)
+      fc.count++;
+  }
+  fc.consts = malloc(sizeof(ConstGlobal) * (fc.count + 1));
+  fc.count = 0;
+  for (size_t i = 0; i < count; i++) {
+    if ((*order[i])->type == A_ASSIGN && (*order[i])->assign.is_const) {
+      ConstGlobal *cg = &fc.consts[fc.count++];
+      cg->name = (*order[i])->assign.name;
+      cg->decl = *order[i];
+      cg->value = NULL;
+      cg->binders = 0;
+    }
+  }
+  for (size_t i = 0; i < modules_count; i++) {
+    for (size_t j = 0; j < modules[i]->count; j++)
+      count_binders_visit(&modules[i]->stmts[j], &fc);
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    fold_visit(order[i], &fc);
+    AST *stmt = *order[i];
+    if (fc.active < fc.count && fc.consts[fc.active].decl == stmt) {
+      ConstGlobal *cg = &fc.consts[fc.active++];
+      if (cg->binders == 1 && ast_is_literal(stmt->assign.value))
+        cg->value = stmt->assign.value;
+    }
+  }
+
+  free(fc.consts);
+  free(order);
+}
+
+/* Every statement is checked so all static errors are reported, but a module
+   (or any module it imports) with one of them is never executed. */
+bool module_analyze(Module *m) {
+  if (m->analyzed)
+    return m->well_typed;
+  m->analyzed = true;
+  m->well_typed = true;
+
+  for (size_t i = 0; i < m->import_count; i++) {
+    if (m->imports[i]->import.module &&
+        !module_analyze(m->imports[i]->import.module))
+      m->well_typed = false;
+  }
+
+  for (size_t i = 0; i < m->count; i++) {
+    if (!check_extern_unwraps(m->stmts[i]) || !typecheck_stmt(m->stmts[i]))
+      m->well_typed = false;
+  }
+  return m->well_typed;
+}
+
+void module_exec_stmt(AST *stmt) {
+  if (stmt->type == A_ASSIGN_UNPACK) {
+    Value rhs = eval(stmt->assign_unpack.value, global_env);
+    if (rhs.type != VAL_TUPLE && rhs.type != VAL_LIST) {
+      error_at(stmt->loc, "cannot unpack non-sequence");
+      return;
+    }
+    size_t count = (rhs.type == VAL_TUPLE) ? rhs.tuple->size : rhs.list->size;
+    Value *items = (rhs.type == VAL_TUPLE) ? rhs.tuple->items : rhs.list->items;
+    if (count != stmt->assign_unpack.count) {
+      error_at(stmt->loc, "unpacking count mismatch");
+      return;
+    }
+    for (size_t i = 0; i < count; i++) {
+      env_set(global_env, stmt->assign_unpack.names[i], items[i],
+              stmt->assign_unpack.is_const);
+    }
+    return;
+  }
+  eval(stmt, global_env);
+}
+
+void module_exec(Module *m) {
+  if (!m || m->executed)
+    return;
+  m->executed = true;
+  for (size_t i = 0; i < m->count; i++)
+    module_exec_stmt(m->stmts[i]);
+}
+
+typedef struct {
+  AST *decl;
+  Module *module;
+  bool done;
+} LazyImport;
+
+LazyImport *lazy_imports = NULL;
+size_t lazy_import_count = 0;
+size_t lazy_import_capacity = 0;
+
+void lazy_import_add(AST *decl) {
+  for (size_t i = 0; i < lazy_import_count; i++) {
+    if (lazy_imports[i].decl == decl)
+      return;
+  }
+  if (lazy_import_count >= lazy_import_capacity) {
+    lazy_import_capacity = lazy_import_capacity ? lazy_import_capacity * 2 : 8;
+    lazy_imports =
+        realloc(lazy_imports, sizeof(LazyImport) * lazy_import_capacity);
+  }
+  lazy_imports[lazy_import_count++] = (LazyImport){decl, NULL, false};
+  lazy_pending++;
+}
+
+bool module_exports(Module *m, const char *name) {
+  for (size_t i = 0; i < m->export_count; i++) {
+    if (!strcmp(m->exports[i], name))
+      return true;
+  }
+  return false;
+}
+
+/* Whether running `m` would bind `name`, either itself or through one of
+   its eager imports. Only consulted once no pending module exports the
+   name directly, since it has to load the imports to answer. */
+bool module_reexports(Module *m, const char *name) {
+  module_load_imports(m);
+  for (size_t i = 0; i < m->import_count; i++) {
+    Module *dep = m->imports[i]->import.module;
+    if (dep && !dep->executed &&
+        (module_exports(dep, name) || module_reexports(dep, name)))
+      return true;
+  }
+  return false;
+}
+
+/* Resolves a global miss for `name` in code from `file` against the lazy
+   imports that file has executed. Pending modules are parsed (or read from
+   the .aoxc cache) to get their export lists, but only the one that binds
+   the name is analysed and run. */
+bool lazy_import_resolve(const char *name, const char *file) {
+  const char *saved_src = src, *saved_start = src_start;
+  Token saved_tok = tok;
+  SourceLoc saved_loc = current_loc;
+  bool saved_errors = errors_occurred;
+  LazyImport *match = NULL;
+
+  for (int pass = 0; pass < 2 && !match; pass++) {
+    for (size_t i = 0; i < lazy_import_count && !match; i++) {
+      LazyImport *li = &lazy_imports[i];
+      if (li->done || !file || strcmp(li->decl->loc.filename, file))
+        continue;
+      if (!li->module) {
+        AST *decl = li->decl;
+        char *path =
+            resolve_import_path(decl->import.path, decl->loc.filename);
+        if (path)
+          li->module = module_load_shallow(path);
+        else
+          error_at(decl->loc, "could not find import file: %s",
+                   decl->import.path);
+        if (!li->module) {
+          li->done = true;
+          lazy_pending--;
+          continue;
+        }
+      }
+      if (li->module->executed) {
+        li->done = true;
+        lazy_pending--;
+        continue;
+      }
+      if (pass == 0 ? module_exports(li->module, name)
+                    : module_reexports(li->module, name))
+        match = li;
+    }
+  }
+
+  if (match) {
+    match->done = true;
+    lazy_pending--;
+    match->decl->import.module = match->module;
+    module_load_imports(match->module);
+    if (!module_analyze(match->module))
+      exit(1);
+    optimize_program(match->module);
+    bool saved_import_mode = import_mode;
+    import_mode = true;
+    module_exec(match->module);
+    import_mode = saved_import_mode;
+  }
+
+  src = saved_src;
+  src_start = saved_start;
+  tok = saved_tok;
+  current_loc = saved_loc;
+  errors_occurred = saved_errors;
+  return match != NULL;
+}
+
+void run_file(const char *filename) {
+  Module *m = module_load(filename);
+  if (!m || !module_analyze(m))
+    return;
+  optimize_program(m);
+  module_exec(m);
+}
+
+typedef struct {
+  const char *name;
+  Value (*fn)(Value *, size_t);
+} BuiltinEntry;
+
+const BuiltinEntry builtin_table[] = {
+    {"print", builtin_print},
+    {"type", builtin_type},
+    {"len", builtin_len},
+    {"range", builtin_range},
+    {"tuple", builtin_tuple},
+    {"help", builtin_help},
+    {"assert", builtin_assert},
+    {"exit", builtin_exit},
+    {"test", builtin_test},
+    {"int", builtin_int},
+    {"double", builtin_double},
+    {"str", builtin_str},
+    {"bool", builtin_bool},
+    {"is_error", builtin_is_error},
+    {"is_null", builtin_is_null},
+    {"char", builtin_char},
+    {"ptr_to_int", builtin_ptr_to_int},
+    {"int_to_ptr", builtin_int_to_ptr},
+    {"apany", builtin_any},
+    {"apply", builtin_apply},
+    {"alloc", builtin_alloc},
+    {"free", builtin_free},
+    {"_store_ptr", builtin_store_ptr},
+    {"view", builtin_view},
+    {"_extern_submit", builtin_extern_submit},
+    {"_extern_poll", builtin_extern_poll},
+    {"_extern_result", builtin_extern_result},
+    {"_extern_wait", builtin_extern_wait},
+};
+
+const char *builtin_name(Value (*fn)(Value *, size_t)) {
+  for (size_t i = 0; i < sizeof(builtin_table) / sizeof(builtin_table[0]);
+       i++) {
+    if (builtin_table[i].fn == fn)
+      return builtin_table[i].name;
+  }
+  return NULL;
+}
+
+Value (*builtin_lookup(const char *name))(Value *, size_t) {
+  for (size_t i = 0; i < sizeof(builtin_table) / sizeof(builtin_table[0]);
+       i++) {
+    if (!strcmp(builtin_table[i].name, name))
+      return builtin_table[i].fn;
+  }
+  return NULL;
+}
+
+void runtime_init(void) {
+  global_arena = arena_new(65536);
+  global_env = env_new();
+  init_import_tracker();
+
+  for (size_t i = 0; i < sizeof(builtin_table) / sizeof(builtin_table[0]);
+       i++) {
+    env_set(global_env, builtin_table[i].name,
+            v_func(make_builtin(builtin_table[i].fn)), true);
+  }
+}
+
+#define AOXS_VERSION 5
+
+enum { SNAP_FN_BUILTIN, SNAP_FN_EXTERN, SNAP_FN_PARTIAL, SNAP_FN_SCRIPT };
+
+typedef struct {
+  CacheWriter w;
+  const void **keys;
+  size_t *ids;
+  size_t count;
+  size_t capacity;
+  const char *global;
+  const char *ptr_global;
+} SnapWriter;
+
+typedef struct {
+  CacheReader r;
+  void **objs;
+  size_t count;
+  size_t capacity;
+} SnapReader;
+
+void snap_ids_grow(SnapWriter *s) {
+  size_t old_cap = s->capacity;
+  const void **old_keys = s->keys;
+  size_t *old_ids = s->ids;
+  s->capacity = old_cap ? old_cap * 2 : 256;
+  s->keys = calloc(s->capacity, sizeof(void *));
+  s->ids = calloc(s->capacity, sizeof(size_t));
+  for (size_t i = 0; i < old_cap; i++) {
+    if (!old_keys[i])
+      continue;
+    size_t h = ((uintptr_t)old_keys[i] >> 4) & (s->capacity - 1);
+    while (s->keys[h])
+      h = (h + 1) & (s->capacity - 1);
+    s->keys[h] = old_keys[i];
+    s->ids[h] = old_ids[i];
+  }
+  free(old_keys);
+  free(old_ids);
+}
+
+/* Writes an object reference; returns true when the object is new and its
+   body has to follow. */
+bool snap_put_ref(SnapWriter *s, const void *p) {
+  if (!p) {
+    cache_put_u32(&s->w, 0xffffffffu);
+    return false;
+  }
+  if ((s->count + 1) * 2 > s->capacity)
+    snap_ids_grow(s);
+  size_t h = ((uintptr_t)p >> 4) & (s->capacity - 1);
+  while (s->keys[h]) {
+    if (s->keys[h] == p) {
+      cache_put_u32(&s->w, s->ids[h]);
+      return false;
+    }
+    h = (h + 1) & (s->capacity - 1);
+  }
+  s->keys[h] = p;
+  s->ids[h] = s->count;
+  cache_put_u32(&s->w, s->count++);
+  return true;
+}
+
+void snap_put_value(SnapWriter *s, Value v);
+
+void snap_put_env(SnapWriter *s, Env *e) {
+  if (!snap_put_ref(s, e))
+    return;
+  cache_put_str(&s->w, e->name);
+  cache_put_u8(&s->w, e->is_const);
+  snap_put_env(s, e->ref);
+  if (!e->ref)
+    snap_put_value(s, e->value_ptr ? *e->value_ptr : e->value);
+}
+
+void snap_put_function(SnapWriter *s, Function *f) {
+  if (!snap_put_ref(s, f))
+    return;
+  if (f->is_builtin) {
+    cache_put_u8(&s->w, SNAP_FN_BUILTIN);
+    cache_put_str(&s->w, builtin_name(f->builtin));
+    return;
+  }
+  if (f->target) {
+    cache_put_u8(&s->w, SNAP_FN_PARTIAL);
+    cache_put_u32(&s->w, f->arity);
+    snap_put_function(s, f->target);
+    cache_put_u32(&s->w, f->bound_count);
+    for (size_t i = 0; i < f->bound_count; i++)
+      snap_put_value(s, f->bound[i]);
+    return;
+  }
+  if (!f->lambda) {
+    ExternFunc *ext = find_extern_fn(f);
+    cache_put_u8(&s->w, SNAP_FN_EXTERN);
+    cache_put_u32(&s->w, f->arity);
+    cache_put_str(&s->w, ext ? ext->name : NULL);
+    return;
+  }
+  cache_put_u8(&s->w, SNAP_FN_SCRIPT);
+  cache_put_u8(&s->w, f->reuse_frame);
+  if (snap_put_ref(s, f->lambda)) {
+    cache_put_str(&s->w, f->lambda->loc.filename);
+    cache_put_ast(&s->w, f->lambda);
+  }
+  for (Env *e = f->closure_env; e && e != global_env; e = e->next) {
+    cache_put_u8(&s->w, 1);
+    snap_put_env(s, e);
+  }
+  cache_put_u8(&s->w, 0);
+}
+
+void snap_put_value(SnapWriter *s, Value v) {
+  if (v.type == VAL_PTR && v.ptr && !s->ptr_global)
+    s->ptr_global = s->global;
+  cache_put_u8(&s->w, v.type);
+  switch (v.type) {
+  case VAL_INT:
+    cache_put(&s->w, &v.i, sizeof(v.i));
+    break;
+  case VAL_DOUBLE:
+    cache_put(&s->w, &v.d, sizeof(v.d));
+    break;
+  case VAL_STRING:
+  case VAL_ERROR:
+    cache_put_str(&s->w, v.s);
+    break;
+  case VAL_BOOL:
+    cache_put_u8(&s->w, v.b);
+    break;
+  case VAL_CHAR:
+    cache_put_u8(&s->w, (unsigned char)v.c);
+    break;
+  case VAL_NULL:
+    break;
+  case VAL_PTR:
+    cache_put_u8(&s->w, v.ptr_info.ptr_type);
+    break;
+  case VAL_ANY:
+    cache_put_u8(&s->w, v.any_val != NULL);
+    if (v.any_val)
+      snap_put_value(s, *v.any_val);
+    break;
+  case VAL_FUNC:
+    snap_put_function(s, v.fn);
+    break;
+  case VAL_LIST:
+    if (snap_put_ref(s, v.list)) {
+      cache_put_u32(&s->w, v.list->size);
+      for (size_t i = 0; i < v.list->size; i++)
+        snap_put_value(s, v.list->items[i]);
+    }
+    break;
+  case VAL_TUPLE:
+    if (snap_put_ref(s, v.tuple)) {
+      cache_put_u32(&s->w, v.tuple->size);
+      for (size_t i = 0; i < v.tuple->size; i++)
+        snap_put_value(s, v.tuple->items[i]);
     }
-
-    if (tok.type == T_IDENT) {
-      char name[256];
-      strcpy(name, tok.text);
-      next_token();
-      if (tok.type == T_LP) {
-        next_token();
-        char **params = xmalloc(sizeof(char *) * 16);
-        size_t n = 0;
-        while (tok.type == T_IDENT) {
-          params[n++] = xstrdup(tok.text);
-          next_token();
-          if (tok.type == T_LP) {
-            int depth = 1;
-            next_token();
-            while (depth > 0 && tok.type != T_EOF) {
-              if (tok.type == T_IDENT && depth == 1) {
-                params[n++] = xstrdup(tok.text);
-              }
-              next_token();
-              if (tok.type == T_LP)
-                depth++;
-              else if (tok.type == T_RP)
-                depth--;
-            }
-          }
-          if (tok.type == T_COMMA) {
-            next_token();
-          } else if (tok.type == T_RP) {
-            break;
-          }
-        }
-        if (tok.type == T_RP) {
-          next_token();
-          if (tok.type == T_ASSIGN) {
-            next_token();
-            AST *body = parse_expr();
-            if (!errors_occurred) {
-              AST *lambda = ast_new(A_LAMBDA);
-              lambda->lambda.params = params;
-              bool is_variadic = false;
-              for (size_t i = 0; i < n; i++) {
-                if (params[i][0] == '$') {
-                  is_variadic = true;
-                  break;
-                }
-              }
-              lambda->lambda.arity = n;
-              lambda->lambda.body = body;
-              Value fn_val = eval(lambda, global_env);
-              fn_val.fn->is_variadic = is_variadic;
-              env_set(global_env, name, fn_val, is_const);
-            }
-            continue;
-          }
-        }
-        src = line;
-        current_loc.column = 1;
-        next_token();
-      } else if (tok.type == T_ASSIGN) {
-        next_token();
-        AST *expr = parse_expr();
-        if (!errors_occurred) {
-          Value v = eval(expr, global_env);
-          env_set(global_env, name, v, is_const);
-        }
-        continue;
+    break;
+  case VAL_STRUCT_DEF:
+    if (snap_put_ref(s, v.struct_def)) {
+      StructDef *def = v.struct_def;
+      cache_put_str(&s->w, def->name);
+      cache_put_strs(&s->w, def->fields, def->field_count);
+      cache_put_u32(&s->w, def->layout ? def->layout->index + 1 : 0);
+      cache_put_u32(&s->w, def->method_count);
+      for (size_t i = 0; i < def->method_count; i++) {
+        cache_put_str(&s->w, def->methods[i] ? def->method_names[i] : NULL);
+        snap_put_function(s, def->methods[i]);
       }
     }
+    break;
+  case VAL_STRUCT:
+    if (snap_put_ref(s, v.struct_val)) {
+      Value def;
+      memset(&def, 0, sizeof(def));
+      def.type = VAL_STRUCT_DEF;
+      def.struct_def = v.struct_val->def;
+      snap_put_value(s, def);
+      for (size_t i = 0; i < v.struct_val->def->field_count; i++)
+        snap_put_value(s, v.struct_val->values[i]);
+    }
+    break;
+  }
+}
 
-    src = line;
-    current_loc.column = 1;
-    next_token();
-    AST *e = parse_stmt();
-    if (errors_occurred)
+bool snapshot_write(const char *path) {
+  SnapWriter s;
+  memset(&s, 0, sizeof(s));
+  s.w.f = fopen(path, "wb");
+  s.w.ok = true;
+  if (!s.w.f) {
+    fprintf(stderr, "Error: cannot write snapshot '%s'\n", path);
+    return false;
+  }
+  uint64_t key = module_cache_key("");
+  cache_put(&s.w, "AOXS", 4);
+  cache_put_u32(&s.w, AOXS_VERSION);
+  cache_put(&s.w, &key, sizeof(key));
+
+  cache_put_u32(&s.w, loaded_libs_count);
+  for (size_t i = 0; i < loaded_libs_count; i++)
+    cache_put_str(&s.w, loaded_libs[i].name);
+  cache_put_u32(&s.w, c_layout_count);
+  for (size_t i = 0; i < c_layout_count; i++) {
+    cache_put_str(&s.w, c_layouts[i]->name);
+    cache_put_strs(&s.w, c_layouts[i]->fields, c_layouts[i]->count);
+    cache_put_strs(&s.w, c_layouts[i]->type_names, c_layouts[i]->count);
+  }
+  cache_put_u32(&s.w, callback_type_count);
+  for (size_t i = 0; i < callback_type_count; i++) {
+    CallbackType *cb = callback_types[i];
+    cache_put_str(&s.w, cb->name);
+    cache_put_u32(&s.w, cb->param_count);
+    for (size_t j = 0; j < cb->param_count; j++)
+      cache_put_u8(&s.w, cb->param_types[j]);
+    cache_put_u8(&s.w, cb->return_type);
+    cache_put_u8(&s.w, cb->retained);
+  }
+  cache_put_u32(&s.w, extern_funcs_count);
+  for (size_t i = 0; i < extern_funcs_count; i++) {
+    ExternFunc *ext = &extern_funcs[i];
+    cache_put_str(&s.w, ext->name);
+    cache_put_str(&s.w, ext->c_name);
+    cache_put_u32(&s.w, ext->param_count);
+    for (size_t j = 0; j < ext->param_count; j++) {
+      cache_put_u8(&s.w, ext->param_types[j]);
+      const char *tname = ext->param_layouts[j] ? ext->param_layouts[j]->name
+                          : ext->param_callbacks[j]
+                              ? ext->param_callbacks[j]->name
+                              : NULL;
+      cache_put_str(&s.w, tname);
+    }
+    cache_put_u8(&s.w, ext->return_type);
+    cache_put_str(&s.w, ext->return_layout ? ext->return_layout->name : NULL);
+  }
+
+  size_t executed = 0;
+  for (size_t i = 0; i < modules_count; i++)
+    executed += modules[i]->executed;
+  cache_put_u32(&s.w, executed);
+  for (size_t i = 0; i < modules_count; i++) {
+    if (modules[i]->executed)
+      cache_put_str(&s.w, modules[i]->filename);
+  }
+
+  size_t count = 0;
+  for (Env *e = global_env->next; e; e = e->next)
+    count++;
+  Env **globals = malloc(sizeof(Env *) * (count + 1));
+  size_t kept = 0;
+  for (Env *e = global_env->next; e; e = e->next) {
+    if (e->value.type == VAL_FUNC && e->value.fn->is_builtin &&
+        builtin_lookup(e->name) == e->value.fn->builtin)
       continue;
+    globals[kept++] = e;
+  }
+  cache_put_u32(&s.w, kept);
+  for (size_t i = kept; i-- > 0;) {
+    cache_put_str(&s.w, globals[i]->name);
+    cache_put_u8(&s.w, globals[i]->is_const);
+    s.global = globals[i]->name;
+    snap_put_value(&s, globals[i]->value_ptr ? *globals[i]->value_ptr
+                                             : globals[i]->value);
+  }
+  free(globals);
+  free(s.keys);
+  free(s.ids);
+
+  s.w.ok = fclose(s.w.f) == 0 && s.w.ok;
+  /* Native pointers do not survive a restart, so an image holding one
+     would come back silently broken. */
+  if (s.ptr_global) {
+    fprintf(stderr,
+            "Error: cannot snapshot '%s': global '%s' holds a native "
+            "pointer\n",
+            path, s.ptr_global);
+    remove(path);
+    return false;
+  }
+  if (!s.w.ok) {
+    fprintf(stderr, "Error: cannot write snapshot '%s'\n", path);
+    remove(path);
+    return false;
+  }
+  return true;
+}
 
-    Value v = eval(e, global_env);
+/* Reads an object reference; fresh objects are allocated zeroed and
+   registered before their body is read so cycles resolve. */
+void *snap_get_ref(SnapReader *s, size_t size, bool *fresh) {
+  *fresh = false;
+  size_t id = cache_get_u32(&s->r);
+  if (!s->r.ok || id == 0xffffffffu)
+    return NULL;
+  if (id < s->count)
+    return s->objs[id];
+  if (id != s->count) {
+    s->r.ok = false;
+    return NULL;
+  }
+  if (s->count >= s->capacity) {
+    s->capacity = s->capacity ? s->capacity * 2 : 256;
+    s->objs = realloc(s->objs, sizeof(void *) * s->capacity);
+  }
+  void *p = xmalloc(size);
+  memset(p, 0, size);
+  s->objs[s->count++] = p;
+  *fresh = true;
+  return p;
+}
 
-    const char *color = value_type_color(v);
-    const char *reset = use_colors ? COLOR_RESET : "";
+size_t snap_get_count(SnapReader *s) {
+  size_t n = cache_get_u32(&s->r);
+  if (!s->r.ok || n > s->r.size - s->r.pos) {
+    s->r.ok = false;
+    return 0;
+  }
+  return n;
+}
 
-    if (v.type == VAL_INT)
-      printf("%s%lld%s\n", color, v.i, reset);
-    else if (v.type == VAL_DOUBLE)
-      printf("%s%g%s\n", color, v.d, reset);
-    else if (v.type == VAL_STRING)
-      printf("%s\"%s\"%s\n", color, v.s, reset);
-    else if (v.type == VAL_BOOL)
-      printf("%s%s%s\n", color, v.b ? "True" : "False", reset);
-    else if (v.type == VAL_ERROR)
-      printf("%sError: %s%s\n", color, v.s, reset);
-    else if (v.type == VAL_PTR)
-      printf("%s<ptr:%p>%s\n", color, v.ptr, reset);
-    else if (v.type == VAL_ANY) {
-      printf("%s<any:", color);
-      if (v.any_val)
-        print_value(*v.any_val);
-      else
-        printf("null");
-      printf(">%s\n", reset);
-    } else if (v.type == VAL_TUPLE) {
-      printf("%s(%s", color, reset);
-      for (size_t i = 0; i < v.tuple->size; i++) {
-        if (i > 0)
-          printf(", ");
-        const char *item_color = value_type_color(v.tuple->items[i]);
-        if (v.tuple->items[i].type == VAL_INT)
-          printf("%s%lld%s", item_color, v.tuple->items[i].i, reset);
-        else if (v.tuple->items[i].type == VAL_DOUBLE)
-          printf("%s%g%s", item_color, v.tuple->items[i].d, reset);
-        else if (v.tuple->items[i].type == VAL_STRING)
-          printf("%s\"%s\"%s", item_color, v.tuple->items[i].s, reset);
-        else if (v.tuple->items[i].type == VAL_PTR)
-          printf("%s<ptr:%p>%s", item_color, v.tuple->items[i].ptr, reset);
+Value snap_get_value(SnapReader *s);
+
+Env *snap_get_env(SnapReader *s) {
+  bool fresh;
+  Env *e = snap_get_ref(s, sizeof(Env), &fresh);
+  if (fresh) {
+    e->name = cache_get_str(&s->r);
+    e->is_const = cache_get_u8(&s->r) != 0;
+    e->ref = snap_get_env(s);
+    if (!e->ref)
+      e->value = snap_get_value(s);
+  }
+  return e;
+}
+
+Function *snap_get_function(SnapReader *s) {
+  bool fresh;
+  Function *f = snap_get_ref(s, sizeof(Function), &fresh);
+  if (!fresh)
+    return f;
+  switch (cache_get_u8(&s->r)) {
+  case SNAP_FN_BUILTIN: {
+    const char *name = cache_get_str(&s->r);
+    f->is_builtin = true;
+    f->builtin = name ? builtin_lookup(name) : NULL;
+    if (!f->builtin)
+      s->r.ok = false;
+    break;
+  }
+  case SNAP_FN_EXTERN: {
+    f->is_variadic = true;
+    f->arity = cache_get_u32(&s->r);
+    const char *name = cache_get_str(&s->r);
+    ExternFunc *ext = name ? find_extern(name) : NULL;
+    if (ext)
+      ext->fn = f;
+    break;
+  }
+  case SNAP_FN_PARTIAL: {
+    f->arity = cache_get_u32(&s->r);
+    f->target = snap_get_function(s);
+    f->bound_count = snap_get_count(s);
+    f->bound = xmalloc(sizeof(Value) * (f->bound_count + 1));
+    for (size_t i = 0; i < f->bound_count; i++)
+      f->bound[i] = snap_get_value(s);
+    if (!f->target || !f->target->lambda || f->arity > f->target->arity) {
+      s->r.ok = false;
+      break;
+    }
+    f->params = f->target->params + (f->target->arity - f->arity);
+    break;
+  }
+  case SNAP_FN_SCRIPT: {
+    f->reuse_frame = cache_get_u8(&s->r) != 0;
+    bool fresh_lambda;
+    AST **slot = snap_get_ref(s, sizeof(AST *), &fresh_lambda);
+    if (fresh_lambda) {
+      s->r.filename = cache_get_str(&s->r);
+      *slot = cache_get_ast(&s->r);
+      if (!*slot || (*slot)->type != A_LAMBDA) {
+        s->r.ok = false;
+        break;
       }
-      printf("%s)%s\n", color, reset);
-    } else if (v.type == VAL_LIST) {
-      printf("%s[%s", color, reset);
-      for (size_t i = 0; i < v.list->size; i++) {
-        if (i > 0)
-          printf(", ");
-        const char *item_color = value_type_color(v.list->items[i]);
-        if (v.list->items[i].type == VAL_INT)
-          printf("%s%lld%s", item_color, v.list->items[i].i, reset);
-        else if (v.list->items[i].type == VAL_DOUBLE)
-          printf("%s%g%s", item_color, v.list->items[i].d, reset);
-        else if (v.list->items[i].type == VAL_STRING)
-          printf("%s\"%s\"%s", item_color, v.list->items[i].s, reset);
-        else if (v.list->items[i].type == VAL_PTR)
-          printf("%s<ptr:%p>%s", item_color, v.list->items[i].ptr, reset);
+      lambda_prepare(*slot);
+    }
+    if (!slot || !*slot) {
+      s->r.ok = false;
+      break;
+    }
+    AST *a = *slot;
+    f->params = a->lambda.params;
+    f->arity = a->lambda.arity;
+    f->body = a->lambda.body;
+    for (size_t i = 0; i < a->lambda.arity; i++) {
+      if (a->lambda.params[i][0] == '$')
+        f->is_variadic = true;
+    }
+    f->param_types = a->lambda.param_types;
+    f->return_type = a->lambda.return_type;
+    f->lambda = a;
+
+    Env **tail = &f->closure_env;
+    while (s->r.ok && cache_get_u8(&s->r)) {
+      Env *e = snap_get_env(s);
+      if (!e) {
+        s->r.ok = false;
+        break;
       }
-      printf("%s]%s\n", color, reset);
+      Env *link = xmalloc(sizeof(Env));
+      memset(link, 0, sizeof(Env));
+      link->name = e->name;
+      link->ref = e->ref ? e->ref : e;
+      *tail = link;
+      tail = &link->next;
+    }
+    *tail = global_env;
+    break;
+  }
+  default:
+    s->r.ok = false;
+  }
+  return f;
+}
+
+StructDef *snap_get_struct_def(SnapReader *s) {
+  bool fresh;
+  StructDef *def = snap_get_ref(s, sizeof(StructDef), &fresh);
+  if (fresh) {
+    def->name = cache_get_str(&s->r);
+    def->fields = cache_get_strs(&s->r, &def->field_count);
+    size_t layout = snap_get_count(s);
+    def->layout = layout && layout <= c_layout_count ? c_layouts[layout - 1]
+                                                     : NULL;
+    def->method_count = snap_get_count(s);
+    def->method_names = xmalloc(sizeof(char *) * (def->method_count + 1));
+    def->methods = xmalloc(sizeof(Function *) * (def->method_count + 1));
+    for (size_t i = 0; i < def->method_count; i++) {
+      def->method_names[i] = cache_get_str(&s->r);
+      def->methods[i] = snap_get_function(s);
+    }
+  }
+  return def;
+}
+
+Value snap_get_value(SnapReader *s) {
+  Value v;
+  memset(&v, 0, sizeof(v));
+  v.type = (ValueType)cache_get_u8(&s->r);
+  bool fresh;
+  switch (v.type) {
+  case VAL_INT:
+    cache_get(&s->r, &v.i, sizeof(v.i));
+    break;
+  case VAL_DOUBLE:
+    cache_get(&s->r, &v.d, sizeof(v.d));
+    break;
+  case VAL_STRING:
+  case VAL_ERROR:
+    v.s = cache_get_str(&s->r);
+    break;
+  case VAL_BOOL:
+    v.b = cache_get_u8(&s->r) != 0;
+    break;
+  case VAL_CHAR:
+    v.c = (char)cache_get_u8(&s->r);
+    break;
+  case VAL_NULL:
+    break;
+  case VAL_PTR:
+    v.ptr_info.ptr_type = (FFIType)cache_get_u8(&s->r);
+    break;
+  case VAL_ANY:
+    if (cache_get_u8(&s->r)) {
+      v.any_val = xmalloc(sizeof(Value));
+      *v.any_val = snap_get_value(s);
     }
-    fflush(stdout);
+    break;
+  case VAL_FUNC:
+    v.fn = snap_get_function(s);
+    if (!v.fn)
+      s->r.ok = false;
+    break;
+  case VAL_LIST:
+    v.list = snap_get_ref(s, sizeof(List), &fresh);
+    if (fresh) {
+      v.list->size = snap_get_count(s);
+      v.list->capacity = v.list->size;
+      v.list->items = xmalloc(sizeof(Value) * (v.list->size + 1));
+      for (size_t i = 0; i < v.list->size; i++)
+        v.list->items[i] = snap_get_value(s);
+    } else if (!v.list) {
+      s->r.ok = false;
+    }
+    break;
+  case VAL_TUPLE:
+    v.tuple = snap_get_ref(s, sizeof(Tuple), &fresh);
+    if (fresh) {
+      v.tuple->size = snap_get_count(s);
+      v.tuple->items = xmalloc(sizeof(Value) * (v.tuple->size + 1));
+      for (size_t i = 0; i < v.tuple->size; i++)
+        v.tuple->items[i] = snap_get_value(s);
+    } else if (!v.tuple) {
+      s->r.ok = false;
+    }
+    break;
+  case VAL_STRUCT_DEF:
+    v.struct_def = snap_get_struct_def(s);
+    if (!v.struct_def)
+      s->r.ok = false;
+    break;
+  case VAL_STRUCT:
+    v.struct_val = snap_get_ref(s, sizeof(StructVal), &fresh);
+    if (fresh) {
+      Value def = snap_get_value(s);
+      if (def.type != VAL_STRUCT_DEF) {
+        s->r.ok = false;
+        break;
+      }
+      v.struct_val->def = def.struct_def;
+      size_t n = def.struct_def->field_count;
+      v.struct_val->values = xmalloc(sizeof(Value) * (n + 1));
+      for (size_t i = 0; i < n; i++)
+        v.struct_val->values[i] = snap_get_value(s);
+    } else if (!v.struct_val) {
+      s->r.ok = false;
+    }
+    break;
+  default:
+    s->r.ok = false;
   }
+  return s->r.ok ? v : v_null();
 }
 
-#ifndef STR1
-#define STR1(x) #x
-#define STR(x) STR1(x)
-#endif
+/* The image stays mapped: strings and names in the restored values point
+   into it. */
+bool snapshot_load(const char *path) {
+  SnapReader s;
+  memset(&s, 0, sizeof(s));
+  s.r.filename = path;
+  s.r.ok = true;
+  s.r.data = map_file(path, &s.r.size);
+  if (!s.r.data) {
+    fprintf(stderr, "Error: cannot read snapshot '%s'\n", path);
+    return false;
+  }
 
-static char *build_and_test(const char *a, const char *b) {
-  size_t la = a ? strlen(a) : 0;
-  size_t lb = b ? strlen(b) : 0;
-  size_t need = la + (la && lb ? 1 : 0) + lb + 1;
-  char *buf = malloc(need);
-  if (!buf)
-    return NULL;
-  if (la && lb)
-    snprintf(buf, need, "%s/%s", a, b);
-  else if (la)
-    snprintf(buf, need, "%s", a);
-  else
-    snprintf(buf, need, "%s", b ? b : "");
-  FILE *f = fopen(buf, "r");
-  if (f) {
-    fclose(f);
-    return buf;
+  char magic[4];
+  uint64_t key = 0;
+  cache_get(&s.r, magic, 4);
+  size_t version = cache_get_u32(&s.r);
+  cache_get(&s.r, &key, sizeof(key));
+  if (!s.r.ok || memcmp(magic, "AOXS", 4) || version != AOXS_VERSION ||
+      key != module_cache_key("")) {
+    fprintf(stderr, "Error: '%s' is not a snapshot from this aoxim build\n",
+            path);
+    unmap_file(s.r.data, s.r.size);
+    return false;
   }
-  free(buf);
-  return NULL;
-}
 
-char *force_ext(const char *name) {
-  char *ext = ".calc";
-  if (!name)
-    return NULL;
-  char *buf = malloc(sizeof(*buf) + strlen(name) + strlen(ext));
-  if (!buf)
-    return NULL;
-  strcpy(buf, name);
-  strcat(buf, ".calc");
-  return buf;
+  size_t libs = snap_get_count(&s);
+  for (size_t i = 0; s.r.ok && i < libs; i++) {
+    const char *lib = cache_get_str(&s.r);
+    if (lib)
+      load_library(lib);
+  }
+  size_t layouts = snap_get_count(&s);
+  for (size_t i = 0; s.r.ok && i < layouts; i++) {
+    const char *name = cache_get_str(&s.r);
+    size_t count, type_count;
+    char **fields = cache_get_strs(&s.r, &count);
+    char **type_names = cache_get_strs(&s.r, &type_count);
+    char err[256];
+    if (!s.r.ok || !name || count != type_count ||
+        !c_layout_define(name, fields, type_names, count, err, sizeof(err)))
+      s.r.ok = false;
+  }
+  size_t callbacks = snap_get_count(&s);
+  for (size_t i = 0; s.r.ok && i < callbacks; i++) {
+    const char *name = cache_get_str(&s.r);
+    size_t param_count = snap_get_count(&s);
+    FFIType *types = xmalloc(sizeof(FFIType) * (param_count + 1));
+    for (size_t j = 0; j < param_count; j++)
+      types[j] = (FFIType)cache_get_u8(&s.r);
+    FFIType ret = (FFIType)cache_get_u8(&s.r);
+    bool retained = cache_get_u8(&s.r) != 0;
+    char err[256];
+    CallbackType *cb =
+        s.r.ok && name ? register_callback_type(name, types, param_count,
+                                                ret, err, sizeof(err))
+                       : NULL;
+    if (cb)
+      cb->retained = retained;
+    else
+      s.r.ok = false;
+  }
+  size_t externs = snap_get_count(&s);
+  for (size_t i = 0; s.r.ok && i < externs; i++) {
+    const char *name = cache_get_str(&s.r);
+    const char *c_name = cache_get_str(&s.r);
+    size_t param_count = snap_get_count(&s);
+    FFIType *types = xmalloc(sizeof(FFIType) * (param_count + 1));
+    char **structs = xmalloc(sizeof(char *) * (param_count + 1));
+    for (size_t j = 0; j < param_count; j++) {
+      types[j] = (FFIType)cache_get_u8(&s.r);
+      structs[j] = cache_get_str(&s.r);
+    }
+    FFIType ret = (FFIType)cache_get_u8(&s.r);
+    const char *ret_struct = cache_get_str(&s.r);
+    if (s.r.ok && name && c_name)
+      register_extern(name, c_name, types, param_count, ret, structs,
+                      ret_struct);
+  }
+
+  size_t module_count = snap_get_count(&s);
+  for (size_t i = 0; s.r.ok && i < module_count; i++) {
+    char *filename = cache_get_str(&s.r);
+    if (!filename)
+      continue;
+    Module *m = xmalloc(sizeof(Module));
+    memset(m, 0, sizeof(Module));
+    m->filename = filename;
+    m->analyzed = m->well_typed = m->optimized = m->executed = true;
+    mark_file_imported(filename, m);
+  }
+
+  size_t count = snap_get_count(&s);
+  for (size_t i = 0; s.r.ok && i < count; i++) {
+    const char *name = cache_get_str(&s.r);
+    bool is_const = cache_get_u8(&s.r) != 0;
+    Value v = snap_get_value(&s);
+    if (s.r.ok && name)
+      env_set(global_env, name, v, is_const);
+  }
+  free(s.objs);
+
+  if (!s.r.ok || s.r.pos != s.r.size) {
+    fprintf(stderr, "Error: snapshot '%s' is corrupt\n", path);
+    return false;
+  }
+  return true;
 }
 
-char *resolve_import_path(const char *import_name, const char *current_file) {
-#ifdef BUILD_DIR
-  {
-    const char *build_dir = STR(BUILD_DIR);
-    if (build_dir && build_dir[0]) {
-      char *p = build_and_test(build_dir, import_name);
-      if (p)
-        return p;
+#define AOXB_VERSION 1
+#define AOXB_TRAILER "AOXBNDL1"
 
-      size_t rel_len = strlen("stdlib/") + strlen(import_name) + 1;
-      char *rel = malloc(rel_len);
-      snprintf(rel, rel_len, "stdlib/%s", import_name);
+const char *self_exe_path(const char *argv0) {
+#ifdef __linux__
+  (void)argv0;
+  return "/proc/self/exe";
+#else
+  return argv0;
+#endif
+}
 
-      char *exet = force_ext(rel);
-      if (!exet) {
-        char *p2 = build_and_test(build_dir, rel);
-        if (p2)
-          return p2;
-      } else {
-        char *p2 = build_and_test(build_dir, exet);
-        if (p2)
-          return p2;
+/* A bundle is the interpreter binary followed by the payload and a trailer
+   holding the payload offset and AOXB_TRAILER. */
+long bundle_payload_offset(FILE *f) {
+  uint64_t offset = 0;
+  char magic[8];
+  if (fseek(f, -16, SEEK_END) != 0 || fread(&offset, 1, 8, f) != 8 ||
+      fread(magic, 1, 8, f) != 8 || memcmp(magic, AOXB_TRAILER, 8))
+    return -1;
+  return (long)offset;
+}
+
+bool bundle_write(const char *input, const char *output, const char *self) {
+  Module *root = module_load(input);
+  if (!root || errors_occurred)
+    return false;
+  for (size_t i = 0; i < modules_count; i++) {
+    Module *m = modules[i];
+    for (size_t j = 0; j < m->import_count; j++) {
+      if (!m->imports[j]->import.lazy)
+        continue;
+      char *path = resolve_import_path(m->imports[j]->import.path, m->filename);
+      if (!path) {
+        error_at(m->imports[j]->loc, "could not find import file: %s",
+                 m->imports[j]->import.path);
+        continue;
       }
-      free(rel);
+      module_load(path);
+      free(path);
     }
   }
+  if (errors_occurred)
+    return false;
+
+  FILE *in = fopen(self, "rb");
+  if (!in) {
+    fprintf(stderr, "Error: could not read interpreter '%s'\n", self);
+    return false;
+  }
+  long exe_size = bundle_payload_offset(in);
+  if (exe_size < 0) {
+    fseek(in, 0, SEEK_END);
+    exe_size = ftell(in);
+  }
+  rewind(in);
+  CacheWriter w = {fopen(output, "wb"), true};
+  if (!w.f) {
+    fclose(in);
+    fprintf(stderr, "Error: could not write '%s'\n", output);
+    return false;
+  }
+  char buf[65536];
+  for (long left = exe_size; left > 0 && w.ok;) {
+    size_t chunk = left < (long)sizeof(buf) ? (size_t)left : sizeof(buf);
+    if (fread(buf, 1, chunk, in) != chunk)
+      w.ok = false;
+    cache_put(&w, buf, chunk);
+    left -= (long)chunk;
+  }
+  fclose(in);
+
+  uint64_t key = module_cache_key("");
+  cache_put(&w, "AOXB", 4);
+  cache_put_u32(&w, AOXB_VERSION);
+  cache_put(&w, &key, sizeof(key));
+  cache_put_str(&w, root->filename);
+
+  size_t lib_count = 0;
+  for (size_t i = 0; i < modules_count; i++) {
+    for (size_t j = 0; j < modules[i]->count; j++)
+      lib_count += modules[i]->stmts[j]->type == A_LINK;
+  }
+  cache_put_u32(&w, lib_count);
+  for (size_t i = 0; i < modules_count; i++) {
+    for (size_t j = 0; j < modules[i]->count; j++) {
+      if (modules[i]->stmts[j]->type == A_LINK)
+        cache_put_str(&w, modules[i]->stmts[j]->link.path);
+    }
+  }
+
+  size_t import_count = 0;
+  for (size_t i = 0; i < modules_count; i++)
+    import_count += modules[i]->import_count;
+  cache_put_u32(&w, import_count);
+  for (size_t i = 0; i < modules_count; i++) {
+    Module *m = modules[i];
+    for (size_t j = 0; j < m->import_count; j++) {
+      char *path = resolve_import_path(m->imports[j]->import.path, m->filename);
+      cache_put_str(&w, m->filename);
+      cache_put_str(&w, m->imports[j]->import.path);
+      cache_put_str(&w, path);
+      free(path);
+    }
+  }
+
+  cache_put_u32(&w, modules_count);
+  for (size_t i = 0; i < modules_count && w.ok; i++) {
+    cache_put_str(&w, modules[i]->filename);
+    long size_pos = ftell(w.f);
+    cache_put_u32(&w, 0);
+    cache_put_asts(&w, modules[i]->stmts, modules[i]->count);
+    long end = ftell(w.f);
+    if (size_pos < 0 || end < 0 || fseek(w.f, size_pos, SEEK_SET) != 0)
+      w.ok = false;
+    cache_put_u32(&w, (size_t)(end - size_pos - 4));
+    if (fseek(w.f, end, SEEK_SET) != 0)
+      w.ok = false;
+  }
+
+  uint64_t offset = (uint64_t)exe_size;
+  cache_put(&w, &offset, sizeof(offset));
+  cache_put(&w, AOXB_TRAILER, 8);
+  w.ok = fclose(w.f) == 0 && w.ok;
+  if (!w.ok) {
+    fprintf(stderr, "Error: could not write '%s'\n", output);
+    remove(output);
+    return false;
+  }
+#ifndef _WIN32
+  chmod(output, 0755);
 #endif
-  if (import_name[0] == '/') {
-    char *p = strdup(import_name);
-    if (p) {
-      FILE *f = fopen(p, "r");
-      if (f) {
-        fclose(f);
-        return p;
+  return true;
+}
+
+/* Returns the entry module when this executable carries a bundle. Imports
+   resolve through the bundled table and modules are read from the payload,
+   so nothing is probed on disk. */
+const char *bundle_attach(const char *self) {
+  FILE *f = fopen(self, "rb");
+  if (!f)
+    return NULL;
+  long offset = bundle_payload_offset(f);
+  fclose(f);
+  if (offset < 0)
+    return NULL;
+
+  size_t size = 0;
+  char *data = map_file(self, &size);
+  if (!data || size < (size_t)offset + 16) {
+    fprintf(stderr, "Error: could not read bundle from '%s'\n", self);
+    exit(1);
+  }
+  CacheReader r = {data + offset, 0, size - (size_t)offset - 16, self, true};
+  char magic[4];
+  uint64_t key = 0;
+  cache_get(&r, magic, 4);
+  size_t version = cache_get_u32(&r);
+  cache_get(&r, &key, sizeof(key));
+  const char *entry = cache_get_str(&r);
+
+  if (r.ok && !memcmp(magic, "AOXB", 4) && version == AOXB_VERSION &&
+      key == module_cache_key("")) {
+    size_t lib_count = cache_get_u32(&r);
+    for (size_t i = 0; r.ok && i < lib_count; i++) {
+      const char *lib = cache_get_str(&r);
+      if (lib)
+        load_library(lib);
+    }
+
+    size_t import_count = cache_get_u32(&r);
+    EmbeddedImport *imports =
+        xmalloc(sizeof(EmbeddedImport) * (r.ok ? import_count + 1 : 1));
+    size_t kept = 0;
+    for (size_t i = 0; r.ok && i < import_count; i++) {
+      imports[kept].from = cache_get_str(&r);
+      imports[kept].name = cache_get_str(&r);
+      imports[kept].path = cache_get_str(&r);
+      if (imports[kept].from && imports[kept].name && imports[kept].path)
+        kept++;
+    }
+    embedded_imports = imports;
+    embedded_import_count = kept;
+
+    size_t module_count = cache_get_u32(&r);
+    if (r.ok && module_count <= r.size - r.pos) {
+      bundled_modules = xmalloc(sizeof(BundledModule) * (module_count + 1));
+      for (size_t i = 0; r.ok && i < module_count; i++) {
+        BundledModule *bm = &bundled_modules[i];
+        bm->path = cache_get_str(&r);
+        bm->size = cache_get_u32(&r);
+        bm->data = r.data + r.pos;
+        if (!bm->path || bm->size > r.size - r.pos)
+          r.ok = false;
+        else
+          r.pos += bm->size;
       }
-      free(p);
+      bundled_module_count = r.ok ? module_count : 0;
+    } else {
+      r.ok = false;
     }
+  } else {
+    r.ok = false;
   }
 
-  if (current_file && strchr(current_file, '/')) {
-    const char *last_slash = strrchr(current_file, '/');
-    size_t dir_len = (size_t)(last_slash - current_file) + 1;
-    char *dir = malloc(dir_len + 1);
-    if (dir) {
-      strncpy(dir, current_file, dir_len);
-      dir[dir_len] = '\0';
-      char *p = build_and_test(dir, import_name);
-      free(dir);
-      if (p)
-        return p;
-    }
+  if (!r.ok || r.pos != r.size || !entry) {
+    fprintf(stderr, "Error: bundle in '%s' is corrupt or from another build\n",
+            self);
+    exit(1);
   }
+  return entry;
+}
 
-#if defined(PATH_MAX)
-  {
-    char cwd[PATH_MAX];
-    if (getcwd(cwd, sizeof(cwd))) {
-      char *p = build_and_test(cwd, import_name);
-      if (p)
-        return p;
-    }
-  }
-#else
-  {
-    const char *pwd = getenv("PWD");
-    if (pwd) {
-      char *p = build_and_test(pwd, import_name);
-      if (p)
-        return p;
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} StrBuf;
+
+void sb_printf(StrBuf *sb, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+  if (n < 0)
+    return;
+  if (sb->len + (size_t)n + 1 > sb->cap) {
+    size_t cap = sb->cap ? sb->cap : 256;
+    while (sb->len + (size_t)n + 1 > cap)
+      cap *= 2;
+    sb->data = realloc(sb->data, cap);
+    sb->cap = cap;
+  }
+  va_start(ap, fmt);
+  vsnprintf(sb->data + sb->len, (size_t)n + 1, fmt, ap);
+  va_end(ap);
+  sb->len += (size_t)n;
+}
+
+void sb_c_string(StrBuf *sb, const char *s) {
+  sb_printf(sb, "\"");
+  for (size_t col = 0; *s; s++, col++) {
+    unsigned char c = (unsigned char)*s;
+    if (c == '\n') {
+      sb_printf(sb, "\\n\"\n    \"");
+      col = 0;
+    } else if (c == '"' || c == '\\') {
+      sb_printf(sb, "\\%c", c);
+    } else if (c < 32 || c >= 127) {
+      sb_printf(sb, "\\%03o", c);
+    } else {
+      sb_printf(sb, "%c", c);
     }
   }
-#endif
-  {
-    char *p = strdup(import_name);
-    if (p) {
-      FILE *f = fopen(p, "r");
-      if (f) {
-        fclose(f);
-        return p;
-      }
-      free(p);
-    }
+  sb_printf(sb, "\"");
+}
+
+const char *aot_error = NULL;
+void **aot_symbols = NULL;
+
+long long aot_idiv(long long l, long long r) {
+  if (r == 0) {
+    aot_error = "division by zero";
+    return 0;
   }
+  return l / r;
+}
 
-  {
-    size_t rel_len = strlen("stdlib/") + strlen(import_name) + 1;
-    char *rel = malloc(rel_len);
-    if (rel) {
-      snprintf(rel, rel_len, "stdlib/%s", import_name);
-      FILE *f = fopen(rel, "r");
-      if (f) {
-        fclose(f);
-        return rel;
-      }
-      free(rel);
-    }
+long long aot_imod(long long l, long long r) {
+  if (r == 0) {
+    aot_error = "modulo by zero";
+    return 0;
   }
+  return l % r;
+}
 
-  return NULL;
+long long aot_ipow(long long l, long long r) {
+  return eval_binop_int('^', l, r).i;
 }
 
-void run_file(const char *filename) {
-  FILE *f = fopen(filename, "r");
-  if (!f) {
-    fprintf(stderr, "%s:1:1: error: could not open file\n", filename);
-    return;
+double aot_ddiv(double l, double r, bool floored) {
+  if (r == 0.0) {
+    aot_error = "division by zero";
+    return 0.0;
   }
-  fseek(f, 0, SEEK_END);
-  long fsize = ftell(f);
-  fseek(f, 0, SEEK_SET);
+  return floored ? floor(l / r) : l / r;
+}
 
-  char *content = xmalloc(fsize + 1);
-  size_t bytes_read = fread(content, 1, fsize, f);
-  content[bytes_read] = 0;
-  fclose(f);
+void *aot_symbol(size_t slot, const char *c_name) {
+  if (!aot_symbols[slot])
+    aot_symbols[slot] = find_symbol(c_name);
+  if (!aot_symbols[slot]) {
+    fprintf(stderr, "Error: Symbol '%s' not found in loaded libraries\n",
+            c_name);
+    exit(1);
+  }
+  return aot_symbols[slot];
+}
 
-  src = content;
-  src_start = content;
-  current_loc.filename = xstrdup(filename);
-  current_loc.line = 1;
-  current_loc.column = 1;
-  errors_occurred = false;
+bool aot_unpack(Value *args, size_t argc, const TypeAnn *types, size_t arity) {
+  if (argc != arity)
+    return false;
+  for (size_t i = 0; i < argc; i++) {
+    if (args[i].type == VAL_ANY && args[i].any_val)
+      args[i] = *args[i].any_val;
+    if (!type_accepts(types[i], &args[i]))
+      return false;
+  }
+  aot_error = NULL;
+  return true;
+}
 
-  next_token();
-  bool skip_next = false;
+typedef struct {
+  const char *name;
+  Value (*entry)(Value *, size_t);
+} AotNative;
 
-  while (tok.type != T_EOF) {
-    if (tok.type == T_ERROR) {
-      next_token();
-      continue;
-    }
-    if (tok.type == T_AT) {
-      next_token();
-      if (tok.type != T_IDENT) {
-        error_at(tok.loc, "expected decorator name after '@'");
-        next_token();
-        continue;
-      }
-      if (tok.type == T_PTR) {
-        if (!strncmp(src, "@", 1) && !is_ident(*(src + 1))) {
-          src += 1;
-          current_loc.column += 1;
-          tok.type = T_AT;
-          strcpy(tok.text, "@");
-          return;
-        }
-      } else {
+typedef struct {
+  const char *entry;
+  const EmbeddedSource *sources;
+  size_t source_count;
+  const EmbeddedImport *imports;
+  size_t import_count;
+  const AotNative *natives;
+  size_t native_count;
+  size_t symbol_count;
+} AotProgram;
 
-        char decorator[256];
-        strcpy(decorator, tok.text);
-        next_token();
+typedef struct {
+  char *name;
+  AST *lambda;
+  bool native;
+} AotFunc;
 
-        if (!strcmp(decorator, "os")) {
-          if (tok.type != T_STRING) {
-            error_at(tok.loc, "@os requires a string argument");
-            next_token();
-            continue;
-          }
-          bool os_matches = match_os(tok.text);
-          next_token();
+typedef struct {
+  char *name;
+  TypeAnn type;
+} AotLocal;
 
-          if (!expect(T_LC)) {
-            continue;
-          }
-          next_token();
+typedef struct {
+  AotFunc *funcs;
+  size_t func_count;
+  char **globals;
+  size_t global_count;
+  AST **externs;
+  size_t extern_count;
+  AST *lambda;
+  AotLocal *locals;
+  size_t local_count;
+  size_t local_cap;
+  int loops;
+} AotCtx;
+
+const char *aot_c_type(TypeAnn t) {
+  return t == TY_DOUBLE ? "double" : "long long";
+}
 
-          while (tok.type != T_RC && tok.type != T_EOF) {
-            if (tok.type == T_LINK) {
-              next_token();
-              if (tok.type != T_STRING) {
-                error_at(tok.loc, "link requires a library path string");
-                next_token();
-                continue;
-              }
-              if (os_matches) {
-                char libpath[256];
-                strcpy(libpath, tok.text);
-                next_token();
-                load_library(libpath);
-              } else {
-                next_token();
-              }
-            } else if (tok.type == T_SEMI) {
-              next_token();
-            } else if (tok.type == T_RC) {
-              break;
-            } else {
-              error_at(tok.loc, "expected link statement or '}' in @os block");
-              next_token();
-            }
-          }
+AotFunc *aot_find_func(AotCtx *ac, const char *name) {
+  for (size_t i = 0; i < ac->func_count; i++) {
+    if (ac->funcs[i].native && !strcmp(ac->funcs[i].name, name))
+      return &ac->funcs[i];
+  }
+  return NULL;
+}
 
-          if (tok.type == T_RC) {
-            next_token();
-          }
-          continue;
-        } else {
-          error_at(tok.loc, "unknown decorator '@%s'", decorator);
-          next_token();
-          continue;
-        }
-      }
+AST *aot_find_extern(AotCtx *ac, const char *name, size_t *slot) {
+  for (size_t i = ac->extern_count; i-- > 0;) {
+    if (!strcmp(ac->externs[i]->extern_decl.name, name)) {
+      *slot = i;
+      return ac->externs[i];
     }
+  }
+  return NULL;
+}
 
-    if (skip_next) {
-      skip_next = false;
-      while (tok.type != T_SEMI && tok.type != T_EOF && tok.type != T_AT) {
-        next_token();
-      }
-      if (tok.type == T_SEMI)
-        next_token();
-      continue;
-    }
+bool aot_is_global(AotCtx *ac, const char *name) {
+  for (size_t i = 0; i < ac->global_count; i++) {
+    if (!strcmp(ac->globals[i], name))
+      return true;
+  }
+  return false;
+}
 
-    if (tok.type == T_IMPORT) {
-      next_token();
-      if (tok.type != T_STRING) {
-        error_at(tok.loc, "import requires a filename string");
-        next_token();
-        continue;
-      }
+AotLocal *aot_find_local(AotCtx *ac, const char *name) {
+  for (size_t i = 0; i < ac->local_count; i++) {
+    if (!strcmp(ac->locals[i].name, name))
+      return &ac->locals[i];
+  }
+  return NULL;
+}
+
+bool aot_ffi_numeric(FFIType t, TypeAnn *out) {
+  switch (t) {
+  case FFI_INT:
+  case FFI_LONG:
+  case FFI_CHAR:
+  case FFI_BOOL:
+    *out = TY_INT;
+    return true;
+  case FFI_DOUBLE:
+  case FFI_FLOAT:
+    *out = TY_DOUBLE;
+    return true;
+  default:
+    return false;
+  }
+}
+
+const char *aot_ffi_c_type(FFIType t) {
+  switch (t) {
+  case FFI_INT:
+    return "int";
+  case FFI_LONG:
+    return "long";
+  case FFI_CHAR:
+    return "char";
+  case FFI_BOOL:
+    return "bool";
+  case FFI_FLOAT:
+    return "float";
+  case FFI_DOUBLE:
+    return "double";
+  default:
+    return "void";
+  }
+}
 
-      const char *import_name = tok.text;
-      char *resolved_path =
-          resolve_import_path(import_name, current_loc.filename);
+bool aot_expr(AotCtx *ac, AST *a, StrBuf *out, TypeAnn *ty);
+
+bool aot_cast(AotCtx *ac, AST *a, TypeAnn want, StrBuf *out) {
+  TypeAnn ty;
+  StrBuf tmp = {NULL, 0, 0};
+  bool ok = aot_expr(ac, a, &tmp, &ty);
+  if (ok && want == TY_DOUBLE && (ty == TY_INT || ty == TY_DOUBLE))
+    sb_printf(out, "(double)(%s)", tmp.data);
+  else if (ok && want == TY_INT && ty == TY_INT)
+    sb_printf(out, "%s", tmp.data);
+  else if (ok && want == TY_BOOL && ty != TY_ANY)
+    sb_printf(out, "((%s) != 0)", tmp.data);
+  else
+    ok = false;
+  free(tmp.data);
+  return ok;
+}
 
-      if (!resolved_path) {
-        error_at(tok.loc, "could not find import file: %s", import_name);
-        next_token();
-        continue;
-      }
+bool aot_call(AotCtx *ac, AST *a, StrBuf *out, TypeAnn *ty) {
+  if (a->call.fn->type != A_VAR)
+    return false;
+  const char *name = a->call.fn->name;
+  AotFunc *fn = aot_find_func(ac, name);
+  if (fn && !aot_find_local(ac, name)) {
+    AST *l = fn->lambda;
+    if (a->call.argc != l->lambda.arity)
+      return false;
+    sb_printf(out, "aot_fn_%s(", name);
+    for (size_t i = 0; i < a->call.argc; i++) {
+      if (i)
+        sb_printf(out, ", ");
+      if (!aot_cast(ac, a->call.args[i], l->lambda.param_types[i], out))
+        return false;
+    }
+    sb_printf(out, ")");
+    *ty = l->lambda.return_type;
+    return true;
+  }
 
-      if (is_file_imported(resolved_path)) {
-        next_token();
-        continue;
-      }
+  size_t slot;
+  AST *ext = aot_find_extern(ac, name, &slot);
+  if (!ext || a->call.argc != ext->extern_decl.param_count)
+    return false;
+  FFIType *pt = ext->extern_decl.param_types;
+  if (!aot_ffi_numeric(ext->extern_decl.return_type, ty))
+    return false;
+  sb_printf(out, "(%s)((%s (*)(", aot_c_type(*ty),
+            aot_ffi_c_type(ext->extern_decl.return_type));
+  for (size_t i = 0; i < a->call.argc; i++)
+    sb_printf(out, "%s%s", i ? ", " : "", aot_ffi_c_type(pt[i]));
+  if (a->call.argc == 0)
+    sb_printf(out, "void");
+  sb_printf(out, "))aot_symbol(%zu, \"%s\"))(", slot,
+            ext->extern_decl.c_name);
+  for (size_t i = 0; i < a->call.argc; i++) {
+    TypeAnn want;
+    if (!aot_ffi_numeric(pt[i], &want))
+      return false;
+    if (i)
+      sb_printf(out, ", ");
+    sb_printf(out, "(%s)", aot_ffi_c_type(pt[i]));
+    if (!aot_cast(ac, a->call.args[i], want, out))
+      return false;
+  }
+  sb_printf(out, ")");
+  return true;
+}
 
-      mark_file_imported(resolved_path);
-      next_token();
+bool aot_binop(AotCtx *ac, AST *a, StrBuf *out, TypeAnn *ty) {
+  TypeAnn lt, rt;
+  StrBuf l = {NULL, 0, 0}, r = {NULL, 0, 0};
+  bool ok = aot_expr(ac, a->bin.l, &l, &lt) && aot_expr(ac, a->bin.r, &r, &rt);
+  char op = a->bin.op;
+  bool ints = lt == TY_INT && rt == TY_INT;
+  bool nums = (lt == TY_INT || lt == TY_DOUBLE) &&
+              (rt == TY_INT || rt == TY_DOUBLE);
+
+  if (!ok) {
+  } else if (op == '&' || op == '|') {
+    *ty = TY_BOOL;
+    sb_printf(out, "(((%s) != 0) %c ((%s) != 0))", l.data, op, r.data);
+  } else if (op == 'E' || op == 'N' || op == '<' || op == '>' || op == 'L' ||
+             op == 'G') {
+    static const char *cmp[] = {"==", "!=", "<", ">", "<=", ">="};
+    const char *ops = "EN<>LG";
+    ok = (op == 'E' || op == 'N') ? lt == rt && lt != TY_ANY : nums;
+    *ty = TY_BOOL;
+    if (ok) {
+      const char *c = cmp[strchr(ops, op) - ops];
+      if (ints || lt == TY_BOOL)
+        sb_printf(out, "((%s) %s (%s))", l.data, c, r.data);
+      else
+        sb_printf(out, "((double)(%s) %s (double)(%s))", l.data, c, r.data);
+    }
+  } else if (ints) {
+    *ty = TY_INT;
+    if (op == '+' || op == '-' || op == '*')
+      sb_printf(out, "((%s) %c (%s))", l.data, op, r.data);
+    else if (op == '/' || op == 'F')
+      sb_printf(out, "aot_idiv(%s, %s)", l.data, r.data);
+    else if (op == '%')
+      sb_printf(out, "aot_imod(%s, %s)", l.data, r.data);
+    else if (op == '^')
+      sb_printf(out, "aot_ipow(%s, %s)", l.data, r.data);
+    else if (op == 'l' || op == 'r')
+      sb_printf(out,
+                "(long long)((unsigned long long)(%s) %s (unsigned)((%s) & 63))",
+                l.data, op == 'l' ? "<<" : ">>", r.data);
+    else
+      ok = false;
+  } else if (nums) {
+    *ty = TY_DOUBLE;
+    if (op == '+' || op == '-' || op == '*')
+      sb_printf(out, "((double)(%s) %c (double)(%s))", l.data, op, r.data);
+    else if (op == '/' || op == 'F')
+      sb_printf(out, "aot_ddiv(%s, %s, %s)", l.data, r.data,
+                op == 'F' ? "true" : "false");
+    else if (op == '^')
+      sb_printf(out, "pow(%s, %s)", l.data, r.data);
+    else
+      ok = false;
+  } else {
+    ok = false;
+  }
+  free(l.data);
+  free(r.data);
+  return ok;
+}
 
-      const char *saved_src = src;
-      const char *saved_src_start = src_start;
-      Token saved_tok = tok;
-      SourceLoc saved_loc = current_loc;
+bool aot_expr(AotCtx *ac, AST *a, StrBuf *out, TypeAnn *ty) {
+  switch (a->type) {
+  case A_INT:
+    *ty = TY_INT;
+    sb_printf(out, "%lldLL", a->i);
+    return true;
+  case A_DOUBLE:
+    *ty = TY_DOUBLE;
+    sb_printf(out, "%a", a->d);
+    return true;
+  case A_BOOL:
+    *ty = TY_BOOL;
+    sb_printf(out, "%d", a->b ? 1 : 0);
+    return true;
+  case A_VAR: {
+    AotLocal *l = aot_find_local(ac, a->name);
+    if (!l)
+      return false;
+    *ty = l->type;
+    sb_printf(out, "aox_%s", a->name);
+    return true;
+  }
+  case A_BINOP:
+    return aot_binop(ac, a, out, ty);
+  case A_CALL:
+    return aot_call(ac, a, out, ty);
+  case A_IF: {
+    TypeAnn ct, tt, et;
+    StrBuf c = {NULL, 0, 0}, t = {NULL, 0, 0}, e = {NULL, 0, 0};
+    bool ok = a->ifelse.else_block && aot_expr(ac, a->ifelse.cond, &c, &ct) &&
+              aot_expr(ac, a->ifelse.then_block, &t, &tt) &&
+              aot_expr(ac, a->ifelse.else_block, &e, &et) && tt == et &&
+              ct != TY_ANY;
+    if (ok) {
+      *ty = tt;
+      sb_printf(out, "((%s) ? (%s) : (%s))", c.data, t.data, e.data);
+    }
+    free(c.data);
+    free(t.data);
+    free(e.data);
+    return ok;
+  }
+  default:
+    return false;
+  }
+}
 
-      bool saved_import_mode = import_mode;
-      import_mode = true;
-      run_file(resolved_path);
-      import_mode = saved_import_mode;
+bool aot_stmt(AotCtx *ac, AST *a, StrBuf *out, bool tail);
 
-      src = saved_src;
-      src_start = saved_src_start;
-      tok = saved_tok;
-      current_loc = saved_loc;
+bool aot_assign(AotCtx *ac, const char *name, AST *value, TypeAnn decl,
+                StrBuf *out) {
+  if (name[0] == '$' || aot_is_global(ac, name))
+    return false;
+  TypeAnn ty;
+  StrBuf v = {NULL, 0, 0};
+  bool ok = aot_expr(ac, value, &v, &ty) && ty != TY_ANY;
+  AotLocal *l = ok ? aot_find_local(ac, name) : NULL;
+  if (ok && !l) {
+    if (ac->local_count >= ac->local_cap) {
+      ac->local_cap = ac->local_cap ? ac->local_cap * 2 : 16;
+      ac->locals = realloc(ac->locals, sizeof(AotLocal) * ac->local_cap);
+    }
+    l = &ac->locals[ac->local_count++];
+    l->name = (char *)name;
+    l->type = decl != TY_ANY ? decl : ty == TY_BOOL ? TY_INT : ty;
+  }
+  if (ok && (l->type == ty || (l->type == TY_INT && ty == TY_BOOL) ||
+             (l->type == TY_DOUBLE && ty == TY_INT)))
+    sb_printf(out, "aox_%s = %s;\n", name, v.data);
+  else
+    ok = false;
+  free(v.data);
+  return ok;
+}
 
-      continue;
-    }
+bool aot_return(AotCtx *ac, AST *value, StrBuf *out) {
+  sb_printf(out, "return ");
+  if (!aot_cast(ac, value, ac->lambda->lambda.return_type, out))
+    return false;
+  sb_printf(out, ";\n");
+  return true;
+}
 
-    if (tok.type == T_LINK) {
-      next_token();
-      if (tok.type != T_STRING) {
-        error_at(tok.loc, "link requires a library path string");
-        next_token();
-        continue;
-      }
-      char libpath[256];
-      strcpy(libpath, tok.text);
-      next_token();
-      load_library(libpath);
-      continue;
+bool aot_stmt(AotCtx *ac, AST *a, StrBuf *out, bool tail) {
+  switch (a->type) {
+  case A_BLOCK:
+    if (a->block.count == 0)
+      return !tail;
+    for (size_t i = 0; i < a->block.count; i++) {
+      if (!aot_stmt(ac, a->block.stmts[i], out,
+                    tail && i + 1 == a->block.count))
+        return false;
     }
+    return true;
+  case A_RETURN:
+    return a->ret.value && aot_return(ac, a->ret.value, out);
+  case A_ASSIGN:
+    return !tail &&
+           (a->assign.check == TY_ANY || a->assign.check == TY_INT ||
+            a->assign.check == TY_DOUBLE) &&
+           aot_assign(ac, a->assign.name, a->assign.value, a->assign.check,
+                      out);
+  case A_INCREMENT:
+  case A_DECREMENT: {
+    AotLocal *l = aot_find_local(ac, a->increment.name);
+    if (tail || !l || l->type != TY_INT)
+      return false;
+    sb_printf(out, "aox_%s%s;\n", a->increment.name,
+              a->type == A_INCREMENT ? "++" : "--");
+    return true;
+  }
+  case A_BREAK:
+  case A_CONTINUE:
+    if (tail || ac->loops == 0)
+      return false;
+    sb_printf(out, "%s;\n", a->type == A_BREAK ? "break" : "continue");
+    return true;
+  case A_WHILE: {
+    if (tail)
+      return false;
+    sb_printf(out, "while (");
+    if (!aot_cast(ac, a->whileloop.cond, TY_BOOL, out))
+      return false;
+    sb_printf(out, ") {\n");
+    ac->loops++;
+    bool ok = aot_stmt(ac, a->whileloop.body, out, false);
+    ac->loops--;
+    sb_printf(out, "}\n");
+    return ok;
+  }
+  case A_IF:
+    if (tail && !a->ifelse.else_block)
+      return false;
+    sb_printf(out, "if (");
+    if (!aot_cast(ac, a->ifelse.cond, TY_BOOL, out))
+      return false;
+    sb_printf(out, ") {\n");
+    if (!aot_stmt(ac, a->ifelse.then_block, out, tail))
+      return false;
+    sb_printf(out, "}");
+    if (a->ifelse.else_block) {
+      sb_printf(out, " else {\n");
+      if (!aot_stmt(ac, a->ifelse.else_block, out, tail))
+        return false;
+      sb_printf(out, "}");
+    }
+    sb_printf(out, "\n");
+    return true;
+  case A_MATCH: {
+    TypeAnn ty;
+    sb_printf(out, "switch (");
+    if (!aot_expr(ac, a->match.value, out, &ty) || ty != TY_INT)
+      return false;
+    sb_printf(out, ") {\n");
+    for (size_t i = 0; i < a->match.case_count; i++) {
+      if (a->match.patterns[i]->type != A_INT)
+        return false;
+      sb_printf(out, "case %lldLL: {\n", a->match.patterns[i]->i);
+      if (!aot_stmt(ac, a->match.bodies[i], out, tail))
+        return false;
+      sb_printf(out, "break;\n}\n");
+    }
+    sb_printf(out, "}\n");
+    if (tail)
+      sb_printf(out, "aot_error = \"no match arm for value\";\nreturn 0;\n");
+    return true;
+  }
+  default: {
+    if (tail)
+      return aot_return(ac, a, out);
+    TypeAnn ty;
+    sb_printf(out, "(void)(");
+    if (!aot_expr(ac, a, out, &ty))
+      return false;
+    sb_printf(out, ");\n");
+    return true;
+  }
+  }
+}
 
-    if (tok.type == T_EXTERN) {
-      next_token();
-      if (tok.type != T_IDENT) {
-        error_at(tok.loc, "extern requires function name");
-        continue;
-      }
-      char aoxim_name[256];
-      strcpy(aoxim_name, tok.text);
-      next_token();
-
-      if (tok.type != T_ASSIGN) {
-        error_at(tok.loc, "expected '=' after extern function name");
-        continue;
-      }
-      next_token();
+bool aot_function(AotCtx *ac, AotFunc *fn, StrBuf *out) {
+  AST *l = fn->lambda;
+  ac->lambda = l;
+  ac->local_count = 0;
+  ac->loops = 0;
+  for (size_t i = 0; i < l->lambda.arity; i++) {
+    AotLocal *p = aot_find_local(ac, l->lambda.params[i]);
+    if (p)
+      return false;
+    if (ac->local_count >= ac->local_cap) {
+      ac->local_cap = ac->local_cap ? ac->local_cap * 2 : 16;
+      ac->locals = realloc(ac->locals, sizeof(AotLocal) * ac->local_cap);
+    }
+    ac->locals[ac->local_count].name = l->lambda.params[i];
+    ac->locals[ac->local_count++].type = l->lambda.param_types[i];
+  }
+
+  StrBuf body = {NULL, 0, 0};
+  bool ok = aot_stmt(ac, l->lambda.body, &body, true);
+  if (ok) {
+    sb_printf(out, "%s aot_fn_%s(",
+              aot_c_type(l->lambda.return_type == TY_BOOL
+                             ? TY_INT
+                             : l->lambda.return_type),
+              fn->name);
+    for (size_t i = 0; i < l->lambda.arity; i++)
+      sb_printf(out, "%s%s aox_%s", i ? ", " : "",
+                aot_c_type(ac->locals[i].type), ac->locals[i].name);
+    sb_printf(out, "%s) {\n", l->lambda.arity ? "" : "void");
+    for (size_t i = l->lambda.arity; i < ac->local_count; i++)
+      sb_printf(out, "%s aox_%s = 0;\n", aot_c_type(ac->locals[i].type),
+                ac->locals[i].name);
+    sb_printf(out, "%s}\n\n", body.data);
+  }
+  free(body.data);
+  return ok;
+}
 
-      if (tok.type != T_IDENT) {
-        error_at(tok.loc, "expected C function name");
-        continue;
-      }
-      char c_name[256];
-      strcpy(c_name, tok.text);
-      next_token();
+bool aot_candidate(AST *l) {
+  if (!l->lambda.param_types || l->lambda.arity > 16)
+    return false;
+  if (l->lambda.return_type != TY_INT && l->lambda.return_type != TY_DOUBLE &&
+      l->lambda.return_type != TY_BOOL)
+    return false;
+  for (size_t i = 0; i < l->lambda.arity; i++) {
+    TypeAnn t = l->lambda.param_types[i];
+    if (l->lambda.params[i][0] == '$' || (t != TY_INT && t != TY_DOUBLE))
+      return false;
+  }
+  return true;
+}
 
-      if (tok.type != T_LP) {
-        error_at(tok.loc, "expected '(' for parameter types");
+void aot_collect(AotCtx *ac) {
+  size_t cap = 0, gcap = 0, ecap = 0;
+  for (size_t i = 0; i < modules_count; i++) {
+    Module *m = modules[i];
+    for (size_t j = 0; j < m->count; j++) {
+      AST *s = m->stmts[j];
+      if (s->type == A_EXTERN) {
+        if (ac->extern_count >= ecap) {
+          ecap = ecap ? ecap * 2 : 16;
+          ac->externs = realloc(ac->externs, sizeof(AST *) * ecap);
+        }
+        ac->externs[ac->extern_count++] = s;
         continue;
       }
-      next_token();
-
-      FFIType param_types[16];
-      size_t param_count = 0;
-      while ((tok.type == T_IDENT || tok.type == T_PTR) && param_count < 16) {
-        param_types[param_count++] = parse_ffi_type(tok.text);
-        next_token();
-        if (tok.type == T_COMMA)
-          next_token();
-        else
-          break;
-      }
-
-      if (tok.type != T_RP) {
-        error_at(tok.loc, "expected ')' after parameters");
-        next_token();
+      if (s->type != A_ASSIGN)
         continue;
+      if (ac->global_count >= gcap) {
+        gcap = gcap ? gcap * 2 : 32;
+        ac->globals = realloc(ac->globals, sizeof(char *) * gcap);
       }
-      next_token();
-
-      if (tok.type != T_COLON) {
-        error_at(tok.loc, "expected ':' before return type");
-        next_token();
+      ac->globals[ac->global_count++] = s->assign.name;
+      if (s->assign.value->type != A_LAMBDA)
         continue;
+      if (ac->func_count >= cap) {
+        cap = cap ? cap * 2 : 16;
+        ac->funcs = realloc(ac->funcs, sizeof(AotFunc) * cap);
       }
-      next_token();
+      AotFunc *f = &ac->funcs[ac->func_count++];
+      f->name = s->assign.name;
+      f->lambda = s->assign.value;
+      f->native = aot_candidate(f->lambda);
+    }
+  }
+  for (size_t i = 0; i < ac->func_count; i++) {
+    size_t seen = 0;
+    for (size_t j = 0; j < ac->global_count; j++)
+      seen += !strcmp(ac->globals[j], ac->funcs[i].name);
+    if (seen > 1)
+      ac->funcs[i].native = false;
+  }
+}
 
-      FFIType return_type;
-      if (tok.type == T_OPTION_PTR) {
-        return_type = FFI_OPTION_PTR;
-        next_token();
-      } else if (tok.type == T_IDENT || tok.type == T_PTR) {
-        return_type = parse_ffi_type(tok.text);
-        next_token();
-      } else {
-        error_at(tok.loc, "expected return type");
-        next_token();
-        continue;
+void aot_emit_natives(AotCtx *ac, StrBuf *out) {
+  StrBuf code = {NULL, 0, 0};
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    code.len = 0;
+    for (size_t i = 0; i < ac->func_count; i++) {
+      AotFunc *f = &ac->funcs[i];
+      if (f->native && !aot_function(ac, f, &code)) {
+        f->native = false;
+        changed = true;
       }
+    }
+  }
 
-      register_extern(aoxim_name, c_name, param_types, param_count,
-                      return_type);
+  for (size_t i = 0; i < ac->func_count; i++) {
+    AST *l = ac->funcs[i].lambda;
+    if (!ac->funcs[i].native)
       continue;
-    }
+    sb_printf(out, "%s aot_fn_%s(",
+              aot_c_type(l->lambda.return_type == TY_BOOL
+                             ? TY_INT
+                             : l->lambda.return_type),
+              ac->funcs[i].name);
+    for (size_t j = 0; j < l->lambda.arity; j++)
+      sb_printf(out, "%s%s", j ? ", " : "",
+                aot_c_type(l->lambda.param_types[j]));
+    sb_printf(out, "%s);\n", l->lambda.arity ? "" : "void");
+  }
+  sb_printf(out, "\n%s", code.len ? code.data : "");
+  free(code.data);
+
+  for (size_t i = 0; i < ac->func_count; i++) {
+    AotFunc *f = &ac->funcs[i];
+    AST *l = f->lambda;
+    if (!f->native)
+      continue;
+    sb_printf(out, "static const TypeAnn aot_types_%s[] = {", f->name);
+    for (size_t j = 0; j < l->lambda.arity; j++)
+      sb_printf(out, "%s%d", j ? ", " : "", (int)l->lambda.param_types[j]);
+    sb_printf(out, "%s};\n\n", l->lambda.arity ? "" : "0");
+    sb_printf(out, "Value aot_entry_%s(Value *args, size_t argc) {\n", f->name);
+    sb_printf(out, "  if (!aot_unpack(args, argc, aot_types_%s, %zu))\n",
+              f->name, l->lambda.arity);
+    sb_printf(out, "    return v_error(\"invalid arguments to '%s'\");\n",
+              f->name);
+    const char *wrap = l->lambda.return_type == TY_DOUBLE ? "v_double"
+                       : l->lambda.return_type == TY_BOOL ? "v_bool"
+                                                          : "v_int";
+    sb_printf(out, "  %s r = aot_fn_%s(",
+              l->lambda.return_type == TY_DOUBLE ? "double" : "long long",
+              f->name);
+    for (size_t j = 0; j < l->lambda.arity; j++)
+      sb_printf(out, "%sargs[%zu].%c", j ? ", " : "", j,
+                l->lambda.param_types[j] == TY_DOUBLE ? 'd' : 'i');
+    sb_printf(out, ");\n  if (aot_error)\n    return v_error(aot_error);\n");
+    sb_printf(out, "  return %s(r);\n}\n\n", wrap);
+  }
+}
 
-    bool is_const = false;
-    if (tok.type == T_CONST) {
-      is_const = true;
-      next_token();
-    }
+/* Falls back to the checkout the binary was built from when the source
+   was not embedded. */
+const char *compile_c_runtime(void) {
+  if (runtime_source)
+    return runtime_source;
+#ifdef BUILD_DIR
+  return read_file_text(STR(BUILD_DIR) "/aoxim.c");
+#else
+  return NULL;
+#endif
+}
 
-    AST *stmt = parse_stmt();
-    if (errors_occurred) {
-      errors_occurred = false;
-      while (tok.type != T_SEMI && tok.type != T_EOF) {
-        next_token();
-      }
-      if (tok.type == T_SEMI)
-        next_token();
-      continue;
-    }
+/* Runs argv[0] with the given arguments and no shell, so paths need no
+   quoting. */
+bool run_command(char **argv) {
+#ifndef _WIN32
+  pid_t pid = fork();
+  if (pid < 0)
+    return false;
+  if (pid == 0) {
+    execvp(argv[0], argv);
+    fprintf(stderr, "Error: could not run '%s'\n", argv[0]);
+    _exit(127);
+  }
+  int status;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR)
+      return false;
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#else
+  return _spawnvp(_P_WAIT, argv[0], (const char *const *)argv) == 0;
+#endif
+}
 
-    if (stmt->type == A_ASSIGN) {
-      if (!errors_occurred) {
-        Value v = eval(stmt->assign.value, global_env);
-        env_set(global_env, stmt->assign.name, v, is_const);
-      }
-    } else if (stmt->type == A_ASSIGN_UNPACK) {
-      if (!errors_occurred) {
-        Value rhs = eval(stmt->assign_unpack.value, global_env);
-        if (rhs.type != VAL_TUPLE && rhs.type != VAL_LIST) {
-          error_at(stmt->loc, "cannot unpack non-sequence");
-        } else {
-          size_t count =
-              (rhs.type == VAL_TUPLE) ? rhs.tuple->size : rhs.list->size;
-          Value *items =
-              (rhs.type == VAL_TUPLE) ? rhs.tuple->items : rhs.list->items;
-          if (count != stmt->assign_unpack.count) {
-            error_at(stmt->loc, "unpacking count mismatch");
-          } else {
-            for (size_t i = 0; i < count; i++) {
-              env_set(global_env, stmt->assign_unpack.names[i], items[i],
-                      is_const);
-            }
-          }
-        }
-      }
-    } else if (stmt->type == A_VAR && tok.type == T_ASSIGN) {
-      /* backward-compatible handling (rare, older parsing style) */
-      char *name = stmt->name;
-      next_token();
-      AST *expr = parse_expr();
-      if (!errors_occurred) {
-        Value v = eval(expr, global_env);
-        env_set(global_env, name, v, is_const);
-      }
-    } else if (stmt->type == A_CALL && stmt->call.fn->type == A_VAR &&
-               tok.type == T_ASSIGN) {
-      char *name = stmt->call.fn->name;
-      AST **args = stmt->call.args;
-      size_t argc = stmt->call.argc;
-
-      char **params = xmalloc(sizeof(char *) * argc);
-      bool all_idents = true;
-      for (size_t i = 0; i < argc; i++) {
-        if (args[i]->type == A_VAR) {
-          params[i] = args[i]->name;
-        } else {
-          error_at(args[i]->loc, "function parameters must be identifiers");
-          all_idents = false;
-          break;
-        }
-      }
+bool compile_c(const char *input, const char *output) {
+  const char *runtime = compile_c_runtime();
+  if (!runtime) {
+    fprintf(stderr, "Error: --compile-c needs the aoxim runtime source; "
+                    "build with build.sh or -DBUILD_DIR\n");
+    return false;
+  }
+  Module *root = module_load(input);
+  if (!root || errors_occurred || !module_analyze(root))
+    return false;
+  optimize_program(root);
+
+  AotCtx ac;
+  memset(&ac, 0, sizeof(ac));
+  aot_collect(&ac);
+
+  StrBuf out = {NULL, 0, 0};
+  sb_printf(&out, "/* generated by aoxim --compile-c from %s */\n", input);
+  sb_printf(&out, "#define AOXIM_NO_MAIN\n");
+  sb_printf(&out, "%s\n", runtime);
+  aot_emit_natives(&ac, &out);
+
+  sb_printf(&out, "static const EmbeddedSource aot_sources[] = {\n");
+  for (size_t i = 0; i < modules_count; i++) {
+    const char *embedded = embedded_source(modules[i]->filename);
+    const char *text =
+        embedded ? embedded : read_file_text(modules[i]->filename);
+    if (!text)
+      return false;
+    sb_printf(&out, "  {");
+    sb_c_string(&out, modules[i]->filename);
+    sb_printf(&out, ",\n    ");
+    sb_c_string(&out, text);
+    sb_printf(&out, "},\n");
+  }
+  sb_printf(&out, "};\n\nstatic const EmbeddedImport aot_imports[] = {\n");
+  size_t import_count = 0;
+  for (size_t i = 0; i < modules_count; i++) {
+    Module *m = modules[i];
+    for (size_t j = 0; j < m->import_count; j++) {
+      char *path = resolve_import_path(m->imports[j]->import.path, m->filename);
+      if (!path)
+        continue;
+      sb_printf(&out, "  {");
+      sb_c_string(&out, m->filename);
+      sb_printf(&out, ", ");
+      sb_c_string(&out, m->imports[j]->import.path);
+      sb_printf(&out, ", ");
+      sb_c_string(&out, path);
+      sb_printf(&out, "},\n");
+      free(path);
+      import_count++;
+    }
+  }
+  if (!import_count)
+    sb_printf(&out, "  {NULL, NULL, NULL},\n");
+  sb_printf(&out, "};\n\nstatic const AotNative aot_natives[] = {\n");
+  size_t native_count = 0;
+  for (size_t i = 0; i < ac.func_count; i++) {
+    if (ac.funcs[i].native) {
+      sb_printf(&out, "  {\"%s\", aot_entry_%s},\n", ac.funcs[i].name,
+                ac.funcs[i].name);
+      native_count++;
+    }
+  }
+  if (!native_count)
+    sb_printf(&out, "  {NULL, NULL},\n");
+  sb_printf(&out, "};\n\nstatic const AotProgram aot_program = {\n  ");
+  sb_c_string(&out, root->filename);
+  sb_printf(&out, ",\n  aot_sources, %zu,\n  aot_imports, %zu,\n"
+                  "  aot_natives, %zu,\n  %zu};\n\n",
+            modules_count, import_count, native_count, ac.extern_count);
+  sb_printf(&out, "int main(int argc, char **argv) {\n"
+                  "  return aot_main(argc, argv, &aot_program);\n}\n");
+
+  size_t c_len = strlen(output) + 3;
+  char *c_path = malloc(c_len);
+  snprintf(c_path, c_len, "%s.c", output);
+  FILE *f = fopen(c_path, "w");
+  if (!f) {
+    fprintf(stderr, "Error: could not write '%s'\n", c_path);
+    return false;
+  }
+  fwrite(out.data, 1, out.len, f);
+  fclose(f);
+  free(out.data);
+
+  char *cc = getenv("CC");
+  char *cc_argv[] = {cc && cc[0] ? cc : "cc", "-std=c99", "-O2", c_path,
+                     "-o", (char *)output, "-ldl", "-lm", "-pthread", NULL};
+  if (!run_command(cc_argv)) {
+    fprintf(stderr, "Error: C compiler failed, generated source kept in %s\n",
+            c_path);
+    return false;
+  }
+  remove(c_path);
+  free(c_path);
+  return true;
+}
 
-      if (all_idents) {
-        next_token();
-        AST *body = parse_expr();
-        if (!errors_occurred) {
-          AST *lambda = ast_new(A_LAMBDA);
-          lambda->lambda.params = params;
-          lambda->lambda.arity = argc;
-          lambda->lambda.body = body;
-          Value fn = eval(lambda, global_env);
-          env_set(global_env, name, fn, is_const);
-        }
-      }
-    } else {
-      if (!errors_occurred) {
-        eval(stmt, global_env);
+void aot_attach_natives(const AotProgram *prog) {
+  for (size_t i = 0; i < modules_count; i++) {
+    for (size_t j = 0; j < modules[i]->count; j++) {
+      AST *s = modules[i]->stmts[j];
+      if (s->type != A_ASSIGN || s->assign.value->type != A_LAMBDA)
+        continue;
+      for (size_t k = 0; k < prog->native_count; k++) {
+        if (!strcmp(prog->natives[k].name, s->assign.name))
+          s->assign.value->lambda.native = prog->natives[k].entry;
       }
     }
+  }
+}
 
-    if (tok.type == T_SEMI) {
-      next_token();
-    }
+int aot_main(int argc, char **argv, const AotProgram *prog) {
+  (void)argc;
+  (void)argv;
+  runtime_init();
+  stack_limit_init();
+
+  embedded_sources = prog->sources;
+  embedded_source_count = prog->source_count;
+  embedded_imports = prog->imports;
+  embedded_import_count = prog->import_count;
+  aot_symbols = calloc(prog->symbol_count + 1, sizeof(void *));
+
+  Module *m = module_load(prog->entry);
+  if (m && module_analyze(m)) {
+    aot_attach_natives(prog);
+    optimize_program(m);
+    module_exec(m);
   }
+  arena_free(global_arena);
+  return errors_occurred ? 1 : 0;
 }
 
+#ifndef AOXIM_NO_MAIN
 int main(int argc, char **argv) {
-  global_arena = arena_new(65536);
-  global_env = env_new();
-  init_import_tracker();
+  runtime_init();
+
+  stack_limit_init();
+
+  const char *bundle_entry = bundle_attach(self_exe_path(argv[0]));
+  if (bundle_entry) {
+    run_file(bundle_entry);
+    arena_free(global_arena);
+    return errors_occurred ? 1 : 0;
+  }
 
   int file_arg = 0;
+  const char *compile_out = NULL;
+  const char *snapshot_out = NULL;
+  const char *snapshot_in = NULL;
+  bool compile = false;
+  bool bundle = false;
   for (int i = 1; i < argc; i++) {
     if (!strcmp(argv[i], "--color")) {
       use_colors = true;
     } else if (!strcmp(argv[i], "--help")) {
       printf("Usage: %s [options] [file]\n", argv[0]);
       printf("Options:\n");
-      printf("  --color    Enable colored output\n");
-      printf("  --help     Show this help message\n");
+      printf("  --color          Enable colored output\n");
+      printf("  --no-cache       Do not read or write the .aoxc module cache\n");
+      printf("  --jit            Compile hot integer functions to x86-64;\n"
+             "                   used from the call after they become hot\n");
+      printf("  --compile-c      Compile the file to a native executable;\n"
+             "                   only typed numeric functions become C,\n"
+             "                   externs and the rest stay interpreted\n");
+      printf("  --bundle         Pack the file and its imports into an "
+             "executable\n");
+      printf("  -o <file>        Output path for --compile-c and --bundle "
+             "(default a.out)\n");
+      printf("  --snapshot <img> Run the file and save its globals to <img>\n");
+      printf("  --from-snapshot <img>\n");
+      printf("                   Restore globals from <img> before running\n");
+      printf("  --max-depth <n>  Limit script recursion depth (default %zu);\n"
+             "                   deeper calls also stop once the call stack\n"
+             "                   uses a quarter of physical memory\n",
+             max_call_depth);
+      printf("  --quicken-stats  Report specialized operator hit rates on exit\n");
+      printf("  --ffi-mem-stats  Report alloc/free pool usage on exit\n");
+      printf("  --help           Show this help message\n");
       return 0;
+    } else if (!strcmp(argv[i], "--quicken-stats")) {
+      quicken_stats = true;
+      atexit(print_quicken_stats);
+    } else if (!strcmp(argv[i], "--ffi-mem-stats")) {
+      atexit(print_ffi_mem_stats);
+    } else if (!strcmp(argv[i], "--no-cache")) {
+      module_cache_enabled = false;
+    } else if (!strcmp(argv[i], "--jit")) {
+#ifdef JIT_SUPPORTED
+      jit_enabled = true;
+#else
+      fprintf(stderr, "warning: --jit is only supported on Linux x86-64\n");
+#endif
+    } else if (!strcmp(argv[i], "--compile-c")) {
+      compile = true;
+    } else if (!strcmp(argv[i], "--bundle")) {
+      bundle = true;
+    } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+      compile_out = argv[++i];
+    } else if (!strcmp(argv[i], "--snapshot") && i + 1 < argc) {
+      snapshot_out = argv[++i];
+    } else if (!strcmp(argv[i], "--from-snapshot") && i + 1 < argc) {
+      snapshot_in = argv[++i];
+    } else if (!strcmp(argv[i], "--max-depth") && i + 1 < argc) {
+      max_call_depth = (size_t)strtoull(argv[++i], NULL, 10);
     } else {
       file_arg = i;
     }
   }
 
-  env_set(global_env, "print", v_func(make_builtin(builtin_print)), true);
-  env_set(global_env, "type", v_func(make_builtin(builtin_type)), true);
-  env_set(global_env, "len", v_func(make_builtin(builtin_len)), true);
-  env_set(global_env, "range", v_func(make_builtin(builtin_range)), true);
-  env_set(global_env, "tuple", v_func(make_builtin(builtin_tuple)), true);
-  env_set(global_env, "help", v_func(make_builtin(builtin_help)), true);
-  env_set(global_env, "assert", v_func(make_builtin(builtin_assert)), true);
-  env_set(global_env, "exit", v_func(make_builtin(builtin_exit)), true);
-  env_set(global_env, "test", v_func(make_builtin(builtin_test)), true);
-
-  env_set(global_env, "int", v_func(make_builtin(builtin_int)), true);
-  env_set(global_env, "double", v_func(make_builtin(builtin_double)), true);
-  env_set(global_env, "str", v_func(make_builtin(builtin_str)), true);
-  env_set(global_env, "bool", v_func(make_builtin(builtin_bool)), true);
-  env_set(global_env, "is_error", v_func(make_builtin(builtin_is_error)), true);
-  env_set(global_env, "is_null", v_func(make_builtin(builtin_is_null)), true);
-  env_set(global_env, "char", v_func(make_builtin(builtin_char)), true);
-  env_set(global_env, "ptr_to_int", v_func(make_builtin(builtin_ptr_to_int)),
-          true);
-  env_set(global_env, "int_to_ptr", v_func(make_builtin(builtin_int_to_ptr)),
-          true);
-  env_set(global_env, "apany", v_func(make_builtin(builtin_any)), true);
-  env_set(global_env, "apply", v_func(make_builtin(builtin_apply)), true);
+  if (compile) {
+    if (file_arg == 0) {
+      fprintf(stderr, "Error: --compile-c requires an input file\n");
+      return 1;
+    }
+    return compile_c(argv[file_arg], compile_out ? compile_out : "a.out") ? 0
+                                                                           : 1;
+  }
+
+  if (bundle) {
+    if (file_arg == 0) {
+      fprintf(stderr, "Error: --bundle requires an input file\n");
+      return 1;
+    }
+    return bundle_write(argv[file_arg], compile_out ? compile_out : "a.out",
+                        self_exe_path(argv[0]))
+               ? 0
+               : 1;
+  }
+  if (snapshot_out) {
+    if (file_arg == 0) {
+      fprintf(stderr, "Error: --snapshot requires an input file\n");
+      return 1;
+    }
+    run_file(argv[file_arg]);
+    return snapshot_write(snapshot_out) && !errors_occurred ? 0 : 1;
+  }
+  if (snapshot_in && !snapshot_load(snapshot_in))
+    return 1;
 
   if (file_arg > 0) {
     run_file(argv[file_arg]);
@@ -5950,3 +13207,4 @@ int main(int argc, char **argv) {
   arena_free(global_arena);
   return errors_occurred ? 1 : 0;
 }
+#endif
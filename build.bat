@@ -3,6 +3,8 @@
 mkdir aoxim-dist
 
 clang-format.exe -i aoxim.c
-clang.exe -std=c99 -Wno-deprecated-declarations -Wall -Wextra -O2 aoxim.c -o .\aoxim-dist\aoxim.exe
+powershell -NoProfile -Command "$q = [char]34; $b = [char]92; Get-ChildItem stdlib\*.aoxim | ForEach-Object { '{' + $q + 'stdlib/' + $_.Name + $q + ','; Get-Content $_.FullName | ForEach-Object { $q + $_.Replace($b, $b + $b).Replace($q, $b + $q) + $b + 'n' + $q }; '},' } | Set-Content -Encoding ascii aoxim-dist\stdlib.inc"
+powershell -NoProfile -Command "$q = [char]34; $b = [char]92; Get-Content aoxim.c | ForEach-Object { $q + $_.Replace($b, $b + $b).Replace($q, $b + $q) + $b + 'n' + $q } | Set-Content -Encoding ascii aoxim-dist\runtime.inc"
+clang.exe -std=c99 -Wno-deprecated-declarations -Wall -Wextra -O2 aoxim.c -o .\aoxim-dist\aoxim.exe -DAOXIM_EMBED_STDLIB -DAOXIM_EMBED_RUNTIME -Iaoxim-dist
 
 xcopy .\stdlib .\aoxim-dist\stdlib /s /e /i /Y
@@ -4,6 +4,14 @@ set -xe
 
 mkdir -p aoxim-dist/
 
-cc -std=c99 -Wall -Wextra -O2 aoxim.c -o ./aoxim-dist/aoxim -ldl -lm -DBUILD_DIR=$(pwd)
+for f in stdlib/*.aoxim; do
+    printf '{"%s",\n' "$f"
+    sed -e 's/\\/\\\\/g' -e 's/"/\\"/g' -e 's/^/"/' -e 's/$/\\n"/' "$f"
+    printf '},\n'
+done > aoxim-dist/stdlib.inc
+
+sed -e 's/\\/\\\\/g' -e 's/"/\\"/g' -e 's/^/"/' -e 's/$/\\n"/' aoxim.c > aoxim-dist/runtime.inc
+
+cc -std=c99 -Wall -Wextra -O2 aoxim.c -o ./aoxim-dist/aoxim -ldl -lm -pthread -DBUILD_DIR=$(pwd) -DAOXIM_EMBED_STDLIB -DAOXIM_EMBED_RUNTIME -Iaoxim-dist
 
 cp -r ./stdlib/ ./aoxim-dist/
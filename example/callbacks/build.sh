@@ -0,0 +1,7 @@
+#!/bin/sh
+
+set -xe
+
+mkdir -p build
+
+cc -Wall -Wextra -O2 -shared -fPIC -o build/sort-shim.so sort-shim.c
@@ -0,0 +1,8 @@
+#include <stdlib.h>
+
+static int compare_ints(const void *a, const void *b) {
+  int x = *(const int *)a, y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+void sort_ints(int *xs, long n) { qsort(xs, n, sizeof(int), compare_ints); }